@@ -0,0 +1,270 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <algorithm>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include "ArenaCpu.h"
+#include "TopologyCpu.h"
+
+//  Buffers of at least one huge page are rounded up to whole huge pages, smaller ones to the
+//  Windows allocation granularity.
+
+const size_t kHugePageSize = 2 * 1024 * 1024;
+const size_t kSmallPageSize = 64 * 1024;
+
+static bool HugePagesRequested()
+{
+    const char* const value = getenv("NBODY_HUGE_PAGES");
+    return (value == nullptr) || (atoi(value) != 0);
+}
+
+ParticleArena& ParticleArena::Instance()
+{
+    static ParticleArena* const pArena = new ParticleArena();
+    return *pArena;
+}
+
+//  A free buffer is only reused for requests of at least half its size.
+
+void* ParticleArena::Allocate(size_t bytes, int node, bool sparse)
+{
+    const size_t granularity = (bytes >= kHugePageSize) ? m_pageSize : kSmallPageSize;
+    bytes = ((std::max(bytes, size_t(1)) + granularity - 1) / granularity) * granularity;
+
+    std::lock_guard<std::mutex> lock(m_lock);
+    Block* pBest = nullptr;
+    for (Block& block : m_blocks)
+    {
+        if (!block.used && (block.node == node) && (block.sparse == sparse) && (block.bytes >= bytes) && (block.bytes <= 2 * bytes) &&
+            ((pBest == nullptr) || (block.bytes < pBest->bytes)))
+            pBest = &block;
+    }
+    if ((pBest != nullptr) && m_discardReused && (node == kAnyNode) && !Discard(pBest->pMemory, pBest->bytes))
+    {
+        Unmap(pBest->pMemory, pBest->bytes);
+        m_blocks.erase(m_blocks.begin() + (pBest - m_blocks.data()));
+        pBest = nullptr;
+    }
+    if (pBest != nullptr)
+    {
+        pBest->used = true;
+        return pBest->pMemory;
+    }
+
+    m_blocks.erase(std::remove_if(m_blocks.begin(), m_blocks.end(), [this, bytes](const Block& block)
+    {
+        if (block.used || (block.bytes >= bytes))
+            return false;
+        Unmap(block.pMemory, block.bytes);
+        return true;
+    }), m_blocks.end());
+
+    const Block block = { Map(bytes, node, sparse), bytes, node, sparse, true };
+    if (block.pMemory == nullptr)
+        return nullptr;
+    m_blocks.push_back(block);
+    return block.pMemory;
+}
+
+void ParticleArena::Free(void* pMemory)
+{
+    if (pMemory == nullptr)
+        return;
+    std::lock_guard<std::mutex> lock(m_lock);
+    for (Block& block : m_blocks)
+    {
+        if (block.pMemory == pMemory)
+        {
+            assert(block.used);
+            block.used = false;
+            return;
+        }
+    }
+    assert(false);
+}
+
+#if defined(_WIN32)
+
+//--------------------------------------------------------------------------------------
+//  Windows, VirtualAllocExNuma.
+//--------------------------------------------------------------------------------------
+//
+//  Large pages are locked into memory, so Windows only grants them to accounts that hold the lock
+//  pages in memory privilege, and even then the privilege must be enabled in the process token.
+//  AdjustTokenPrivileges succeeds without enabling anything if the account does not hold it,
+//  which is reported by ERROR_NOT_ALL_ASSIGNED.
+
+static bool EnableLargePages()
+{
+    if (!HugePagesRequested() || (GetLargePageMinimum() == 0))
+        return false;
+    HANDLE token = nullptr;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+        return false;
+    TOKEN_PRIVILEGES privileges = {};
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    const bool enabled = LookupPrivilegeValue(nullptr, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+        AdjustTokenPrivileges(token, FALSE, &privileges, 0, nullptr, nullptr) && (GetLastError() == ERROR_SUCCESS);
+    CloseHandle(token);
+    return enabled;
+}
+
+ParticleArena::ParticleArena() :
+    m_hugePages(EnableLargePages()),
+    m_discardReused(GetCpuTopology().numNodes > 1),
+    m_pageSize(std::max(size_t(GetLargePageMinimum()), kHugePageSize))
+{
+}
+
+//  If there are not enough free large pages the buffer is allocated with normal pages.
+
+void* ParticleArena::Map(size_t bytes, int node, bool sparse) const
+{
+    const DWORD preferred = (node == kAnyNode) ? NUMA_NO_PREFERRED_NODE : DWORD(node);
+    void* pMemory = nullptr;
+    if (m_hugePages && !sparse && (bytes % m_pageSize == 0))
+        pMemory = VirtualAllocExNuma(GetCurrentProcess(), nullptr, bytes, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, preferred);
+    if (pMemory == nullptr)
+        pMemory = VirtualAllocExNuma(GetCurrentProcess(), nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, preferred);
+    return pMemory;
+}
+
+void ParticleArena::Unmap(void* pMemory, size_t /*bytes*/) const
+{
+    VirtualFree(pMemory, 0, MEM_RELEASE);
+}
+
+//  Decommitting and committing the pages again gives zeroed pages that are placed when they are
+//  first written. Large pages are only committed along with the allocation, so such a buffer is
+//  replaced, and its new pages are placed on the node of the allocating thread as before.
+
+bool ParticleArena::Discard(void* pMemory, size_t bytes) const
+{
+    return VirtualFree(pMemory, bytes, MEM_DECOMMIT) && (VirtualAlloc(pMemory, bytes, MEM_COMMIT, PAGE_READWRITE) != nullptr);
+}
+
+#elif defined(__linux__)
+
+//--------------------------------------------------------------------------------------
+//  Linux, mmap.
+//--------------------------------------------------------------------------------------
+//
+//  Buffers of a huge page or more are mapped with an extra huge page, which is trimmed off so
+//  that the buffer starts on a huge page boundary, as the kernel only uses huge pages for whole
+//  aligned 2 MB ranges. The node is given to mbind, called directly as glibc has no wrapper. If
+//  the kernel has no NUMA support the call fails and the pages go wherever they are first used.
+//  Sparse buffers are excluded from transparent huge pages, which would otherwise back them when
+//  THP is set to always.
+
+ParticleArena::ParticleArena() :
+    m_hugePages(HugePagesRequested()),
+    m_discardReused(GetCpuTopology().numNodes > 1),
+    m_pageSize(kHugePageSize)
+{
+}
+
+void* ParticleArena::Map(size_t bytes, int node, bool sparse) const
+{
+    const size_t alignment = (bytes >= kHugePageSize) ? kHugePageSize : 0;
+    char* const pMapped = static_cast<char*>(mmap(nullptr, bytes + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (pMapped == MAP_FAILED)
+        return nullptr;
+
+    char* pMemory = pMapped;
+    if (alignment > 0)
+    {
+        pMemory = reinterpret_cast<char*>((reinterpret_cast<uintptr_t>(pMapped) + alignment - 1) & ~uintptr_t(alignment - 1));
+        if (pMemory > pMapped)
+            munmap(pMapped, pMemory - pMapped);
+        if (pMapped + alignment > pMemory)
+            munmap(pMemory + bytes, pMapped + alignment - pMemory);
+#if defined(MADV_HUGEPAGE)
+        if (m_hugePages && !sparse)
+            madvise(pMemory, bytes, MADV_HUGEPAGE);
+        else if (sparse)
+            madvise(pMemory, bytes, MADV_NOHUGEPAGE);
+#endif
+    }
+
+    const int kPreferredPolicy = 1;                             // MPOL_PREFERRED
+    unsigned long nodeMask[1024 / (8 * sizeof(unsigned long))] = {};
+    const int maskBits = int(sizeof(nodeMask) * 8);
+    if ((node >= 0) && (node < maskBits))
+    {
+        nodeMask[node / (8 * sizeof(unsigned long))] = 1ul << (node % (8 * sizeof(unsigned long)));
+        syscall(SYS_mbind, pMemory, bytes, kPreferredPolicy, nodeMask, maskBits + 1, 0);
+    }
+    return pMemory;
+}
+
+void ParticleArena::Unmap(void* pMemory, size_t bytes) const
+{
+    munmap(pMemory, bytes);
+}
+
+//  The next write to a discarded page of a private mapping faults in a zeroed page, placed by the
+//  mapping's policy, and the huge page advice is kept.
+
+bool ParticleArena::Discard(void* pMemory, size_t bytes) const
+{
+    return madvise(pMemory, bytes, MADV_DONTNEED) == 0;
+}
+
+#else
+
+//--------------------------------------------------------------------------------------
+//  Other systems, the C library.
+//--------------------------------------------------------------------------------------
+
+ParticleArena::ParticleArena() :
+    m_hugePages(false),
+    m_discardReused(false),
+    m_pageSize(kHugePageSize)
+{
+}
+
+void* ParticleArena::Map(size_t bytes, int /*node*/, bool /*sparse*/) const
+{
+    void* pMemory = nullptr;
+    return (posix_memalign(&pMemory, kSmallPageSize, bytes) == 0) ? pMemory : nullptr;
+}
+
+void ParticleArena::Unmap(void* pMemory, size_t /*bytes*/) const
+{
+    free(pMemory);
+}
+
+bool ParticleArena::Discard(void* /*pMemory*/, size_t /*bytes*/) const
+{
+    return true;
+}
+
+#endif
@@ -0,0 +1,104 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <stddef.h>
+#include <mutex>
+#include <vector>
+
+//--------------------------------------------------------------------------------------
+//  Memory for the particle stores.
+//--------------------------------------------------------------------------------------
+//
+//  The stores are large and live for as long as the engine or the application that owns them.
+//  The arena maps their memory directly from the system, rounded up to whole 2 MB pages, so
+//  every buffer is aligned to at least a cache line and, where the system allows it, backed by
+//  huge pages. One TLB entry then covers half a million floats rather than a thousand, which
+//  matters once the j loops stream through millions of particles.
+//
+//  On Linux transparent huge pages are requested with madvise for every buffer of a huge page or
+//  more, which the kernel honours unless THP is disabled. On Windows large pages need the lock
+//  pages in memory privilege. The arena enables it if the account holds it, and otherwise uses
+//  normal pages. NBODY_HUGE_PAGES=0 disables huge pages on both. Smaller buffers are rounded up
+//  to 64 KB and use normal pages.
+//
+//  A buffer may also be placed on a NUMA node, whichever thread first writes to it, for data
+//  that each node reads from its own copy. Otherwise pages go to the node of the thread that
+//  first writes to them, a whole huge page at a time, or on Windows to the node of the thread
+//  that allocates large pages.
+//
+//  A buffer that is only ever partly written can be asked for as sparse. It always uses normal
+//  pages, so only the pages that are written take physical memory. Windows commits every large
+//  page when it is allocated, and a transparent huge page is faulted in whole.
+//
+//  Freed buffers are kept and handed out again for later requests on the same node that fit
+//  into them. Resetting the simulation recreates the engines, and their stores, so this avoids
+//  unmapping the memory and faulting it back in each time. Free buffers too small for a request
+//  are returned to the system before a new one is mapped, so stores that grow do not leave a
+//  trail of them behind. On a machine with more than one node, writing to a reused buffer would
+//  not move its pages, so the pages of a buffer that is not placed on a node are discarded
+//  before it is handed out again and are placed by their next first write. A buffer whose
+//  pages cannot be discarded is returned to the system and a new one is mapped.
+
+class ParticleArena
+{
+public:
+    static const int kAnyNode = -1;
+
+private:
+    struct Block
+    {
+        void* pMemory;
+        size_t bytes;                                           // Mapped size, a whole number of pages.
+        int node;
+        bool sparse;                                            // Normal pages only.
+        bool used;
+    };
+
+    std::vector<Block> m_blocks;
+    std::mutex m_lock;
+    const bool m_hugePages;
+    const bool m_discardReused;                                 // Place reused buffers by first touch again.
+    const size_t m_pageSize;                                    // Granularity of the mappings.
+
+public:
+    //  The arena is never destroyed, so stores destroyed during static destruction can still
+    //  return their memory.
+
+    static ParticleArena& Instance();
+
+    //  Return a buffer of at least the given size, aligned to at least a cache line. Its contents
+    //  are undefined.
+
+    void* Allocate(size_t bytes, int node = kAnyNode, bool sparse = false);
+    void Free(void* pMemory);
+
+    //  Whether the buffers are being backed by huge pages, if the system has them free.
+
+    inline bool HugePages() const { return m_hugePages; }
+
+private:
+    ParticleArena();
+
+    void* Map(size_t bytes, int node, bool sparse) const;
+    void Unmap(void* pMemory, size_t bytes) const;
+    bool Discard(void* pMemory, size_t bytes) const;
+
+    // VC++ does not yet support deleted functions.
+    ParticleArena(const ParticleArena&);
+    ParticleArena& operator=(const ParticleArena&);
+};
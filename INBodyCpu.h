@@ -21,13 +21,23 @@
 //--------------------------------------------------------------------------------------
 //
 //  Each class implements the Integrate method. Some update pParticlesIn in place, others
-//  leave the input array unchanged and write the new values to pParticlesOut.
+//  leave the input store unchanged and write the new values to pParticlesOut.
+//
+//  Classes that keep per-particle state between steps discard it in ParticlesChanged, which
+//  is called when the particles have been reordered, or reloaded if reloaded is true. When the
+//  order is known ParticlesReordered is called instead, where slot s now holds the particle that
+//  was in slot index[s]. Classes whose state is costly to rebuild permute it, by default it is
+//  discarded.
 
-struct ParticleCpu;
+class ParticleStoreSoA;
 
 class INBodyCpu
 {
 public:
-    virtual void Integrate(ParticleCpu* const pParticlesIn, 
-        ParticleCpu* const pParticlesOut, int numParticles) const = 0;
+    virtual void Integrate(ParticleStoreSoA* const pParticlesIn, 
+        ParticleStoreSoA* const pParticlesOut, int numParticles) const = 0;
+
+    virtual void ParticlesChanged(bool /*reloaded*/) {}
+
+    virtual void ParticlesReordered(const int* const /*index*/, int /*numParticles*/) { ParticlesChanged(false); }
 };
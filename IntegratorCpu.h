@@ -0,0 +1,108 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+//--------------------------------------------------------------------------------------
+//  Integrator policies.
+//--------------------------------------------------------------------------------------
+//
+//  Each step is split around the force calculation. Begin is applied to every particle
+//  before the accelerations are calculated and End afterwards. Engines that keep the
+//  particles' accelerations in the store call both through BeginParticleStep and
+//  EndParticleStep, which are instantiated for each policy so the per particle updates
+//  are inlined into the loops.
+//
+//  The acceleration passed to Begin is the one calculated by the previous step. Begin leaves
+//  it zero so the force calculation can accumulate the new accelerations into the store.
+//  Damping is applied to the velocity once per step, at the end of it.
+
+enum IntegratorType
+{
+    kIntegratorEuler = 0,
+    kIntegratorLeapfrog,
+    kIntegratorVelocityVerlet
+};
+
+//  Integrators that start each step with the previous step's accelerations need them to be
+//  calculated before the first step.
+
+inline bool UsesPreviousAcceleration(IntegratorType integrator)
+{
+    return integrator != kIntegratorEuler;
+}
+
+//  Semi-implicit Euler, first order. Positions are advanced with the new velocities, so only
+//  End has any work to do.
+
+struct EulerIntegrator
+{
+    static const bool kDriftsBeforeForces = false;
+
+    static inline void Begin(float& /*x*/, float& /*v*/, float& /*a*/, float /*dt*/)
+    {
+    }
+
+    static inline void End(float& x, float& v, float& a, float dt, float damping)
+    {
+        v = (v + a * dt) * damping;
+        x += v * dt;
+        a = 0.0f;
+    }
+};
+
+//  Kick-drift-kick leapfrog, second order and symplectic. Half a kick with the old acceleration
+//  and a full drift before the forces, half a kick with the new acceleration after them. The
+//  acceleration is kept in the store for the next step's first kick.
+
+struct LeapfrogIntegrator
+{
+    static const bool kDriftsBeforeForces = true;
+
+    static inline void Begin(float& x, float& v, float& a, float dt)
+    {
+        v += a * (0.5f * dt);
+        x += v * dt;
+        a = 0.0f;
+    }
+
+    static inline void End(float& /*x*/, float& v, float& a, float dt, float damping)
+    {
+        v = (v + a * (0.5f * dt)) * damping;
+    }
+};
+
+//  Velocity Verlet, x += v dt + a dt^2 / 2 and v += (a + a') dt / 2. In exact arithmetic this is
+//  the same map as the leapfrog. The position is advanced from the velocity at the start of the
+//  step, and the old acceleration's half of the velocity update is applied in Begin because its
+//  slot in the store is reused for the new acceleration.
+
+struct VelocityVerletIntegrator
+{
+    static const bool kDriftsBeforeForces = true;
+
+    static inline void Begin(float& x, float& v, float& a, float dt)
+    {
+        x += (v + a * (0.5f * dt)) * dt;
+        v += a * (0.5f * dt);
+        a = 0.0f;
+    }
+
+    static inline void End(float& /*x*/, float& v, float& a, float dt, float damping)
+    {
+        v = (v + a * (0.5f * dt)) * damping;
+    }
+};
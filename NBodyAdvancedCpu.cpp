@@ -16,18 +16,17 @@
 
 #include <string.h>
 #include <math.h>
-#include <ppl.h>
-#include <concrtrm.h>
 #include <assert.h>
-#include <atlbase.h>
 #include <random>
+#include <chrono>
 #include <memory>
 #include <algorithm>
 
 #include "Common.h"
 #include "NBodyAdvancedCpu.h"
+#include "SimdUtilities.h"
+#include "ParallelCpu.h"
 
-using namespace concurrency;
 using namespace concurrency::graphics;
 
 //--------------------------------------------------------------------------------------
@@ -43,158 +42,1178 @@ using namespace concurrency::graphics;
 //  http://software.intel.com/en-us/blogs/2010/07/01/n-bodies-a-parallel-tbb-solution-parallel-code-balanced-recursive-parallelism-with-parallel_invoke/
 
 //  Select which interaction engine to use based on the available SSE support.
+//
+//  The body-body kernels are instantiated for both the near field, the pairs closer than the
+//  cutoff, and the far field, the rest. They differ only in the comparison with the cutoff that
+//  every kernel already makes. Each is also instantiated without the updates of the j particles
+//  for the gathers. All the kernels are instantiated for a uniform mass, held in a register, and
+//  for individual masses read from the mass stream.
+
+void NBodyAdvancedInteractionEngine::SelectCpuImplementation(CpuSSE maxSSE)
+{
+    if (m_uniformMass)
+        SelectKernels<true>(maxSSE);
+    else
+        SelectKernels<false>(maxSSE);
+}
 
-void NBodyAdvancedInteractionEngine::SelectCpuImplementation()
+template <bool uniformMass>
+void NBodyAdvancedInteractionEngine::SelectKernels(CpuSSE maxSSE)
 {
-    switch (GetSSEType())
+    typedef NBodyAdvancedInteractionEngine Engine;
+
+    switch (std::min(GetSSEType(), maxSSE))
     {
-    case kCpuSSE4:
-        m_funcptr = &NBodyAdvancedInteractionEngine::BodyBodyInteractionSSE4;
+    case kCpuAVX512:
+#ifdef NBODY_AVX512_SUPPORTED
+        m_funcptr = m_farField ? &Engine::BodyBodyInteractionAVX512<true, true, uniformMass> : &Engine::BodyBodyInteractionAVX512<false, true, uniformMass>;
+        m_gatherFuncptr = m_farField ? &Engine::BodyBodyInteractionAVX512<true, false, uniformMass> : &Engine::BodyBodyInteractionAVX512<false, false, uniformMass>;
+        m_hermiteFuncptr = &Engine::HermiteInteractionAVX512<uniformMass>;
+        m_hermiteGatherFuncptr = &Engine::HermiteGatherAVX512<uniformMass>;
+        break;
+#endif
+    case kCpuAVX2:
+        m_funcptr = m_farField ? &Engine::BodyBodyInteractionAVX2<true, true, uniformMass> : &Engine::BodyBodyInteractionAVX2<false, true, uniformMass>;
+        m_gatherFuncptr = m_farField ? &Engine::BodyBodyInteractionAVX2<true, false, uniformMass> : &Engine::BodyBodyInteractionAVX2<false, false, uniformMass>;
+        m_hermiteFuncptr = &Engine::HermiteInteractionAVX2<uniformMass>;
+        m_hermiteGatherFuncptr = &Engine::HermiteGatherAVX2<uniformMass>;
         break;
+    case kCpuSSE4:
     case kCpuSSE:
-        m_funcptr = &NBodyAdvancedInteractionEngine::BodyBodyInteractionSSE;
+        m_funcptr = m_farField ? &Engine::BodyBodyInteractionSSE<true, true, uniformMass> : &Engine::BodyBodyInteractionSSE<false, true, uniformMass>;
+        m_gatherFuncptr = m_farField ? &Engine::BodyBodyInteractionSSE<true, false, uniformMass> : &Engine::BodyBodyInteractionSSE<false, false, uniformMass>;
+        m_hermiteFuncptr = &Engine::HermiteInteractionSSE<uniformMass>;
+        m_hermiteGatherFuncptr = &Engine::HermiteGatherSSE<uniformMass>;
         break;
     default:
-        m_funcptr = &NBodyAdvancedInteractionEngine::BodyBodyInteraction;
+        m_funcptr = m_farField ? &Engine::BodyBodyInteraction<true, true, uniformMass> : &Engine::BodyBodyInteraction<false, true, uniformMass>;
+        m_gatherFuncptr = m_farField ? &Engine::BodyBodyInteraction<true, false, uniformMass> : &Engine::BodyBodyInteraction<false, false, uniformMass>;
+        m_hermiteFuncptr = &Engine::HermiteInteraction<uniformMass>;
+        m_hermiteGatherFuncptr = &Engine::HermiteGather<uniformMass>;
     }
 }
 
-void NBodyAdvancedInteractionEngine::BodyBodyInteraction(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+//  Whether a pair interacts, given its softened squared distance.
+
+template <bool farField>
+static inline bool Interacts(float distSqr, float cutoffSquared)
+{
+    return farField ? (distSqr >= cutoffSquared) : (distSqr < cutoffSquared);
+}
+
+template <bool farField>
+static inline __m128 Interacts(const __m128 distSqr, const __m128 cutoffSquared)
+{
+    return farField ? _mm_cmpge_ps(distSqr, cutoffSquared) : _mm_cmplt_ps(distSqr, cutoffSquared);
+}
+
+//  Mass of particle j, the engine's particle mass unless the masses are read from the stream.
+
+template <bool uniformMass>
+static inline float ParticleMass(float particleMass, const float* const mass, size_t j)
+{
+    return uniformMass ? particleMass : mass[j];
+}
+
+//  With individual masses particle i is accelerated by the mass of j and j by the mass of i, so
+//  the reciprocal kernels scale the shared inverse cube by each. With a uniform mass both scales
+//  are the same product.
+
+template <bool farField, bool reciprocal, bool uniformMass>
+void NBodyAdvancedInteractionEngine::BodyBodyInteraction(ParticleStoreSoA* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
 {
+    const float* const mass = pParticles->mass;
+
     // The inner loop is not parallelized because Integrate and InteractionList are already running on all cores.
 
     for (size_t i = iBegin; i < iEnd; ++i)
     {
+        const float_3 pos = pParticles->Position(i);
+        const float massI = ParticleMass<uniformMass>(m_particleMass, mass, i);
+        float_3 acc(0.0f);
+
         for (size_t j = jBegin; j < jEnd; ++j)
         {
-            const float_3 r = pParticles[j].pos - pParticles[i].pos;
+            const float_3 r = pParticles->Position(j) - pos;
             const float distSqr = SqrLength(r) + m_softeningSquared;
 
             float invDist = 1.0f / sqrt(distSqr);
             float invDistCube =  invDist * invDist * invDist;
-            float s = m_particleMass * invDistCube;
+            float s = Interacts<farField>(distSqr, m_cutoffSquared) ? invDistCube : 0.0f;
+            const float sI = ParticleMass<uniformMass>(m_particleMass, mass, j) * s;
+            const float sJ = uniformMass ? sI : massI * s;
 
             // Cache intermediate acceleration results for both particles in this interaction.
-            pParticles[i].acc += r * s;
-            pParticles[j].acc -= r * s;
+            acc += r * sI;
+            if (reciprocal)
+                pParticles->SetAcceleration(j, pParticles->Acceleration(j) - r * sJ);
         }
+        pParticles->SetAcceleration(i, pParticles->Acceleration(i) + acc);
     }
 }
 
-void NBodyAdvancedInteractionEngine::BodyBodyInteractionSSE(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+//  The SIMD implementations load the same component of several consecutive j particles into one
+//  register. The acceleration of particle i is accumulated in registers and the accelerations of
+//  the j particles are updated in their streams. The j range starts at an arbitrary index so the
+//  loads and stores are unaligned.
+//
+//  Lanes past jEnd belong to particles that may be being updated by another thread so they must
+//  never be written. The SSE implementation finishes each row with scalar code, the AVX
+//  implementations use masked loads and stores for the last partial register.
+//
+//  Unless reciprocal is set the j particles are only read, for the tracers' gathers. Unless
+//  uniformMass is set the j particles' masses are loaded from the mass stream alongside their
+//  positions, otherwise the engine's particle mass is a constant register.
+
+template <bool farField, bool reciprocal, bool uniformMass>
+void NBodyAdvancedInteractionEngine::BodyBodyInteractionSSE(ParticleStoreSoA* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
 {
-    ParticleSSE* const pParticlesSSE = reinterpret_cast<ParticleSSE* const>(pParticles);
-    const __m128 softeningSquared = _mm_load1_ps( &m_softeningSquared);
-    const __m128 particleMass = _mm_load1_ps( &m_particleMass );
+    const __m128 softeningSquared = _mm_load1_ps(&m_softeningSquared);
+    const __m128 particleMass = _mm_load1_ps(&m_particleMass);
+    const __m128 cutoffSquared = _mm_load1_ps(&m_cutoffSquared);
+    const size_t jVectorEnd = jBegin + ((jEnd - jBegin) & ~size_t(3));
+    const float* const mass = pParticles->mass;
 
     // The inner loop is not parallelized because Integrate and InteractionList are already running on all cores.
 
     for (size_t i = iBegin; i < iEnd; ++i)
     {
-        for (size_t j = jBegin; j < jEnd; ++j)
+        const __m128 posX = _mm_load1_ps(&pParticles->x[i]);
+        const __m128 posY = _mm_load1_ps(&pParticles->y[i]);
+        const __m128 posZ = _mm_load1_ps(&pParticles->z[i]);
+        const __m128 massI = uniformMass ? particleMass : _mm_load1_ps(&mass[i]);
+        __m128 accX = _mm_setzero_ps();
+        __m128 accY = _mm_setzero_ps();
+        __m128 accZ = _mm_setzero_ps();
+
+        for (size_t j = jBegin; j < jVectorEnd; j += 4)
         {
             //const float_3 r = pParticles[j].pos - pParticles[i].pos;
-            __m128 r = _mm_sub_ps(pParticlesSSE[j].pos, pParticlesSSE[i].pos);
+            const __m128 rX = _mm_sub_ps(_mm_loadu_ps(&pParticles->x[j]), posX);
+            const __m128 rY = _mm_sub_ps(_mm_loadu_ps(&pParticles->y[j]), posY);
+            const __m128 rZ = _mm_sub_ps(_mm_loadu_ps(&pParticles->z[j]), posZ);
 
             //float distSqr = float_3::SqrLength(r) + m_softeningSquared;
-            __m128 distSqr = _mm_mul_ps(r, r);    //x    y    z    ?
-            __m128 rshuf = _mm_shuffle_ps(distSqr, distSqr, _MM_SHUFFLE(0,3,2,1));
-            distSqr = _mm_add_ps(distSqr, rshuf);  //x+y, y+z, z+?, ?+x
-            rshuf = _mm_shuffle_ps(distSqr, distSqr, _MM_SHUFFLE(1,0,3,2));
-            distSqr = _mm_add_ps(rshuf, distSqr);  //x+y+z+0, y+z+0+X, z+0+x+y, 0+x+y+z
-            distSqr = _mm_add_ps(distSqr, softeningSquared); 
+            __m128 distSqr = _mm_add_ps(_mm_mul_ps(rX, rX), softeningSquared);
+            distSqr = _mm_add_ps(_mm_mul_ps(rY, rY), distSqr);
+            distSqr = _mm_add_ps(_mm_mul_ps(rZ, rZ), distSqr);
 
             //float invDist = 1.0f / sqrt(distSqr);
             //float invDistCube =  invDist * invDist * invDist;
             //float s = m_particleMass * invDistCube;
-            __m128 invDistSqr = _mm_rsqrt_ps(distSqr);
-            __m128 invDistCube = _mm_mul_ps(_mm_mul_ps(invDistSqr, invDistSqr), invDistSqr);            
-            __m128 s = _mm_mul_ps(particleMass, invDistCube); 
-
-            //m_pBodiesCache[i].acc += r * s;
-            //m_pBodiesCache[j].acc -= r * s;
-            __m128 k = _mm_mul_ps(r, s);
-            pParticlesSSE[i].acc = _mm_add_ps(pParticlesSSE[i].acc, k);
-            pParticlesSSE[j].acc = _mm_sub_ps(pParticlesSSE[j].acc, k);
+            const __m128 invDist = _mm_rsqrt_ps(distSqr);
+            const __m128 invDistCube = _mm_mul_ps(_mm_mul_ps(invDist, invDist), invDist);            
+            const __m128 s = _mm_and_ps(invDistCube, Interacts<farField>(distSqr, cutoffSquared));
+            const __m128 sI = _mm_mul_ps(uniformMass ? particleMass : _mm_loadu_ps(&mass[j]), s);
+
+            //pParticles[i].acc += r * s;
+            //pParticles[j].acc -= r * s;
+            const __m128 kX = _mm_mul_ps(rX, sI);
+            const __m128 kY = _mm_mul_ps(rY, sI);
+            const __m128 kZ = _mm_mul_ps(rZ, sI);
+            accX = _mm_add_ps(accX, kX);
+            accY = _mm_add_ps(accY, kY);
+            accZ = _mm_add_ps(accZ, kZ);
+            if (reciprocal)
+            {
+                // With a uniform mass the j particles receive exactly -k.
+                const __m128 sJ = _mm_mul_ps(massI, s);
+                _mm_storeu_ps(&pParticles->ax[j], _mm_sub_ps(_mm_loadu_ps(&pParticles->ax[j]), uniformMass ? kX : _mm_mul_ps(rX, sJ)));
+                _mm_storeu_ps(&pParticles->ay[j], _mm_sub_ps(_mm_loadu_ps(&pParticles->ay[j]), uniformMass ? kY : _mm_mul_ps(rY, sJ)));
+                _mm_storeu_ps(&pParticles->az[j], _mm_sub_ps(_mm_loadu_ps(&pParticles->az[j]), uniformMass ? kZ : _mm_mul_ps(rZ, sJ)));
+            }
+        }
+
+        float_3 acc(HorizontalSum(accX), HorizontalSum(accY), HorizontalSum(accZ));
+        const float_3 pos = pParticles->Position(i);
+        const float massScalarI = ParticleMass<uniformMass>(m_particleMass, mass, i);
+
+        for (size_t j = jVectorEnd; j < jEnd; ++j)
+        {
+            const float_3 r = pParticles->Position(j) - pos;
+            const float distSqr = SqrLength(r) + m_softeningSquared;
+
+            float invDist = 1.0f / sqrt(distSqr);
+            float invDistCube =  invDist * invDist * invDist;
+            float s = Interacts<farField>(distSqr, m_cutoffSquared) ? invDistCube : 0.0f;
+
+            acc += r * (ParticleMass<uniformMass>(m_particleMass, mass, j) * s);
+            if (reciprocal)
+                pParticles->SetAcceleration(j, pParticles->Acceleration(j) - r * (massScalarI * s));
         }
+        pParticles->SetAcceleration(i, pParticles->Acceleration(i) + acc);
     }
 }
 
-void NBodyAdvancedInteractionEngine::BodyBodyInteractionSSE4(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+//  Calculates 1 / (|r|^2 + m_softeningSquared)^(3/2) for eight interactions, or zero for pairs
+//  that do not interact. The caller scales it by the masses. Arguments are passed by reference
+//  because VC++ cannot pass more than three __m256 values by value on x86.
+
+template <bool farField>
+static inline __m256 InteractionScaleAVX2(const __m256& rX, const __m256& rY, const __m256& rZ, 
+    const __m256& softeningSquared, const __m256& cutoffSquared)
 {
-    ParticleSSE* const pParticlesSSE = reinterpret_cast<ParticleSSE* const>(pParticles);
-    const __m128 softeningSquared = _mm_load1_ps( &m_softeningSquared);
-    const __m128 particleMass = _mm_load1_ps( &m_particleMass );
+    //const float distSqr = SqrLength(r) + m_softeningSquared;
+    __m256 distSqr = _mm256_fmadd_ps(rX, rX, softeningSquared);
+    distSqr = _mm256_fmadd_ps(rY, rY, distSqr);
+    distSqr = _mm256_fmadd_ps(rZ, rZ, distSqr);
+
+    //float invDist = 1.0f / sqrt(distSqr);
+    //float invDistCube =  invDist * invDist * invDist;
+    //float s = m_particleMass * invDistCube;
+    const __m256 invDist = _mm256_rsqrt_ps(distSqr);
+    const __m256 invDistCube = _mm256_mul_ps(_mm256_mul_ps(invDist, invDist), invDist);
+    return _mm256_and_ps(invDistCube, _mm256_cmp_ps(distSqr, cutoffSquared, farField ? _CMP_GE_OQ : _CMP_LT_OQ));
+}
+
+template <bool farField, bool reciprocal, bool uniformMass>
+void NBodyAdvancedInteractionEngine::BodyBodyInteractionAVX2(ParticleStoreSoA* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+{
+    const __m256 softeningSquared = _mm256_set1_ps(m_softeningSquared);
+    const __m256 particleMass = _mm256_set1_ps(m_particleMass);
+    const __m256 cutoffSquared = _mm256_set1_ps(m_cutoffSquared);
+    const size_t jVectorEnd = jBegin + ((jEnd - jBegin) & ~size_t(7));
+    const __m256i tailMask = TailMask8i(static_cast<int>(jEnd - jVectorEnd));
+    float* const x = pParticles->x; float* const y = pParticles->y; float* const z = pParticles->z;
+    float* const ax = pParticles->ax; float* const ay = pParticles->ay; float* const az = pParticles->az;
+    const float* const mass = pParticles->mass;
 
     // The inner loop is not parallelized because Integrate and InteractionList are already running on all cores.
 
     for (size_t i = iBegin; i < iEnd; ++i)
     {
-        for (size_t j = jBegin; j < jEnd; ++j)
+        const __m256 posX = _mm256_broadcast_ss(&x[i]);
+        const __m256 posY = _mm256_broadcast_ss(&y[i]);
+        const __m256 posZ = _mm256_broadcast_ss(&z[i]);
+        const __m256 massI = uniformMass ? particleMass : _mm256_broadcast_ss(&mass[i]);
+        __m256 accX = _mm256_setzero_ps();
+        __m256 accY = _mm256_setzero_ps();
+        __m256 accZ = _mm256_setzero_ps();
+
+        for (size_t j = jBegin; j < jVectorEnd; j += 8)
+        {
+            //const float_3 r = pParticles[j].pos - pParticles[i].pos;
+            const __m256 rX = _mm256_sub_ps(_mm256_loadu_ps(&x[j]), posX);
+            const __m256 rY = _mm256_sub_ps(_mm256_loadu_ps(&y[j]), posY);
+            const __m256 rZ = _mm256_sub_ps(_mm256_loadu_ps(&z[j]), posZ);
+            const __m256 s = InteractionScaleAVX2<farField>(rX, rY, rZ, softeningSquared, cutoffSquared);
+            const __m256 sI = _mm256_mul_ps(uniformMass ? particleMass : _mm256_loadu_ps(&mass[j]), s);
+
+            //pParticles[i].acc += r * s;
+            //pParticles[j].acc -= r * s;
+            accX = _mm256_fmadd_ps(rX, sI, accX);
+            accY = _mm256_fmadd_ps(rY, sI, accY);
+            accZ = _mm256_fmadd_ps(rZ, sI, accZ);
+            if (reciprocal)
+            {
+                const __m256 sJ = uniformMass ? sI : _mm256_mul_ps(massI, s);
+                _mm256_storeu_ps(&ax[j], _mm256_fnmadd_ps(rX, sJ, _mm256_loadu_ps(&ax[j])));
+                _mm256_storeu_ps(&ay[j], _mm256_fnmadd_ps(rY, sJ, _mm256_loadu_ps(&ay[j])));
+                _mm256_storeu_ps(&az[j], _mm256_fnmadd_ps(rZ, sJ, _mm256_loadu_ps(&az[j])));
+            }
+        }
+
+        // Remaining j particles that do not fill a whole register. Masked lanes load as zero and
+        // are excluded from s, so they contribute nothing and are not written back.
+        if (jVectorEnd < jEnd)
+        {
+            const size_t j = jVectorEnd;
+            const __m256 rX = _mm256_sub_ps(_mm256_maskload_ps(&x[j], tailMask), posX);
+            const __m256 rY = _mm256_sub_ps(_mm256_maskload_ps(&y[j], tailMask), posY);
+            const __m256 rZ = _mm256_sub_ps(_mm256_maskload_ps(&z[j], tailMask), posZ);
+            const __m256 s = _mm256_and_ps(InteractionScaleAVX2<farField>(rX, rY, rZ, softeningSquared, cutoffSquared), 
+                _mm256_castsi256_ps(tailMask));
+            const __m256 sI = _mm256_mul_ps(uniformMass ? particleMass : _mm256_maskload_ps(&mass[j], tailMask), s);
+
+            accX = _mm256_fmadd_ps(rX, sI, accX);
+            accY = _mm256_fmadd_ps(rY, sI, accY);
+            accZ = _mm256_fmadd_ps(rZ, sI, accZ);
+            if (reciprocal)
+            {
+                const __m256 sJ = uniformMass ? sI : _mm256_mul_ps(massI, s);
+                _mm256_maskstore_ps(&ax[j], tailMask, _mm256_fnmadd_ps(rX, sJ, _mm256_maskload_ps(&ax[j], tailMask)));
+                _mm256_maskstore_ps(&ay[j], tailMask, _mm256_fnmadd_ps(rY, sJ, _mm256_maskload_ps(&ay[j], tailMask)));
+                _mm256_maskstore_ps(&az[j], tailMask, _mm256_fnmadd_ps(rZ, sJ, _mm256_maskload_ps(&az[j], tailMask)));
+            }
+        }
+
+        ax[i] += HorizontalSum(accX);
+        ay[i] += HorizontalSum(accY);
+        az[i] += HorizontalSum(accZ);
+    }
+    _mm256_zeroupper();
+}
+
+#ifdef NBODY_AVX512_SUPPORTED
+
+template <bool farField, bool reciprocal, bool uniformMass>
+void NBodyAdvancedInteractionEngine::BodyBodyInteractionAVX512(ParticleStoreSoA* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+{
+    const __m512 softeningSquared = _mm512_set1_ps(m_softeningSquared);
+    const __m512 particleMass = _mm512_set1_ps(m_particleMass);
+    const __m512 cutoffSquared = _mm512_set1_ps(m_cutoffSquared);
+    const float* const mass = pParticles->mass;
+
+    // The inner loop is not parallelized because Integrate and InteractionList are already running on all cores.
+
+    for (size_t i = iBegin; i < iEnd; ++i)
+    {
+        const __m512 posX = _mm512_set1_ps(pParticles->x[i]);
+        const __m512 posY = _mm512_set1_ps(pParticles->y[i]);
+        const __m512 posZ = _mm512_set1_ps(pParticles->z[i]);
+        const __m512 massI = uniformMass ? particleMass : _mm512_set1_ps(mass[i]);
+        __m512 accX = _mm512_setzero_ps();
+        __m512 accY = _mm512_setzero_ps();
+        __m512 accZ = _mm512_setzero_ps();
+
+        for (size_t j = jBegin; j < jEnd; j += 16)
         {
-            //const float_3 r = m_pBodiesCache[j].pos - m_pBodiesCache[i].pos;
-            __m128 r = _mm_sub_ps(pParticlesSSE[j].pos, pParticlesSSE[i].pos);
+            const __mmask16 mask = TailMask16(jEnd - j);
+
+            //const float_3 r = pParticles[j].pos - pParticles[i].pos;
+            const __m512 rX = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &pParticles->x[j]), posX);
+            const __m512 rY = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &pParticles->y[j]), posY);
+            const __m512 rZ = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &pParticles->z[j]), posZ);
+
             //const float distSqr = SqrLength(r) + m_softeningSquared;
-            //This uses the additional SSE4 _mm_dp_ps intrinsic.
-            __m128 distSqr = _mm_add_ps(_mm_dp_ps(r, r, 0x7F), softeningSquared);
+            __m512 distSqr = _mm512_fmadd_ps(rX, rX, softeningSquared);
+            distSqr = _mm512_fmadd_ps(rY, rY, distSqr);
+            distSqr = _mm512_fmadd_ps(rZ, rZ, distSqr);
 
             //float invDist = 1.0f / sqrt(distSqr);
             //float invDistCube =  invDist * invDist * invDist;
             //float s = m_particleMass * invDistCube;
-            __m128 invDistSqr = _mm_rsqrt_ps(distSqr);
-            __m128 invDistCube = _mm_mul_ps(_mm_mul_ps(invDistSqr, invDistSqr), invDistSqr);            
-            __m128 s = _mm_mul_ps(particleMass, invDistCube); 
-
-            //m_pBodiesCache[i].acc += r * s;
-            //m_pBodiesCache[j].acc -= r * s;
-            __m128 k = _mm_mul_ps(r, s);
-            pParticlesSSE[i].acc = _mm_add_ps(pParticlesSSE[i].acc, k);
-            pParticlesSSE[j].acc = _mm_sub_ps(pParticlesSSE[j].acc, k);
+            const __m512 invDist = ReciprocalSqrtNewton(distSqr);
+            const __m512 invDistCube = _mm512_mul_ps(_mm512_mul_ps(invDist, invDist), invDist);
+            const __mmask16 inside = _mm512_mask_cmp_ps_mask(mask, distSqr, cutoffSquared, farField ? _CMP_GE_OQ : _CMP_LT_OQ);
+            const __m512 sI = _mm512_maskz_mul_ps(inside, uniformMass ? particleMass : _mm512_maskz_loadu_ps(mask, &mass[j]), invDistCube);
+
+            //pParticles[i].acc += r * s;
+            //pParticles[j].acc -= r * s;
+            accX = _mm512_fmadd_ps(rX, sI, accX);
+            accY = _mm512_fmadd_ps(rY, sI, accY);
+            accZ = _mm512_fmadd_ps(rZ, sI, accZ);
+            if (reciprocal)
+            {
+                const __m512 sJ = uniformMass ? sI : _mm512_maskz_mul_ps(inside, massI, invDistCube);
+                _mm512_mask_storeu_ps(&pParticles->ax[j], mask, _mm512_fnmadd_ps(rX, sJ, _mm512_maskz_loadu_ps(mask, &pParticles->ax[j])));
+                _mm512_mask_storeu_ps(&pParticles->ay[j], mask, _mm512_fnmadd_ps(rY, sJ, _mm512_maskz_loadu_ps(mask, &pParticles->ay[j])));
+                _mm512_mask_storeu_ps(&pParticles->az[j], mask, _mm512_fnmadd_ps(rZ, sJ, _mm512_maskz_loadu_ps(mask, &pParticles->az[j])));
+            }
+        }
+
+        pParticles->ax[i] += _mm512_reduce_add_ps(accX);
+        pParticles->ay[i] += _mm512_reduce_add_ps(accY);
+        pParticles->az[i] += _mm512_reduce_add_ps(accZ);
+    }
+    _mm256_zeroupper();
+}
+
+#endif
+
+//  The neighbors of each particle are scattered through the streams so they are gathered one at
+//  a time. Each particle's list holds all of its neighbors, rather than only those with a higher
+//  index, so only particle i is written and no two tasks update the same particle. The list
+//  radius includes the skin so the cutoff must still be tested.
+
+template <bool uniformMass>
+void NBodyAdvancedInteractionEngine::NeighborInteractionKernel(ParticleStoreSoA* const pParticles, const int iBegin, const int iEnd, const NeighborList& neighbors) const
+{
+    const float* const x = pParticles->x;
+    const float* const y = pParticles->y;
+    const float* const z = pParticles->z;
+    const float* const mass = pParticles->mass;
+    const int* const list = neighbors.Neighbors();
+
+    for (int i = iBegin; i < iEnd; ++i)
+    {
+        const float posX = x[i];
+        const float posY = y[i];
+        const float posZ = z[i];
+        float accX = 0.0f;
+        float accY = 0.0f;
+        float accZ = 0.0f;
+
+        for (int n = neighbors.Begin(i); n < neighbors.End(i); ++n)
+        {
+            const int j = list[n];
+            const float rX = x[j] - posX;
+            const float rY = y[j] - posY;
+            const float rZ = z[j] - posZ;
+            const float distSqr = rX * rX + rY * rY + rZ * rZ + m_softeningSquared;
+
+            const float invDist = 1.0f / sqrt(distSqr);
+            const float s = (distSqr < m_cutoffSquared) ? ParticleMass<uniformMass>(m_particleMass, mass, j) * invDist * invDist * invDist : 0.0f;
+            accX += rX * s;
+            accY += rY * s;
+            accZ += rZ * s;
         }
+        pParticles->ax[i] += accX;
+        pParticles->ay[i] += accY;
+        pParticles->az[i] += accZ;
     }
 }
 
+void NBodyAdvancedInteractionEngine::NeighborInteraction(ParticleStoreSoA* const pParticles, const int iBegin, const int iEnd, const NeighborList& neighbors) const
+{
+    if (m_uniformMass)
+        NeighborInteractionKernel<true>(pParticles, iBegin, iEnd, neighbors);
+    else
+        NeighborInteractionKernel<false>(pParticles, iBegin, iEnd, neighbors);
+}
+
+//--------------------------------------------------------------------------------------
+//  Hermite kernels, accelerations and jerks.
+//--------------------------------------------------------------------------------------
+//
+//  For r = pos[j] - pos[i] and v = vel[j] - vel[i] the jerk of particle i due to j is
+//
+//      s * (v - 3 (r . v) r / |r|^2),  where s = mass / |r|^3
+//
+//  and particle j receives the negated acceleration and jerk, so both are accumulated in the
+//  same pass over the pairs. The fourth order integrator needs more accurate inverse square
+//  roots than the plain approximations so the SIMD kernels refine them with a Newton step.
+//
+//  As for the body-body kernels, with individual masses the terms of particle i are scaled by
+//  the mass of j and those of j by the mass of i.
+
+//  One pair, used by the scalar kernel and to finish the rows of the SSE kernel.
+
+//  The acceleration and jerk of particle i due to particle j of unit mass, given their relative
+//  position and velocity.
+
+static inline void HermiteTerms(const float_3& r, const float_3& v, float softeningSquared, float cutoffSquared, float_3& a, float_3& k)
+{
+    const float distSqr = SqrLength(r) + softeningSquared;
+
+    const float invDist = 1.0f / sqrt(distSqr);
+    const float invDistSqr = invDist * invDist;
+    const float s = (distSqr < cutoffSquared) ? invDist * invDistSqr : 0.0f;
+    const float alpha = 3.0f * (r.x * v.x + r.y * v.y + r.z * v.z) * invDistSqr;
+
+    a = r * s;
+    k = (v - r * alpha) * s;
+}
+
+template <bool uniformMass>
+static inline void HermitePair(ParticleStoreSoA* const pParticles, const JerkStreams& jerk, const size_t j,
+    const float_3& pos, const float_3& vel, float massI, float softeningSquared, float particleMass, float cutoffSquared, float_3& acc, float_3& jrk)
+{
+    float_3 a;
+    float_3 k;
+    HermiteTerms(pParticles->Position(j) - pos, pParticles->Velocity(j) - vel, softeningSquared, cutoffSquared, a, k);
+    const float massJ = ParticleMass<uniformMass>(particleMass, pParticles->mass, j);
+    acc += a * massJ;
+    jrk += k * massJ;
+    pParticles->SetAcceleration(j, pParticles->Acceleration(j) - a * massI);
+    jerk.x[j] -= k.x * massI;
+    jerk.y[j] -= k.y * massI;
+    jerk.z[j] -= k.z * massI;
+}
+
+template <bool uniformMass>
+void NBodyAdvancedInteractionEngine::HermiteInteraction(ParticleStoreSoA* const pParticles, const JerkStreams& jerk, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+{
+    for (size_t i = iBegin; i < iEnd; ++i)
+    {
+        const float_3 pos = pParticles->Position(i);
+        const float_3 vel = pParticles->Velocity(i);
+        const float massI = ParticleMass<uniformMass>(m_particleMass, pParticles->mass, i);
+        float_3 acc(0.0f);
+        float_3 jrk(0.0f);
+
+        for (size_t j = jBegin; j < jEnd; ++j)
+            HermitePair<uniformMass>(pParticles, jerk, j, pos, vel, massI, m_softeningSquared, m_particleMass, m_cutoffSquared, acc, jrk);
+
+        pParticles->SetAcceleration(i, pParticles->Acceleration(i) + acc);
+        jerk.x[i] += jrk.x;
+        jerk.y[i] += jrk.y;
+        jerk.z[i] += jrk.z;
+    }
+}
+
+template <bool uniformMass>
+void NBodyAdvancedInteractionEngine::HermiteInteractionSSE(ParticleStoreSoA* const pParticles, const JerkStreams& jerk, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+{
+    const __m128 softeningSquared = _mm_set1_ps(m_softeningSquared);
+    const __m128 particleMass = _mm_set1_ps(m_particleMass);
+    const __m128 cutoffSquared = _mm_set1_ps(m_cutoffSquared);
+    const __m128 three = _mm_set1_ps(3.0f);
+    const size_t jVectorEnd = jBegin + ((jEnd - jBegin) & ~size_t(3));
+    float* const x = pParticles->x; float* const y = pParticles->y; float* const z = pParticles->z;
+    float* const vx = pParticles->vx; float* const vy = pParticles->vy; float* const vz = pParticles->vz;
+    float* const ax = pParticles->ax; float* const ay = pParticles->ay; float* const az = pParticles->az;
+    float* const jx = jerk.x; float* const jy = jerk.y; float* const jz = jerk.z;
+    const float* const mass = pParticles->mass;
+
+    for (size_t i = iBegin; i < iEnd; ++i)
+    {
+        const __m128 posX = _mm_set1_ps(x[i]);
+        const __m128 posY = _mm_set1_ps(y[i]);
+        const __m128 posZ = _mm_set1_ps(z[i]);
+        const __m128 velX = _mm_set1_ps(vx[i]);
+        const __m128 velY = _mm_set1_ps(vy[i]);
+        const __m128 velZ = _mm_set1_ps(vz[i]);
+        const __m128 massI = uniformMass ? particleMass : _mm_set1_ps(mass[i]);
+        __m128 accX = _mm_setzero_ps();
+        __m128 accY = _mm_setzero_ps();
+        __m128 accZ = _mm_setzero_ps();
+        __m128 jrkX = _mm_setzero_ps();
+        __m128 jrkY = _mm_setzero_ps();
+        __m128 jrkZ = _mm_setzero_ps();
+
+        for (size_t j = jBegin; j < jVectorEnd; j += 4)
+        {
+            const __m128 rX = _mm_sub_ps(_mm_loadu_ps(&x[j]), posX);
+            const __m128 rY = _mm_sub_ps(_mm_loadu_ps(&y[j]), posY);
+            const __m128 rZ = _mm_sub_ps(_mm_loadu_ps(&z[j]), posZ);
+            const __m128 vX = _mm_sub_ps(_mm_loadu_ps(&vx[j]), velX);
+            const __m128 vY = _mm_sub_ps(_mm_loadu_ps(&vy[j]), velY);
+            const __m128 vZ = _mm_sub_ps(_mm_loadu_ps(&vz[j]), velZ);
+
+            __m128 distSqr = _mm_add_ps(_mm_mul_ps(rX, rX), softeningSquared);
+            distSqr = _mm_add_ps(_mm_mul_ps(rY, rY), distSqr);
+            distSqr = _mm_add_ps(_mm_mul_ps(rZ, rZ), distSqr);
+            __m128 rv = _mm_mul_ps(rX, vX);
+            rv = _mm_add_ps(_mm_mul_ps(rY, vY), rv);
+            rv = _mm_add_ps(_mm_mul_ps(rZ, vZ), rv);
+
+            const __m128 invDist = ReciprocalSqrtNewton(distSqr);
+            const __m128 invDistSqr = _mm_mul_ps(invDist, invDist);
+            const __m128 s = _mm_and_ps(_mm_mul_ps(invDistSqr, invDist), _mm_cmplt_ps(distSqr, cutoffSquared));
+            const __m128 sI = _mm_mul_ps(uniformMass ? particleMass : _mm_loadu_ps(&mass[j]), s);
+            const __m128 sJ = uniformMass ? sI : _mm_mul_ps(massI, s);
+            const __m128 alpha = _mm_mul_ps(_mm_mul_ps(three, rv), invDistSqr);
+
+            const __m128 dX = _mm_sub_ps(vX, _mm_mul_ps(rX, alpha));
+            const __m128 dY = _mm_sub_ps(vY, _mm_mul_ps(rY, alpha));
+            const __m128 dZ = _mm_sub_ps(vZ, _mm_mul_ps(rZ, alpha));
+
+            accX = _mm_add_ps(accX, _mm_mul_ps(rX, sI));
+            accY = _mm_add_ps(accY, _mm_mul_ps(rY, sI));
+            accZ = _mm_add_ps(accZ, _mm_mul_ps(rZ, sI));
+            jrkX = _mm_add_ps(jrkX, _mm_mul_ps(dX, sI));
+            jrkY = _mm_add_ps(jrkY, _mm_mul_ps(dY, sI));
+            jrkZ = _mm_add_ps(jrkZ, _mm_mul_ps(dZ, sI));
+            _mm_storeu_ps(&ax[j], _mm_sub_ps(_mm_loadu_ps(&ax[j]), _mm_mul_ps(rX, sJ)));
+            _mm_storeu_ps(&ay[j], _mm_sub_ps(_mm_loadu_ps(&ay[j]), _mm_mul_ps(rY, sJ)));
+            _mm_storeu_ps(&az[j], _mm_sub_ps(_mm_loadu_ps(&az[j]), _mm_mul_ps(rZ, sJ)));
+            _mm_storeu_ps(&jx[j], _mm_sub_ps(_mm_loadu_ps(&jx[j]), _mm_mul_ps(dX, sJ)));
+            _mm_storeu_ps(&jy[j], _mm_sub_ps(_mm_loadu_ps(&jy[j]), _mm_mul_ps(dY, sJ)));
+            _mm_storeu_ps(&jz[j], _mm_sub_ps(_mm_loadu_ps(&jz[j]), _mm_mul_ps(dZ, sJ)));
+        }
+
+        float_3 acc(HorizontalSum(accX), HorizontalSum(accY), HorizontalSum(accZ));
+        float_3 jrk(HorizontalSum(jrkX), HorizontalSum(jrkY), HorizontalSum(jrkZ));
+        const float_3 pos = pParticles->Position(i);
+        const float_3 vel = pParticles->Velocity(i);
+        const float massScalarI = ParticleMass<uniformMass>(m_particleMass, mass, i);
+
+        for (size_t j = jVectorEnd; j < jEnd; ++j)
+            HermitePair<uniformMass>(pParticles, jerk, j, pos, vel, massScalarI, m_softeningSquared, m_particleMass, m_cutoffSquared, acc, jrk);
+
+        pParticles->SetAcceleration(i, pParticles->Acceleration(i) + acc);
+        jx[i] += jrk.x;
+        jy[i] += jrk.y;
+        jz[i] += jrk.z;
+    }
+}
+
+//  Accumulates the acceleration and jerk of one register of j particles. Masked lanes load as
+//  zero, are excluded from s and are not written back. Arguments are passed by reference because
+//  VC++ cannot pass more than three __m256 values by value on x86. Unless reciprocal is set the
+//  j particles are only read and jerk and massI are unused.
+
+template <bool reciprocal, bool uniformMass>
+static inline void HermiteRowAVX2(const JerkStreams& jerk, ParticleStoreSoA* const pParticles, const size_t j, const __m256i& mask,
+    const __m256& posX, const __m256& posY, const __m256& posZ, const __m256& velX, const __m256& velY, const __m256& velZ,
+    const __m256& massI, const __m256& softeningSquared, const __m256& particleMass, const __m256& cutoffSquared,
+    __m256& accX, __m256& accY, __m256& accZ, __m256& jrkX, __m256& jrkY, __m256& jrkZ)
+{
+    const __m256 rX = _mm256_sub_ps(_mm256_maskload_ps(&pParticles->x[j], mask), posX);
+    const __m256 rY = _mm256_sub_ps(_mm256_maskload_ps(&pParticles->y[j], mask), posY);
+    const __m256 rZ = _mm256_sub_ps(_mm256_maskload_ps(&pParticles->z[j], mask), posZ);
+    const __m256 vX = _mm256_sub_ps(_mm256_maskload_ps(&pParticles->vx[j], mask), velX);
+    const __m256 vY = _mm256_sub_ps(_mm256_maskload_ps(&pParticles->vy[j], mask), velY);
+    const __m256 vZ = _mm256_sub_ps(_mm256_maskload_ps(&pParticles->vz[j], mask), velZ);
+
+    __m256 distSqr = _mm256_fmadd_ps(rX, rX, softeningSquared);
+    distSqr = _mm256_fmadd_ps(rY, rY, distSqr);
+    distSqr = _mm256_fmadd_ps(rZ, rZ, distSqr);
+    __m256 rv = _mm256_mul_ps(rX, vX);
+    rv = _mm256_fmadd_ps(rY, vY, rv);
+    rv = _mm256_fmadd_ps(rZ, vZ, rv);
+
+    const __m256 invDist = ReciprocalSqrtNewton(distSqr);
+    const __m256 invDistSqr = _mm256_mul_ps(invDist, invDist);
+    const __m256 inside = _mm256_and_ps(_mm256_cmp_ps(distSqr, cutoffSquared, _CMP_LT_OQ), _mm256_castsi256_ps(mask));
+    const __m256 s = _mm256_and_ps(_mm256_mul_ps(invDistSqr, invDist), inside);
+    const __m256 sI = _mm256_mul_ps(uniformMass ? particleMass : _mm256_maskload_ps(&pParticles->mass[j], mask), s);
+    const __m256 alpha = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(3.0f), rv), invDistSqr);
+
+    const __m256 dX = _mm256_fnmadd_ps(rX, alpha, vX);
+    const __m256 dY = _mm256_fnmadd_ps(rY, alpha, vY);
+    const __m256 dZ = _mm256_fnmadd_ps(rZ, alpha, vZ);
+
+    accX = _mm256_fmadd_ps(rX, sI, accX);
+    accY = _mm256_fmadd_ps(rY, sI, accY);
+    accZ = _mm256_fmadd_ps(rZ, sI, accZ);
+    jrkX = _mm256_fmadd_ps(dX, sI, jrkX);
+    jrkY = _mm256_fmadd_ps(dY, sI, jrkY);
+    jrkZ = _mm256_fmadd_ps(dZ, sI, jrkZ);
+    if (!reciprocal)
+        return;
+
+    const __m256 sJ = uniformMass ? sI : _mm256_mul_ps(massI, s);
+    _mm256_maskstore_ps(&pParticles->ax[j], mask, _mm256_fnmadd_ps(rX, sJ, _mm256_maskload_ps(&pParticles->ax[j], mask)));
+    _mm256_maskstore_ps(&pParticles->ay[j], mask, _mm256_fnmadd_ps(rY, sJ, _mm256_maskload_ps(&pParticles->ay[j], mask)));
+    _mm256_maskstore_ps(&pParticles->az[j], mask, _mm256_fnmadd_ps(rZ, sJ, _mm256_maskload_ps(&pParticles->az[j], mask)));
+    _mm256_maskstore_ps(&jerk.x[j], mask, _mm256_fnmadd_ps(dX, sJ, _mm256_maskload_ps(&jerk.x[j], mask)));
+    _mm256_maskstore_ps(&jerk.y[j], mask, _mm256_fnmadd_ps(dY, sJ, _mm256_maskload_ps(&jerk.y[j], mask)));
+    _mm256_maskstore_ps(&jerk.z[j], mask, _mm256_fnmadd_ps(dZ, sJ, _mm256_maskload_ps(&jerk.z[j], mask)));
+}
+
+template <bool uniformMass>
+void NBodyAdvancedInteractionEngine::HermiteInteractionAVX2(ParticleStoreSoA* const pParticles, const JerkStreams& jerk, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+{
+    const __m256 softeningSquared = _mm256_set1_ps(m_softeningSquared);
+    const __m256 particleMass = _mm256_set1_ps(m_particleMass);
+    const __m256 cutoffSquared = _mm256_set1_ps(m_cutoffSquared);
+    const __m256i allLanes = _mm256_set1_epi32(-1);
+
+    for (size_t i = iBegin; i < iEnd; ++i)
+    {
+        const __m256 posX = _mm256_broadcast_ss(&pParticles->x[i]);
+        const __m256 posY = _mm256_broadcast_ss(&pParticles->y[i]);
+        const __m256 posZ = _mm256_broadcast_ss(&pParticles->z[i]);
+        const __m256 velX = _mm256_broadcast_ss(&pParticles->vx[i]);
+        const __m256 velY = _mm256_broadcast_ss(&pParticles->vy[i]);
+        const __m256 velZ = _mm256_broadcast_ss(&pParticles->vz[i]);
+        const __m256 massI = uniformMass ? particleMass : _mm256_broadcast_ss(&pParticles->mass[i]);
+        __m256 accX = _mm256_setzero_ps();
+        __m256 accY = _mm256_setzero_ps();
+        __m256 accZ = _mm256_setzero_ps();
+        __m256 jrkX = _mm256_setzero_ps();
+        __m256 jrkY = _mm256_setzero_ps();
+        __m256 jrkZ = _mm256_setzero_ps();
+
+        for (size_t j = jBegin; j < jEnd; j += 8)
+        {
+            const __m256i mask = (jEnd - j >= 8) ? allLanes : TailMask8i(static_cast<int>(jEnd - j));
+            HermiteRowAVX2<true, uniformMass>(jerk, pParticles, j, mask, posX, posY, posZ, velX, velY, velZ,
+                massI, softeningSquared, particleMass, cutoffSquared, accX, accY, accZ, jrkX, jrkY, jrkZ);
+        }
+
+        pParticles->ax[i] += HorizontalSum(accX);
+        pParticles->ay[i] += HorizontalSum(accY);
+        pParticles->az[i] += HorizontalSum(accZ);
+        jerk.x[i] += HorizontalSum(jrkX);
+        jerk.y[i] += HorizontalSum(jrkY);
+        jerk.z[i] += HorizontalSum(jrkZ);
+    }
+    _mm256_zeroupper();
+}
+
+#ifdef NBODY_AVX512_SUPPORTED
+
+template <bool uniformMass>
+void NBodyAdvancedInteractionEngine::HermiteInteractionAVX512(ParticleStoreSoA* const pParticles, const JerkStreams& jerk, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+{
+    const __m512 softeningSquared = _mm512_set1_ps(m_softeningSquared);
+    const __m512 particleMass = _mm512_set1_ps(m_particleMass);
+    const __m512 cutoffSquared = _mm512_set1_ps(m_cutoffSquared);
+    const __m512 three = _mm512_set1_ps(3.0f);
+    float* const x = pParticles->x; float* const y = pParticles->y; float* const z = pParticles->z;
+    float* const vx = pParticles->vx; float* const vy = pParticles->vy; float* const vz = pParticles->vz;
+    float* const ax = pParticles->ax; float* const ay = pParticles->ay; float* const az = pParticles->az;
+    float* const jx = jerk.x; float* const jy = jerk.y; float* const jz = jerk.z;
+    const float* const mass = pParticles->mass;
+
+    for (size_t i = iBegin; i < iEnd; ++i)
+    {
+        const __m512 posX = _mm512_set1_ps(x[i]);
+        const __m512 posY = _mm512_set1_ps(y[i]);
+        const __m512 posZ = _mm512_set1_ps(z[i]);
+        const __m512 velX = _mm512_set1_ps(vx[i]);
+        const __m512 velY = _mm512_set1_ps(vy[i]);
+        const __m512 velZ = _mm512_set1_ps(vz[i]);
+        const __m512 massI = uniformMass ? particleMass : _mm512_set1_ps(mass[i]);
+        __m512 accX = _mm512_setzero_ps();
+        __m512 accY = _mm512_setzero_ps();
+        __m512 accZ = _mm512_setzero_ps();
+        __m512 jrkX = _mm512_setzero_ps();
+        __m512 jrkY = _mm512_setzero_ps();
+        __m512 jrkZ = _mm512_setzero_ps();
+
+        for (size_t j = jBegin; j < jEnd; j += 16)
+        {
+            const __mmask16 mask = TailMask16(jEnd - j);
+
+            const __m512 rX = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &x[j]), posX);
+            const __m512 rY = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &y[j]), posY);
+            const __m512 rZ = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &z[j]), posZ);
+            const __m512 vX = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &vx[j]), velX);
+            const __m512 vY = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &vy[j]), velY);
+            const __m512 vZ = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &vz[j]), velZ);
+
+            __m512 distSqr = _mm512_fmadd_ps(rX, rX, softeningSquared);
+            distSqr = _mm512_fmadd_ps(rY, rY, distSqr);
+            distSqr = _mm512_fmadd_ps(rZ, rZ, distSqr);
+            __m512 rv = _mm512_mul_ps(rX, vX);
+            rv = _mm512_fmadd_ps(rY, vY, rv);
+            rv = _mm512_fmadd_ps(rZ, vZ, rv);
+
+            const __m512 invDist = ReciprocalSqrtNewton(distSqr);
+            const __m512 invDistSqr = _mm512_mul_ps(invDist, invDist);
+            const __mmask16 inside = _mm512_mask_cmp_ps_mask(mask, distSqr, cutoffSquared, _CMP_LT_OQ);
+            const __m512 invDistCube = _mm512_mul_ps(invDistSqr, invDist);
+            const __m512 sI = _mm512_maskz_mul_ps(inside, uniformMass ? particleMass : _mm512_maskz_loadu_ps(mask, &mass[j]), invDistCube);
+            const __m512 sJ = uniformMass ? sI : _mm512_maskz_mul_ps(inside, massI, invDistCube);
+            const __m512 alpha = _mm512_mul_ps(_mm512_mul_ps(three, rv), invDistSqr);
+
+            const __m512 dX = _mm512_fnmadd_ps(rX, alpha, vX);
+            const __m512 dY = _mm512_fnmadd_ps(rY, alpha, vY);
+            const __m512 dZ = _mm512_fnmadd_ps(rZ, alpha, vZ);
+
+            accX = _mm512_fmadd_ps(rX, sI, accX);
+            accY = _mm512_fmadd_ps(rY, sI, accY);
+            accZ = _mm512_fmadd_ps(rZ, sI, accZ);
+            jrkX = _mm512_fmadd_ps(dX, sI, jrkX);
+            jrkY = _mm512_fmadd_ps(dY, sI, jrkY);
+            jrkZ = _mm512_fmadd_ps(dZ, sI, jrkZ);
+            _mm512_mask_storeu_ps(&ax[j], mask, _mm512_fnmadd_ps(rX, sJ, _mm512_maskz_loadu_ps(mask, &ax[j])));
+            _mm512_mask_storeu_ps(&ay[j], mask, _mm512_fnmadd_ps(rY, sJ, _mm512_maskz_loadu_ps(mask, &ay[j])));
+            _mm512_mask_storeu_ps(&az[j], mask, _mm512_fnmadd_ps(rZ, sJ, _mm512_maskz_loadu_ps(mask, &az[j])));
+            _mm512_mask_storeu_ps(&jx[j], mask, _mm512_fnmadd_ps(dX, sJ, _mm512_maskz_loadu_ps(mask, &jx[j])));
+            _mm512_mask_storeu_ps(&jy[j], mask, _mm512_fnmadd_ps(dY, sJ, _mm512_maskz_loadu_ps(mask, &jy[j])));
+            _mm512_mask_storeu_ps(&jz[j], mask, _mm512_fnmadd_ps(dZ, sJ, _mm512_maskz_loadu_ps(mask, &jz[j])));
+        }
+
+        ax[i] += _mm512_reduce_add_ps(accX);
+        ay[i] += _mm512_reduce_add_ps(accY);
+        az[i] += _mm512_reduce_add_ps(accZ);
+        jx[i] += _mm512_reduce_add_ps(jrkX);
+        jy[i] += _mm512_reduce_add_ps(jrkY);
+        jz[i] += _mm512_reduce_add_ps(jrkZ);
+    }
+    _mm256_zeroupper();
+}
+
+#endif
+
+//--------------------------------------------------------------------------------------
+//  Hermite gather kernels.
+//--------------------------------------------------------------------------------------
+//
+//  With individual time steps only the particles due at each step need new accelerations and
+//  jerks, so the reciprocal kernels would do mostly wasted work. These calculate the terms for a
+//  single i particle from a range of j particles and only read the store.
+
+template <bool uniformMass>
+void NBodyAdvancedInteractionEngine::HermiteGather(ParticleStoreSoA* const pParticles, const size_t i, const size_t jBegin, const size_t jEnd, float_3& acc, float_3& jrk) const
+{
+    const float_3 pos = pParticles->Position(i);
+    const float_3 vel = pParticles->Velocity(i);
+
+    for (size_t j = jBegin; j < jEnd; ++j)
+    {
+        float_3 a;
+        float_3 k;
+        HermiteTerms(pParticles->Position(j) - pos, pParticles->Velocity(j) - vel, m_softeningSquared, m_cutoffSquared, a, k);
+        const float massJ = ParticleMass<uniformMass>(m_particleMass, pParticles->mass, j);
+        acc += a * massJ;
+        jrk += k * massJ;
+    }
+}
+
+template <bool uniformMass>
+void NBodyAdvancedInteractionEngine::HermiteGatherSSE(ParticleStoreSoA* const pParticles, const size_t i, const size_t jBegin, const size_t jEnd, float_3& acc, float_3& jrk) const
+{
+    const __m128 softeningSquared = _mm_set1_ps(m_softeningSquared);
+    const __m128 particleMass = _mm_set1_ps(m_particleMass);
+    const __m128 cutoffSquared = _mm_set1_ps(m_cutoffSquared);
+    const __m128 three = _mm_set1_ps(3.0f);
+    const size_t jVectorEnd = jBegin + ((jEnd - jBegin) & ~size_t(3));
+    const float* const x = pParticles->x; const float* const y = pParticles->y; const float* const z = pParticles->z;
+    const float* const vx = pParticles->vx; const float* const vy = pParticles->vy; const float* const vz = pParticles->vz;
+    const float* const mass = pParticles->mass;
+
+    const __m128 posX = _mm_set1_ps(x[i]);
+    const __m128 posY = _mm_set1_ps(y[i]);
+    const __m128 posZ = _mm_set1_ps(z[i]);
+    const __m128 velX = _mm_set1_ps(vx[i]);
+    const __m128 velY = _mm_set1_ps(vy[i]);
+    const __m128 velZ = _mm_set1_ps(vz[i]);
+    __m128 accX = _mm_setzero_ps();
+    __m128 accY = _mm_setzero_ps();
+    __m128 accZ = _mm_setzero_ps();
+    __m128 jrkX = _mm_setzero_ps();
+    __m128 jrkY = _mm_setzero_ps();
+    __m128 jrkZ = _mm_setzero_ps();
+
+    for (size_t j = jBegin; j < jVectorEnd; j += 4)
+    {
+        const __m128 rX = _mm_sub_ps(_mm_loadu_ps(&x[j]), posX);
+        const __m128 rY = _mm_sub_ps(_mm_loadu_ps(&y[j]), posY);
+        const __m128 rZ = _mm_sub_ps(_mm_loadu_ps(&z[j]), posZ);
+        const __m128 vX = _mm_sub_ps(_mm_loadu_ps(&vx[j]), velX);
+        const __m128 vY = _mm_sub_ps(_mm_loadu_ps(&vy[j]), velY);
+        const __m128 vZ = _mm_sub_ps(_mm_loadu_ps(&vz[j]), velZ);
+
+        __m128 distSqr = _mm_add_ps(_mm_mul_ps(rX, rX), softeningSquared);
+        distSqr = _mm_add_ps(_mm_mul_ps(rY, rY), distSqr);
+        distSqr = _mm_add_ps(_mm_mul_ps(rZ, rZ), distSqr);
+        __m128 rv = _mm_mul_ps(rX, vX);
+        rv = _mm_add_ps(_mm_mul_ps(rY, vY), rv);
+        rv = _mm_add_ps(_mm_mul_ps(rZ, vZ), rv);
+
+        const __m128 invDist = ReciprocalSqrtNewton(distSqr);
+        const __m128 invDistSqr = _mm_mul_ps(invDist, invDist);
+        const __m128 s = _mm_and_ps(_mm_mul_ps(uniformMass ? particleMass : _mm_loadu_ps(&mass[j]), _mm_mul_ps(invDistSqr, invDist)),
+            _mm_cmplt_ps(distSqr, cutoffSquared));
+        const __m128 alpha = _mm_mul_ps(_mm_mul_ps(three, rv), invDistSqr);
+
+        accX = _mm_add_ps(accX, _mm_mul_ps(rX, s));
+        accY = _mm_add_ps(accY, _mm_mul_ps(rY, s));
+        accZ = _mm_add_ps(accZ, _mm_mul_ps(rZ, s));
+        jrkX = _mm_add_ps(jrkX, _mm_mul_ps(_mm_sub_ps(vX, _mm_mul_ps(rX, alpha)), s));
+        jrkY = _mm_add_ps(jrkY, _mm_mul_ps(_mm_sub_ps(vY, _mm_mul_ps(rY, alpha)), s));
+        jrkZ = _mm_add_ps(jrkZ, _mm_mul_ps(_mm_sub_ps(vZ, _mm_mul_ps(rZ, alpha)), s));
+    }
+
+    acc += float_3(HorizontalSum(accX), HorizontalSum(accY), HorizontalSum(accZ));
+    jrk += float_3(HorizontalSum(jrkX), HorizontalSum(jrkY), HorizontalSum(jrkZ));
+    HermiteGather<uniformMass>(pParticles, i, jVectorEnd, jEnd, acc, jrk);
+}
+
+template <bool uniformMass>
+void NBodyAdvancedInteractionEngine::HermiteGatherAVX2(ParticleStoreSoA* const pParticles, const size_t i, const size_t jBegin, const size_t jEnd, float_3& acc, float_3& jrk) const
+{
+    const __m256 softeningSquared = _mm256_set1_ps(m_softeningSquared);
+    const __m256 particleMass = _mm256_set1_ps(m_particleMass);
+    const __m256 cutoffSquared = _mm256_set1_ps(m_cutoffSquared);
+    const __m256i allLanes = _mm256_set1_epi32(-1);
+    const JerkStreams unused = { nullptr, nullptr, nullptr };
+
+    const __m256 posX = _mm256_broadcast_ss(&pParticles->x[i]);
+    const __m256 posY = _mm256_broadcast_ss(&pParticles->y[i]);
+    const __m256 posZ = _mm256_broadcast_ss(&pParticles->z[i]);
+    const __m256 velX = _mm256_broadcast_ss(&pParticles->vx[i]);
+    const __m256 velY = _mm256_broadcast_ss(&pParticles->vy[i]);
+    const __m256 velZ = _mm256_broadcast_ss(&pParticles->vz[i]);
+    __m256 accX = _mm256_setzero_ps();
+    __m256 accY = _mm256_setzero_ps();
+    __m256 accZ = _mm256_setzero_ps();
+    __m256 jrkX = _mm256_setzero_ps();
+    __m256 jrkY = _mm256_setzero_ps();
+    __m256 jrkZ = _mm256_setzero_ps();
+
+    for (size_t j = jBegin; j < jEnd; j += 8)
+    {
+        const __m256i mask = (jEnd - j >= 8) ? allLanes : TailMask8i(static_cast<int>(jEnd - j));
+        HermiteRowAVX2<false, uniformMass>(unused, pParticles, j, mask, posX, posY, posZ, velX, velY, velZ,
+            particleMass, softeningSquared, particleMass, cutoffSquared, accX, accY, accZ, jrkX, jrkY, jrkZ);
+    }
+
+    acc += float_3(HorizontalSum(accX), HorizontalSum(accY), HorizontalSum(accZ));
+    jrk += float_3(HorizontalSum(jrkX), HorizontalSum(jrkY), HorizontalSum(jrkZ));
+    _mm256_zeroupper();
+}
+
+#ifdef NBODY_AVX512_SUPPORTED
+
+template <bool uniformMass>
+void NBodyAdvancedInteractionEngine::HermiteGatherAVX512(ParticleStoreSoA* const pParticles, const size_t i, const size_t jBegin, const size_t jEnd, float_3& acc, float_3& jrk) const
+{
+    const __m512 softeningSquared = _mm512_set1_ps(m_softeningSquared);
+    const __m512 particleMass = _mm512_set1_ps(m_particleMass);
+    const __m512 cutoffSquared = _mm512_set1_ps(m_cutoffSquared);
+    const __m512 three = _mm512_set1_ps(3.0f);
+    const float* const x = pParticles->x; const float* const y = pParticles->y; const float* const z = pParticles->z;
+    const float* const vx = pParticles->vx; const float* const vy = pParticles->vy; const float* const vz = pParticles->vz;
+    const float* const mass = pParticles->mass;
+
+    const __m512 posX = _mm512_set1_ps(x[i]);
+    const __m512 posY = _mm512_set1_ps(y[i]);
+    const __m512 posZ = _mm512_set1_ps(z[i]);
+    const __m512 velX = _mm512_set1_ps(vx[i]);
+    const __m512 velY = _mm512_set1_ps(vy[i]);
+    const __m512 velZ = _mm512_set1_ps(vz[i]);
+    __m512 accX = _mm512_setzero_ps();
+    __m512 accY = _mm512_setzero_ps();
+    __m512 accZ = _mm512_setzero_ps();
+    __m512 jrkX = _mm512_setzero_ps();
+    __m512 jrkY = _mm512_setzero_ps();
+    __m512 jrkZ = _mm512_setzero_ps();
+
+    for (size_t j = jBegin; j < jEnd; j += 16)
+    {
+        const __mmask16 mask = TailMask16(jEnd - j);
+
+        const __m512 rX = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &x[j]), posX);
+        const __m512 rY = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &y[j]), posY);
+        const __m512 rZ = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &z[j]), posZ);
+        const __m512 vX = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &vx[j]), velX);
+        const __m512 vY = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &vy[j]), velY);
+        const __m512 vZ = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, &vz[j]), velZ);
+
+        __m512 distSqr = _mm512_fmadd_ps(rX, rX, softeningSquared);
+        distSqr = _mm512_fmadd_ps(rY, rY, distSqr);
+        distSqr = _mm512_fmadd_ps(rZ, rZ, distSqr);
+        __m512 rv = _mm512_mul_ps(rX, vX);
+        rv = _mm512_fmadd_ps(rY, vY, rv);
+        rv = _mm512_fmadd_ps(rZ, vZ, rv);
+
+        const __m512 invDist = ReciprocalSqrtNewton(distSqr);
+        const __m512 invDistSqr = _mm512_mul_ps(invDist, invDist);
+        const __mmask16 inside = _mm512_mask_cmp_ps_mask(mask, distSqr, cutoffSquared, _CMP_LT_OQ);
+        const __m512 s = _mm512_maskz_mul_ps(inside, uniformMass ? particleMass : _mm512_maskz_loadu_ps(mask, &mass[j]), _mm512_mul_ps(invDistSqr, invDist));
+        const __m512 alpha = _mm512_mul_ps(_mm512_mul_ps(three, rv), invDistSqr);
+
+        accX = _mm512_fmadd_ps(rX, s, accX);
+        accY = _mm512_fmadd_ps(rY, s, accY);
+        accZ = _mm512_fmadd_ps(rZ, s, accZ);
+        jrkX = _mm512_fmadd_ps(_mm512_fnmadd_ps(rX, alpha, vX), s, jrkX);
+        jrkY = _mm512_fmadd_ps(_mm512_fnmadd_ps(rY, alpha, vY), s, jrkY);
+        jrkZ = _mm512_fmadd_ps(_mm512_fnmadd_ps(rZ, alpha, vZ), s, jrkZ);
+    }
+
+    acc += float_3(_mm512_reduce_add_ps(accX), _mm512_reduce_add_ps(accY), _mm512_reduce_add_ps(accZ));
+    jrk += float_3(_mm512_reduce_add_ps(jrkX), _mm512_reduce_add_ps(jrkY), _mm512_reduce_add_ps(jrkZ));
+    _mm256_zeroupper();
+}
+
+#endif
+
 //--------------------------------------------------------------------------------------
 //  Advanced parallel, cache aware implementation of the n-body calculation.
 //--------------------------------------------------------------------------------------
 //
 // Particles are updated in place so the particleOut parameter is unused.
+//
+// With a cutoff the neighbor lists are rebuilt if needed and each particle sums the forces of its
+// neighbors. Whichever half of the integration step moves the particles also measures how far
+// they have moved since the lists were built, which decides when the lists must be rebuilt.
+//
+// Integrators that start each step with the previous step's accelerations calculate them once
+// more before the first step, and again after the particles have been reloaded.
+//
+// With an adaptive time step the step is fixed for the whole of each step, so the integrators
+// are used as they are but are no longer symplectic.
 
 #pragma warning(push)
 #pragma warning(disable:4100)   // Ignore unused parameter warning.
 
-void NBodyAdvanced::Integrate(ParticleCpu* const pParticles, ParticleCpu* const unused, int numParticles) const
+const int kNeighborChunkSize = 256;
+
+const float NBodyAdvanced::kMinTimeStepFraction = 1.0f / 64.0f;
+
+//  Number of particles copied or kicked by each task of the far field calculation. These loops
+//  are static, like the integration steps, so each thread works on its own node's share.
+
+const int kFarFieldChunkSize = 4 * 1024;
+
+void NBodyAdvanced::Integrate(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const unused, int numParticles) const
+{
+    if (!m_primed && UsesPreviousAcceleration(m_integrator))
+    {
+        std::fill(pParticles->ax, pParticles->ax + numParticles, 0.0f);
+        std::fill(pParticles->ay, pParticles->ay + numParticles, 0.0f);
+        std::fill(pParticles->az, pParticles->az + numParticles, 0.0f);
+        AccumulateAccelerations(pParticles, numParticles);
+    }
+    m_primed = true;
+
+    const float deltaTime = m_stepDeltaTime;
+    const float farFieldKick = 0.5f * m_farFieldInterval * deltaTime;
+    if ((m_farEngine != nullptr) && (m_substep == 0))
+    {
+        if (!m_farFieldValid)
+            ComputeFarField(pParticles, numParticles);
+        FarFieldKick(pParticles, numParticles, farFieldKick);
+    }
+
+    StepMaxima* const pMaxima = (m_timeStepAccuracy > 0.0f) ? &m_maxima : nullptr;
+    NeighborList* const neighbors = m_neighbors.get();
+    if (neighbors == nullptr)
+    {
+        BeginParticleStep(pParticles, numParticles, deltaTime, m_integrator);
+        AccumulateAccelerations(pParticles, numParticles);
+        EndParticleStep(pParticles, numParticles, deltaTime, m_dampingFactor, m_integrator, nullptr, nullptr, nullptr, pMaxima);
+    }
+    else
+    {
+        // The reference positions are only valid if the lists were built for these particles.
+        if (neighbors->Built(numParticles))
+            neighbors->RecordDisplacementSqr(BeginParticleStep(pParticles, numParticles, deltaTime, m_integrator,
+                neighbors->ReferenceX(), neighbors->ReferenceY(), neighbors->ReferenceZ()));
+        else
+            BeginParticleStep(pParticles, numParticles, deltaTime, m_integrator);
+
+        AccumulateAccelerations(pParticles, numParticles);
+
+        neighbors->RecordDisplacementSqr(EndParticleStep(pParticles, numParticles, deltaTime, m_dampingFactor, m_integrator,
+            neighbors->ReferenceX(), neighbors->ReferenceY(), neighbors->ReferenceZ(), pMaxima));
+    }
+
+    // The far field calculated at the end of each cycle also starts the next one.
+    if ((m_farEngine != nullptr) && (++m_substep == m_farFieldInterval))
+    {
+        ComputeFarField(pParticles, numParticles);
+        FarFieldKick(pParticles, numParticles, farFieldKick);
+        m_substep = 0;
+    }
+
+    m_lastDeltaTime = deltaTime;
+    if (pMaxima != nullptr)
+        ChooseDeltaTime();
+}
+
+#pragma warning(pop)
+
+//  Choose the next step so that, for the accuracy a and length scale L, no particle moves further
+//  than a L in it, either at its current speed or from rest under its current acceleration:
+//
+//      dt = min(a L / |v|max, sqrt(2 a L / |a|max))
+//
+//  The step can at most double from one step to the next, so a quiet step after a close passage
+//  does not jump straight back to deltaTime.
+
+void NBodyAdvanced::ChooseDeltaTime() const
 {
+    const float distance = m_timeStepAccuracy * m_timeStepLength;
+    float deltaTime = std::min(m_deltaTime, 2.0f * m_stepDeltaTime);
+    if (m_maxima.velocitySqr > 0.0f)
+        deltaTime = std::min(deltaTime, distance / sqrt(m_maxima.velocitySqr));
+    if (m_maxima.accelerationSqr > 0.0f)
+        deltaTime = std::min(deltaTime, sqrt(2.0f * distance / sqrt(m_maxima.accelerationSqr)));
+    m_stepDeltaTime = std::max(deltaTime, m_deltaTime * kMinTimeStepFraction);
+}
+
+//  Calculate the far field accelerations at the particles' current positions with the tiled
+//  kernels, which only consider the pairs beyond the cutoff.
+
+void NBodyAdvanced::ComputeFarField(const ParticleStoreSoA* const pParticles, int numParticles) const
+{
+    if ((m_pFarField == nullptr) || (m_pFarField->Capacity() < numParticles))
+        m_pFarField.reset(new ParticleStoreSoA(numParticles));
+
+    ParticleStoreSoA* const pFarField = m_pFarField.get();
+    ParallelForStatic(0, numParticles, kFarFieldChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kFarFieldChunkSize, numParticles);
+        std::copy(pParticles->x + begin, pParticles->x + end, pFarField->x + begin);
+        std::copy(pParticles->y + begin, pParticles->y + end, pFarField->y + begin);
+        std::copy(pParticles->z + begin, pParticles->z + end, pFarField->z + begin);
+        std::copy(pParticles->mass + begin, pParticles->mass + end, pFarField->mass + begin);
+        std::fill(pFarField->ax + begin, pFarField->ax + end, 0.0f);
+        std::fill(pFarField->ay + begin, pFarField->ay + end, 0.0f);
+        std::fill(pFarField->az + begin, pFarField->az + end, 0.0f);
+    });
+
+    const int numSources = pParticles->NumSources(numParticles);
+    m_pBodiesCache = pFarField;
+    m_pEngineCache = m_farEngine.get();
+    ChooseStepBlockSize(numSources);
+    InteractionList(0, numSources);
+    TracerInteractions(numSources, numParticles);
+    m_farFieldValid = true;
+}
+
+void NBodyAdvanced::FarFieldKick(ParticleStoreSoA* const pParticles, int numParticles, float deltaTime) const
+{
+    const ParticleStoreSoA* const pFarField = m_pFarField.get();
+    ParallelForStatic(0, numParticles, kFarFieldChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kFarFieldChunkSize, numParticles);
+        for (int i = begin; i < end; ++i)
+        {
+            pParticles->vx[i] += pFarField->ax[i] * deltaTime;
+            pParticles->vy[i] += pFarField->ay[i] * deltaTime;
+            pParticles->vz[i] += pFarField->az[i] * deltaTime;
+        }
+    });
+}
+
+void NBodyAdvanced::AccumulateAccelerations(ParticleStoreSoA* const pParticles, int numParticles) const
+{
+    if (m_neighbors != nullptr)
+    {
+        NeighborList* const neighbors = m_neighbors.get();
+        neighbors->Update(pParticles, numParticles);
+
+        const NBodyAdvancedInteractionEngine* const engine = m_engine.get();
+        ParallelFor(0, numParticles, kNeighborChunkSize, [=](int begin)
+        {
+            engine->NeighborInteraction(pParticles, begin, std::min(begin + kNeighborChunkSize, numParticles), *neighbors);
+        });
+        return;
+    }
+
     // Maintain local global reference to pBodies, saves pushing it on stack for each call.
+    const int numSources = pParticles->NumSources(numParticles);
     m_pBodiesCache = pParticles;
+    m_pEngineCache = m_engine.get();
+    ChooseStepBlockSize(numSources);
     // Break calculations down into chunks of interations whose particles fit into the L1 cache.
-    InteractionList(0, numParticles);
+    InteractionList(0, numSources);
+    TracerInteractions(numSources, numParticles);
+}
 
-    parallel_for_each(pParticles, pParticles + numParticles, [=](ParticleCpu& b)
+//  Each task gathers the accelerations of a tile of tracers from every tile of sources in turn.
+//  Only the tracers are written so the tasks share the sources. The tiles all cost the same, so
+//  each thread gathers a fixed share of them, the share of the store placed on its node.
+
+void NBodyAdvanced::TracerInteractions(const int numSources, const int numParticles) const
+{
+    const int tileSize = static_cast<int>(m_tileSize);
+    ParticleStoreSoA* const pParticles = m_pBodiesCache;
+    const NBodyAdvancedInteractionEngine* const engine = m_pEngineCache;
+    ParallelForStatic(numSources, numParticles, tileSize, [=](int begin)
     {
-        b.vel += b.acc * m_deltaTime;
-        b.vel *= m_dampingFactor;
-        b.pos += b.vel * m_deltaTime;
-        // Reset acceleration values before starting next integration step.
-        b.acc = 0.0f;
+        const int end = std::min(begin + tileSize, numParticles);
+        for (int j = 0; j < numSources; j += tileSize)
+            engine->InvokeBodyBodyGather(pParticles, begin, end, j, std::min(j + tileSize, numSources));
     });
 }
 
-#pragma warning(pop)
+//  A cell of two blocks is updated by one task, as both blocks are written, so the recursion
+//  only has as many parallel tasks as there are cells of blocks. The block size of each step is
+//  therefore the one set, but no more than the sources can be divided into two blocks per
+//  thread, and no less than a tile.
 
-//  Recursively break down the list into chunks that fit within the L1 cache.
+void NBodyAdvanced::ChooseStepBlockSize(int numSources) const
+{
+    const size_t share = size_t(numSources) / (2 * size_t(ParallelConcurrency()));
+    m_stepBlockSize = std::max(m_tileSize, std::min(m_blockSize, share));
+}
+
+//  Recursively break down the list into blocks that fit within the L2 cache, forking the
+//  halves of ranges larger than the parallel cutoff as tasks. Ranges that fit into a block are
+//  not divided any further, whatever the cutoff.
 
 void NBodyAdvanced::InteractionList(const size_t begin, const size_t end) const
 {
     const size_t width = end - begin;
 
-    if (width > m_tileSize)
+    if ((width > m_stepBlockSize) && (width > m_parallelCutoff))
     {
         const size_t middle = begin + (width / 2);
-        parallel_invoke([=] { InteractionList(begin, middle); },
+        ParallelInvoke([=] { InteractionList(begin, middle); },
             [=] { InteractionList(middle, end); });
         InteractionCell(begin, middle, middle, end);
     }
+    else if (width > m_stepBlockSize)
+    {
+        const size_t middle = begin + (width / 2);
+        InteractionList(begin, middle);
+        InteractionList(middle, end);
+        InteractionCell(begin, middle, middle, end);
+    }
+    else if (width > m_tileSize)
+    {
+        BlockList(begin, end);
+    }
     else if (width > 1)
     {
         const size_t middle = begin + (width / 2);
@@ -204,25 +1223,61 @@ void NBodyAdvanced::InteractionList(const size_t begin, const size_t end) const
     }
 }
 
-//  For each cell update the particles once they fit into L1 cache.
+//  For each cell update the particles once they fit into the L2 cache.
 
 void NBodyAdvanced::InteractionCell(const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
 {
     const size_t iWidth = iEnd - iBegin;
     const size_t jWidth = jEnd - jBegin;
 
-    if (iWidth > m_tileSize && jWidth > m_tileSize)
+    if ((iWidth <= m_stepBlockSize) || (jWidth <= m_stepBlockSize))
+    {
+        BlockCell(iBegin, iEnd, jBegin, jEnd);
+    }
+    else if (iWidth > m_parallelCutoff && jWidth > m_parallelCutoff)
     {
         const size_t iMiddle = iBegin + (iWidth / 2);
         const size_t jMiddle = jBegin + (jWidth / 2);
-        parallel_invoke([=] { InteractionCell(iBegin, iMiddle, jBegin, jMiddle); },
+        ParallelInvoke([=] { InteractionCell(iBegin, iMiddle, jBegin, jMiddle); },
             [=] { InteractionCell(iMiddle, iEnd, jMiddle, jEnd); });
-        parallel_invoke([=] { InteractionCell(iBegin, iMiddle, jMiddle, jEnd); },
+        ParallelInvoke([=] { InteractionCell(iBegin, iMiddle, jMiddle, jEnd); },
             [=] { InteractionCell(iMiddle, iEnd, jBegin, jMiddle); });
     }
     else
     {
-        m_engine->InvokeBodyBodyInteraction(m_pBodiesCache, iBegin, iEnd, jBegin, jEnd);
+        const size_t iMiddle = iBegin + (iWidth / 2);
+        const size_t jMiddle = jBegin + (jWidth / 2);
+        InteractionCell(iBegin, iMiddle, jBegin, jMiddle);
+        InteractionCell(iMiddle, iEnd, jMiddle, jEnd);
+        InteractionCell(iBegin, iMiddle, jMiddle, jEnd);
+        InteractionCell(iMiddle, iEnd, jBegin, jMiddle);
+    }
+}
+
+//  Interactions within a block. Each tile interacts with itself and then with the tiles after
+//  it, which are still in the L2 cache from the previous tile's pass.
+
+void NBodyAdvanced::BlockList(const size_t begin, const size_t end) const
+{
+    for (size_t i = begin; i < end; i += m_tileSize)
+    {
+        const size_t iEnd = std::min(i + m_tileSize, end);
+        InteractionList(i, iEnd);
+        if (iEnd < end)
+            BlockCell(i, iEnd, iEnd, end);
+    }
+}
+
+//  Interactions between two blocks, or within a tile. Each i tile stays in the L1 cache while it
+//  interacts with each j tile in turn.
+
+void NBodyAdvanced::BlockCell(const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+{
+    for (size_t i = iBegin; i < iEnd; i += m_tileSize)
+    {
+        const size_t iTileEnd = std::min(i + m_tileSize, iEnd);
+        for (size_t j = jBegin; j < jEnd; j += m_tileSize)
+            m_pEngineCache->InvokeBodyBodyInteraction(m_pBodiesCache, i, iTileEnd, j, std::min(j + m_tileSize, jEnd));
     }
 }
 
@@ -230,52 +1285,132 @@ void NBodyAdvanced::InteractionCell(const size_t iBegin, const size_t iEnd, cons
 //  Utility functions.
 //--------------------------------------------------------------------------------------
 
-//  Get size of the L1 cache.
+//  Apply the first or second half of a step of the integrator to every particle. If reference
+//  positions are given and this half moves the particles, return the largest squared distance
+//  of any particle from its reference position.
 //
-//  Assume that all L1 caches for each logical processor are the same size and return the first one.
+//  Each task updates a contiguous chunk of the streams so the loop can be vectorized by the
+//  compiler. The displacements, accelerations and velocities are measured in separate loops over
+//  the chunk while it is still in the L1 cache, and the results of the chunks are reduced once
+//  all the tasks have finished. Each thread updates the same share of the chunks every step, the
+//  share of the store placed on its node.
 
-typedef BOOL (WINAPI* GetProcInfoFunc)(PSYSTEM_LOGICAL_PROCESSOR_INFORMATION, DWORD*);
-
-int GetLevelOneCacheSize()
+template <typename Integrator, bool beginStep>
+static float StepParticles(ParticleStoreSoA* const pParticles, int numParticles, float deltaTime, float dampingFactor,
+    const float* const referenceX, const float* const referenceY, const float* const referenceZ, StepMaxima* const pMaxima)
 {
-    //  If this code fails at any point then just default to 16k.
-    const int defaultCacheSize = 1024 * 16; 
-    GetProcInfoFunc funcptr = (GetProcInfoFunc)::GetProcAddress(GetModuleHandle(TEXT("kernel32")), "GetLogicalProcessorInformation");
-
-    if (nullptr == funcptr) 
-        return defaultCacheSize;
+    if (beginStep && !Integrator::kDriftsBeforeForces)
+        return 0.0f;
 
-    typedef std::unique_ptr<SYSTEM_LOGICAL_PROCESSOR_INFORMATION, FreeDeleter<SYSTEM_LOGICAL_PROCESSOR_INFORMATION>> BufferType;
+    const int chunkSize = 1024;
+    const int numChunks = (numParticles + chunkSize - 1) / chunkSize;
+    const bool track = (referenceX != nullptr) && (beginStep == Integrator::kDriftsBeforeForces);
+    const bool measure = (pMaxima != nullptr) && !beginStep;
+    std::vector<float> chunkMax(track ? numChunks : 0, 0.0f);
+    std::vector<StepMaxima> chunkMaxima(measure ? numChunks : 0);
+    std::vector<std::chrono::steady_clock::duration> chunkTimes(measure ? numChunks : 0, std::chrono::steady_clock::duration::zero());
+    float* const maxDisplacementSqr = chunkMax.data();
+    StepMaxima* const maxima = chunkMaxima.data();
+    std::chrono::steady_clock::duration* const times = chunkTimes.data();
+    ParallelForStatic(0, numParticles, chunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + chunkSize, numParticles);
+        float* const x = pParticles->x; float* const y = pParticles->y; float* const z = pParticles->z;
+        float* const vx = pParticles->vx; float* const vy = pParticles->vy; float* const vz = pParticles->vz;
+        float* const ax = pParticles->ax; float* const ay = pParticles->ay; float* const az = pParticles->az;
+        std::chrono::steady_clock::time_point start;
 
-    BufferType buffer(nullptr);
-    DWORD bufferSize = 0;
+        // The accelerations must be measured before End, which may clear them.
+        if (measure)
+        {
+            start = std::chrono::steady_clock::now();
+            float chunkMaxSqr = 0.0f;
+            for (int i = begin; i < end; ++i)
+                chunkMaxSqr = std::max(chunkMaxSqr, ax[i] * ax[i] + ay[i] * ay[i] + az[i] * az[i]);
+            maxima[begin / chunkSize].accelerationSqr = chunkMaxSqr;
+            times[begin / chunkSize] = std::chrono::steady_clock::now() - start;
+        }
 
-    // Loop through twice. First pass gets buffer size, second pass fills buffer.
+        for (int i = begin; i < end; ++i)
+        {
+            if (beginStep)
+            {
+                Integrator::Begin(x[i], vx[i], ax[i], deltaTime);
+                Integrator::Begin(y[i], vy[i], ay[i], deltaTime);
+                Integrator::Begin(z[i], vz[i], az[i], deltaTime);
+            }
+            else
+            {
+                Integrator::End(x[i], vx[i], ax[i], deltaTime, dampingFactor);
+                Integrator::End(y[i], vy[i], ay[i], deltaTime, dampingFactor);
+                Integrator::End(z[i], vz[i], az[i], deltaTime, dampingFactor);
+            }
+        }
 
-    while (true)
-    {
-        DWORD ret = funcptr(buffer.get(), &bufferSize);
-        if (0 != ret) 
-            break;
+        if (track)
+        {
+            float chunkMaxSqr = 0.0f;
+            for (int i = begin; i < end; ++i)
+            {
+                const float dX = x[i] - referenceX[i];
+                const float dY = y[i] - referenceY[i];
+                const float dZ = z[i] - referenceZ[i];
+                chunkMaxSqr = std::max(chunkMaxSqr, dX * dX + dY * dY + dZ * dZ);
+            }
+            maxDisplacementSqr[begin / chunkSize] = chunkMaxSqr;
+        }
 
-        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER) 
-            return defaultCacheSize;
+        if (measure)
+        {
+            start = std::chrono::steady_clock::now();
+            float chunkMaxSqr = 0.0f;
+            for (int i = begin; i < end; ++i)
+                chunkMaxSqr = std::max(chunkMaxSqr, vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i]);
+            maxima[begin / chunkSize].velocitySqr = chunkMaxSqr;
+            times[begin / chunkSize] += std::chrono::steady_clock::now() - start;
+        }
+    });
 
-        buffer = BufferType((SYSTEM_LOGICAL_PROCESSOR_INFORMATION*)std::malloc(bufferSize));
-        if (nullptr == buffer.get()) 
-            return defaultCacheSize;
+    if (measure)
+    {
+        pMaxima->accelerationSqr = 0.0f;
+        pMaxima->velocitySqr = 0.0f;
+        std::chrono::steady_clock::duration totalTime = std::chrono::steady_clock::duration::zero();
+        for (int c = 0; c < numChunks; ++c)
+        {
+            pMaxima->accelerationSqr = std::max(pMaxima->accelerationSqr, maxima[c].accelerationSqr);
+            pMaxima->velocitySqr = std::max(pMaxima->velocitySqr, maxima[c].velocitySqr);
+            totalTime += times[c];
+        }
+        pMaxima->reductionTime = std::chrono::duration<float, std::milli>(totalTime).count();
     }
+    return chunkMax.empty() ? 0.0f : *std::max_element(chunkMax.begin(), chunkMax.end());
+}
 
-    // Get all L1 cache sizes.
-
-    int bufferLen = bufferSize / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION);
-    std::vector<DWORD> cacheSizes(0);
-    std::for_each(buffer.get(), buffer.get() + bufferLen, [&cacheSizes](SYSTEM_LOGICAL_PROCESSOR_INFORMATION& r)
+float BeginParticleStep(ParticleStoreSoA* const pParticles, int numParticles, float deltaTime, IntegratorType integrator,
+    const float* const referenceX, const float* const referenceY, const float* const referenceZ)
+{
+    switch (integrator)
     {
-        if ((RelationCache == r.Relationship) && (1 == r.Cache.Level))
-            cacheSizes.push_back(r.Cache.Size);
-    });
+    case kIntegratorLeapfrog:
+        return StepParticles<LeapfrogIntegrator, true>(pParticles, numParticles, deltaTime, 1.0f, referenceX, referenceY, referenceZ, nullptr);
+    case kIntegratorVelocityVerlet:
+        return StepParticles<VelocityVerletIntegrator, true>(pParticles, numParticles, deltaTime, 1.0f, referenceX, referenceY, referenceZ, nullptr);
+    default:
+        return StepParticles<EulerIntegrator, true>(pParticles, numParticles, deltaTime, 1.0f, referenceX, referenceY, referenceZ, nullptr);
+    }
+}
 
-    assert(std::count_if(cacheSizes.begin(), cacheSizes.end(), [cacheSizes](DWORD r){ return (r != cacheSizes[0]); }) == 0);
-    return cacheSizes[0];
+float EndParticleStep(ParticleStoreSoA* const pParticles, int numParticles, float deltaTime, float dampingFactor, IntegratorType integrator,
+    const float* const referenceX, const float* const referenceY, const float* const referenceZ, StepMaxima* const pMaxima)
+{
+    switch (integrator)
+    {
+    case kIntegratorLeapfrog:
+        return StepParticles<LeapfrogIntegrator, false>(pParticles, numParticles, deltaTime, dampingFactor, referenceX, referenceY, referenceZ, pMaxima);
+    case kIntegratorVelocityVerlet:
+        return StepParticles<VelocityVerletIntegrator, false>(pParticles, numParticles, deltaTime, dampingFactor, referenceX, referenceY, referenceZ, pMaxima);
+    default:
+        return StepParticles<EulerIntegrator, false>(pParticles, numParticles, deltaTime, dampingFactor, referenceX, referenceY, referenceZ, pMaxima);
+    }
 }
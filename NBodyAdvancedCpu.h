@@ -16,11 +16,16 @@
 
 #pragma once
 
+#include <math.h>
+#include <float.h>
+#include <memory>
+#include <algorithm>
 #include <amp_short_vectors.h>
-#include <concrtrm.h>
 
 #include "ParticleCpu.h"
 #include "NBodyCpu.h"
+#include "NBodyNeighborListCpu.h"
+#include "IntegratorCpu.h"
 
 
 //--------------------------------------------------------------------------------------
@@ -38,43 +43,146 @@
 //  http://software.intel.com/en-us/articles/a-cute-technique-for-avoiding-certain-race-conditions
 //  http://software.intel.com/en-us/blogs/2010/07/01/n-bodies-a-parallel-tbb-solution-parallel-code-balanced-recursive-parallelism-with-parallel_invoke/
 //
-//  The SSE implementations also take advantage of the alignment of the __m128 data members to
-//  avoid doing unaligned load operations.
+//  The particles are stored as a structure of arrays so the SIMD implementations calculate four
+//  (SSE), eight (AVX2) or sixteen (AVX-512) interactions per instruction by loading consecutive j
+//  particles' positions directly from the x, y and z streams.
+//
+//  Given a particle mass every source has that mass and the kernels keep it in a register. Given
+//  kPerParticleMass each particle's mass is loaded from the mass stream along with its position.
+//  The choice is made when the kernels are selected, so the uniform case costs nothing extra.
 
 class NBodyAdvancedInteractionEngine;
 
-typedef void (NBodyAdvancedInteractionEngine::* NBodyAdvancedFunc)(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+typedef void (NBodyAdvancedInteractionEngine::* NBodyAdvancedFunc)(ParticleStoreSoA* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+
+//  Jerk, the time derivative of the acceleration, of each particle. Used by the Hermite kernels.
+
+struct JerkStreams
+{
+    float* x;
+    float* y;
+    float* z;
+};
+
+typedef void (NBodyAdvancedInteractionEngine::* NBodyHermiteFunc)(ParticleStoreSoA* const pParticles, const JerkStreams& jerk, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+typedef void (NBodyAdvancedInteractionEngine::* NBodyHermiteGatherFunc)(ParticleStoreSoA* const pParticles, const size_t i, const size_t jBegin, const size_t jEnd, float_3& acc, float_3& jrk) const;
 
 class NBodyAdvancedInteractionEngine
 {
 private:
     const float m_softeningSquared;
     const float m_particleMass;
+    const float m_cutoffSquared;                                // Softened square of the cutoff radius.
+    const bool m_farField;
+    const bool m_uniformMass;
     NBodyAdvancedFunc m_funcptr;
+    NBodyAdvancedFunc m_gatherFuncptr;
+    NBodyHermiteFunc m_hermiteFuncptr;
+    NBodyHermiteGatherFunc m_hermiteGatherFuncptr;
 
 public:
-    NBodyAdvancedInteractionEngine(float softeningSquared, float particleMass) :
+    //  Pairs further apart than the cutoff radius do not interact. The default has no cutoff. For
+    //  the far field only pairs at least the cutoff radius apart interact in the body-body kernels,
+    //  so the near and far fields together give all the interactions.
+
+    NBodyAdvancedInteractionEngine(float softeningSquared, float particleMass, CpuSSE maxSSE = kCpuAVX512, float cutoffRadius = FLT_MAX,
+        bool farField = false) :
         m_softeningSquared(softeningSquared),
         m_particleMass(particleMass),
-        m_funcptr(nullptr)
+        m_cutoffSquared((cutoffRadius < sqrt(FLT_MAX)) ? cutoffRadius * cutoffRadius + softeningSquared : FLT_MAX),
+        m_farField(farField),
+        m_uniformMass(particleMass != kPerParticleMass),
+        m_funcptr(nullptr),
+        m_gatherFuncptr(nullptr),
+        m_hermiteFuncptr(nullptr),
+        m_hermiteGatherFuncptr(nullptr)
     {
-        SelectCpuImplementation();
+        SelectCpuImplementation(maxSSE);
     }
 
-    inline void InvokeBodyBodyInteraction(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+    inline void InvokeBodyBodyInteraction(ParticleStoreSoA* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
     {
-        assert(((uintptr_t)pParticles % SSE_ALIGNMENTBOUNDARY) == 0);
+        assert(((uintptr_t)pParticles->x % CACHE_ALIGNMENTBOUNDARY) == 0);
         (this->*m_funcptr)(pParticles, iBegin, iEnd, jBegin, jEnd); 
     };
 
+    //  As InvokeBodyBodyInteraction but only particles [iBegin, iEnd) are updated. Used for the
+    //  tracers, which exert no force on the j particles, so the j range may be read by other
+    //  tasks at the same time.
+
+    inline void InvokeBodyBodyGather(ParticleStoreSoA* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+    {
+        (this->*m_gatherFuncptr)(pParticles, iBegin, iEnd, jBegin, jEnd);
+    };
+
+    //  Accumulate the accelerations of particles [iBegin, iEnd) due to their neighbors within the
+    //  cutoff. Only the i particles are updated, so ranges can be processed in parallel.
+
+    void NeighborInteraction(ParticleStoreSoA* const pParticles, const int iBegin, const int iEnd, const NeighborList& neighbors) const;
+
+    //  As InvokeBodyBodyInteraction, also accumulating the jerk of each particle from the
+    //  velocity streams. The jerk is reciprocal too, so both blocks are updated.
+
+    inline void InvokeHermiteInteraction(ParticleStoreSoA* const pParticles, const JerkStreams& jerk, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+    {
+        (this->*m_hermiteFuncptr)(pParticles, jerk, iBegin, iEnd, jBegin, jEnd);
+    };
+
+    //  Add the acceleration and jerk of particle i due to particles [jBegin, jEnd), which must not
+    //  include i, to acc and jrk. Nothing is written to the store, so any number of i particles can
+    //  be gathered in parallel.
+
+    inline void InvokeHermiteGather(ParticleStoreSoA* const pParticles, const size_t i, const size_t jBegin, const size_t jEnd, float_3& acc, float_3& jrk) const
+    {
+        (this->*m_hermiteGatherFuncptr)(pParticles, i, jBegin, jEnd, acc, jrk);
+    };
+
 private:
-    void SelectCpuImplementation();
+    void SelectCpuImplementation(CpuSSE maxSSE);
+    template <bool uniformMass>
+    void SelectKernels(CpuSSE maxSSE);
 
     // Different implementations of the body-body interaction.
 
-    void BodyBodyInteraction(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
-    void BodyBodyInteractionSSE(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
-    void BodyBodyInteractionSSE4(ParticleCpu* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+    template <bool farField, bool reciprocal, bool uniformMass>
+    void BodyBodyInteraction(ParticleStoreSoA* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+    template <bool farField, bool reciprocal, bool uniformMass>
+    void BodyBodyInteractionSSE(ParticleStoreSoA* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+    template <bool farField, bool reciprocal, bool uniformMass>
+    void BodyBodyInteractionAVX2(ParticleStoreSoA* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+    template <bool farField, bool reciprocal, bool uniformMass>
+    void BodyBodyInteractionAVX512(ParticleStoreSoA* const pParticles, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+
+    template <bool uniformMass>
+    void NeighborInteractionKernel(ParticleStoreSoA* const pParticles, const int iBegin, const int iEnd, const NeighborList& neighbors) const;
+
+    template <bool uniformMass>
+    void HermiteInteraction(ParticleStoreSoA* const pParticles, const JerkStreams& jerk, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+    template <bool uniformMass>
+    void HermiteInteractionSSE(ParticleStoreSoA* const pParticles, const JerkStreams& jerk, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+    template <bool uniformMass>
+    void HermiteInteractionAVX2(ParticleStoreSoA* const pParticles, const JerkStreams& jerk, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+    template <bool uniformMass>
+    void HermiteInteractionAVX512(ParticleStoreSoA* const pParticles, const JerkStreams& jerk, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+
+    template <bool uniformMass>
+    void HermiteGather(ParticleStoreSoA* const pParticles, const size_t i, const size_t jBegin, const size_t jEnd, float_3& acc, float_3& jrk) const;
+    template <bool uniformMass>
+    void HermiteGatherSSE(ParticleStoreSoA* const pParticles, const size_t i, const size_t jBegin, const size_t jEnd, float_3& acc, float_3& jrk) const;
+    template <bool uniformMass>
+    void HermiteGatherAVX2(ParticleStoreSoA* const pParticles, const size_t i, const size_t jBegin, const size_t jEnd, float_3& acc, float_3& jrk) const;
+    template <bool uniformMass>
+    void HermiteGatherAVX512(ParticleStoreSoA* const pParticles, const size_t i, const size_t jBegin, const size_t jEnd, float_3& acc, float_3& jrk) const;
+};
+
+//  Largest squared acceleration and velocity of any particle, measured by EndParticleStep, and
+//  the CPU time in milliseconds summed over all the tasks spent measuring them.
+
+struct StepMaxima
+{
+    float accelerationSqr;
+    float velocitySqr;
+    float reductionTime;
 };
 
 //--------------------------------------------------------------------------------------
@@ -84,6 +192,29 @@ private:
 //  This give a much better indication of what is possible on a CPU. When making direct
 //  performance comparisons it is important to compare algorithms and implementations that
 //  take advantage of the avainable hardware to the same degree.
+//
+//  Given a cutoff radius the engine only calculates interactions between particles within the
+//  cutoff of each other, using Verlet neighbor lists with the given skin. The integration step
+//  also tracks how far the particles have moved so the lists are only rebuilt when needed.
+//
+//  Given a time step accuracy the step is chosen each step, up to deltaTime, so that no particle
+//  moves more than a fraction of the time step length scale in one step. The largest
+//  acceleration and velocity are measured in the same pass that ends each step.
+//
+//  Given a cutoff radius and a far field interval K greater than one, the force is instead split
+//  RESPA style. The near field, the pairs within the cutoff, is calculated every step from the
+//  neighbor lists. The far field, the rest, changes slowly and is only calculated every K steps
+//  by the tiled kernels, into a private store where it is kept until the next calculation. Each
+//  cycle of K steps starts and ends with half a kick of K steps by the far field accelerations,
+//  so with the leapfrog integrator the scheme remains symplectic.
+//
+//  Only the sources interact with each other through the tiled kernels. The tracers, which
+//  follow them in the store, then gather their accelerations from the sources, so the cost is
+//  proportional to the number of sources times the number of particles. The neighbor lists
+//  only hold sources.
+//
+//  See: M. Tuckerman, B. Berne and G. Martyna, "Reversible multiple time scale molecular
+//  dynamics", J. Chem. Phys. 97, 1992.
 
 class NBodyAdvanced : public INBodyCpu
 {
@@ -91,31 +222,136 @@ private:
     std::shared_ptr<NBodyAdvancedInteractionEngine> m_engine;
     const float m_deltaTime;
     const float m_dampingFactor;
+    const IntegratorType m_integrator;
     size_t m_tileSize;                                          // Number of particles that fit into an L1 cache.
-    mutable ParticleCpu* m_pBodiesCache;
+    size_t m_blockSize;                                         // Number of particles that fit into a core's share of the L2 cache.
+    size_t m_parallelCutoff;                                    // Ranges this size or smaller are not forked.
+    mutable size_t m_stepBlockSize;                             // Block size used by this step's recursion.
+    mutable ParticleStoreSoA* m_pBodiesCache;
+    mutable bool m_primed;                                      // The store holds the previous step's accelerations.
+    std::shared_ptr<NeighborList> m_neighbors;                  // Only used with a cutoff radius.
+    const float m_timeStepAccuracy;                             // Zero for a fixed time step.
+    const float m_timeStepLength;
+    mutable float m_stepDeltaTime;                              // Time step of the next step.
+    mutable float m_lastDeltaTime;
+    mutable StepMaxima m_maxima;                                // Measured at the end of the last step.
+    std::shared_ptr<NBodyAdvancedInteractionEngine> m_farEngine;  // Only used with a far field interval.
+    const int m_farFieldInterval;
+    mutable std::unique_ptr<ParticleStoreSoA> m_pFarField;      // Positions and far field accelerations.
+    mutable bool m_farFieldValid;                               // The far field is for the current particles.
+    mutable int m_substep;                                      // Step within the far field cycle.
+    mutable const NBodyAdvancedInteractionEngine* m_pEngineCache;
 
 public:
-    NBodyAdvanced(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int tileSize) :
+    NBodyAdvanced(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int tileSize, CpuSSE maxSSE = kCpuAVX512,
+        float cutoffRadius = 0.0f, float skin = 0.0f, IntegratorType integrator = kIntegratorEuler,
+        float timeStepAccuracy = 0.0f, float timeStepLength = 0.0f, int farFieldInterval = 1) :
         INBodyCpu(),
         m_deltaTime(deltaTime),
         m_dampingFactor(dampingFactor),
-        m_engine(new NBodyAdvancedInteractionEngine(softeningSquared, particleMass)),
+        m_integrator(integrator),
+        m_engine(new NBodyAdvancedInteractionEngine(softeningSquared, particleMass, maxSSE, (cutoffRadius > 0.0f) ? cutoffRadius : FLT_MAX)),
         m_tileSize(tileSize),
-        m_pBodiesCache(nullptr)
+        m_blockSize(tileSize),
+        m_parallelCutoff(2 * size_t(tileSize)),
+        m_stepBlockSize(tileSize),
+        m_pBodiesCache(nullptr),
+        m_primed(false),
+        m_neighbors((cutoffRadius > 0.0f) ? new NeighborList(cutoffRadius, skin) : nullptr),
+        m_timeStepAccuracy(timeStepAccuracy),
+        m_timeStepLength(timeStepLength),
+        m_stepDeltaTime(deltaTime),
+        m_lastDeltaTime(deltaTime),
+        m_farEngine((farFieldInterval > 1) ? new NBodyAdvancedInteractionEngine(softeningSquared, particleMass, maxSSE, cutoffRadius, true) : nullptr),
+        m_farFieldInterval(std::max(farFieldInterval, 1)),
+        m_farFieldValid(false),
+        m_substep(0),
+        m_pEngineCache(nullptr)
+    {
+        assert((timeStepAccuracy == 0.0f) || (timeStepLength > 0.0f));
+        // The far field kicks assume every step in a cycle is the same length.
+        assert((farFieldInterval <= 1) || ((cutoffRadius > 0.0f) && (timeStepAccuracy == 0.0f)));
+        m_maxima.accelerationSqr = m_maxima.velocitySqr = m_maxima.reductionTime = 0.0f;
+        if (timeStepAccuracy > 0.0f)
+            m_stepDeltaTime = deltaTime * kMinTimeStepFraction;
+    }
+
+    void Integrate(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const unused, int numParticles) const;
+
+    void ParticlesChanged(bool reloaded)
     {
+        if (m_neighbors != nullptr)
+            m_neighbors->Invalidate();
+        m_primed = m_primed && !reloaded;
+        if (reloaded && (m_timeStepAccuracy > 0.0f))
+            m_stepDeltaTime = m_deltaTime * kMinTimeStepFraction;
+        m_farFieldValid = false;
+        if (reloaded)
+            m_substep = 0;
     }
 
-    void Integrate(ParticleCpu* const pParticles, ParticleCpu* const unused, int numParticles) const;
+    //  The time step of the last step and the CPU time, in milliseconds, spent measuring the
+    //  largest acceleration and velocity in it.
+
+    inline float LastDeltaTime() const { return m_lastDeltaTime; }
+    inline float ReductionTime() const { return m_maxima.reductionTime; }
+
+    //  The recursion forks its halves as parallel tasks only while they are larger than this
+    //  many particles. Smaller ranges are still divided into tiles, but by the thread that
+    //  reached them, so the tasks that would only call a few kernels run inline. Defaults to
+    //  two tiles, so every task divides further. Ranges that fit into a block are never forked.
+    //  The application sets it from the NBODY_PARALLEL_CUTOFF environment variable.
+
+    inline void SetParallelCutoff(int particles) { m_parallelCutoff = std::max(size_t(particles), m_tileSize); }
+
+    //  The recursion divides ranges down to blocks of at most this many particles, which should
+    //  fit into a core's share of the L2 cache along with the block they interact with. Each
+    //  block is then cut into tiles that fit into the L1 cache, and each i tile interacts with
+    //  every j tile in turn while the j block stays in the L2 cache. Defaults to one tile, so
+    //  there is only the L1 level. Each step uses a smaller block if the sources would not give
+    //  each thread two blocks, as a cell of two blocks is a single task.
+
+    inline void SetBlockSize(int particles) { m_blockSize = std::max(size_t(particles), m_tileSize); }
+
+    //  The neighbor lists, or null if there is no cutoff.
+
+    inline const NeighborList* Neighbors() const { return m_neighbors.get(); }
 
 private:
+    //  Shortest adaptive time step as a fraction of deltaTime. Steps start from it after the
+    //  particles are reloaded, and can at most double each step.
+
+    static const float kMinTimeStepFraction;
+
+    void AccumulateAccelerations(ParticleStoreSoA* const pParticles, int numParticles) const;
+    void ChooseDeltaTime() const;
+    void ComputeFarField(const ParticleStoreSoA* const pParticles, int numParticles) const;
+    void FarFieldKick(ParticleStoreSoA* const pParticles, int numParticles, float deltaTime) const;
+    void TracerInteractions(const int numSources, const int numParticles) const;
+    void ChooseStepBlockSize(int numSources) const;
     void InteractionList(const size_t begin, const size_t end) const;
     void InteractionCell(const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+    void BlockList(const size_t begin, const size_t end) const;
+    void BlockCell(const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
 };
 
 //--------------------------------------------------------------------------------------
 //  Utility functions.
 //--------------------------------------------------------------------------------------
 
-//  Get the size of the L1 cache.
+//  Advance the particles in place with the given integrator, as NBodyAdvanced does. Begin is
+//  called before the accelerations are accumulated into the store and End afterwards. Other
+//  engines that update the particles in place use these so that they integrate and damp the
+//  particles in the same way.
+//
+//  If reference positions are given, the half step that moves the particles returns the largest
+//  squared distance of any particle's new position from its reference position. Otherwise they
+//  return zero. If maxima is given EndParticleStep also measures the largest acceleration, before
+//  it is applied, and the largest new velocity.
+
+float BeginParticleStep(ParticleStoreSoA* const pParticles, int numParticles, float deltaTime, IntegratorType integrator,
+    const float* const referenceX = nullptr, const float* const referenceY = nullptr, const float* const referenceZ = nullptr);
 
-int GetLevelOneCacheSize();
\ No newline at end of file
+float EndParticleStep(ParticleStoreSoA* const pParticles, int numParticles, float deltaTime, float dampingFactor, IntegratorType integrator,
+    const float* const referenceX = nullptr, const float* const referenceY = nullptr, const float* const referenceZ = nullptr,
+    StepMaxima* const pMaxima = nullptr);
\ No newline at end of file
@@ -0,0 +1,308 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <math.h>
+#include <float.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "Common.h"
+#include "NBodyBarnesHutCpu.h"
+#include "ParallelCpu.h"
+
+using namespace concurrency::graphics;
+
+//  Maximum number of particles in a leaf of the tree. Larger leaves give each traversal more
+//  particles to amortize its cost over and longer vectorizable inner loops.
+
+const int kBarnesHutLeafSize = 64;
+
+//  Nodes with more particles than this calculate their children's moments in parallel.
+
+const int kParallelMomentsThreshold = 4 * 1024;
+
+//  Number of leaves traversed by each task. Each task reuses its interaction list storage.
+
+const int kLeavesPerTask = 16;
+
+NBodyBarnesHut::NBodyBarnesHut(float softeningSquared, float dampingFactor, float deltaTime, float openingAngle) :
+    INBodyCpu(),
+    m_softeningSquared(softeningSquared),
+    m_dampingFactor(dampingFactor),
+    m_deltaTime(deltaTime),
+    m_openingAngle(openingAngle),
+    m_tree(kBarnesHutLeafSize)
+{
+    // Larger angles would allow a node to be accepted by particles inside it.
+    assert((openingAngle >= 0.0f) && (openingAngle <= 1.0f));
+}
+
+//--------------------------------------------------------------------------------------
+//  Integrate all the particles.
+//--------------------------------------------------------------------------------------
+//
+//  The accelerations are calculated in Morton order, using the tree's sorted copy of the
+//  particles, and then each particle's velocity and position are written to pParticlesOut
+//  in the original order.
+
+void NBodyBarnesHut::Integrate(ParticleStoreSoA* const pParticlesIn, ParticleStoreSoA* const pParticlesOut, int numParticles) const
+{
+    m_tree.Build(pParticlesIn, numParticles);
+
+    if (m_moments.size() < static_cast<size_t>(m_tree.NumNodes()))
+        m_moments.resize(std::max(static_cast<size_t>(m_tree.NumNodes()), 2 * static_cast<size_t>(numParticles)));
+    ComputeMoments(m_tree.Root());
+
+    const int numLeaves = m_tree.NumLeaves();
+    ParallelFor(0, numLeaves, kLeavesPerTask, [=](int begin)
+    {
+        std::vector<int> nodeList;
+        std::vector<int> leafList;
+        std::vector<int> stack;
+        const int end = std::min(begin + kLeavesPerTask, numLeaves);
+        for (int l = begin; l < end; ++l)
+            LeafInteractions(m_tree.Leaf(l), nodeList, leafList, stack);
+    });
+
+    const ParticleStoreSoA* const pSorted = m_tree.Sorted();
+    const int chunkSize = 1024;
+    ParallelFor(0, numParticles, chunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + chunkSize, numParticles);
+        for (int s = begin; s < end; ++s)
+        {
+            const int i = m_tree.SortedIndex(s);
+            float_3 vel = pParticlesIn->Velocity(i);
+            vel += pSorted->Acceleration(s) * m_deltaTime;
+            vel *= m_dampingFactor;
+            pParticlesOut->SetVelocity(i, vel);
+            pParticlesOut->SetPosition(i, pParticlesIn->Position(i) + vel * m_deltaTime);
+        }
+    });
+}
+
+//--------------------------------------------------------------------------------------
+//  Calculate the moments of each node, from the leaves up.
+//--------------------------------------------------------------------------------------
+//
+//  Leaf moments are summed directly from their particles. A parent's moments are found from
+//  its children's using the parallel axis theorem: Q = sum(Qc + mc * (3 * D * D' - |D|^2 * I))
+//  where D is the offset of the child's center of mass from the parent's. A node without
+//  sources is given its geometric center and is never used.
+
+void NBodyBarnesHut::ComputeMoments(int node) const
+{
+    const OctreeNode& n = m_tree.Node(node);
+    BarnesHutMoments& moments = m_moments[node];
+    float_3 com(0.0f);
+    float mass = 0.0f;
+    float qXX = 0.0f, qXY = 0.0f, qXZ = 0.0f, qYY = 0.0f, qYZ = 0.0f, qZZ = 0.0f;
+
+    if (n.IsLeaf())
+    {
+        const ParticleStoreSoA* const pSorted = m_tree.Sorted();
+        for (int s = n.begin; s < n.SourceEnd(); ++s)
+        {
+            com += pSorted->Position(s) * pSorted->mass[s];
+            mass += pSorted->mass[s];
+        }
+        com = (mass > 0.0f) ? com * (1.0f / mass) : n.center;
+
+        for (int s = n.begin; s < n.SourceEnd(); ++s)
+        {
+            const float_3 d = pSorted->Position(s) - com;
+            const float dSqr = SqrLength(d);
+            const float m = pSorted->mass[s];
+            qXX += m * (3.0f * d.x * d.x - dSqr);
+            qXY += m * (3.0f * d.x * d.y);
+            qXZ += m * (3.0f * d.x * d.z);
+            qYY += m * (3.0f * d.y * d.y - dSqr);
+            qYZ += m * (3.0f * d.y * d.z);
+            qZZ += m * (3.0f * d.z * d.z - dSqr);
+        }
+    }
+    else
+    {
+        if (n.Count() > kParallelMomentsThreshold)
+            ParallelFor(n.firstChild, n.firstChild + n.numChildren, [=](int c) { ComputeMoments(c); });
+        else
+            for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+                ComputeMoments(c);
+
+        for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+        {
+            com += m_moments[c].centerOfMass * m_moments[c].mass;
+            mass += m_moments[c].mass;
+        }
+        com = (mass > 0.0f) ? com * (1.0f / mass) : n.center;
+
+        for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+        {
+            const BarnesHutMoments& child = m_moments[c];
+            const float_3 d = child.centerOfMass - com;
+            const float dSqr = SqrLength(d);
+            qXX += child.quadXX + child.mass * (3.0f * d.x * d.x - dSqr);
+            qXY += child.quadXY + child.mass * (3.0f * d.x * d.y);
+            qXZ += child.quadXZ + child.mass * (3.0f * d.x * d.z);
+            qYY += child.quadYY + child.mass * (3.0f * d.y * d.y - dSqr);
+            qYZ += child.quadYZ + child.mass * (3.0f * d.y * d.z);
+            qZZ += child.quadZZ + child.mass * (3.0f * d.z * d.z - dSqr);
+        }
+    }
+
+    moments.centerOfMass = com;
+    moments.mass = mass;
+    moments.quadXX = qXX; moments.quadXY = qXY; moments.quadXZ = qXZ;
+    moments.quadYY = qYY; moments.quadYZ = qYZ; moments.quadZZ = qZZ;
+
+    // An opening angle of zero never accepts a node, giving the direct sum.
+    const float delta = sqrt(SqrLength(com - n.center));
+    const float openRadius = (m_openingAngle > 0.0f) ? (2.0f * n.halfWidth / m_openingAngle + delta) : FLT_MAX;
+    moments.openRadiusSqr = (openRadius < sqrt(FLT_MAX)) ? openRadius * openRadius : FLT_MAX;
+}
+
+//--------------------------------------------------------------------------------------
+//  Calculate the accelerations of one leaf's particles.
+//--------------------------------------------------------------------------------------
+//
+//  The tree is walked once for the whole leaf. Nodes far enough from every point in the
+//  leaf's bounding box are added to the node list, leaves that are too close are added to
+//  the leaf list and have their sources summed directly. The leaf itself is on the leaf list
+//  if it has sources, their interactions with themselves are zero because of the softening.
+//
+//  The accelerations are written to the acceleration streams of the tree's sorted store.
+
+void NBodyBarnesHut::LeafInteractions(int leaf, std::vector<int>& nodeList, std::vector<int>& leafList, std::vector<int>& stack) const
+{
+    ParticleStoreSoA* const pSorted = m_tree.Sorted();
+    const OctreeNode& target = m_tree.Node(leaf);
+
+    float_3 boxMin(FLT_MAX);
+    float_3 boxMax(-FLT_MAX);
+    for (int s = target.begin; s < target.end; ++s)
+    {
+        boxMin.x = std::min(boxMin.x, pSorted->x[s]); boxMax.x = std::max(boxMax.x, pSorted->x[s]);
+        boxMin.y = std::min(boxMin.y, pSorted->y[s]); boxMax.y = std::max(boxMax.y, pSorted->y[s]);
+        boxMin.z = std::min(boxMin.z, pSorted->z[s]); boxMax.z = std::max(boxMax.z, pSorted->z[s]);
+    }
+
+    nodeList.clear();
+    leafList.clear();
+    stack.clear();
+    stack.push_back(m_tree.Root());
+
+    while (!stack.empty())
+    {
+        const int node = stack.back();
+        stack.pop_back();
+        const OctreeNode& n = m_tree.Node(node);
+        if (n.numSources == 0)
+            continue;
+        const BarnesHutMoments& moments = m_moments[node];
+
+        // Distance from the node's center of mass to the nearest point of the leaf's box.
+        const float_3 com = moments.centerOfMass;
+        const float dx = std::max(0.0f, std::max(boxMin.x - com.x, com.x - boxMax.x));
+        const float dy = std::max(0.0f, std::max(boxMin.y - com.y, com.y - boxMax.y));
+        const float dz = std::max(0.0f, std::max(boxMin.z - com.z, com.z - boxMax.z));
+
+        if ((dx * dx + dy * dy + dz * dz) > moments.openRadiusSqr)
+            nodeList.push_back(node);
+        else if (n.IsLeaf())
+            leafList.push_back(node);
+        else
+            for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+                stack.push_back(c);
+    }
+
+    // The leaf's particles are copied into local arrays and each source is applied to all of
+    // them in turn. The inner loops have no dependencies between iterations so the compiler
+    // can vectorize them. A leaf at the deepest level may hold more than kBarnesHutLeafSize
+    // particles so they are processed in blocks.
+    for (int blockBegin = target.begin; blockBegin < target.end; blockBegin += kBarnesHutLeafSize)
+    {
+        const int count = std::min(target.end - blockBegin, kBarnesHutLeafSize);
+        float posX[kBarnesHutLeafSize], posY[kBarnesHutLeafSize], posZ[kBarnesHutLeafSize];
+        float accX[kBarnesHutLeafSize], accY[kBarnesHutLeafSize], accZ[kBarnesHutLeafSize];
+        for (int i = 0; i < count; ++i)
+        {
+            posX[i] = pSorted->x[blockBegin + i];
+            posY[i] = pSorted->y[blockBegin + i];
+            posZ[i] = pSorted->z[blockBegin + i];
+            accX[i] = accY[i] = accZ[i] = 0.0f;
+        }
+
+        // Far field, monopole and quadrupole terms of each accepted node. With r the offset of
+        // the particle from the center of mass: a = -M * r / r^3 + Q * r / r^5 - 5/2 * (r' * Q * r) * r / r^7
+        for (auto it = nodeList.cbegin(); it != nodeList.cend(); ++it)
+        {
+            const BarnesHutMoments& m = m_moments[*it];
+            for (int i = 0; i < count; ++i)
+            {
+                const float rX = posX[i] - m.centerOfMass.x;
+                const float rY = posY[i] - m.centerOfMass.y;
+                const float rZ = posZ[i] - m.centerOfMass.z;
+                const float distSqr = rX * rX + rY * rY + rZ * rZ + m_softeningSquared;
+                const float invDist = 1.0f / sqrt(distSqr);
+                const float invDistSqr = invDist * invDist;
+                const float invDist3 = invDist * invDistSqr;
+                const float invDist5 = invDist3 * invDistSqr;
+
+                const float qrX = m.quadXX * rX + m.quadXY * rY + m.quadXZ * rZ;
+                const float qrY = m.quadXY * rX + m.quadYY * rY + m.quadYZ * rZ;
+                const float qrZ = m.quadXZ * rX + m.quadYZ * rY + m.quadZZ * rZ;
+                const float rqr = rX * qrX + rY * qrY + rZ * qrZ;
+                const float s = m.mass * invDist3 + 2.5f * rqr * invDist5 * invDistSqr;
+
+                accX[i] += qrX * invDist5 - rX * s;
+                accY[i] += qrY * invDist5 - rY * s;
+                accZ[i] += qrZ * invDist5 - rZ * s;
+            }
+        }
+
+        // Near field, direct sum over the sources of each opened leaf.
+        for (auto it = leafList.cbegin(); it != leafList.cend(); ++it)
+        {
+            const OctreeNode& source = m_tree.Node(*it);
+            for (int j = source.begin; j < source.SourceEnd(); ++j)
+            {
+                const float jX = pSorted->x[j];
+                const float jY = pSorted->y[j];
+                const float jZ = pSorted->z[j];
+                const float jMass = pSorted->mass[j];
+                for (int i = 0; i < count; ++i)
+                {
+                    const float rX = jX - posX[i];
+                    const float rY = jY - posY[i];
+                    const float rZ = jZ - posZ[i];
+                    const float distSqr = rX * rX + rY * rY + rZ * rZ + m_softeningSquared;
+                    const float invDist = 1.0f / sqrt(distSqr);
+                    const float s = jMass * invDist * invDist * invDist;
+                    accX[i] += rX * s;
+                    accY[i] += rY * s;
+                    accZ[i] += rZ * s;
+                }
+            }
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            pSorted->ax[blockBegin + i] = accX[i];
+            pSorted->ay[blockBegin + i] = accY[i];
+            pSorted->az[blockBegin + i] = accZ[i];
+        }
+    }
+}
@@ -0,0 +1,84 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <vector>
+#include <amp_short_vectors.h>
+
+#include "INBodyCpu.h"
+#include "ParticleCpu.h"
+#include "NBodyOctreeCpu.h"
+
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  Barnes-Hut tree code implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  The direct implementations calculate all N^2 interactions. This engine builds an octree
+//  of the particles each step and approximates the acceleration due to distant nodes using
+//  their monopole and quadrupole moments, reducing the cost to O(N log N).
+//
+//  A node is used as a whole if the distance from its center of mass to the particles being
+//  updated is greater than l / theta + delta, where l is the length of the node's sides, theta
+//  the opening angle and delta the distance between the node's center of mass and its
+//  geometric center. Smaller opening angles are more accurate and slower, zero gives the
+//  direct sum. The delta term guards against large errors when the mass of a node is
+//  concentrated in one corner.
+//
+//  Each leaf of the tree is traversed once for all of its particles. The interaction list
+//  of accepted nodes and leaf particles is built using the leaf's bounding box and then
+//  evaluated for each particle. The tree build, moment calculation and traversal of the
+//  leaves all run in parallel.
+//
+//  The moments are summed from the particles' masses. Nodes that only hold tracers have no
+//  mass and are dropped from the walk, and only the sources of opened leaves are summed.
+//
+//  See: J. Barnes and P. Hut, "A hierarchical O(N log N) force-calculation algorithm",
+//  Nature 324, 1986.
+
+//  Monopole and traceless quadrupole moments of a node: Q = sum(m * (3 * d * d' - |d|^2 * I))
+//  where d is the position of each particle relative to the node's center of mass.
+
+struct BarnesHutMoments
+{
+    float_3 centerOfMass;
+    float mass;
+    float quadXX, quadXY, quadXZ, quadYY, quadYZ, quadZZ;
+    float openRadiusSqr;        // Square of the distance beyond which the node is not opened.
+};
+
+class NBodyBarnesHut : public INBodyCpu
+{
+private:
+    const float m_softeningSquared;
+    const float m_dampingFactor;
+    const float m_deltaTime;
+    const float m_openingAngle;
+
+    mutable Octree m_tree;
+    mutable std::vector<BarnesHutMoments> m_moments;
+
+public:
+    NBodyBarnesHut(float softeningSquared, float dampingFactor, float deltaTime, float openingAngle);
+
+    void Integrate(ParticleStoreSoA* const pParticlesIn, ParticleStoreSoA* const pParticlesOut, int numParticles) const;
+
+private:
+    void ComputeMoments(int node) const;
+    void LeafInteractions(int leaf, std::vector<int>& nodeList, std::vector<int>& leafList, std::vector<int>& stack) const;
+};
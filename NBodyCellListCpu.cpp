@@ -0,0 +1,171 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <math.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "Common.h"
+#include "NBodyCellListCpu.h"
+#include "ParallelCpu.h"
+
+using namespace concurrency::graphics;
+
+//  Number of particles copied or integrated by each task.
+
+const int kCellListChunkSize = 4 * 1024;
+
+NBodyCellList::NBodyCellList(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, float cutoffRadius, CpuSSE maxSSE) :
+    INBodyCpu(),
+    m_engine(new NBodyAdvancedInteractionEngine(softeningSquared, particleMass, maxSSE, cutoffRadius)),
+    m_deltaTime(deltaTime),
+    m_dampingFactor(dampingFactor),
+    m_cutoffRadius(cutoffRadius)
+{
+    assert(cutoffRadius > 0.0f);
+}
+
+//--------------------------------------------------------------------------------------
+//  Integrate all the particles.
+//--------------------------------------------------------------------------------------
+//
+//  The accelerations are calculated in cell order in the sorted store and then each particle's
+//  velocity and position are written to pParticlesOut in the original order.
+
+void NBodyCellList::Integrate(ParticleStoreSoA* const pParticlesIn, ParticleStoreSoA* const pParticlesOut, int numParticles) const
+{
+    // Copy the particles into cell order so each cell's particles are contiguous.
+    m_grid.Build(pParticlesIn, numParticles, m_cutoffRadius);
+    if ((m_pSorted == nullptr) || (m_pSorted->Capacity() < numParticles))
+        m_pSorted.reset(new ParticleStoreSoA(numParticles));
+
+    ParticleStoreSoA* const pSorted = m_pSorted.get();
+    ParallelFor(0, numParticles, kCellListChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kCellListChunkSize, numParticles);
+        for (int s = begin; s < end; ++s)
+        {
+            const int i = m_grid.SortedIndex(s);
+            pSorted->x[s] = pParticlesIn->x[i];
+            pSorted->y[s] = pParticlesIn->y[i];
+            pSorted->z[s] = pParticlesIn->z[i];
+            pSorted->mass[s] = pParticlesIn->mass[i];
+            pSorted->ax[s] = pSorted->ay[s] = pSorted->az[s] = 0.0f;
+        }
+    });
+
+    // Rows of cells (y, z) in the same phase are at least three rows apart in y or two planes
+    // apart in z. Each row only touches the rows above it and the rows either side of it in the
+    // next plane, so rows in the same phase never update the same particles.
+    for (int phase = 0; phase < 6; ++phase)
+    {
+        const int phaseY = phase % 3;
+        const int phaseZ = phase / 3;
+        const int rowsY = (m_grid.CellsY() - phaseY + 2) / 3;
+        const int rowsZ = (m_grid.CellsZ() - phaseZ + 1) / 2;
+        ParallelFor(0, rowsY * rowsZ, [=](int row)
+        {
+            RowInteractions(phaseY + 3 * (row % rowsY), phaseZ + 2 * (row / rowsY));
+        });
+    }
+
+    ParallelFor(0, numParticles, kCellListChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kCellListChunkSize, numParticles);
+        for (int s = begin; s < end; ++s)
+        {
+            const int i = m_grid.SortedIndex(s);
+            float_3 vel = pParticlesIn->Velocity(i);
+            vel += pSorted->Acceleration(s) * m_deltaTime;
+            vel *= m_dampingFactor;
+            pParticlesOut->SetVelocity(i, vel);
+            pParticlesOut->SetPosition(i, pParticlesIn->Position(i) + vel * m_deltaTime);
+        }
+    });
+}
+
+//--------------------------------------------------------------------------------------
+//  Calculate the interactions of one row of cells.
+//--------------------------------------------------------------------------------------
+//
+//  Each cell's sources interact with each other and with the sources of the 13 neighbors that
+//  follow it: the next cell in the row, the three cells in the next row and the nine cells in
+//  the next plane. Every pair of neighboring cells is therefore processed exactly once. The
+//  cell's tracers then gather from the sources of the cell and all 26 of its neighbors.
+
+void NBodyCellList::RowInteractions(int y, int z) const
+{
+    ParticleStoreSoA* const pSorted = m_pSorted.get();
+    const int cellsX = m_grid.CellsX();
+    const int cellsY = m_grid.CellsY();
+    const int cellsZ = m_grid.CellsZ();
+
+    for (int x = 0; x < cellsX; ++x)
+    {
+        const int cell = m_grid.Cell(x, y, z);
+        const int iBegin = m_grid.CellBegin(cell);
+        const int iSourceEnd = m_grid.CellSourceEnd(cell);
+        const int iEnd = m_grid.CellEnd(cell);
+        if (iBegin == iEnd)
+            continue;
+
+        if (iBegin < iSourceEnd)
+        {
+            // Pairs within the cell, each source with the sources after it.
+            for (int i = iBegin; i < iSourceEnd - 1; ++i)
+                m_engine->InvokeBodyBodyInteraction(pSorted, i, i + 1, i + 1, iSourceEnd);
+
+            for (int dz = 0; dz <= 1; ++dz)
+            {
+                for (int dy = (dz == 0) ? 0 : -1; dy <= 1; ++dy)
+                {
+                    for (int dx = ((dz == 0) && (dy == 0)) ? 1 : -1; dx <= 1; ++dx)
+                    {
+                        const int nx = x + dx;
+                        const int ny = y + dy;
+                        const int nz = z + dz;
+                        if ((nx < 0) || (nx >= cellsX) || (ny < 0) || (ny >= cellsY) || (nz >= cellsZ))
+                            continue;
+
+                        const int neighbor = m_grid.Cell(nx, ny, nz);
+                        const int jBegin = m_grid.CellBegin(neighbor);
+                        const int jSourceEnd = m_grid.CellSourceEnd(neighbor);
+                        if (jBegin < jSourceEnd)
+                            m_engine->InvokeBodyBodyInteraction(pSorted, iBegin, iSourceEnd, jBegin, jSourceEnd);
+                    }
+                }
+            }
+        }
+
+        if (iSourceEnd == iEnd)
+            continue;
+
+        for (int nz = std::max(0, z - 1); nz <= std::min(cellsZ - 1, z + 1); ++nz)
+        {
+            for (int ny = std::max(0, y - 1); ny <= std::min(cellsY - 1, y + 1); ++ny)
+            {
+                for (int nx = std::max(0, x - 1); nx <= std::min(cellsX - 1, x + 1); ++nx)
+                {
+                    const int neighbor = m_grid.Cell(nx, ny, nz);
+                    const int jBegin = m_grid.CellBegin(neighbor);
+                    const int jSourceEnd = m_grid.CellSourceEnd(neighbor);
+                    if (jBegin < jSourceEnd)
+                        m_engine->InvokeBodyBodyGather(pSorted, iSourceEnd, iEnd, jBegin, jSourceEnd);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,66 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <amp_short_vectors.h>
+
+#include "INBodyCpu.h"
+#include "ParticleCpu.h"
+#include "NBodyAdvancedCpu.h"
+#include "NBodyNeighborListCpu.h"
+
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  Cell list implementation of a cutoff n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  Only pairs of particles closer than the cutoff radius interact. Each step the particles are
+//  binned into a uniform grid of cells at least as wide as the cutoff and sorted by cell, so
+//  each cell's particles are contiguous and every interacting pair lies in the same or
+//  neighboring cells. For a bounded density the cost is O(N).
+//
+//  Each cell interacts with itself and half of its 26 neighbors, using the reciprocal SIMD
+//  kernels of NBodyAdvancedInteractionEngine on the two cells' blocks of particles. The kernels
+//  update both blocks, so the rows of cells are processed in six phases. Rows in the same phase
+//  never touch the same cells and run in parallel.
+//
+//  Only the sources of each cell, which come before its tracers, are used by the reciprocal
+//  kernels. The tracers of each cell then gather from the sources of all 27 cells around it.
+//  Only the cell's own tracers are written so this fits in the same row tasks.
+
+class NBodyCellList : public INBodyCpu
+{
+private:
+    std::shared_ptr<NBodyAdvancedInteractionEngine> m_engine;
+    const float m_deltaTime;
+    const float m_dampingFactor;
+    const float m_cutoffRadius;
+
+    mutable CellGrid m_grid;
+    mutable std::unique_ptr<ParticleStoreSoA> m_pSorted;
+
+public:
+    NBodyCellList(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, float cutoffRadius, CpuSSE maxSSE = kCpuAVX512);
+
+    void Integrate(ParticleStoreSoA* const pParticlesIn, ParticleStoreSoA* const pParticlesOut, int numParticles) const;
+
+private:
+    void RowInteractions(int y, int z) const;
+};
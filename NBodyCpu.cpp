@@ -16,8 +16,6 @@
 
 #include <string.h>
 #include <math.h>
-#include <ppl.h>
-#include <concrtrm.h>
 #include <amprt.h>
 #include <assert.h>
 #include <atlbase.h>
@@ -26,175 +24,262 @@
 
 #include "Common.h"
 #include "NBodyCpu.h"
+#include "SimdUtilities.h"
+#include "ParallelCpu.h"
 
-using namespace concurrency;
 using namespace concurrency::graphics;
 
 //--------------------------------------------------------------------------------------
 //  The interaction engine to update a single particle.
 //--------------------------------------------------------------------------------------
 //
-//  Each interaction function takes a list of particles as input and updates a single particle.
+//  Each interaction function takes a list of particles as input and updates a single particle
+//  from the first numSources of them, the particles with mass.
 //  This implementation does not store intermediate acceleration values. For a more efficient implementation
 //  see the advanced integrator.
 
-//  Select which interaction engine to use based on the available SSE support.
+//  Select which interaction engine to use based on the available SSE support and whether the
+//  sources share one mass.
 
-void NBodySimpleInteractionEngine::SelectCpuImplementation()
+void NBodySimpleInteractionEngine::SelectCpuImplementation(CpuSSE maxSSE)
 {
-    switch (GetSSEType())
+    if (m_particleMass != kPerParticleMass)
+        SelectKernel<true>(maxSSE);
+    else
+        SelectKernel<false>(maxSSE);
+}
+
+template <bool uniformMass>
+void NBodySimpleInteractionEngine::SelectKernel(CpuSSE maxSSE)
+{
+    switch (std::min(GetSSEType(), maxSSE))
     {
-    case kCpuSSE4:
-        m_funcptr = &NBodySimpleInteractionEngine::BodyBodyInteractionSSE4;
+    case kCpuAVX512:
+#ifdef NBODY_AVX512_SUPPORTED
+        m_funcptr = &NBodySimpleInteractionEngine::BodyBodyInteractionAVX512<uniformMass>;
         break;
+#endif
+    case kCpuAVX2:
+        m_funcptr = &NBodySimpleInteractionEngine::BodyBodyInteractionAVX2<uniformMass>;
+        break;
+    case kCpuSSE4:
     case kCpuSSE:
-        m_funcptr = &NBodySimpleInteractionEngine::BodyBodyInteractionSSE;
+        m_funcptr = &NBodySimpleInteractionEngine::BodyBodyInteractionSSE<uniformMass>;
         break;
     default:
-        m_funcptr = &NBodySimpleInteractionEngine::BodyBodyInteraction;
+        m_funcptr = &NBodySimpleInteractionEngine::BodyBodyInteraction<uniformMass>;
     }
 }
 
-void NBodySimpleInteractionEngine::BodyBodyInteraction(const ParticleCpu* const pParticlesIn, 
-    ParticleCpu& particleOut, int numParticles) const 
+template <bool uniformMass>
+void NBodySimpleInteractionEngine::BodyBodyInteraction(const ParticleStoreSoA* const pParticlesIn, 
+    const ParticleStoreSoA* const pSources, ParticleStoreSoA* const pParticlesOut, int i, int numSources) const 
 {
-    float_3 pos(particleOut.pos);
-    float_3 vel(particleOut.vel);
+    float_3 pos(pParticlesIn->Position(i));
+    float_3 vel(pParticlesIn->Velocity(i));
     float_3 acc(0.0f);
 
-    std::for_each(pParticlesIn, pParticlesIn + numParticles, [=, &acc](const ParticleCpu& p)
+    for (int j = 0; j < numSources; ++j)
     {  
-        const float_3 r = p.pos - pos;
+        const float_3 r = pSources->Position(j) - pos;
 
         float distSqr = SqrLength(r) + m_softeningSquared;
         float invDist = 1.0f / sqrt(distSqr);
         float invDistCube =  invDist * invDist * invDist;
-        float s = m_particleMass * invDistCube;
+        float s = (uniformMass ? m_particleMass : pSources->mass[j]) * invDistCube;
 
         // Note: The book code contains typos, the = operator is used instead of +=. 
         // The code below is correct.
         acc += r * s;
-    });
+    }
 
     vel += acc * m_deltaTime;
     vel *= m_dampingFactor;
     pos += vel * m_deltaTime;
 
-    particleOut.pos = pos;
-    particleOut.vel = vel;
+    pParticlesOut->SetPosition(i, pos);
+    pParticlesOut->SetVelocity(i, vel);
 }
 
-void NBodySimpleInteractionEngine::BodyBodyInteractionSSE(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const 
+//  The SIMD implementations load the same component of several consecutive j particles into
+//  one register. The last iteration masks out the lanes beyond numSources, the stream padding
+//  in ParticleStoreSoA ensures the loads for these lanes stay within the buffer. Individual
+//  masses are loaded from the mass stream in the same way.
+
+template <bool uniformMass>
+void NBodySimpleInteractionEngine::BodyBodyInteractionSSE(const ParticleStoreSoA* const pParticlesIn, 
+    const ParticleStoreSoA* const pSources, ParticleStoreSoA* const pParticlesOut, int i, int numSources) const 
 {
-    const __m128 softeningSquared = _mm_load1_ps( &m_softeningSquared);
-    const __m128 dampingFactor = _mm_load_ps1(&m_dampingFactor);
-    const __m128 deltaTime = _mm_load_ps1(&m_deltaTime);
-    const __m128 particleMass = _mm_load1_ps( &m_particleMass );
+    const __m128 softeningSquared = _mm_load1_ps(&m_softeningSquared);
+    const __m128 particleMass = _mm_load1_ps(&m_particleMass);
+    const __m128 allLanes = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    const __m128 tailLanes = TailMask4(numSources % 4);
 
     //float_3 pos(particleOut.pos);
-    //float_3 vel(particleOut.vel);
     //float_3 acc(0.0f);
-    __m128 pos = _mm_loadu_ps((float*)&particleOut.pos);
-    __m128 vel = _mm_loadu_ps((float*)&particleOut.vel);
-    __m128 acc = _mm_setzero_ps();
-
-    // Cannot use lambdas here because __m128 is aligned.
-    for (int j = 0; j < numParticles; ++j)
+    const __m128 posX = _mm_load1_ps(&pParticlesIn->x[i]);
+    const __m128 posY = _mm_load1_ps(&pParticlesIn->y[i]);
+    const __m128 posZ = _mm_load1_ps(&pParticlesIn->z[i]);
+    __m128 accX = _mm_setzero_ps();
+    __m128 accY = _mm_setzero_ps();
+    __m128 accZ = _mm_setzero_ps();
+
+    for (int j = 0; j < numSources; j += 4)
     {    
+        const __m128 mask = (j + 4 <= numSources) ? allLanes : tailLanes;
+
         //float_3 r = p.pos - pos;
-        __m128 pos1 = _mm_loadu_ps((float*)&pParticlesIn[j].pos);
-        __m128 r = _mm_sub_ps(pos1, pos);
+        const __m128 rX = _mm_sub_ps(_mm_load_ps(&pSources->x[j]), posX);
+        const __m128 rY = _mm_sub_ps(_mm_load_ps(&pSources->y[j]), posY);
+        const __m128 rZ = _mm_sub_ps(_mm_load_ps(&pSources->z[j]), posZ);
 
         //float distSqr = float_3::SqrLength(r) + m_softeningSquared;
-        __m128 distSqr = _mm_mul_ps(r, r);    //x    y    z    ?
-        __m128 rshuf = _mm_shuffle_ps(distSqr, distSqr, _MM_SHUFFLE(0,3,2,1));
-        distSqr = _mm_add_ps(distSqr, rshuf);  //x+y, y+z, z+?, ?+x
-        rshuf = _mm_shuffle_ps(distSqr, distSqr, _MM_SHUFFLE(1,0,3,2));
-        distSqr = _mm_add_ps(rshuf, distSqr);  //x+y+z+0, y+z+0+X, z+0+x+y, 0+x+y+z
-        distSqr = _mm_add_ps(distSqr, softeningSquared); 
+        __m128 distSqr = _mm_add_ps(_mm_mul_ps(rX, rX), softeningSquared);
+        distSqr = _mm_add_ps(_mm_mul_ps(rY, rY), distSqr);
+        distSqr = _mm_add_ps(_mm_mul_ps(rZ, rZ), distSqr);
 
         //float invDist = 1.0f / sqrt(distSqr);
         //float invDistCube =  invDist * invDist * invDist;
         //float s = m_particleMass * invDistCube;
-        __m128 invDistSqr = _mm_rsqrt_ps(distSqr);
-        __m128 invDistCube = _mm_mul_ps(_mm_mul_ps(invDistSqr, invDistSqr), invDistSqr);
-        __m128 s = _mm_mul_ps(particleMass, invDistCube); 
+        const __m128 invDist = _mm_rsqrt_ps(distSqr);
+        const __m128 invDistCube = _mm_mul_ps(_mm_mul_ps(invDist, invDist), invDist);
+        const __m128 massJ = uniformMass ? particleMass : _mm_load_ps(&pSources->mass[j]);
+        const __m128 s = _mm_and_ps(_mm_mul_ps(massJ, invDistCube), mask); 
 
         //acc += r * s;
-        acc = _mm_add_ps( _mm_mul_ps(r, s), acc ); 
+        accX = _mm_add_ps(_mm_mul_ps(rX, s), accX); 
+        accY = _mm_add_ps(_mm_mul_ps(rY, s), accY); 
+        accZ = _mm_add_ps(_mm_mul_ps(rZ, s), accZ); 
     }
 
-    //vel += acc * m_deltaTime;
-    vel = _mm_add_ps( _mm_mul_ps(acc, deltaTime), vel ); 
+    const float_3 acc(HorizontalSum(accX), HorizontalSum(accY), HorizontalSum(accZ));
+    float_3 vel(pParticlesIn->Velocity(i));
 
-    //vel *= m_dampingFactor;   
-    vel = _mm_mul_ps(vel, dampingFactor); 
-
-    //pos += vel * m_deltaTime;
-    pos = _mm_add_ps( _mm_mul_ps(vel, deltaTime), pos ); 
+    vel += acc * m_deltaTime;
+    vel *= m_dampingFactor;
 
-    // The r3 word in each register has an undefined value at this point but
-    // this isn't used elsewhere so there is no need to clear it.
-    //particleOut.pos = pos;
-    //particleOut.vel = vel;
-    _mm_storeu_ps((float*)&particleOut.pos, pos);
-    _mm_storeu_ps((float*)&particleOut.vel, vel);
+    pParticlesOut->SetPosition(i, pParticlesIn->Position(i) + vel * m_deltaTime);
+    pParticlesOut->SetVelocity(i, vel);
 }
 
-void NBodySimpleInteractionEngine::BodyBodyInteractionSSE4(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const 
+template <bool uniformMass>
+void NBodySimpleInteractionEngine::BodyBodyInteractionAVX2(const ParticleStoreSoA* const pParticlesIn, 
+    const ParticleStoreSoA* const pSources, ParticleStoreSoA* const pParticlesOut, int i, int numSources) const 
 {
-    const __m128 softeningSquared = _mm_load1_ps( &m_softeningSquared);
-    const __m128 dampingFactor = _mm_load_ps1(&m_dampingFactor);
-    const __m128 deltaTime = _mm_load_ps1(&m_deltaTime);
-    const __m128 particleMass = _mm_load1_ps( &m_particleMass );
+    const __m256 softeningSquared = _mm256_set1_ps(m_softeningSquared);
+    const __m256 particleMass = _mm256_set1_ps(m_particleMass);
+    const __m256 allLanes = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    const __m256 tailLanes = TailMask8(numSources % 8);
 
     //float_3 pos(particleOut.pos);
-    //float_3 vel(particleOut.vel);
     //float_3 acc(0.0f);
-    __m128 pos = _mm_loadu_ps((float*)&particleOut.pos);
-    __m128 vel = _mm_loadu_ps((float*)&particleOut.vel);
-    __m128 acc = _mm_setzero_ps();
-
-    // Cannot use lambdas here because __m128 is aligned.
-    for (int j = 0; j < numParticles; ++j)
+    const __m256 posX = _mm256_broadcast_ss(&pParticlesIn->x[i]);
+    const __m256 posY = _mm256_broadcast_ss(&pParticlesIn->y[i]);
+    const __m256 posZ = _mm256_broadcast_ss(&pParticlesIn->z[i]);
+    __m256 accX = _mm256_setzero_ps();
+    __m256 accY = _mm256_setzero_ps();
+    __m256 accZ = _mm256_setzero_ps();
+
+    for (int j = 0; j < numSources; j += 8)
     {
+        const __m256 mask = (j + 8 <= numSources) ? allLanes : tailLanes;
+
         //float_3 r = p.pos - pos;
-        __m128 pos1 = _mm_loadu_ps((float*)&pParticlesIn[j].pos);
-        __m128 r = _mm_sub_ps(pos1, pos);
+        const __m256 rX = _mm256_sub_ps(_mm256_load_ps(&pSources->x[j]), posX);
+        const __m256 rY = _mm256_sub_ps(_mm256_load_ps(&pSources->y[j]), posY);
+        const __m256 rZ = _mm256_sub_ps(_mm256_load_ps(&pSources->z[j]), posZ);
 
         //float distSqr = float_3::SqrLength(r) + m_softeningSquared;
-        //This uses the additional SSE4 _mm_dp_ps intrinsic.
-        __m128 distSqr = _mm_dp_ps(r, r, 0x7F);
-        distSqr = _mm_add_ps(distSqr, softeningSquared);
+        __m256 distSqr = _mm256_fmadd_ps(rX, rX, softeningSquared);
+        distSqr = _mm256_fmadd_ps(rY, rY, distSqr);
+        distSqr = _mm256_fmadd_ps(rZ, rZ, distSqr);
 
         //float invDist = 1.0f / sqrt(distSqr);
         //float invDistCube =  invDist * invDist * invDist;
         //float s = m_particleMass * invDistCube;
-        __m128 invDistSqr = _mm_rsqrt_ps(distSqr);
-        __m128 invDistCube = _mm_mul_ps(_mm_mul_ps(invDistSqr, invDistSqr), invDistSqr);            
-        __m128 s = _mm_mul_ps(particleMass, invDistCube); 
+        const __m256 invDist = _mm256_rsqrt_ps(distSqr);
+        const __m256 invDistCube = _mm256_mul_ps(_mm256_mul_ps(invDist, invDist), invDist);
+        const __m256 massJ = uniformMass ? particleMass : _mm256_load_ps(&pSources->mass[j]);
+        const __m256 s = _mm256_and_ps(_mm256_mul_ps(massJ, invDistCube), mask);
 
         //acc += r * s;
-        acc = _mm_add_ps( _mm_mul_ps(r, s), acc ); 
+        accX = _mm256_fmadd_ps(rX, s, accX);
+        accY = _mm256_fmadd_ps(rY, s, accY);
+        accZ = _mm256_fmadd_ps(rZ, s, accZ);
     }
 
-    //vel += acc * m_deltaTime;
-    vel = _mm_add_ps( _mm_mul_ps(acc, deltaTime), vel ); 
+    const float_3 acc(HorizontalSum(accX), HorizontalSum(accY), HorizontalSum(accZ));
+    _mm256_zeroupper();
+    float_3 vel(pParticlesIn->Velocity(i));
 
-    //vel *= m_dampingFactor;
-    vel = _mm_mul_ps(vel, dampingFactor); 
+    vel += acc * m_deltaTime;
+    vel *= m_dampingFactor;
 
-    //pos += vel * m_deltaTime;
-    pos = _mm_add_ps( _mm_mul_ps(vel, deltaTime), pos ); 
+    pParticlesOut->SetPosition(i, pParticlesIn->Position(i) + vel * m_deltaTime);
+    pParticlesOut->SetVelocity(i, vel);
+}
+
+#ifdef NBODY_AVX512_SUPPORTED
 
-    // The r3 word in each register has an undefined value at this point but
-    // this isn't used elsewhere so there is no need to clear it.
-    //particleOut.pos = pos;
-    //particleOut.vel = vel;
-    _mm_storeu_ps((float*)&particleOut.pos, pos);
-    _mm_storeu_ps((float*)&particleOut.vel, vel);   
+template <bool uniformMass>
+void NBodySimpleInteractionEngine::BodyBodyInteractionAVX512(const ParticleStoreSoA* const pParticlesIn, 
+    const ParticleStoreSoA* const pSources, ParticleStoreSoA* const pParticlesOut, int i, int numSources) const 
+{
+    const __m512 softeningSquared = _mm512_set1_ps(m_softeningSquared);
+    const __m512 particleMass = _mm512_set1_ps(m_particleMass);
+
+    //float_3 pos(particleOut.pos);
+    //float_3 acc(0.0f);
+    const __m512 posX = _mm512_set1_ps(pParticlesIn->x[i]);
+    const __m512 posY = _mm512_set1_ps(pParticlesIn->y[i]);
+    const __m512 posZ = _mm512_set1_ps(pParticlesIn->z[i]);
+    __m512 accX = _mm512_setzero_ps();
+    __m512 accY = _mm512_setzero_ps();
+    __m512 accZ = _mm512_setzero_ps();
+
+    // Process sixteen particles per iteration. The final iteration uses a mask so lanes beyond
+    // the end of the particle list are neither loaded nor accumulated.
+    for (int j = 0; j < numSources; j += 16)
+    {
+        const __mmask16 mask = TailMask16(numSources - j);
+
+        //float_3 r = p.pos - pos;
+        const __m512 rX = _mm512_sub_ps(_mm512_maskz_load_ps(mask, &pSources->x[j]), posX);
+        const __m512 rY = _mm512_sub_ps(_mm512_maskz_load_ps(mask, &pSources->y[j]), posY);
+        const __m512 rZ = _mm512_sub_ps(_mm512_maskz_load_ps(mask, &pSources->z[j]), posZ);
+
+        //float distSqr = float_3::SqrLength(r) + m_softeningSquared;
+        __m512 distSqr = _mm512_fmadd_ps(rX, rX, softeningSquared);
+        distSqr = _mm512_fmadd_ps(rY, rY, distSqr);
+        distSqr = _mm512_fmadd_ps(rZ, rZ, distSqr);
+
+        //float invDist = 1.0f / sqrt(distSqr);
+        //float invDistCube =  invDist * invDist * invDist;
+        //float s = m_particleMass * invDistCube;
+        const __m512 invDist = ReciprocalSqrtNewton(distSqr);
+        const __m512 invDistCube = _mm512_mul_ps(_mm512_mul_ps(invDist, invDist), invDist);
+        const __m512 massJ = uniformMass ? particleMass : _mm512_maskz_load_ps(mask, &pSources->mass[j]);
+        const __m512 s = _mm512_maskz_mul_ps(mask, massJ, invDistCube);
+
+        //acc += r * s;
+        accX = _mm512_fmadd_ps(rX, s, accX);
+        accY = _mm512_fmadd_ps(rY, s, accY);
+        accZ = _mm512_fmadd_ps(rZ, s, accZ);
+    }
+
+    const float_3 acc(_mm512_reduce_add_ps(accX), _mm512_reduce_add_ps(accY), _mm512_reduce_add_ps(accZ));
+    _mm256_zeroupper();
+    float_3 vel(pParticlesIn->Velocity(i));
+
+    vel += acc * m_deltaTime;
+    vel *= m_dampingFactor;
+
+    pParticlesOut->SetPosition(i, pParticlesIn->Position(i) + vel * m_deltaTime);
+    pParticlesOut->SetVelocity(i, vel);
 }
 
+#endif
+
 //--------------------------------------------------------------------------------------
 //  The sequential integration engine to update all particles.
 //--------------------------------------------------------------------------------------
@@ -202,32 +287,41 @@ void NBodySimpleInteractionEngine::BodyBodyInteractionSSE4(const ParticleCpu* co
 //  This updates all particles by calling the integration engine for each particle in the 
 //  list.
 
-void NBodySimpleSingleCore::Integrate(ParticleCpu* const pParticlesIn, 
-    ParticleCpu* const pParticlesOut, int numParticles) const
+void NBodySimpleSingleCore::Integrate(ParticleStoreSoA* const pParticlesIn, 
+    ParticleStoreSoA* const pParticlesOut, int numParticles) const
 {
+    const int numSources = pParticlesIn->NumSources(numParticles);
     for (int i = 0; i < numParticles; ++i)
-    {
-        pParticlesOut[i] = pParticlesIn[i];    
-        m_engine->InvokeBodyBodyInteraction(pParticlesIn, pParticlesOut[i], numParticles);
-    }
+        m_engine->InvokeBodyBodyInteraction(pParticlesIn, pParticlesIn, pParticlesOut, i, numSources);
 }
 
 //--------------------------------------------------------------------------------------
 //  The parallel integration engine to update all particles.
 //--------------------------------------------------------------------------------------
 //
-//  This uses the PPL to update chunks of particles in parallel on different threads.
+//  This uses the parallel backend to update chunks of particles in parallel on different threads.
 //  This is thread safe because all threads read from a readonly copy of the particles
-//  stored in pParticlesIn and only one thread writes to a given array element in pParticlesOut.
-//  Ensuring that the ParticleCpu struct is aligned and occupies a whole cache line reduces the 
-//  amount of false cache line shareing and improves performance. 
+//  stored in pParticlesIn and only one thread writes to a given element of the streams in 
+//  pParticlesOut.
+//
+//  Every particle costs the same, so each thread is given a fixed contiguous share of them. This is
+//  the share of each stream it zeroed when the stores were created, so on a NUMA machine it reads
+//  and writes its particles on its own node. The sources, which every thread reads, are read from
+//  the copy on the thread's node.
+
+const int kSimpleChunkSize = 256;
 
-void NBodySimpleMultiCore::Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const
+void NBodySimpleMultiCore::Integrate(ParticleStoreSoA* const pParticlesIn, ParticleStoreSoA* const pParticlesOut, int numParticles) const
 {
-    parallel_for(0, numParticles, [=, this, &pParticlesOut](int i)
+    const int numSources = pParticlesIn->NumSources(numParticles);
+    m_sources.Update(pParticlesIn, numSources);
+    const SourceReplicas* const pSources = &m_sources;
+    ParallelForStatic(0, numParticles, kSimpleChunkSize, [=](int begin)
     {
-        pParticlesOut[i] = pParticlesIn[i];
-        m_engine->InvokeBodyBodyInteraction(pParticlesIn, pParticlesOut[i], numParticles);
+        const ParticleStoreSoA* const pLocalSources = pSources->Local();
+        const int end = std::min(begin + kSimpleChunkSize, numParticles);
+        for (int i = begin; i < end; ++i)
+            m_engine->InvokeBodyBodyInteraction(pParticlesIn, pLocalSources, pParticlesOut, i, numSources);
     });
 }
 
@@ -235,7 +329,7 @@ void NBodySimpleMultiCore::Integrate(ParticleCpu* const pParticlesIn, ParticleCp
 //  Utility functions.
 //--------------------------------------------------------------------------------------
 
-void LoadClusterParticles(ParticleCpu* const pParticles, float_3 center, float_3 velocity, 
+void LoadClusterParticles(ParticleStoreSoA* const pParticles, int begin, float_3 center, float_3 velocity, 
     float spread, int numParticles)
 {
     std::random_device rd; 
@@ -244,22 +338,40 @@ void LoadClusterParticles(ParticleCpu* const pParticles, float_3 center, float_3
     std::uniform_real_distribution<float> randTheta(-1.0f, 1.0f);
     std::uniform_real_distribution<float> randPhi(0.0f, 2.0f * static_cast<float>(std::_Pi));
 
-    std::for_each(pParticles, pParticles + numParticles, 
-        [=, &engine, &randRadius, &randTheta, &randPhi](ParticleCpu& p)
+    for (int i = begin; i < begin + numParticles; ++i)
     {
         float_3 delta = PolarToCartesian(randRadius(engine), 
             acos(randTheta(engine)), randPhi(engine));
-        p.pos = center + delta; 
-        p.vel = velocity;
-        p.acc = 0.0f;
-    });  
+        pParticles->SetPosition(i, center + delta); 
+        pParticles->SetVelocity(i, velocity);
+        pParticles->SetAcceleration(i, 0.0f);
+    }
 }
 
-inline CpuSSE GetSSEType()
+CpuSSE GetSSEType()
 {
     int CpuInfo[4] = { -1 };
+    __cpuid(CpuInfo, 0);
+    const int maxLeaf = CpuInfo[0];
+
     __cpuid(CpuInfo, 1);
 
+    // AVX2 and AVX-512 are reported in leaf 7. The processor must also support FMA3 and the OS must have 
+    // enabled saving of the XMM and YMM state, reported by OSXSAVE and XGETBV.
+
+    const bool hasFma = (CpuInfo[2] >> 12 & 0x1) != 0;
+    const bool hasOsxsave = (CpuInfo[2] >> 27 & 0x1) != 0;
+    const bool hasAvx = (CpuInfo[2] >> 28 & 0x1) != 0;
+    if ((maxLeaf >= 7) && hasFma && hasOsxsave && hasAvx && ((_xgetbv(0) & 0x6) == 0x6))
+    {
+        int CpuInfo7[4] = { -1 };
+        __cpuidex(CpuInfo7, 7, 0);
+
+        // AVX-512F also requires the OS to save the opmask and both halves of the ZMM registers.
+        if ((CpuInfo7[1] >> 16 & 0x1) && ((_xgetbv(0) & 0xE6) == 0xE6)) return kCpuAVX512;
+        if (CpuInfo7[1] >> 5 & 0x1) return kCpuAVX2;
+    }
+
     // Note: The book code contains typos, the && operator is used instead of & and 
     // CpuInfo is capitalized incorrectly. The code below is correct.
 
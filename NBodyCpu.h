@@ -16,7 +16,6 @@
 
 #pragma once
 
-#include <concrtrm.h>
 
 #include "INBodyCpu.h"
 #include "ParticleCpu.h"
@@ -30,28 +29,59 @@ enum ComputeType
 {
     kCpuSingle = 0,
     kCpuMulti = 1,
-    kCpuAdvanced = 2
+    kCpuAdvanced = 2,
+    kCpuBarnesHut = 3,
+    kCpuFmm = 4,
+    kCpuParticleMesh = 5,
+    kCpuTreePm = 6,
+    kCpuCellList = 7,
+    kCpuAdvancedCutoff = 8,
+    kCpuHermite = 9,
+    kCpuHermiteBlock = 10,
+    kCpuAdvancedRespa = 11,
+    kCpuPrivate = 12
 };
 
 //  Level of SSE support available. Determined dynamically at runtime.
+//
+//  kCpuAVX2 requires both AVX2 and FMA3 support from the processor and that the OS saves
+//  the upper half of the YMM registers on a context switch. Similarly kCpuAVX512 requires
+//  AVX-512F and OS support for the ZMM and opmask registers.
+//
+//  The engines take a maximum level so that a slower implementation can be selected at runtime
+//  for comparison. The level used is the lower of this and the level the hardware supports.
 
 enum CpuSSE
 {
     kCpuNone = 0,
     kCpuSSE,
-    kCpuSSE4
+    kCpuSSE4,
+    kCpuAVX2,
+    kCpuAVX512
 };
 
+//  Passed to the direct engines in place of a particle mass when the sources' masses differ, so
+//  that the kernels read each source's mass from the mass stream.
+
+const float kPerParticleMass = 0.0f;
+
 //--------------------------------------------------------------------------------------
 //  A simple integration engine.
 //--------------------------------------------------------------------------------------
 //
 //  On initialization this picks the most performant integration engine and sets a function
 //  pointer. During calculations this is used to quickly call the correct integration code.
+//
+//  Each function updates particle i in pParticlesOut using the positions of all the sources in
+//  pSources, which are either pParticlesIn or a copy of its sources. The j particles are read from the x, y and z streams several at a time so the
+//  SSE4 _mm_dp_ps based implementation is no longer needed, SSE4 hardware uses the SSE code.
+//
+//  Each implementation is instantiated for a uniform mass, the given particle mass, and for
+//  individual masses, loaded from the mass stream with the positions, see kPerParticleMass.
 
 class NBodySimpleInteractionEngine;
 
-typedef void (NBodySimpleInteractionEngine::* NBodySimpleFunc)(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const;
+typedef void (NBodySimpleInteractionEngine::* NBodySimpleFunc)(const ParticleStoreSoA* const pParticlesIn, const ParticleStoreSoA* const pSources, ParticleStoreSoA* const pParticlesOut, int i, int numSources) const;
 
 class NBodySimpleInteractionEngine
 {
@@ -63,29 +93,36 @@ private:
     NBodySimpleFunc m_funcptr;
 
 public:
-    NBodySimpleInteractionEngine(float softeningSquared, float dampingFactor, float deltaTime, float particleMass) :
+    NBodySimpleInteractionEngine(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, CpuSSE maxSSE = kCpuAVX512) :
         m_softeningSquared(softeningSquared),
         m_dampingFactor(dampingFactor),
         m_deltaTime(deltaTime),
         m_particleMass(particleMass),
         m_funcptr(nullptr)
     {
-        SelectCpuImplementation();
+        SelectCpuImplementation(maxSSE);
     }
 
-    inline void InvokeBodyBodyInteraction(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const
+    inline void InvokeBodyBodyInteraction(const ParticleStoreSoA* const pParticlesIn, const ParticleStoreSoA* const pSources, ParticleStoreSoA* const pParticlesOut, int i, int numSources) const
     {
-        (this->*m_funcptr)(pParticlesIn, particleOut, numParticles); 
+        (this->*m_funcptr)(pParticlesIn, pSources, pParticlesOut, i, numSources); 
     };
 
 private:
-    void SelectCpuImplementation();
+    void SelectCpuImplementation(CpuSSE maxSSE);
+    template <bool uniformMass>
+    void SelectKernel(CpuSSE maxSSE);
 
     // Different implementations of the body-body interaction.
 
-    void BodyBodyInteraction(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const;
-    void BodyBodyInteractionSSE(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const;
-    void BodyBodyInteractionSSE4(const ParticleCpu* const pParticlesIn, ParticleCpu& particleOut, int numParticles) const;
+    template <bool uniformMass>
+    void BodyBodyInteraction(const ParticleStoreSoA* const pParticlesIn, const ParticleStoreSoA* const pSources, ParticleStoreSoA* const pParticlesOut, int i, int numSources) const;
+    template <bool uniformMass>
+    void BodyBodyInteractionSSE(const ParticleStoreSoA* const pParticlesIn, const ParticleStoreSoA* const pSources, ParticleStoreSoA* const pParticlesOut, int i, int numSources) const;
+    template <bool uniformMass>
+    void BodyBodyInteractionAVX2(const ParticleStoreSoA* const pParticlesIn, const ParticleStoreSoA* const pSources, ParticleStoreSoA* const pParticlesOut, int i, int numSources) const;
+    template <bool uniformMass>
+    void BodyBodyInteractionAVX512(const ParticleStoreSoA* const pParticlesIn, const ParticleStoreSoA* const pSources, ParticleStoreSoA* const pParticlesOut, int i, int numSources) const;
 };
 
 //--------------------------------------------------------------------------------------
@@ -101,13 +138,13 @@ private:
     std::shared_ptr<NBodySimpleInteractionEngine> m_engine;
 
 public:
-    NBodySimpleSingleCore(float softeningSquared, float dampingFactor, float deltaTime, float particleMass) : 
+    NBodySimpleSingleCore(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, CpuSSE maxSSE = kCpuAVX512) : 
         INBodyCpu(),
-        m_engine(std::make_shared<NBodySimpleInteractionEngine>(softeningSquared, dampingFactor, deltaTime, particleMass))
+        m_engine(std::make_shared<NBodySimpleInteractionEngine>(softeningSquared, dampingFactor, deltaTime, particleMass, maxSSE))
     {
     }
 
-    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu*const pParticlesOut, int numParticles) const;
+    void Integrate(ParticleStoreSoA* const pParticlesIn, ParticleStoreSoA* const pParticlesOut, int numParticles) const;
 };
 
 //--------------------------------------------------------------------------------------
@@ -121,26 +158,28 @@ class NBodySimpleMultiCore : public INBodyCpu
 {
 private:
     std::shared_ptr<NBodySimpleInteractionEngine> m_engine;
+    mutable SourceReplicas m_sources;
 
 public:
-    NBodySimpleMultiCore(float softeningSquared, float dampingFactor, float deltaTime, float particleMass) : 
+    NBodySimpleMultiCore(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, CpuSSE maxSSE = kCpuAVX512) : 
         INBodyCpu(),
-        m_engine(new NBodySimpleInteractionEngine(softeningSquared, dampingFactor, deltaTime, particleMass))
+        m_engine(new NBodySimpleInteractionEngine(softeningSquared, dampingFactor, deltaTime, particleMass, maxSSE))
     {
     }
 
-    void Integrate(ParticleCpu* const pParticlesIn, ParticleCpu* const pParticlesOut, int numParticles) const;
+    void Integrate(ParticleStoreSoA* const pParticlesIn, ParticleStoreSoA* const pParticlesOut, int numParticles) const;
 };
 
 //--------------------------------------------------------------------------------------
 //  Utility functions.
 //--------------------------------------------------------------------------------------
 
-//  Generate a cluster of particles uniformly distributed within a sphere.
+//  Generate a cluster of particles uniformly distributed within a sphere. The particles are
+//  written to the store starting at index begin.
 //  This is not a physically realistic model but it is adequate for demonstration purposes.
 
-void LoadClusterParticles(ParticleCpu* const pParticles, float_3 center, float_3 velocity, float spread, int numParticles);
+void LoadClusterParticles(ParticleStoreSoA* const pParticles, int begin, float_3 center, float_3 velocity, float spread, int numParticles);
 
 //  Get the level of SSE support available on the current hardware. 
 
-inline CpuSSE GetSSEType();
+CpuSSE GetSSEType();
@@ -0,0 +1,525 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <math.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "Common.h"
+#include "NBodyFmmCpu.h"
+#include "ParallelCpu.h"
+
+using namespace concurrency::graphics;
+
+//  Maximum number of particles in a leaf of the tree.
+
+const int kFmmLeafSize = 64;
+
+//  Nodes with more particles than this process their children as parallel tasks.
+
+const int kFmmParallelThreshold = 4 * 1024;
+
+//  Binomial coefficient of a multi-index, the product of the binomial coefficients of each axis.
+
+static double Binomial(int n, int k)
+{
+    double result = 1.0;
+    for (int i = 1; i <= k; ++i)
+        result = result * (n - k + i) / i;
+    return result;
+}
+
+static double Binomial(const int* const n, const int* const k)
+{
+    return Binomial(n[0], k[0]) * Binomial(n[1], k[1]) * Binomial(n[2], k[2]);
+}
+
+NBodyFmm::NBodyFmm(float softeningSquared, float dampingFactor, float deltaTime, int order, float openingAngle) :
+    INBodyCpu(),
+    m_softeningSquared(softeningSquared),
+    m_dampingFactor(dampingFactor),
+    m_deltaTime(deltaTime),
+    m_order(order),
+    m_openingAngle(openingAngle),
+    m_numTerms(0),
+    m_tree(kFmmLeafSize)
+{
+    assert((order >= 1) && (order <= kMaxOrder));
+    assert((openingAngle > 0.0f) && (openingAngle < 1.0f));
+    BuildOperators();
+}
+
+//--------------------------------------------------------------------------------------
+//  Expansion operators.
+//--------------------------------------------------------------------------------------
+//
+//  With S the multipole moments of the particles about the source center, S(k) = sum(m * d^k),
+//  and a(k) the Taylor coefficients of the potential at R = target - source, the potential
+//  near the target center is phi(z + y) = sum(L(n) * y^n) where:
+//
+//  M2M     S(k) = sum over l <= k of C(k, l) * S'(l) * t^(k - l), t the child's offset
+//  M2L     L(n) = sum over |k| + |n| <= p of (-1)^|k| * C(k + n, k) * S(k) * a(k + n)
+//  L2L     L'(m) = sum over n >= m of C(n, m) * L(n) * s^(n - m), s the child's offset
+//  L2P     acc = grad(phi) = sum(L(n) * n(i) * y^(n - e(i)))
+//
+//  C is the multi-index binomial coefficient. All the operators are a list of terms that is
+//  built once here for the chosen order.
+
+void NBodyFmm::BuildOperators()
+{
+    const int p = m_order;
+    m_termIndex.assign((p + 1) * (p + 1) * (p + 1), -1);
+    m_termPowers.clear();
+
+    for (int degree = 0; degree <= p; ++degree)
+        for (int kx = degree; kx >= 0; --kx)
+            for (int ky = degree - kx; ky >= 0; --ky)
+            {
+                const int kz = degree - kx - ky;
+                m_termIndex[(kx * (p + 1) + ky) * (p + 1) + kz] = static_cast<int>(m_termPowers.size() / 3);
+                m_termPowers.push_back(kx);
+                m_termPowers.push_back(ky);
+                m_termPowers.push_back(kz);
+            }
+    m_numTerms = static_cast<int>(m_termPowers.size() / 3);
+    assert(m_numTerms <= kMaxTerms);
+
+    m_recurrence.resize(m_numTerms);
+    for (int t = 0; t < m_numTerms; ++t)
+    {
+        const int* const k = &m_termPowers[3 * t];
+        FmmRecurrence& rec = m_recurrence[t];
+        rec.degree = k[0] + k[1] + k[2];
+        for (int i = 0; i < 3; ++i)
+        {
+            int lower[3] = { k[0], k[1], k[2] };
+            lower[i] -= 1;
+            rec.lower1[i] = (lower[i] >= 0) ? TermIndex(lower[0], lower[1], lower[2]) : -1;
+            lower[i] -= 1;
+            rec.lower2[i] = (lower[i] >= 0) ? TermIndex(lower[0], lower[1], lower[2]) : -1;
+        }
+    }
+
+    m_m2m.clear();
+    m_m2l.clear();
+    m_l2l.clear();
+    m_l2p.clear();
+
+    for (int a = 0; a < m_numTerms; ++a)
+    {
+        const int* const ka = &m_termPowers[3 * a];
+        const int degreeA = ka[0] + ka[1] + ka[2];
+
+        for (int b = 0; b < m_numTerms; ++b)
+        {
+            const int* const kb = &m_termPowers[3 * b];
+            const int degreeB = kb[0] + kb[1] + kb[2];
+
+            // M2M and L2L, b <= a in every component.
+            if ((kb[0] <= ka[0]) && (kb[1] <= ka[1]) && (kb[2] <= ka[2]))
+            {
+                const int shift = TermIndex(ka[0] - kb[0], ka[1] - kb[1], ka[2] - kb[2]);
+                const FmmTerm m2m = { a, b, shift, Binomial(ka, kb) };
+                m_m2m.push_back(m2m);
+                const FmmTerm l2l = { b, a, shift, Binomial(ka, kb) };
+                m_l2l.push_back(l2l);
+            }
+
+            // M2L, the local coefficient a from the multipole moment b.
+            if (degreeA + degreeB <= p)
+            {
+                const int sum[3] = { ka[0] + kb[0], ka[1] + kb[1], ka[2] + kb[2] };
+                const double sign = (degreeB % 2 == 0) ? 1.0 : -1.0;
+                const FmmTerm m2l = { a, b, TermIndex(sum[0], sum[1], sum[2]), sign * Binomial(sum, kb) };
+                m_m2l.push_back(m2l);
+            }
+        }
+
+        // L2P, the gradient of each term along each axis.
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (ka[axis] == 0)
+                continue;
+            int shift[3] = { ka[0], ka[1], ka[2] };
+            --shift[axis];
+            const FmmTerm l2p = { axis, a, TermIndex(shift[0], shift[1], shift[2]), static_cast<double>(ka[axis]) };
+            m_l2p.push_back(l2p);
+        }
+    }
+}
+
+//  All the monomials x^kx * y^ky * z^kz of the expansion.
+
+void NBodyFmm::Monomials(const double x, const double y, const double z, double* const monomials) const
+{
+    double powers[3][kMaxOrder + 1];
+    powers[0][0] = powers[1][0] = powers[2][0] = 1.0;
+    for (int k = 1; k <= m_order; ++k)
+    {
+        powers[0][k] = powers[0][k - 1] * x;
+        powers[1][k] = powers[1][k - 1] * y;
+        powers[2][k] = powers[2][k - 1] * z;
+    }
+
+    for (int t = 0; t < m_numTerms; ++t)
+    {
+        const int* const k = &m_termPowers[3 * t];
+        monomials[t] = powers[0][k[0]] * powers[1][k[1]] * powers[2][k[2]];
+    }
+}
+
+//  Taylor coefficients a(k) = D^k(G) / k! of the softened potential G = 1 / sqrt(r^2 + e^2) at r.
+//  They satisfy the recurrence, with n = |k|:
+//
+//  n * (r^2 + e^2) * a(k) + (2n - 1) * sum(r(i) * a(k - e(i))) + (n - 1) * sum(a(k - 2e(i))) = 0
+//
+//  The terms are ordered by degree so the lower order coefficients are always available.
+
+void NBodyFmm::Derivatives(const double x, const double y, const double z, double* const derivatives) const
+{
+    const double r[3] = { x, y, z };
+    const double distSqr = x * x + y * y + z * z + m_softeningSquared;
+    derivatives[0] = 1.0 / sqrt(distSqr);
+
+    for (int t = 1; t < m_numTerms; ++t)
+    {
+        const FmmRecurrence& rec = m_recurrence[t];
+        double sum1 = 0.0;
+        double sum2 = 0.0;
+        for (int i = 0; i < 3; ++i)
+        {
+            if (rec.lower1[i] >= 0)
+                sum1 += r[i] * derivatives[rec.lower1[i]];
+            if (rec.lower2[i] >= 0)
+                sum2 += derivatives[rec.lower2[i]];
+        }
+        const int n = rec.degree;
+        derivatives[t] = -((2 * n - 1) * sum1 + (n - 1) * sum2) / (n * distSqr);
+    }
+}
+
+//--------------------------------------------------------------------------------------
+//  Integrate all the particles.
+//--------------------------------------------------------------------------------------
+//
+//  As in the Barnes-Hut engine the accelerations are calculated in Morton order and then
+//  each particle's velocity and position are written to pParticlesOut in the original order.
+
+void NBodyFmm::Integrate(ParticleStoreSoA* const pParticlesIn, ParticleStoreSoA* const pParticlesOut, int numParticles) const
+{
+    m_tree.Build(pParticlesIn, numParticles);
+
+    const size_t numNodes = m_tree.NumNodes();
+    if (m_cells.size() < numNodes)
+    {
+        const size_t capacity = std::max(numNodes, 2 * static_cast<size_t>(numParticles));
+        m_cells.resize(capacity);
+        m_multipoles.resize(capacity * m_numTerms);
+        m_locals.resize(capacity * m_numTerms);
+    }
+    std::fill(m_locals.begin(), m_locals.begin() + numNodes * m_numTerms, 0.0);
+
+    ParticleStoreSoA* const pSorted = m_tree.Sorted();
+    const int chunkSize = 1024;
+    ParallelFor(0, numParticles, chunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + chunkSize, numParticles);
+        std::fill(pSorted->ax + begin, pSorted->ax + end, 0.0f);
+        std::fill(pSorted->ay + begin, pSorted->ay + end, 0.0f);
+        std::fill(pSorted->az + begin, pSorted->az + end, 0.0f);
+    });
+
+    Upward(m_tree.Root());
+    Interact(m_tree.Root(), m_tree.Root());
+    Downward(m_tree.Root());
+
+    ParallelFor(0, numParticles, chunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + chunkSize, numParticles);
+        for (int s = begin; s < end; ++s)
+        {
+            const int i = m_tree.SortedIndex(s);
+            float_3 vel = pParticlesIn->Velocity(i);
+            vel += pSorted->Acceleration(s) * m_deltaTime;
+            vel *= m_dampingFactor;
+            pParticlesOut->SetVelocity(i, vel);
+            pParticlesOut->SetPosition(i, pParticlesIn->Position(i) + vel * m_deltaTime);
+        }
+    });
+}
+
+//--------------------------------------------------------------------------------------
+//  Upward pass, P2M and M2M.
+//--------------------------------------------------------------------------------------
+//
+//  Each node's expansion center is its center of mass and its radius bounds the distance
+//  from the center to all of its particles, tracers included as the same center is used for
+//  the local expansion. Nodes without sources are centered on their particles instead.
+
+void NBodyFmm::Upward(int node) const
+{
+    const OctreeNode& n = m_tree.Node(node);
+    FmmCell& cell = m_cells[node];
+    double* const multipole = &m_multipoles[node * m_numTerms];
+    std::fill(multipole, multipole + m_numTerms, 0.0);
+
+    if (n.IsLeaf())
+    {
+        const ParticleStoreSoA* const pSorted = m_tree.Sorted();
+        float_3 center(0.0f);
+        float mass = 0.0f;
+        for (int s = n.begin; s < n.SourceEnd(); ++s)
+        {
+            center += pSorted->Position(s) * pSorted->mass[s];
+            mass += pSorted->mass[s];
+        }
+        if (mass > 0.0f)
+        {
+            center *= 1.0f / mass;
+        }
+        else
+        {
+            for (int s = n.begin; s < n.end; ++s)
+                center += pSorted->Position(s);
+            center *= 1.0f / std::max(n.Count(), 1);
+        }
+
+        float radiusSqr = 0.0f;
+        double monomials[kMaxTerms];
+        for (int s = n.begin; s < n.end; ++s)
+            radiusSqr = std::max(radiusSqr, SqrLength(pSorted->Position(s) - center));
+        for (int s = n.begin; s < n.SourceEnd(); ++s)
+        {
+            const float_3 d = pSorted->Position(s) - center;
+            Monomials(d.x, d.y, d.z, monomials);
+            for (int t = 0; t < m_numTerms; ++t)
+                multipole[t] += pSorted->mass[s] * monomials[t];
+        }
+        cell.center = center;
+        cell.radius = sqrt(radiusSqr);
+        return;
+    }
+
+    if (n.Count() > kFmmParallelThreshold)
+    {
+        TaskGroup tasks;
+        for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+            tasks.Run([=] { Upward(c); });
+        tasks.Wait();
+    }
+    else
+    {
+        for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+            Upward(c);
+    }
+
+    // The first term of each child's expansion, S(0), is its mass.
+    float_3 center(0.0f);
+    float mass = 0.0f;
+    for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+    {
+        const float childMass = static_cast<float>(m_multipoles[c * m_numTerms]);
+        center += m_cells[c].center * childMass;
+        mass += childMass;
+    }
+    if (mass > 0.0f)
+    {
+        center *= 1.0f / mass;
+    }
+    else
+    {
+        for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+            center += m_cells[c].center * static_cast<float>(m_tree.Node(c).Count());
+        center *= 1.0f / n.Count();
+    }
+
+    float radius = 0.0f;
+    double monomials[kMaxTerms];
+    for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+    {
+        const float_3 t = m_cells[c].center - center;
+        radius = std::max(radius, sqrt(SqrLength(t)) + m_cells[c].radius);
+
+        const double* const child = &m_multipoles[c * m_numTerms];
+        Monomials(t.x, t.y, t.z, monomials);
+        for (auto it = m_m2m.cbegin(); it != m_m2m.cend(); ++it)
+            multipole[it->outIndex] += it->coefficient * child[it->inIndex] * monomials[it->shiftIndex];
+    }
+    cell.center = center;
+    cell.radius = radius;
+}
+
+//--------------------------------------------------------------------------------------
+//  Dual tree traversal, M2L and P2P.
+//--------------------------------------------------------------------------------------
+//
+//  Well separated pairs add the source's multipole expansion to the target's local expansion.
+//  Otherwise the node with the larger radius is split, ties split the target. Only splitting
+//  the target runs the children in parallel, the tasks then write to disjoint nodes and
+//  particles.
+
+void NBodyFmm::Interact(int target, int source) const
+{
+    if (m_tree.Node(source).numSources == 0)
+        return;
+
+    const FmmCell& targetCell = m_cells[target];
+    const FmmCell& sourceCell = m_cells[source];
+    const float_3 r = targetCell.center - sourceCell.center;
+    const float separation = m_openingAngle * sqrt(SqrLength(r));
+
+    if ((target != source) && (targetCell.radius + sourceCell.radius < separation))
+    {
+        double derivatives[kMaxTerms];
+        Derivatives(r.x, r.y, r.z, derivatives);
+        const double* const multipole = &m_multipoles[source * m_numTerms];
+        double* const local = &m_locals[target * m_numTerms];
+        for (auto it = m_m2l.cbegin(); it != m_m2l.cend(); ++it)
+            local[it->outIndex] += it->coefficient * multipole[it->inIndex] * derivatives[it->shiftIndex];
+        return;
+    }
+
+    const OctreeNode& t = m_tree.Node(target);
+    const OctreeNode& s = m_tree.Node(source);
+
+    if (t.IsLeaf() && s.IsLeaf())
+    {
+        DirectInteractions(t, s);
+        return;
+    }
+
+    if (!t.IsLeaf() && (s.IsLeaf() || targetCell.radius >= sourceCell.radius))
+    {
+        if (t.Count() > kFmmParallelThreshold)
+        {
+            TaskGroup tasks;
+            for (int c = t.firstChild; c < t.firstChild + t.numChildren; ++c)
+                tasks.Run([=] { Interact(c, source); });
+            tasks.Wait();
+        }
+        else
+        {
+            for (int c = t.firstChild; c < t.firstChild + t.numChildren; ++c)
+                Interact(c, source);
+        }
+    }
+    else
+    {
+        for (int c = s.firstChild; c < s.firstChild + s.numChildren; ++c)
+            Interact(target, c);
+    }
+}
+
+//  Direct sum of the source leaf's sources onto the target leaf's particles. As in the
+//  Barnes-Hut engine each source particle is applied to a block of target particles held in
+//  local arrays so the inner loop can be vectorized.
+
+void NBodyFmm::DirectInteractions(const OctreeNode& target, const OctreeNode& source) const
+{
+    ParticleStoreSoA* const pSorted = m_tree.Sorted();
+
+    for (int blockBegin = target.begin; blockBegin < target.end; blockBegin += kFmmLeafSize)
+    {
+        const int count = std::min(target.end - blockBegin, kFmmLeafSize);
+        float posX[kFmmLeafSize], posY[kFmmLeafSize], posZ[kFmmLeafSize];
+        float accX[kFmmLeafSize], accY[kFmmLeafSize], accZ[kFmmLeafSize];
+        for (int i = 0; i < count; ++i)
+        {
+            posX[i] = pSorted->x[blockBegin + i];
+            posY[i] = pSorted->y[blockBegin + i];
+            posZ[i] = pSorted->z[blockBegin + i];
+            accX[i] = accY[i] = accZ[i] = 0.0f;
+        }
+
+        for (int j = source.begin; j < source.SourceEnd(); ++j)
+        {
+            const float jX = pSorted->x[j];
+            const float jY = pSorted->y[j];
+            const float jZ = pSorted->z[j];
+            const float jMass = pSorted->mass[j];
+            for (int i = 0; i < count; ++i)
+            {
+                const float rX = jX - posX[i];
+                const float rY = jY - posY[i];
+                const float rZ = jZ - posZ[i];
+                const float distSqr = rX * rX + rY * rY + rZ * rZ + m_softeningSquared;
+                const float invDist = 1.0f / sqrt(distSqr);
+                const float s = jMass * invDist * invDist * invDist;
+                accX[i] += rX * s;
+                accY[i] += rY * s;
+                accZ[i] += rZ * s;
+            }
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            pSorted->ax[blockBegin + i] += accX[i];
+            pSorted->ay[blockBegin + i] += accY[i];
+            pSorted->az[blockBegin + i] += accZ[i];
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------------
+//  Downward pass, L2L and L2P.
+//--------------------------------------------------------------------------------------
+
+void NBodyFmm::Downward(int node) const
+{
+    const OctreeNode& n = m_tree.Node(node);
+    const FmmCell& cell = m_cells[node];
+    const double* const local = &m_locals[node * m_numTerms];
+    double monomials[kMaxTerms];
+
+    if (n.IsLeaf())
+    {
+        ParticleStoreSoA* const pSorted = m_tree.Sorted();
+        for (int s = n.begin; s < n.end; ++s)
+        {
+            const float_3 y = pSorted->Position(s) - cell.center;
+            Monomials(y.x, y.y, y.z, monomials);
+            double acc[3] = { 0.0, 0.0, 0.0 };
+            for (auto it = m_l2p.cbegin(); it != m_l2p.cend(); ++it)
+                acc[it->outIndex] += it->coefficient * local[it->inIndex] * monomials[it->shiftIndex];
+            pSorted->ax[s] += static_cast<float>(acc[0]);
+            pSorted->ay[s] += static_cast<float>(acc[1]);
+            pSorted->az[s] += static_cast<float>(acc[2]);
+        }
+        return;
+    }
+
+    for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+    {
+        const float_3 s = m_cells[c].center - cell.center;
+        double* const child = &m_locals[c * m_numTerms];
+        Monomials(s.x, s.y, s.z, monomials);
+        for (auto it = m_l2l.cbegin(); it != m_l2l.cend(); ++it)
+            child[it->outIndex] += it->coefficient * local[it->inIndex] * monomials[it->shiftIndex];
+    }
+
+    if (n.Count() > kFmmParallelThreshold)
+    {
+        TaskGroup tasks;
+        for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+            tasks.Run([=] { Downward(c); });
+        tasks.Wait();
+    }
+    else
+    {
+        for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+            Downward(c);
+    }
+}
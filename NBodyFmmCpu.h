@@ -0,0 +1,132 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <vector>
+#include <amp_short_vectors.h>
+
+#include "INBodyCpu.h"
+#include "ParticleCpu.h"
+#include "NBodyOctreeCpu.h"
+
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  Fast multipole method implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  The FMM reduces the cost of the calculation to O(N) by approximating the interactions
+//  between pairs of well separated nodes, rather than between nodes and particles as the
+//  Barnes-Hut engine does. Each step:
+//
+//  P2M     Each leaf's particles are summed into a multipole expansion about its center of mass.
+//  M2M     Multipole expansions are shifted up the tree and summed into their parents'.
+//  M2L     The dual tree traversal converts the multipole expansion of each source node that
+//          is well separated from a target node into a local expansion about the target.
+//          Nodes that are too close are split, leaves that are too close interact directly.
+//  L2L     Local expansions are shifted down the tree and added to their children's.
+//  L2P     Each leaf's local expansion is evaluated at its particles to give their acceleration.
+//
+//  The expansions are Cartesian Taylor series of the softened potential 1 / sqrt(r^2 + e^2),
+//  truncated at a configurable order. The far field therefore uses the same softening as the
+//  direct sum. Two nodes are well separated if (rA + rB) < theta * |cA - cB| where r is the
+//  radius of a node's particles about its expansion center c.
+//
+//  Every particle is a target but only the sources contribute to the multipole expansions and
+//  the direct sums. Source nodes that only hold tracers are skipped by the traversal.
+//
+//  The traversal only ever writes to the target node, so splitting the target node gives
+//  independent tasks that run in parallel. The upward and downward passes are parallel over
+//  the children of large nodes.
+//
+//  See: W. Dehnen, "A fast multipole method for stellar dynamics", Computational
+//  Astrophysics and Cosmology 1, 2014.
+
+//  Each term of an expansion operator: out[outIndex] += coefficient * in[inIndex] * shift[shiftIndex].
+
+struct FmmTerm
+{
+    int outIndex;
+    int inIndex;
+    int shiftIndex;
+    double coefficient;
+};
+
+//  Indices of the lower order coefficients used to calculate each Taylor coefficient, -1 where
+//  the multi-index would have a negative component.
+
+struct FmmRecurrence
+{
+    int degree;
+    int lower1[3];              // k - e(i)
+    int lower2[3];              // k - 2e(i)
+};
+
+//  Expansion center and radius of the particles of each node.
+
+struct FmmCell
+{
+    float_3 center;
+    float radius;
+};
+
+class NBodyFmm : public INBodyCpu
+{
+public:
+    static const int kMaxOrder = 8;
+    static const int kMaxTerms = (kMaxOrder + 1) * (kMaxOrder + 2) * (kMaxOrder + 3) / 6;
+
+private:
+    const float m_softeningSquared;
+    const float m_dampingFactor;
+    const float m_deltaTime;
+    const int m_order;
+    const float m_openingAngle;
+
+    // Multi-index tables. Terms are ordered by total degree, m_termIndex maps a multi-index
+    // (kx, ky, kz) to its position in the expansion arrays.
+    int m_numTerms;
+    std::vector<int> m_termIndex;
+    std::vector<int> m_termPowers;
+    std::vector<FmmRecurrence> m_recurrence;
+    std::vector<FmmTerm> m_m2m;
+    std::vector<FmmTerm> m_m2l;
+    std::vector<FmmTerm> m_l2l;
+    std::vector<FmmTerm> m_l2p;
+
+    mutable Octree m_tree;
+    mutable std::vector<FmmCell> m_cells;
+    mutable std::vector<double> m_multipoles;
+    mutable std::vector<double> m_locals;
+
+public:
+    NBodyFmm(float softeningSquared, float dampingFactor, float deltaTime, int order, float openingAngle);
+
+    void Integrate(ParticleStoreSoA* const pParticlesIn, ParticleStoreSoA* const pParticlesOut, int numParticles) const;
+
+private:
+    void BuildOperators();
+    inline int TermIndex(int kx, int ky, int kz) const { return m_termIndex[(kx * (m_order + 1) + ky) * (m_order + 1) + kz]; }
+
+    void Monomials(const double x, const double y, const double z, double* const monomials) const;
+    void Derivatives(const double x, const double y, const double z, double* const derivatives) const;
+
+    void Upward(int node) const;
+    void Interact(int target, int source) const;
+    void Downward(int node) const;
+    void DirectInteractions(const OctreeNode& target, const OctreeNode& source) const;
+};
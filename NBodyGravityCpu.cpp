@@ -14,9 +14,11 @@
 // PARTICULAR PURPOSE.
 //===============================================================================
 
+#include <stdlib.h>
 #include <memory>
 #include <deque>
 #include <numeric>
+#include <random>
 #include <d3dx11.h>
 #include <commdlg.h>
 #include <atlbase.h>
@@ -30,6 +32,16 @@
 #include "Common.h"
 #include "NbodyCpu.h"
 #include "NbodyAdvancedCpu.h"
+#include "NBodyBarnesHutCpu.h"
+#include "NBodyFmmCpu.h"
+#include "NBodyParticleMeshCpu.h"
+#include "NBodyTreePmCpu.h"
+#include "NBodyCellListCpu.h"
+#include "NBodyHermiteCpu.h"
+#include "NBodyPrivateCpu.h"
+#include "ParticleReorderCpu.h"
+#include "ParallelCpu.h"
+#include "TopologyCpu.h"
 #include "resource.h"
 
 //--------------------------------------------------------------------------------------
@@ -40,9 +52,26 @@ const float g_softeningSquared = 0.0000015625f;
 const float g_dampingFactor = 0.9995f;
 const float g_particleMass = ((6.67300e-11f * 10000.0f) * 10000.0f * 10000.0f);
 const float g_deltaTime = 0.1f;
-
-const int g_maxParticles = (15 * 1024);                  // Maximum number of particles in the CPU n-body simulation
-const int g_particleNumStepSize = 256;                        // Number of particles added for each slider tick
+const float g_openingAngle = 0.5f;                       // Barnes-Hut opening angle, smaller is more accurate
+const int g_fmmOrder = 4;                                // FMM expansion order, higher is more accurate
+const float g_fmmOpeningAngle = 0.5f;                    // FMM well separated criterion, smaller is more accurate
+const int g_meshSize = 64;                               // Particle-mesh grid cells along each side, a power of two
+const MeshAssignment g_meshAssignment = kMeshTSC;        // Particle-mesh mass assignment and interpolation scheme
+const int g_treePmMeshSize = 64;                         // TreePM grid cells along each side, a power of two
+const float g_treePmSplitScale = 1.25f;                  // TreePM long/short range split scale in mesh cells
+const float g_cutoffRadius = 20.0f;                      // Cell list and cutoff engine interaction cutoff radius
+const float g_neighborSkin = 8.0f;                       // Neighbor list skin, lists are rebuilt after moving half of this
+const int g_reorderInterval = 16;                        // Steps between sorting the particles into Morton order
+const int g_farFieldInterval = 4;                        // RESPA steps between far field calculations
+const float g_timeStepAccuracy = 0.05f;                  // Adaptive time step, fraction of the length scale moved per step
+const float g_timeStepLength = 40.0f;                    // Adaptive time step length scale
+const int g_hermiteTimeStepLevels = 6;                   // Block time step levels, the shortest step is g_deltaTime / 2^levels
+const int g_tracerSourceInterval = 10;                   // With tracers enabled only every tenth particle has mass
+const float g_massSpread = 0.9f;                         // Mixed masses are spread evenly over g_particleMass * (1 +/- spread)
+
+const int g_maxParticles = (1024 * 1024);                // Maximum number of particles in the CPU n-body simulation
+const int g_particleNumStepSize = 16;                    // Number of particles added for each slider tick, one AVX-512 vector
+const int g_particleLoadGroupSize = 256;                 // Particles loaded into the two clusters on each turn
 
 const float g_Spread = 400.0f;                     // Separation between the two clusters.
 
@@ -85,20 +114,30 @@ CComPtr<ID3D11ShaderResourceView>   g_pShaderResView;
 
 int                                 g_numParticles = 1024;                  // The current number of particles in the n-body simulation
 ComputeType                         g_eComputeType = kCpuAdvanced;          // Default integrator compute type
+CpuSSE                              g_eCpuSSE = kCpuAVX512;                 // Highest SIMD level the integrator may use
+IntegratorType                      g_eIntegrator = kIntegratorEuler;       // Time integration scheme of the in place integrators
 std::shared_ptr<INBodyCpu>          g_pNBody;                               // The current integrator
+bool                                g_reorderParticles = true;              // Periodically sort the particles into Morton order
+bool                                g_adaptiveTimeStep = false;             // Choose the advanced integrators' time step each step
+bool                                g_tracers = false;                      // Load most particles as massless tracers
+bool                                g_mixedMasses = false;                  // Give each source its own mass
 
 // This example uses fixed size arrays, rather that dynamic vectors, because during initialization
 // they are coupled to the DirectX rendering engine. Dynamically resizing them would mean re-initializing 
 // the DirectX buffers.
 
-//  Particle data structures.
+//  Particle data structures. The stores are created by wWinMain, not during static initialization,
+//  so that the engines' threads are running to place each share of them on its thread's node.
+
+std::unique_ptr<ParticleStoreSoA>   g_particlesOld;
+std::unique_ptr<ParticleStoreSoA>   g_particlesNew;
+ParticleStoreSoA* g_pParticlesOld = nullptr;
+ParticleStoreSoA* g_pParticlesNew = nullptr;
+MortonReorder                       g_reorder(g_maxParticles, g_reorderInterval);
 
-__declspec(align(SSE_ALIGNMENTBOUNDARY))
-std::vector<ParticleCpu>            g_particlesOld(g_maxParticles);
-__declspec(align(SSE_ALIGNMENTBOUNDARY))
-std::vector<ParticleCpu>            g_particlesNew(g_maxParticles);
-ParticleCpu* g_pParticlesOld = &g_particlesOld[0];
-ParticleCpu* g_pParticlesNew = &g_particlesNew[0];
+//  Position and z velocity of each particle, gathered from the particle store for the renderer.
+
+std::vector<float_4>                g_renderParticles(g_maxParticles);
 
 // Particle colors.
 
@@ -119,6 +158,12 @@ std::vector<D3DCOLOR>               g_particleColors;
 #define IDC_NBODIES_SLIDER          8
 #define IDC_NBODIES_TEXT            9
 #define IDC_FPS_TEXT                10
+#define IDC_SIMDTYPECOMBO           11
+#define IDC_REORDERCHECK            12
+#define IDC_INTEGRATORCOMBO         13
+#define IDC_TIMESTEPCHECK           14
+#define IDC_TRACERCHECK             15
+#define IDC_MASSCHECK               16
 
 //--------------------------------------------------------------------------------------
 // Forward declarations 
@@ -142,6 +187,7 @@ void CALLBACK OnD3D11FrameRender(ID3D11Device* pd3dDevice, ID3D11DeviceContext*
 								 float fElapsedTime, void* pUserContext);
 void InitApp();
 void RenderText();
+bool UsesIntegrator(ComputeType type);
 
 //--------------------------------------------------------------------------------------
 // Helper function to compile an hlsl shader from file, 
@@ -186,6 +232,11 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPWSTR lpCmdLi
 	DXUTSetCallbackD3D11SwapChainReleasing(OnD3D11ReleasingSwapChain);
 	DXUTSetCallbackD3D11DeviceDestroyed(OnD3D11DestroyDevice);
 
+	g_particlesOld.reset(new ParticleStoreSoA(g_maxParticles));
+	g_particlesNew.reset(new ParticleStoreSoA(g_maxParticles));
+	g_pParticlesOld = g_particlesOld.get();
+	g_pParticlesNew = g_particlesNew.get();
+
 	InitApp();
 
 	//DXUTInit( true, true, L"-forceref" ); // Force Create a ref device so that feature level D3D_FEATURE_LEVEL_11_0 is guaranteed
@@ -217,6 +268,8 @@ void InitApp(){
 	WCHAR szTemp[256];
 	swprintf_s(szTemp, L"Bodies: %d", g_numParticles);
 	g_HUD.AddStatic(IDC_NBODIES_LABEL, szTemp, -20, y += 34, 125, 22);
+	// The kernels mask off the end of their last vector so any count works. The slider moves a
+	// vector at a time, so the arrow keys give the finest steps and dragging still spans the range.
 	g_HUD.AddSlider(IDC_NBODIES_SLIDER, -20, y += 34, 170, 22, 1, g_maxParticles / g_particleNumStepSize);
 	CDXUTComboBox* pComboBox = nullptr;
 	g_HUD.AddComboBox(IDC_COMPUTETYPECOMBO, -20, y += 34, 190, 26, L'G', false, &pComboBox);
@@ -225,15 +278,67 @@ void InitApp(){
 		pComboBox->AddItem(L"CPU Single Core", nullptr);
 		pComboBox->AddItem(L"CPU Multi Core", nullptr);
 		pComboBox->AddItem(L"CPU Advanced", nullptr);
+		pComboBox->AddItem(L"CPU Barnes-Hut", nullptr);
+		pComboBox->AddItem(L"CPU Fast Multipole", nullptr);
+		pComboBox->AddItem(L"CPU Particle Mesh", nullptr);
+		pComboBox->AddItem(L"CPU TreePM", nullptr);
+		pComboBox->AddItem(L"CPU Cell List (cutoff)", nullptr);
+		pComboBox->AddItem(L"CPU Advanced (cutoff)", nullptr);
+		pComboBox->AddItem(L"CPU Hermite (4th order)", nullptr);
+		pComboBox->AddItem(L"CPU Hermite (block steps)", nullptr);
+		pComboBox->AddItem(L"CPU Advanced (RESPA)", nullptr);
+		pComboBox->AddItem(L"CPU Private Accumulation", nullptr);
+	}
+
+	// Instruction sets the hardware does not support are still listed, the engines fall back to the
+	// best supported implementation below the selected one.
+	CDXUTComboBox* pSimdComboBox = nullptr;
+	g_HUD.AddComboBox(IDC_SIMDTYPECOMBO, -20, y += 34, 190, 26, L'I', false, &pSimdComboBox);
+
+	if(pSimdComboBox){
+		pSimdComboBox->AddItem(L"No SIMD", nullptr);
+		pSimdComboBox->AddItem(L"SSE", nullptr);
+		pSimdComboBox->AddItem(L"SSE4", nullptr);
+		pSimdComboBox->AddItem(L"AVX2 + FMA", nullptr);
+		pSimdComboBox->AddItem(L"AVX-512", nullptr);
+		g_eCpuSSE = GetSSEType();
+		pSimdComboBox->SetSelectedByIndex(g_eCpuSSE);
+	}
+
+	// Only some of the integrators that update the particles in place support the higher order
+	// schemes, see UsesIntegrator. The combo is disabled for the others.
+	CDXUTComboBox* pIntegratorComboBox = nullptr;
+	g_HUD.AddComboBox(IDC_INTEGRATORCOMBO, -20, y += 34, 190, 26, L'T', false, &pIntegratorComboBox);
+
+	if(pIntegratorComboBox){
+		pIntegratorComboBox->AddItem(L"Semi-implicit Euler", nullptr);
+		pIntegratorComboBox->AddItem(L"Leapfrog (KDK)", nullptr);
+		pIntegratorComboBox->AddItem(L"Velocity Verlet", nullptr);
+		pIntegratorComboBox->SetSelectedByIndex(g_eIntegrator);
 	}
+	g_HUD.AddCheckBox(IDC_REORDERCHECK, L"Morton reorder", -20, y += 34, 190, 22, g_reorderParticles);
+	g_HUD.AddCheckBox(IDC_TIMESTEPCHECK, L"Adaptive time step", -20, y += 26, 190, 22, g_adaptiveTimeStep);
+	g_HUD.AddCheckBox(IDC_TRACERCHECK, L"Massless tracers", -20, y += 26, 190, 22, g_tracers);
+	g_HUD.AddCheckBox(IDC_MASSCHECK, L"Mixed masses", -20, y += 26, 190, 22, g_mixedMasses);
 
 	g_HUD.GetSlider(IDC_NBODIES_SLIDER)->SetValue((g_numParticles / g_particleNumStepSize));
 	g_HUD.GetComboBox(IDC_COMPUTETYPECOMBO)->SetSelectedByData((void*)g_eComputeType);
 	pComboBox->SetSelectedByIndex(g_eComputeType);
-	g_particleColors.resize(3);
+	g_HUD.GetComboBox(IDC_INTEGRATORCOMBO)->SetEnabled(UsesIntegrator(g_eComputeType));
+	g_particleColors.resize(13);
 	g_particleColors[kCpuSingle] = D3DXCOLOR(1.0f, 0.05f, 0.05f, 1.0f);
 	g_particleColors[kCpuMulti] = D3DXCOLOR(0.8f, 0.0f, 0.0f, 1.0f);
 	g_particleColors[kCpuAdvanced] = D3DXCOLOR(0.8f, 0.0f, 0.0f, 1.0f);
+	g_particleColors[kCpuBarnesHut] = D3DXCOLOR(0.8f, 0.4f, 0.0f, 1.0f);
+	g_particleColors[kCpuFmm] = D3DXCOLOR(0.8f, 0.6f, 0.0f, 1.0f);
+	g_particleColors[kCpuParticleMesh] = D3DXCOLOR(0.2f, 0.4f, 0.8f, 1.0f);
+	g_particleColors[kCpuTreePm] = D3DXCOLOR(0.2f, 0.6f, 0.8f, 1.0f);
+	g_particleColors[kCpuCellList] = D3DXCOLOR(0.2f, 0.8f, 0.4f, 1.0f);
+	g_particleColors[kCpuAdvancedCutoff] = D3DXCOLOR(0.2f, 0.8f, 0.2f, 1.0f);
+	g_particleColors[kCpuHermite] = D3DXCOLOR(0.6f, 0.2f, 0.8f, 1.0f);
+	g_particleColors[kCpuHermiteBlock] = D3DXCOLOR(0.8f, 0.2f, 0.8f, 1.0f);
+	g_particleColors[kCpuAdvancedRespa] = D3DXCOLOR(0.8f, 0.2f, 0.2f, 1.0f);
+	g_particleColors[kCpuPrivate] = D3DXCOLOR(0.8f, 0.0f, 0.4f, 1.0f);
 	g_particleColor = g_particleColors[g_eComputeType];
 
 	g_sampleUI.SetCallback(OnGUIEvent);
@@ -267,24 +372,75 @@ HRESULT CreateParticleBuffer(ID3D11Device* pd3dDevice){
 	return hr;
 }
 
+//--------------------------------------------------------------------------------------
+//  Clear the accelerations in both stores. The leapfrog and velocity Verlet integrators keep
+//  each step's accelerations for the next step, so they must not be carried over to another
+//  integrator.
+void ResetAccelerations(){
+	ParticleStoreSoA* const stores[] = { g_pParticlesOld, g_pParticlesNew };
+	for(ParticleStoreSoA* pStore : stores){
+		std::fill(pStore->ax, pStore->ax + g_maxParticles, 0.0f);
+		std::fill(pStore->ay, pStore->ay + g_maxParticles, 0.0f);
+		std::fill(pStore->az, pStore->az + g_maxParticles, 0.0f);
+	}
+}
+
+//--------------------------------------------------------------------------------------
+//  The stores hold g_maxParticles particles but the engines' static loops only split those in
+//  use, so move these to the NUMA nodes of the threads that integrate them whenever their
+//  number changes.
+void PlaceParticles(){
+	g_pParticlesOld->Place(g_numParticles);
+	g_pParticlesNew->Place(g_numParticles);
+}
+
 //--------------------------------------------------------------------------------------
 //  Load particles. Two clusters set to collide.
 //--------------------------------------------------------------------------------------
 
 void LoadParticles(){
+	// The clusters take turns a group at a time, so any number of particles holds both.
 	const float centerSpread = g_Spread * 0.50f;
-	for(size_t i = 0; i < g_maxParticles; i += g_particleNumStepSize){
-		LoadClusterParticles(&g_pParticlesOld[i],
+	for(int i = 0; i < g_maxParticles; i += g_particleLoadGroupSize){
+		LoadClusterParticles(g_pParticlesOld, i,
 							 float_3(centerSpread, 0.0f, 0.0f),
 							 float_3(0, 0, -20),
 							 g_Spread,
-							 g_particleNumStepSize / 2);
-		LoadClusterParticles(&g_pParticlesOld[i + g_particleNumStepSize / 2],
+							 g_particleLoadGroupSize / 2);
+		LoadClusterParticles(g_pParticlesOld, i + g_particleLoadGroupSize / 2,
 							 float_3(-centerSpread, 0.0f, 0.0f),
 							 float_3(0, 0, 20),
 							 g_Spread,
-							 (g_particleNumStepSize + 1) / 2);
+							 (g_particleLoadGroupSize + 1) / 2);
 	}
+	// The reorders swap the stores' buffers, so both hold every particle and the particles beyond
+	// the current count are the same whichever store holds the particles.
+	const float* const loaded[] = { g_pParticlesOld->x, g_pParticlesOld->y, g_pParticlesOld->z, g_pParticlesOld->vx, g_pParticlesOld->vy, g_pParticlesOld->vz };
+	float* const copies[] = { g_pParticlesNew->x, g_pParticlesNew->y, g_pParticlesNew->z, g_pParticlesNew->vx, g_pParticlesNew->vy, g_pParticlesNew->vz };
+	for(int s = 0; s < 6; ++s)
+		std::copy(loaded[s], loaded[s] + g_maxParticles, copies[s]);
+	// Masses never change so both stores are initialized here rather than being copied each step.
+	std::default_random_engine engine;
+	std::uniform_real_distribution<float> randMass(1.0f - g_massSpread, 1.0f + g_massSpread);
+	for(int i = 0; i < g_maxParticles; ++i){
+		const bool tracer = g_tracers && ((i % g_tracerSourceInterval) != 0);
+		const float mass = g_mixedMasses ? g_particleMass * randMass(engine) : g_particleMass;
+		g_pParticlesOld->mass[i] = g_pParticlesNew->mass[i] = tracer ? 0.0f : mass;
+	}
+	ResetAccelerations();
+	g_reorder.Reset();
+	// The engines expect the tracers behind the sources.
+	g_reorder.Reorder(g_pParticlesOld, g_pParticlesNew, g_numParticles);
+	PlaceParticles();
+	if(g_pNBody != nullptr)
+		g_pNBody->ParticlesChanged(true);
+}
+
+//--------------------------------------------------------------------------------------
+//  The mass given to the direct engines. With mixed masses their kernels read each source's
+//  mass from the mass stream, the tree and mesh engines always do.
+float SourceMass(){
+	return g_mixedMasses ? kPerParticleMass : g_particleMass;
 }
 
 //--------------------------------------------------------------------------------------
@@ -295,30 +451,118 @@ std::shared_ptr<INBodyCpu> NBodyFactory(ComputeType type){
 	switch(type){
 	case kCpuSingle:
 		return std::make_shared<NBodySimpleSingleCore>(g_softeningSquared, g_dampingFactor,
-													   g_deltaTime, g_particleMass);
+													   g_deltaTime, SourceMass(), g_eCpuSSE);
 		break;
 	case kCpuMulti:
 		return std::make_shared<NBodySimpleMultiCore>(g_softeningSquared, g_dampingFactor,
-													  g_deltaTime, g_particleMass);
+													  g_deltaTime, SourceMass(), g_eCpuSSE);
 		break;
 	case kCpuAdvanced:
+	case kCpuAdvancedCutoff:
+	case kCpuAdvancedRespa:
+	{
+		// Both the i and the j tile of each interaction cell should fit into the L1 cache, and both
+		// blocks into this thread's share of the L2 cache.
+		const CpuTopology& topology = GetCpuTopology();
+		int tileSize = topology.levelOneCacheSize / (2 * ParticleStoreSoA::kInteractionBytes);
+		int blockSize = (topology.levelTwoCacheSize / topology.levelTwoSharedBy) / (2 * ParticleStoreSoA::kInteractionBytes);
+		const float timeStepAccuracy = g_adaptiveTimeStep ? g_timeStepAccuracy : 0.0f;
+		std::shared_ptr<NBodyAdvanced> pAdvanced;
+		// The far field cycles use a fixed time step.
+		if(type == kCpuAdvancedRespa)
+			pAdvanced = std::make_shared<NBodyAdvanced>(g_softeningSquared, g_dampingFactor, g_deltaTime, SourceMass(),
+													   tileSize, g_eCpuSSE, g_cutoffRadius, g_neighborSkin, g_eIntegrator,
+													   0.0f, 0.0f, g_farFieldInterval);
+		else if(type == kCpuAdvancedCutoff)
+			pAdvanced = std::make_shared<NBodyAdvanced>(g_softeningSquared, g_dampingFactor, g_deltaTime, SourceMass(),
+													   tileSize, g_eCpuSSE, g_cutoffRadius, g_neighborSkin, g_eIntegrator,
+													   timeStepAccuracy, g_timeStepLength);
+		else
+			pAdvanced = std::make_shared<NBodyAdvanced>(g_softeningSquared, g_dampingFactor, g_deltaTime, SourceMass(),
+													   tileSize, g_eCpuSSE, 0.0f, 0.0f, g_eIntegrator, timeStepAccuracy, g_timeStepLength);
+		pAdvanced->SetBlockSize(blockSize);
+		// The recursion's sequential cutoff can be tuned per machine without rebuilding.
+		const char* const parallelCutoff = getenv("NBODY_PARALLEL_CUTOFF");
+		if(parallelCutoff != nullptr)
+			pAdvanced->SetParallelCutoff(atoi(parallelCutoff));
+		return pAdvanced;
+	}
+	break;
+	case kCpuPrivate:
+	{
+		// Sized as for the advanced engine.
+		const CpuTopology& topology = GetCpuTopology();
+		int tileSize = topology.levelOneCacheSize / (2 * ParticleStoreSoA::kInteractionBytes);
+		int blockSize = (topology.levelTwoCacheSize / topology.levelTwoSharedBy) / (2 * ParticleStoreSoA::kInteractionBytes);
+		return std::make_shared<NBodyPrivateAccumulation>(g_softeningSquared, g_dampingFactor, g_deltaTime, SourceMass(),
+														  tileSize, blockSize, g_eCpuSSE, g_eIntegrator);
+	}
+	break;
+	case kCpuHermite:
+	case kCpuHermiteBlock:
 	{
-		int tileSize = GetLevelOneCacheSize() / sizeof(ParticleCpu);
-		return std::make_shared<NBodyAdvanced>(g_softeningSquared, g_dampingFactor,
-											   g_deltaTime, g_particleMass, tileSize);
+		int tileSize = GetCpuTopology().levelOneCacheSize / (2 * NBodyHermite::kInteractionBytes);
+		return std::make_shared<NBodyHermite>(g_softeningSquared, g_dampingFactor, g_deltaTime, SourceMass(),
+											  tileSize, g_eCpuSSE, (type == kCpuHermiteBlock) ? g_hermiteTimeStepLevels : 0);
 	}
 	break;
+	case kCpuBarnesHut:
+		return std::make_shared<NBodyBarnesHut>(g_softeningSquared, g_dampingFactor,
+												g_deltaTime, g_openingAngle);
+		break;
+	case kCpuFmm:
+		return std::make_shared<NBodyFmm>(g_softeningSquared, g_dampingFactor,
+										  g_deltaTime, g_fmmOrder, g_fmmOpeningAngle);
+		break;
+	case kCpuParticleMesh:
+		return std::make_shared<NBodyParticleMesh>(g_softeningSquared, g_dampingFactor,
+												   g_deltaTime, g_meshSize, g_meshAssignment, g_eIntegrator);
+		break;
+	case kCpuTreePm:
+		return std::make_shared<NBodyTreePm>(g_softeningSquared, g_dampingFactor, g_deltaTime,
+											 g_openingAngle, g_treePmMeshSize, g_treePmSplitScale, g_eIntegrator);
+		break;
+	case kCpuCellList:
+		return std::make_shared<NBodyCellList>(g_softeningSquared, g_dampingFactor, g_deltaTime,
+											   SourceMass(), g_cutoffRadius, g_eCpuSSE);
+		break;
 	default:
 		assert(false);
 		return nullptr;
 		break;
 	}
 }//--------------------------------------------------------------------------------------
+//  Integrators that update the particles in place leave their results in pParticlesIn, so the 
+//  buffers must not be swapped after each step.
+bool UpdatesInPlace(ComputeType type){
+	return (type == kCpuAdvanced) || (type == kCpuAdvancedCutoff) || (type == kCpuParticleMesh) || (type == kCpuTreePm) ||
+		(type == kCpuHermite) || (type == kCpuHermiteBlock) || (type == kCpuAdvancedRespa) || (type == kCpuPrivate);
+}//--------------------------------------------------------------------------------------
+//  Integrators that take the integrator combo's scheme. The others always use semi-implicit
+//  Euler, or Hermite's own predictor-corrector, so the combo is disabled for them.
+bool UsesIntegrator(ComputeType type){
+	return (type == kCpuAdvanced) || (type == kCpuAdvancedCutoff) || (type == kCpuParticleMesh) || (type == kCpuTreePm) ||
+		(type == kCpuAdvancedRespa) || (type == kCpuPrivate);
+}//--------------------------------------------------------------------------------------
+//  Gather the position and z velocity of each particle into the layout read by the vertex 
+//  shader. Only these four streams are touched, rather than uploading the whole particle state.
+//  Each particle is written to the vertex of its id so reordering does not change the vertices.
+void GatherRenderParticles(const ParticleStoreSoA* const pParticles, int numParticles){
+	float_4* const pRender = g_renderParticles.data();
+	const int* const ids = g_reorder.Ids();
+	const int chunkSize = 4096;
+	ParallelFor(0, numParticles, chunkSize, [=](int begin){
+		const int end = std::min(begin + chunkSize, numParticles);
+		for(int i = begin; i < end; ++i)
+			pRender[ids[i]] = float_4(pParticles->x[i], pParticles->y[i], pParticles->z[i], pParticles->vz[i]);
+	});
+}//--------------------------------------------------------------------------------------
 //  Create render buffer. 
 HRESULT CreateParticlePosVeloBuffers(ID3D11Device* const pd3dDevice){
 	HRESULT hr = S_OK;
 
 	LoadParticles();
+	GatherRenderParticles(g_pParticlesOld, g_maxParticles);
 
 	// Create C++ AMP arrays for the two particle arrays stored in CPU memory. These are only required for the
 	// CPU version because the C++ AMP version's DirectX rendering code reads the particle data directly from GPU memory. 
@@ -327,20 +571,19 @@ HRESULT CreateParticlePosVeloBuffers(ID3D11Device* const pd3dDevice){
 
 	D3D11_BUFFER_DESC vertexDesc;
 	vertexDesc.Usage = D3D11_USAGE_DEFAULT;
-	vertexDesc.ByteWidth = sizeof(ParticleCpu) * g_maxParticles;
+	vertexDesc.ByteWidth = sizeof(float_4) * g_maxParticles;
 	vertexDesc.BindFlags = D3D11_BIND_VERTEX_BUFFER | D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_UNORDERED_ACCESS;
 	vertexDesc.CPUAccessFlags = 0;
 	vertexDesc.MiscFlags = 0;
-	vertexDesc.StructureByteStride = sizeof(ParticleCpu);
+	vertexDesc.StructureByteStride = sizeof(float_4);
 	vertexDesc.MiscFlags = D3D11_RESOURCE_MISC_BUFFER_ALLOW_RAW_VIEWS;
 	D3D11_SUBRESOURCE_DATA vertexData;
 	vertexData.SysMemPitch = 0;
 	vertexData.SysMemSlicePitch = 0;
 	g_pParticlePosVeloAcc0 = nullptr;
 	g_pParticlePosVeloAcc1 = nullptr;
-	vertexData.pSysMem = g_particlesOld.data();
+	vertexData.pSysMem = g_renderParticles.data();
 	V_RETURN(pd3dDevice->CreateBuffer(&vertexDesc, &vertexData, &g_pParticlePosVeloAcc0));
-	vertexData.pSysMem = g_particlesNew.data();
 	V_RETURN(pd3dDevice->CreateBuffer(&vertexDesc, &vertexData, &g_pParticlePosVeloAcc1));
 
 	D3D11_SHADER_RESOURCE_VIEW_DESC resourceDesc;
@@ -348,7 +591,7 @@ HRESULT CreateParticlePosVeloBuffers(ID3D11Device* const pd3dDevice){
 	resourceDesc.Format = DXGI_FORMAT_R32_TYPELESS;
 	resourceDesc.ViewDimension = D3D11_SRV_DIMENSION_BUFFEREX;
 	resourceDesc.BufferEx.FirstElement = 0;
-	resourceDesc.BufferEx.NumElements = (g_maxParticles * sizeof(ParticleCpu)) / sizeof(float);
+	resourceDesc.BufferEx.NumElements = (g_maxParticles * sizeof(float_4)) / sizeof(float);
 	resourceDesc.BufferEx.Flags = D3D11_BUFFEREX_SRV_FLAG_RAW;
 	g_pParticlePosVeloAccRV0 = nullptr;
 	g_pParticlePosVeloAccRV1 = nullptr;
@@ -360,7 +603,7 @@ HRESULT CreateParticlePosVeloBuffers(ID3D11Device* const pd3dDevice){
 	viewDesc.Format = DXGI_FORMAT_R32_TYPELESS;
 	viewDesc.ViewDimension = D3D11_UAV_DIMENSION_BUFFER;
 	viewDesc.Buffer.FirstElement = 0;
-	viewDesc.Buffer.NumElements = (g_maxParticles * sizeof(ParticleCpu)) / sizeof(float);
+	viewDesc.Buffer.NumElements = (g_maxParticles * sizeof(float_4)) / sizeof(float);
 	viewDesc.Buffer.Flags = D3D11_BUFFER_UAV_FLAG_RAW;
 	g_pParticlePosVeloAccUAV0 = nullptr;
 	g_pParticlePosVeloAccUAV1 = nullptr;
@@ -394,10 +637,14 @@ bool CALLBACK ModifyDeviceSettings(DXUTDeviceSettings* pDeviceSettings, void* pU
 // intended to contain actual rendering calls, which should instead be placed in the 
 // OnFrameRender callback.  
 void CALLBACK OnFrameMove(double fTime, float fElapsedTime, void* pUserContext){
+	// Keep particles that are close in space close in memory.
+	if(g_reorderParticles && g_reorder.Update(g_pParticlesOld, g_pParticlesNew, g_numParticles))
+		g_pNBody->ParticlesReordered(g_reorder.Order(), g_numParticles);
+
 	g_pNBody->Integrate(g_pParticlesOld, g_pParticlesNew, g_numParticles);
 
-	// Advanced integrator updates particles in place, so no need to swap the buffers.
-	if(g_eComputeType != kCpuAdvanced)
+	// Integrators that update particles in place need no swap of the buffers.
+	if(!UpdatesInPlace(g_eComputeType))
 		std::swap(g_pParticlesOld, g_pParticlesNew);
 
 	// Update the camera's position based on user input 
@@ -449,6 +696,8 @@ void CALLBACK OnGUIEvent(UINT nEvent, int nControlID, CDXUTControl* pControl, vo
 
 		g_particleColor = g_particleColors[g_eComputeType];
 		g_pNBody = NBodyFactory(g_eComputeType);
+		g_HUD.GetComboBox(IDC_INTEGRATORCOMBO)->SetEnabled(UsesIntegrator(g_eComputeType));
+		ResetAccelerations();
 
 		WCHAR szTemp[256];
 		swprintf_s(szTemp, L"Bodies: %d", g_numParticles);
@@ -456,10 +705,53 @@ void CALLBACK OnGUIEvent(UINT nEvent, int nControlID, CDXUTControl* pControl, vo
 		g_FpsStatistics.clear();
 	}
 	break;
+	case IDC_SIMDTYPECOMBO:
+	{
+		CDXUTComboBox* pComboBox = static_cast<CDXUTComboBox*>(pControl);
+		g_eCpuSSE = static_cast<CpuSSE>(pComboBox->GetSelectedIndex());
+		g_pNBody = NBodyFactory(g_eComputeType);
+		g_FpsStatistics.clear();
+	}
+	break;
+	case IDC_INTEGRATORCOMBO:
+	{
+		CDXUTComboBox* pComboBox = static_cast<CDXUTComboBox*>(pControl);
+		g_eIntegrator = static_cast<IntegratorType>(pComboBox->GetSelectedIndex());
+		g_pNBody = NBodyFactory(g_eComputeType);
+		ResetAccelerations();
+		g_FpsStatistics.clear();
+	}
+	break;
+	case IDC_REORDERCHECK:
+		g_reorderParticles = static_cast<CDXUTCheckBox*>(pControl)->GetChecked();
+		break;
+	case IDC_TIMESTEPCHECK:
+		g_adaptiveTimeStep = static_cast<CDXUTCheckBox*>(pControl)->GetChecked();
+		g_pNBody = NBodyFactory(g_eComputeType);
+		ResetAccelerations();
+		g_FpsStatistics.clear();
+		break;
+	case IDC_TRACERCHECK:
+		g_tracers = static_cast<CDXUTCheckBox*>(pControl)->GetChecked();
+		LoadParticles();
+		break;
+	case IDC_MASSCHECK:
+		g_mixedMasses = static_cast<CDXUTCheckBox*>(pControl)->GetChecked();
+		g_pNBody = NBodyFactory(g_eComputeType);
+		LoadParticles();
+		g_FpsStatistics.clear();
+		break;
 	case IDC_NBODIES_SLIDER:
 	{
 		CDXUTSlider* pSlider = static_cast<CDXUTSlider*>(pControl);
+
+		// Particles are added and removed in the order they were loaded. Those that are added
+		// have no accelerations from the previous step.
+		g_reorder.Restore(g_pParticlesOld, g_pParticlesNew, g_numParticles);
+		g_pNBody->ParticlesChanged(true);
 		g_numParticles = pSlider->GetValue() * g_particleNumStepSize;
+		g_reorder.Reorder(g_pParticlesOld, g_pParticlesNew, g_numParticles);
+		PlaceParticles();
 
 		WCHAR szTemp[256];
 		swprintf_s(szTemp, L"Bodies: %d", g_numParticles);
@@ -586,7 +878,7 @@ HRESULT CALLBACK OnD3D11ResizedSwapChain(ID3D11Device* pd3dDevice, IDXGISwapChai
 	g_camera.SetButtonMasks(0, MOUSE_WHEEL, MOUSE_LEFT_BUTTON | MOUSE_MIDDLE_BUTTON | MOUSE_RIGHT_BUTTON);
 
 	g_HUD.SetLocation(pBackBufferSurfaceDesc->Width - 170, 0);
-	g_HUD.SetSize(170, 170);
+	g_HUD.SetSize(170, 204);
 	g_sampleUI.SetLocation(pBackBufferSurfaceDesc->Width - 170, pBackBufferSurfaceDesc->Height - 300);
 	g_sampleUI.SetSize(170, 300);
 	return hr;
@@ -615,16 +907,41 @@ void RenderText(){
 	const float gflops = (g_numParticles / 1000.0f) * (g_numParticles / 1000.0f) * fps * 20 / 1000.0f;
 	g_pTxtHelper->DrawFormattedTextLine(L"GFlops: %.2f ", gflops);
 
+	if((g_eComputeType == kCpuAdvancedCutoff) || (g_eComputeType == kCpuAdvancedRespa)){
+		const NeighborList* pNeighbors = std::static_pointer_cast<NBodyAdvanced>(g_pNBody)->Neighbors();
+		if(pNeighbors->Builds() > 0)
+			g_pTxtHelper->DrawFormattedTextLine(L"Neighbor lists rebuilt every %.1f steps", float(pNeighbors->Steps()) / pNeighbors->Builds());
+	}
+	if(g_adaptiveTimeStep && ((g_eComputeType == kCpuAdvanced) || (g_eComputeType == kCpuAdvancedCutoff))){
+		const std::shared_ptr<NBodyAdvanced> pAdvanced = std::static_pointer_cast<NBodyAdvanced>(g_pNBody);
+		g_pTxtHelper->DrawFormattedTextLine(L"Time step: %.4f (max %.2f), reduction %.3f ms", pAdvanced->LastDeltaTime(), g_deltaTime,
+											pAdvanced->ReductionTime());
+	}
+	if(g_eComputeType == kCpuHermiteBlock){
+		const float forces = std::static_pointer_cast<NBodyHermite>(g_pNBody)->ForceCalculationsPerStep();
+		g_pTxtHelper->DrawFormattedTextLine(L"Forces per body per step: %.1f of %d", forces, 1 << g_hermiteTimeStepLevels);
+	}
+#if defined(NBODY_PARALLEL_THREADS)
+	// Work stealing counters since the last frame.
+	static ParallelStatistics lastStatistics = {};
+	const ParallelStatistics statistics = GetParallelStatistics();
+	g_pTxtHelper->DrawFormattedTextLine(L"Tasks: %llu, steals %llu, failed steals %llu, sleeps %llu", statistics.tasks - lastStatistics.tasks,
+										statistics.steals - lastStatistics.steals, statistics.failedSteals - lastStatistics.failedSteals,
+										statistics.sleeps - lastStatistics.sleeps);
+	lastStatistics = statistics;
+#endif
+
 	g_pTxtHelper->End();
 } // ////////////////////////////////////////////////////////////////////////////////////////////////////
 bool RenderParticles(ID3D11DeviceContext* pd3dImmediateContext, D3DXMATRIX& view, D3DXMATRIX& projection){
 	// copy in particle position and velocity values
-	UINT size = static_cast<UINT>(g_numParticles * sizeof(ParticleCpu));
+	GatherRenderParticles(g_pParticlesOld, g_numParticles);
+	UINT size = static_cast<UINT>(g_numParticles * sizeof(float_4));
 	D3D11_BOX box;
 	box.left = box.top = box.front = 0;
 	box.right = size;
 	box.bottom = box.back = 1;
-	pd3dImmediateContext->UpdateSubresource(g_pParticlePosVeloAcc0, 0, &box, g_pParticlesOld, size, 0);
+	pd3dImmediateContext->UpdateSubresource(g_pParticlePosVeloAcc0, 0, &box, g_renderParticles.data(), size, 0);
 
 	CComPtr<ID3D11BlendState> pBlendState0;
 	CComPtr<ID3D11DepthStencilState> pDepthStencilState0;
@@ -0,0 +1,419 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <math.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "Common.h"
+#include "NBodyHermiteCpu.h"
+#include "ParallelCpu.h"
+
+using namespace concurrency::graphics;
+
+//  Number of particles predicted or corrected by each task.
+
+const int kHermiteChunkSize = 1024;
+
+//  Number of active particles gathered by each task. Each one is a pass over all the particles.
+
+const int kHermiteActiveChunkSize = 16;
+
+//  Accuracy parameters of the time step criterion, for the first step of each particle and for
+//  the steps after it.
+
+const float kInitialTimeStepAccuracy = 0.01f;
+const float kTimeStepAccuracy = 0.02f;
+
+NBodyHermite::NBodyHermite(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int tileSize, CpuSSE maxSSE,
+    int timeStepLevels) :
+    INBodyCpu(),
+    m_engine(new NBodyAdvancedInteractionEngine(softeningSquared, particleMass, maxSSE)),
+    m_deltaTime(deltaTime),
+    m_dampingFactor(dampingFactor),
+    m_tileSize(std::max(tileSize, 1)),
+    m_timeStepLevels(timeStepLevels),
+    m_primed(false),
+    m_particleSteps(0),
+    m_activeParticles(0)
+{
+    assert((timeStepLevels >= 0) && (timeStepLevels < 30));
+}
+
+//--------------------------------------------------------------------------------------
+//  Integrate all the particles.
+//--------------------------------------------------------------------------------------
+
+#pragma warning(push)
+#pragma warning(disable:4100)   // Ignore unused parameter warning.
+
+void NBodyHermite::Integrate(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const unused, int numParticles) const
+{
+    if ((m_pPredicted == nullptr) || (m_pPredicted->Capacity() < numParticles))
+    {
+        m_pPredicted.reset(new ParticleStoreSoA(numParticles));
+        m_primed = false;
+    }
+    if (m_jerkX.size() < static_cast<size_t>(numParticles))
+    {
+        std::vector<float>* const streams[] = { &m_jerkX, &m_jerkY, &m_jerkZ, &m_newJerkX, &m_newJerkY, &m_newJerkZ };
+        for (int s = 0; s < 6; ++s)
+            streams[s]->resize(numParticles);
+        m_level.resize(numParticles);
+        m_time.resize(numParticles);
+        m_primed = false;
+    }
+
+    const int numSources = pParticles->NumSources(numParticles);
+    if (!m_primed)
+        Prime(pParticles, numParticles, numSources);
+
+    if (m_timeStepLevels > 0)
+    {
+        BlockSteps(pParticles, numParticles, numSources);
+    }
+    else
+    {
+        Predict(pParticles, numParticles, m_deltaTime);
+        ComputeForces(numParticles, numSources);
+        Correct(pParticles, numParticles);
+        m_activeParticles += numParticles;
+    }
+    m_particleSteps += numParticles;
+}
+
+#pragma warning(pop)
+
+//  Calculate the accelerations and jerks at the current state, by predicting with a zero step,
+//  and choose each particle's first time step from them.
+
+void NBodyHermite::Prime(ParticleStoreSoA* const pParticles, int numParticles, int numSources) const
+{
+    Predict(pParticles, numParticles, 0.0f);
+    ComputeForces(numParticles, numSources);
+    const ParticleStoreSoA* const pPredicted = m_pPredicted.get();
+    std::copy(pPredicted->ax, pPredicted->ax + numParticles, pParticles->ax);
+    std::copy(pPredicted->ay, pPredicted->ay + numParticles, pParticles->ay);
+    std::copy(pPredicted->az, pPredicted->az + numParticles, pParticles->az);
+    std::copy(m_newJerkX.begin(), m_newJerkX.begin() + numParticles, m_jerkX.begin());
+    std::copy(m_newJerkY.begin(), m_newJerkY.begin() + numParticles, m_jerkY.begin());
+    std::copy(m_newJerkZ.begin(), m_newJerkZ.begin() + numParticles, m_jerkZ.begin());
+
+    for (int i = 0; i < numParticles; ++i)
+    {
+        const float acc = sqrt(SqrLength(pParticles->Acceleration(i)));
+        const float jerk = sqrt(SqrLength(float_3(m_jerkX[i], m_jerkY[i], m_jerkZ[i])));
+        m_level[i] = LevelForStep((jerk > 0.0f) ? kInitialTimeStepAccuracy * acc / jerk : m_deltaTime);
+        m_time[i] = 0;
+    }
+    // The priming pass calculates the forces on every particle too.
+    m_particleSteps = 0;
+    m_activeParticles = numParticles;
+    m_primed = true;
+}
+
+//  Permute the jerks and levels into the new order of the particles, using the new jerks and the
+//  times as scratch space. Every particle's time is zero between calls.
+
+void NBodyHermite::ParticlesReordered(const int* const index, int numParticles)
+{
+    if (!m_primed || (m_jerkX.size() < static_cast<size_t>(numParticles)))
+    {
+        m_primed = false;
+        return;
+    }
+
+    std::vector<float>* const from[] = { &m_jerkX, &m_jerkY, &m_jerkZ };
+    std::vector<float>* const to[] = { &m_newJerkX, &m_newJerkY, &m_newJerkZ };
+    const int* const level = m_level.data();
+    int* const newLevel = m_time.data();
+    ParallelFor(0, numParticles, kHermiteChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kHermiteChunkSize, numParticles);
+        for (int s = 0; s < 3; ++s)
+        {
+            const float* const pFrom = from[s]->data();
+            float* const pTo = to[s]->data();
+            for (int i = begin; i < end; ++i)
+                pTo[i] = pFrom[index[i]];
+        }
+        for (int i = begin; i < end; ++i)
+            newLevel[i] = level[index[i]];
+    });
+
+    m_jerkX.swap(m_newJerkX);
+    m_jerkY.swap(m_newJerkY);
+    m_jerkZ.swap(m_newJerkZ);
+    m_level.swap(m_time);
+    std::fill(m_time.begin(), m_time.begin() + numParticles, 0);
+}
+
+//  Predict the positions and velocities at the end of the step into the private store and
+//  clear its accelerations and the new jerks ready for the force calculation.
+
+void NBodyHermite::Predict(const ParticleStoreSoA* const pParticles, int numParticles, float deltaTime) const
+{
+    ParticleStoreSoA* const pPredicted = m_pPredicted.get();
+    const float* const jx = m_jerkX.data(); const float* const jy = m_jerkY.data(); const float* const jz = m_jerkZ.data();
+    float* const kx = m_newJerkX.data(); float* const ky = m_newJerkY.data(); float* const kz = m_newJerkZ.data();
+    const float dt = deltaTime;
+    const float dt2 = dt * dt / 2.0f;
+    const float dt3 = dt * dt * dt / 6.0f;
+    const bool primed = m_primed;
+
+    ParallelFor(0, numParticles, kHermiteChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kHermiteChunkSize, numParticles);
+        for (int i = begin; i < end; ++i)
+        {
+            // Before the first step there are no accelerations or jerks and the step is zero.
+            const float_3 acc = primed ? pParticles->Acceleration(i) : float_3(0.0f);
+            const float_3 jerk = primed ? float_3(jx[i], jy[i], jz[i]) : float_3(0.0f);
+            const float_3 vel = pParticles->Velocity(i);
+            pPredicted->SetPosition(i, pParticles->Position(i) + vel * dt + acc * dt2 + jerk * dt3);
+            pPredicted->SetVelocity(i, vel + acc * dt + jerk * dt2);
+            pPredicted->SetAcceleration(i, float_3(0.0f));
+            pPredicted->mass[i] = pParticles->mass[i];
+            kx[i] = 0.0f;
+            ky[i] = 0.0f;
+            kz[i] = 0.0f;
+        }
+    });
+}
+
+//  Apply the Hermite corrector and keep the new accelerations and jerks for the next step.
+
+void NBodyHermite::Correct(ParticleStoreSoA* const pParticles, int numParticles) const
+{
+    const ParticleStoreSoA* const pPredicted = m_pPredicted.get();
+
+    ParallelFor(0, numParticles, kHermiteChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kHermiteChunkSize, numParticles);
+        for (int i = begin; i < end; ++i)
+        {
+            const float_3 jerk1(m_newJerkX[i], m_newJerkY[i], m_newJerkZ[i]);
+            CorrectParticle(pParticles, i, pPredicted->Acceleration(i), jerk1, m_deltaTime, m_dampingFactor);
+        }
+    });
+}
+
+void NBodyHermite::CorrectParticle(ParticleStoreSoA* const pParticles, int i, const float_3& acc1, const float_3& jerk1, float deltaTime, float dampingFactor) const
+{
+    const float dt = deltaTime;
+    const float dt2 = dt * dt / 12.0f;
+    const float_3 acc0 = pParticles->Acceleration(i);
+    const float_3 jerk0(m_jerkX[i], m_jerkY[i], m_jerkZ[i]);
+    const float_3 vel0 = pParticles->Velocity(i);
+
+    const float_3 vel1 = vel0 + (acc0 + acc1) * (dt / 2.0f) + (jerk0 - jerk1) * dt2;
+    pParticles->SetPosition(i, pParticles->Position(i) + (vel0 + vel1) * (dt / 2.0f) + (acc0 - acc1) * dt2);
+    pParticles->SetVelocity(i, vel1 * dampingFactor);
+    pParticles->SetAcceleration(i, acc1);
+    m_jerkX[i] = jerk1.x;
+    m_jerkY[i] = jerk1.y;
+    m_jerkZ[i] = jerk1.z;
+}
+
+//--------------------------------------------------------------------------------------
+//  Block time steps.
+//--------------------------------------------------------------------------------------
+//
+//  Times are counted in the shortest step, deltaTime / 2^levels, from the start of the call. A
+//  particle on level l takes steps of 2^(levels - l) of these and all the particles finish
+//  together at the end of the call, where the damping is applied as it is each shared step.
+//  Active particles gather from every source but themselves.
+
+void NBodyHermite::BlockSteps(ParticleStoreSoA* const pParticles, int numParticles, int numSources) const
+{
+    const int endTime = 1 << m_timeStepLevels;
+    ParticleStoreSoA* const pPredicted = m_pPredicted.get();
+
+    int time = 0;
+    while (time < endTime)
+    {
+        // The next sub-step is the earliest end of any particle's step.
+        int next = endTime;
+        for (int i = 0; i < numParticles; ++i)
+            next = std::min(next, m_time[i] + (endTime >> m_level[i]));
+        m_active.clear();
+        for (int i = 0; i < numParticles; ++i)
+        {
+            if (m_time[i] + (endTime >> m_level[i]) == next)
+                m_active.push_back(i);
+        }
+        time = next;
+
+        PredictToTime(pParticles, numParticles, time);
+
+        const int* const active = m_active.data();
+        const int numActive = static_cast<int>(m_active.size());
+        const float damping = (time == endTime) ? m_dampingFactor : 1.0f;
+        ParallelFor(0, numActive, kHermiteActiveChunkSize, [=](int begin)
+        {
+            const int end = std::min(begin + kHermiteActiveChunkSize, numActive);
+            for (int a = begin; a < end; ++a)
+            {
+                const int i = active[a];
+                float_3 acc1(0.0f);
+                float_3 jerk1(0.0f);
+                m_engine->InvokeHermiteGather(pPredicted, i, 0, std::min(i, numSources), acc1, jerk1);
+                m_engine->InvokeHermiteGather(pPredicted, i, std::min(i + 1, numSources), numSources, acc1, jerk1);
+
+                const float_3 acc0 = pParticles->Acceleration(i);
+                const float_3 jerk0(m_jerkX[i], m_jerkY[i], m_jerkZ[i]);
+                CorrectParticle(pParticles, i, acc1, jerk1, m_deltaTime / (1 << m_level[i]), damping);
+                m_level[i] = NextLevel(i, acc0, acc1, jerk0, jerk1, time);
+                m_time[i] = time;
+            }
+        });
+        m_activeParticles += numActive;
+    }
+
+    std::fill(m_time.begin(), m_time.begin() + numParticles, 0);
+}
+
+//  Predict every particle from the end of its last step to the given time. The gather kernels
+//  also read the masses, which are copied again as a reorder since priming may have moved them.
+
+void NBodyHermite::PredictToTime(const ParticleStoreSoA* const pParticles, int numParticles, int time) const
+{
+    ParticleStoreSoA* const pPredicted = m_pPredicted.get();
+    const float subStep = m_deltaTime / (1 << m_timeStepLevels);
+
+    ParallelFor(0, numParticles, kHermiteChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kHermiteChunkSize, numParticles);
+        for (int i = begin; i < end; ++i)
+        {
+            const float dt = (time - m_time[i]) * subStep;
+            const float dt2 = dt * dt / 2.0f;
+            const float dt3 = dt * dt2 / 3.0f;
+            const float_3 acc = pParticles->Acceleration(i);
+            const float_3 jerk(m_jerkX[i], m_jerkY[i], m_jerkZ[i]);
+            const float_3 vel = pParticles->Velocity(i);
+            pPredicted->SetPosition(i, pParticles->Position(i) + vel * dt + acc * dt2 + jerk * dt3);
+            pPredicted->SetVelocity(i, vel + acc * dt + jerk * dt2);
+            pPredicted->mass[i] = pParticles->mass[i];
+        }
+    });
+}
+
+//  Choose the level of particle i's next step with the Aarseth criterion, using the second and
+//  third derivatives of its acceleration given by the Hermite interpolant over the last step.
+//  A particle can move to any shorter step but only to the next longer one, and only when the
+//  current time is a multiple of it.
+
+int NBodyHermite::NextLevel(int i, const float_3& acc0, const float_3& acc1, const float_3& jerk0, const float_3& jerk1, int time) const
+{
+    const int level = m_level[i];
+    const float dt = m_deltaTime / (1 << level);
+    const float invDt = 1.0f / dt;
+    const float_3 snap0 = ((acc0 - acc1) * -6.0f - (jerk0 * 4.0f + jerk1 * 2.0f) * dt) * (invDt * invDt);
+    const float_3 crackle = ((acc0 - acc1) * 12.0f + (jerk0 + jerk1) * (6.0f * dt)) * (invDt * invDt * invDt);
+    const float_3 snap1 = snap0 + crackle * dt;
+
+    const float a = sqrt(SqrLength(acc1));
+    const float j = sqrt(SqrLength(jerk1));
+    const float s = sqrt(SqrLength(snap1));
+    const float c = sqrt(SqrLength(crackle));
+    const float denominator = j * c + s * s;
+    const int next = LevelForStep((denominator > 0.0f) ? sqrt(kTimeStepAccuracy * (a * s + j * j) / denominator) : m_deltaTime);
+
+    if (next >= level)
+        return next;
+    const int endTime = 1 << m_timeStepLevels;
+    return ((time % (endTime >> (level - 1))) == 0) ? level - 1 : level;
+}
+
+//  The lowest level whose step is no longer than the given one.
+
+int NBodyHermite::LevelForStep(float step) const
+{
+    int level = 0;
+    while ((level < m_timeStepLevels) && (m_deltaTime / (1 << level) > step))
+        ++level;
+    return level;
+}
+
+//--------------------------------------------------------------------------------------
+//  Calculate the accelerations and jerks at the predicted state.
+//--------------------------------------------------------------------------------------
+//
+//  The same recursive decomposition as NBodyAdvanced, see InteractionList there, for the
+//  sources. The tracers then gather from all the sources in parallel.
+
+void NBodyHermite::ComputeForces(int numParticles, int numSources) const
+{
+    const JerkStreams jerk = { m_newJerkX.data(), m_newJerkY.data(), m_newJerkZ.data() };
+    InteractionList(jerk, 0, numSources);
+
+    ParticleStoreSoA* const pPredicted = m_pPredicted.get();
+    ParallelFor(numSources, numParticles, kHermiteActiveChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kHermiteActiveChunkSize, numParticles);
+        for (int i = begin; i < end; ++i)
+        {
+            float_3 acc(0.0f);
+            float_3 jrk(0.0f);
+            m_engine->InvokeHermiteGather(pPredicted, i, 0, numSources, acc, jrk);
+            pPredicted->SetAcceleration(i, acc);
+            jerk.x[i] = jrk.x;
+            jerk.y[i] = jrk.y;
+            jerk.z[i] = jrk.z;
+        }
+    });
+}
+
+void NBodyHermite::InteractionList(const JerkStreams& jerk, const size_t begin, const size_t end) const
+{
+    const size_t width = end - begin;
+
+    if (width > m_tileSize)
+    {
+        const size_t middle = begin + (width / 2);
+        ParallelInvoke([=, &jerk] { InteractionList(jerk, begin, middle); },
+            [=, &jerk] { InteractionList(jerk, middle, end); });
+        InteractionCell(jerk, begin, middle, middle, end);
+    }
+    else if (width > 1)
+    {
+        const size_t middle = begin + (width / 2);
+        InteractionList(jerk, begin, middle);
+        InteractionList(jerk, middle, end);
+        InteractionCell(jerk, begin, middle, middle, end);
+    }
+}
+
+void NBodyHermite::InteractionCell(const JerkStreams& jerk, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const
+{
+    const size_t iWidth = iEnd - iBegin;
+    const size_t jWidth = jEnd - jBegin;
+
+    if (iWidth > m_tileSize && jWidth > m_tileSize)
+    {
+        const size_t iMiddle = iBegin + (iWidth / 2);
+        const size_t jMiddle = jBegin + (jWidth / 2);
+        ParallelInvoke([=, &jerk] { InteractionCell(jerk, iBegin, iMiddle, jBegin, jMiddle); },
+            [=, &jerk] { InteractionCell(jerk, iMiddle, iEnd, jMiddle, jEnd); });
+        ParallelInvoke([=, &jerk] { InteractionCell(jerk, iBegin, iMiddle, jMiddle, jEnd); },
+            [=, &jerk] { InteractionCell(jerk, iMiddle, iEnd, jBegin, jMiddle); });
+    }
+    else
+    {
+        m_engine->InvokeHermiteInteraction(m_pPredicted.get(), jerk, iBegin, iEnd, jBegin, jEnd);
+    }
+}
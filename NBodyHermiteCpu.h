@@ -0,0 +1,127 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <amp_short_vectors.h>
+
+#include "INBodyCpu.h"
+#include "ParticleCpu.h"
+#include "NBodyAdvancedCpu.h"
+
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  Fourth order Hermite implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  Each step predicts every particle's position and velocity from its acceleration and jerk
+//  with a Taylor series, calculates the accelerations and jerks at the predicted state and then
+//  corrects the positions and velocities with the Hermite interpolant:
+//
+//      v1 = v0 + (a0 + a1) dt / 2 + (j0 - j1) dt^2 / 12
+//      x1 = x0 + (v0 + v1) dt / 2 + (a0 - a1) dt^2 / 12
+//
+//  The error per step is fifth order in dt so much larger steps can be taken than with the
+//  second order integrators for the same accuracy, which is what matters for collisional
+//  systems where close encounters dominate the error.
+//
+//  Accelerations and jerks are calculated together by the Hermite kernels of
+//  NBodyAdvancedInteractionEngine, which update both particles of each pair, on the same
+//  cache aware recursive decomposition as NBodyAdvanced. The kernels read the predicted state
+//  from a private store and also touch the velocities and jerks, so the tiles are half the size.
+//
+//  Given a number of time step levels each particle instead has its own step, a power of two
+//  fraction of deltaTime down to deltaTime / 2^levels, chosen from its acceleration and its
+//  derivatives with the Aarseth criterion. Each call then advances the particles by deltaTime in
+//  block steps: every sub-step all the particles are predicted to the current time but only the
+//  active particles, those whose step ends there, have their accelerations and jerks calculated
+//  and are corrected. Particles only move to a longer step when the current time is a multiple
+//  of it, so the particles on each level stay synchronized. The active particles are gathered
+//  in parallel from all the others with the Hermite gather kernels, so the cost of a sub-step
+//  is proportional to the number of active particles.
+//
+//  Only the sources interact through the reciprocal kernels, the tracers gather from them.
+//
+//  The current accelerations are kept in the acceleration streams and the jerks and time step
+//  levels in private streams. These are permuted with the particles when they are reordered and
+//  only recalculated, by a full force pass, after the particles are reloaded. Particles are
+//  updated in place, so the particleOut parameter is unused.
+//
+//  See: J. Makino and S. Aarseth, "On a Hermite integrator with Ahmad-Cohen scheme for
+//  gravitational many-body problems", PASJ 44, 1992, and J. Makino, "A modified Aarseth code for
+//  GRAPE and vector processors", PASJ 43, 1991, for the block time steps.
+
+class NBodyHermite : public INBodyCpu
+{
+public:
+    //  Number of bytes of each particle touched by the Hermite kernels, used to size the tiles.
+
+    static const int kInteractionBytes = 12 * sizeof(float);
+
+private:
+    std::shared_ptr<NBodyAdvancedInteractionEngine> m_engine;
+    const float m_deltaTime;
+    const float m_dampingFactor;
+    size_t m_tileSize;
+    const int m_timeStepLevels;                                   // Zero for a shared time step.
+
+    mutable std::unique_ptr<ParticleStoreSoA> m_pPredicted;      // Predicted state and new accelerations.
+    mutable std::vector<float> m_jerkX;                           // Jerks at the start of the step.
+    mutable std::vector<float> m_jerkY;
+    mutable std::vector<float> m_jerkZ;
+    mutable std::vector<float> m_newJerkX;                        // Jerks at the predicted state.
+    mutable std::vector<float> m_newJerkY;
+    mutable std::vector<float> m_newJerkZ;
+    mutable std::vector<int> m_level;                             // Time step level of each particle.
+    mutable std::vector<int> m_time;                              // Time of each particle in sub-steps since the start of the step.
+    mutable std::vector<int> m_active;
+    mutable bool m_primed;
+    mutable long long m_particleSteps;                            // Particles times steps since priming.
+    mutable long long m_activeParticles;                          // Active particles over all sub-steps since priming.
+
+public:
+    NBodyHermite(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int tileSize, CpuSSE maxSSE = kCpuAVX512,
+        int timeStepLevels = 0);
+
+    void Integrate(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const unused, int numParticles) const;
+
+    void ParticlesChanged(bool /*reloaded*/) { m_primed = false; }
+
+    void ParticlesReordered(const int* const index, int numParticles);
+
+    //  Average number of force calculations per particle in each call to Integrate.
+
+    inline float ForceCalculationsPerStep() const
+    {
+        return (m_particleSteps > 0) ? float(m_activeParticles) / float(m_particleSteps) : 0.0f;
+    }
+
+private:
+    void Prime(ParticleStoreSoA* const pParticles, int numParticles, int numSources) const;
+    void BlockSteps(ParticleStoreSoA* const pParticles, int numParticles, int numSources) const;
+    void Predict(const ParticleStoreSoA* const pParticles, int numParticles, float deltaTime) const;
+    void PredictToTime(const ParticleStoreSoA* const pParticles, int numParticles, int time) const;
+    void Correct(ParticleStoreSoA* const pParticles, int numParticles) const;
+    void CorrectParticle(ParticleStoreSoA* const pParticles, int i, const float_3& acc1, const float_3& jerk1, float deltaTime, float dampingFactor) const;
+    int NextLevel(int i, const float_3& acc0, const float_3& acc1, const float_3& jerk0, const float_3& jerk1, int time) const;
+    int LevelForStep(float step) const;
+    void ComputeForces(int numParticles, int numSources) const;
+    void InteractionList(const JerkStreams& jerk, const size_t begin, const size_t end) const;
+    void InteractionCell(const JerkStreams& jerk, const size_t iBegin, const size_t iEnd, const size_t jBegin, const size_t jEnd) const;
+};
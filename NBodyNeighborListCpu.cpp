@@ -0,0 +1,255 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <math.h>
+#include <float.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "NBodyOctreeCpu.h"
+#include "NBodyNeighborListCpu.h"
+#include "ParallelCpu.h"
+
+using namespace concurrency::graphics;
+
+//  Maximum number of cells per particle. Sparse particles share larger cells rather than
+//  leaving most of the cells empty.
+
+const int kMaxCellsPerParticle = 2;
+
+//  Number of particles binned, copied or scanned by each task.
+
+const int kCellGridChunkSize = 4 * 1024;
+
+//--------------------------------------------------------------------------------------
+//  Uniform grid of cells.
+//--------------------------------------------------------------------------------------
+//
+//  The cell of each particle, with a low bit set for tracers, is used as its sort key. The radix
+//  sort shared with the octree is a parallel counting sort on each byte of the keys and skips the
+//  bytes every key has in common, so only one or two counting passes are needed. The start of
+//  each cell's range, and of its tracers, is then found from the sorted keys.
+
+CellGrid::CellGrid() :
+    m_cellsX(0),
+    m_cellsY(0),
+    m_cellsZ(0)
+{
+}
+
+void CellGrid::Build(const ParticleStoreSoA* const pParticles, int numParticles, float minCellSize)
+{
+    m_keys.resize(std::max(numParticles, static_cast<int>(m_keys.size())));
+    m_index.resize(std::max(numParticles, static_cast<int>(m_index.size())));
+
+    float_3 lo;
+    float_3 hi;
+    ParticleBounds(pParticles, numParticles, lo, hi);
+    const float_3 extent = hi - lo;
+
+    // Grow the cells if there would be too many of them.
+    const float maxCells = float(kMaxCellsPerParticle) * std::max(numParticles, 1);
+    float cellSize = minCellSize;
+    const float numCells = std::max(1.0f, extent.x / cellSize) * std::max(1.0f, extent.y / cellSize) * std::max(1.0f, extent.z / cellSize);
+    if (numCells > maxCells)
+        cellSize *= pow(numCells / maxCells, 1.0f / 3.0f);
+
+    // Rounding the number of cells down keeps every cell at least cellSize wide.
+    const int cellsX = std::max(1, static_cast<int>(extent.x / cellSize));
+    const int cellsY = std::max(1, static_cast<int>(extent.y / cellSize));
+    const int cellsZ = std::max(1, static_cast<int>(extent.z / cellSize));
+    const float_3 inverseWidth(cellsX / std::max(extent.x, cellSize), cellsY / std::max(extent.y, cellSize), cellsZ / std::max(extent.z, cellSize));
+    m_cellsX = cellsX;
+    m_cellsY = cellsY;
+    m_cellsZ = cellsZ;
+
+    uint64_t* const keys = m_keys.data();
+    int* const index = m_index.data();
+    ParallelFor(0, numParticles, kCellGridChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kCellGridChunkSize, numParticles);
+        for (int i = begin; i < end; ++i)
+        {
+            const int cx = std::min(cellsX - 1, static_cast<int>((pParticles->x[i] - lo.x) * inverseWidth.x));
+            const int cy = std::min(cellsY - 1, static_cast<int>((pParticles->y[i] - lo.y) * inverseWidth.y));
+            const int cz = std::min(cellsZ - 1, static_cast<int>((pParticles->z[i] - lo.z) * inverseWidth.z));
+            const uint64_t cell = (static_cast<uint64_t>(cz) * cellsY + cy) * cellsX + cx;
+            keys[i] = (cell << 1) | ((pParticles->mass[i] > 0.0f) ? 0 : 1);
+            index[i] = i;
+        }
+    });
+
+    ParallelRadixSort(m_keys, m_index, m_keysTemp, m_indexTemp, numParticles);
+
+    const int totalCells = cellsX * cellsY * cellsZ;
+    m_cellStart.resize(totalCells + 1);
+    int* const cellStart = m_cellStart.data();
+    const uint64_t* const sortedKeys = m_keys.data();
+    ParallelFor(0, numParticles, kCellGridChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kCellGridChunkSize, numParticles);
+        for (int s = begin; s < end; ++s)
+        {
+            // The first particle of each cell marks the start of it and of any empty cells before it.
+            const int cell = static_cast<int>(sortedKeys[s] >> 1);
+            const int previous = (s > 0) ? static_cast<int>(sortedKeys[s - 1] >> 1) : -1;
+            for (int c = previous + 1; c <= cell; ++c)
+                cellStart[c] = s;
+        }
+    });
+
+    const int lastCell = (numParticles > 0) ? static_cast<int>(sortedKeys[numParticles - 1] >> 1) : -1;
+    std::fill(cellStart + lastCell + 1, cellStart + totalCells + 1, numParticles);
+
+    m_cellSourceEnd.resize(totalCells);
+    int* const cellSourceEnd = m_cellSourceEnd.data();
+    ParallelFor(0, totalCells, kCellGridChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kCellGridChunkSize, totalCells);
+        for (int c = begin; c < end; ++c)
+        {
+            const uint64_t firstTracer = (static_cast<uint64_t>(c) << 1) | 1;
+            cellSourceEnd[c] = static_cast<int>(std::lower_bound(sortedKeys + cellStart[c], sortedKeys + cellStart[c + 1], firstTracer) - sortedKeys);
+        }
+    });
+}
+
+//--------------------------------------------------------------------------------------
+//  Verlet neighbor lists.
+//--------------------------------------------------------------------------------------
+
+NeighborList::NeighborList(float cutoffRadius, float skin) :
+    m_cutoffRadius(cutoffRadius),
+    m_skin(skin),
+    m_numParticles(-1),
+    m_maxDisplacementSqr(FLT_MAX),
+    m_steps(0),
+    m_builds(0)
+{
+    assert((cutoffRadius > 0.0f) && (skin >= 0.0f));
+}
+
+void NeighborList::Update(const ParticleStoreSoA* const pParticles, int numParticles)
+{
+    const float halfSkin = 0.5f * m_skin;
+    if ((numParticles != m_numParticles) || (m_maxDisplacementSqr > halfSkin * halfSkin))
+        Build(pParticles, numParticles);
+    ++m_steps;
+}
+
+//  The lists are built in two passes over the particles in cell order, which keeps each cell's
+//  neighbors in cache. The first pass counts each particle's neighbors so the second can write
+//  them directly to their place in the flattened lists.
+
+void NeighborList::Build(const ParticleStoreSoA* const pParticles, int numParticles)
+{
+    const float radius = m_cutoffRadius + m_skin;
+    m_grid.Build(pParticles, numParticles, radius);
+
+    m_sortedX.resize(numParticles);
+    m_sortedY.resize(numParticles);
+    m_sortedZ.resize(numParticles);
+    m_referenceX.resize(numParticles);
+    m_referenceY.resize(numParticles);
+    m_referenceZ.resize(numParticles);
+    m_offsets.resize(numParticles + 1);
+
+    ParallelFor(0, numParticles, kCellGridChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kCellGridChunkSize, numParticles);
+        for (int s = begin; s < end; ++s)
+        {
+            const int i = m_grid.SortedIndex(s);
+            m_sortedX[s] = m_referenceX[i] = pParticles->x[i];
+            m_sortedY[s] = m_referenceY[i] = pParticles->y[i];
+            m_sortedZ[s] = m_referenceZ[i] = pParticles->z[i];
+        }
+    });
+
+    const float radiusSqr = radius * radius;
+    int* const offsets = m_offsets.data();
+    ParallelFor(0, numParticles, kCellGridChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kCellGridChunkSize, numParticles);
+        for (int s = begin; s < end; ++s)
+            offsets[m_grid.SortedIndex(s)] = ScanNeighbors<false>(s, radiusSqr, nullptr);
+    });
+
+    int total = 0;
+    for (int i = 0; i < numParticles; ++i)
+    {
+        const int count = offsets[i];
+        offsets[i] = total;
+        total += count;
+    }
+    offsets[numParticles] = total;
+    m_neighbors.resize(total);
+
+    int* const neighbors = m_neighbors.data();
+    ParallelFor(0, numParticles, kCellGridChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kCellGridChunkSize, numParticles);
+        for (int s = begin; s < end; ++s)
+            ScanNeighbors<true>(s, radiusSqr, neighbors + offsets[m_grid.SortedIndex(s)]);
+    });
+
+    m_numParticles = numParticles;
+    m_maxDisplacementSqr = 0.0f;
+    ++m_builds;
+}
+
+//  Count, and if fill is true write, the caller's indices of the sources within the list radius
+//  of sorted particle s, searching its own and the 26 surrounding cells.
+
+template <bool fill>
+int NeighborList::ScanNeighbors(int s, float radiusSqr, int* const neighbors) const
+{
+    const int cell = m_grid.SortedCell(s);
+    const int cellsX = m_grid.CellsX();
+    const int cellsY = m_grid.CellsY();
+    const int cellsZ = m_grid.CellsZ();
+    const int x = cell % cellsX;
+    const int y = (cell / cellsX) % cellsY;
+    const int z = cell / (cellsX * cellsY);
+    const float posX = m_sortedX[s];
+    const float posY = m_sortedY[s];
+    const float posZ = m_sortedZ[s];
+
+    int count = 0;
+    for (int nz = std::max(0, z - 1); nz <= std::min(cellsZ - 1, z + 1); ++nz)
+    {
+        for (int ny = std::max(0, y - 1); ny <= std::min(cellsY - 1, y + 1); ++ny)
+        {
+            for (int nx = std::max(0, x - 1); nx <= std::min(cellsX - 1, x + 1); ++nx)
+            {
+                const int neighbor = m_grid.Cell(nx, ny, nz);
+                for (int t = m_grid.CellBegin(neighbor); t < m_grid.CellSourceEnd(neighbor); ++t)
+                {
+                    const float rX = m_sortedX[t] - posX;
+                    const float rY = m_sortedY[t] - posY;
+                    const float rZ = m_sortedZ[t] - posZ;
+                    if ((t != s) && ((rX * rX + rY * rY + rZ * rZ) < radiusSqr))
+                    {
+                        if (fill)
+                            neighbors[count] = m_grid.SortedIndex(t);
+                        ++count;
+                    }
+                }
+            }
+        }
+    }
+    return count;
+}
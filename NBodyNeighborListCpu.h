@@ -0,0 +1,152 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <stdint.h>
+#include <float.h>
+#include <vector>
+#include <algorithm>
+#include <amp_short_vectors.h>
+
+#include "ParticleCpu.h"
+
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  Uniform grid of cells sorted by the particles they contain.
+//--------------------------------------------------------------------------------------
+//
+//  Build bins the particles into cells at least the given size and sorts their indices by
+//  cell, so each cell's particles form a contiguous range of the sorted indices. The number of
+//  cells is limited to a few per particle, so widely spread particles get larger cells. Within
+//  each cell the sources come before the tracers.
+
+class CellGrid
+{
+private:
+    int m_cellsX;
+    int m_cellsY;
+    int m_cellsZ;
+    std::vector<uint64_t> m_keys;
+    std::vector<int> m_index;
+    std::vector<uint64_t> m_keysTemp;
+    std::vector<int> m_indexTemp;
+    std::vector<int> m_cellStart;
+    std::vector<int> m_cellSourceEnd;
+
+public:
+    CellGrid();
+
+    void Build(const ParticleStoreSoA* const pParticles, int numParticles, float minCellSize);
+
+    inline int CellsX() const { return m_cellsX; }
+    inline int CellsY() const { return m_cellsY; }
+    inline int CellsZ() const { return m_cellsZ; }
+    inline int Cell(int x, int y, int z) const { return (z * m_cellsY + y) * m_cellsX + x; }
+
+    //  Range of sorted positions holding a cell's particles.
+
+    inline int CellBegin(int cell) const { return m_cellStart[cell]; }
+    inline int CellEnd(int cell) const { return m_cellStart[cell + 1]; }
+    inline int CellSourceEnd(int cell) const { return m_cellSourceEnd[cell]; }
+
+    //  Cell of each sorted particle and its index in the caller's particle store.
+
+    inline int SortedCell(int s) const { return static_cast<int>(m_keys[s] >> 1); }
+    inline int SortedIndex(int s) const { return m_index[s]; }
+
+private:
+    // VC++ does not yet support deleted functions.
+    CellGrid(const CellGrid&);
+    CellGrid& operator=(const CellGrid&);
+};
+
+//--------------------------------------------------------------------------------------
+//  Verlet neighbor lists.
+//--------------------------------------------------------------------------------------
+//
+//  Each particle's list holds every other source within the cutoff radius plus a skin. The
+//  lists remain complete until some particle has moved more than half the skin since they were
+//  built, because until then no pair can have closed from outside the list radius to inside
+//  the cutoff. The integration step measures each particle's displacement from its position
+//  at the last build and reports the largest, so the lists are only rebuilt when needed.
+//
+//  The lists are built with a CellGrid whose cells are as wide as the list radius. Each
+//  particle lists all of its neighbors, so every pair of sources appears twice and the force
+//  calculation can update each particle independently. Tracers have lists but are never listed.
+
+class NeighborList
+{
+private:
+    const float m_cutoffRadius;
+    const float m_skin;
+    int m_numParticles;
+    float m_maxDisplacementSqr;         // Largest squared displacement since the last build.
+    int m_steps;
+    int m_builds;
+
+    CellGrid m_grid;
+    std::vector<int> m_offsets;         // Neighbors of particle i are m_neighbors[m_offsets[i], m_offsets[i + 1]).
+    std::vector<int> m_neighbors;
+    std::vector<float> m_sortedX;
+    std::vector<float> m_sortedY;
+    std::vector<float> m_sortedZ;
+    std::vector<float> m_referenceX;    // Positions of the particles when the lists were built.
+    std::vector<float> m_referenceY;
+    std::vector<float> m_referenceZ;
+
+public:
+    NeighborList(float cutoffRadius, float skin);
+
+    //  Called once per step before the lists are used. Rebuilds the lists if a particle has moved
+    //  more than half the skin or the number of particles has changed.
+
+    void Update(const ParticleStoreSoA* const pParticles, int numParticles);
+
+    //  Force a rebuild on the next update, after the particles have been reloaded or reordered.
+
+    inline void Invalidate() { m_maxDisplacementSqr = FLT_MAX; }
+
+    //  The integration step records the largest squared displacement from the reference positions.
+    //  The reference positions are only valid if the lists were built for the same particles.
+
+    inline bool Built(int numParticles) const { return m_numParticles == numParticles; }
+    inline void RecordDisplacementSqr(float displacementSqr) { m_maxDisplacementSqr = std::max(m_maxDisplacementSqr, displacementSqr); }
+    inline const float* ReferenceX() const { return m_referenceX.data(); }
+    inline const float* ReferenceY() const { return m_referenceY.data(); }
+    inline const float* ReferenceZ() const { return m_referenceZ.data(); }
+
+    inline float CutoffRadius() const { return m_cutoffRadius; }
+    inline int Begin(int i) const { return m_offsets[i]; }
+    inline int End(int i) const { return m_offsets[i + 1]; }
+    inline const int* Neighbors() const { return m_neighbors.data(); }
+
+    //  Rebuild frequency since the lists were created.
+
+    inline int Steps() const { return m_steps; }
+    inline int Builds() const { return m_builds; }
+
+private:
+    void Build(const ParticleStoreSoA* const pParticles, int numParticles);
+
+    template <bool fill>
+    int ScanNeighbors(int s, float radiusSqr, int* const neighbors) const;
+
+    // VC++ does not yet support deleted functions.
+    NeighborList(const NeighborList&);
+    NeighborList& operator=(const NeighborList&);
+};
@@ -0,0 +1,383 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <math.h>
+#include <float.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "NBodyOctreeCpu.h"
+#include "ParallelCpu.h"
+
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  Bounding box of the particles.
+//--------------------------------------------------------------------------------------
+//
+//  Each chunk's bounding box is found in parallel and the results are then combined.
+
+void ParticleBounds(const ParticleStoreSoA* const pParticles, int numParticles, float_3& boxMin, float_3& boxMax)
+{
+    const int chunkSize = 4 * 1024;
+    const int numChunks = std::max(1, (numParticles + chunkSize - 1) / chunkSize);
+    std::vector<float_3> chunkMin(numChunks, float_3(FLT_MAX));
+    std::vector<float_3> chunkMax(numChunks, float_3(-FLT_MAX));
+
+    ParallelFor(0, numChunks, [=, &chunkMin, &chunkMax](int c)
+    {
+        float_3 lo(FLT_MAX);
+        float_3 hi(-FLT_MAX);
+        const int end = std::min((c + 1) * chunkSize, numParticles);
+        for (int i = c * chunkSize; i < end; ++i)
+        {
+            lo.x = std::min(lo.x, pParticles->x[i]); hi.x = std::max(hi.x, pParticles->x[i]);
+            lo.y = std::min(lo.y, pParticles->y[i]); hi.y = std::max(hi.y, pParticles->y[i]);
+            lo.z = std::min(lo.z, pParticles->z[i]); hi.z = std::max(hi.z, pParticles->z[i]);
+        }
+        chunkMin[c] = lo;
+        chunkMax[c] = hi;
+    });
+
+    boxMin = chunkMin[0];
+    boxMax = chunkMax[0];
+    for (int c = 1; c < numChunks; ++c)
+    {
+        boxMin.x = std::min(boxMin.x, chunkMin[c].x); boxMax.x = std::max(boxMax.x, chunkMax[c].x);
+        boxMin.y = std::min(boxMin.y, chunkMin[c].y); boxMax.y = std::max(boxMax.y, chunkMax[c].y);
+        boxMin.z = std::min(boxMin.z, chunkMin[c].z); boxMax.z = std::max(boxMax.z, chunkMax[c].z);
+    }
+
+    if (numParticles == 0)
+        boxMin = boxMax = float_3(0.0f);
+}
+
+//--------------------------------------------------------------------------------------
+//  Morton keys and sorting.
+//--------------------------------------------------------------------------------------
+
+//  Spread the lower 21 bits of a value out so there are two zero bits between each of them.
+
+static inline uint64_t SpreadBits(uint32_t v)
+{
+    uint64_t x = v & 0x1fffff;
+    x = (x | (x << 32)) & 0x001f00000000ffffull;
+    x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+    x = (x | (x << 8))  & 0x100f00f00f00f00full;
+    x = (x | (x << 4))  & 0x10c30c30c30c30c3ull;
+    x = (x | (x << 2))  & 0x1249249249249249ull;
+    return x;
+}
+
+//  The inverse of SpreadBits.
+
+static inline uint32_t CompactBits(uint64_t x)
+{
+    x &= 0x1249249249249249ull;
+    x = (x | (x >> 2))  & 0x10c30c30c30c30c3ull;
+    x = (x | (x >> 4))  & 0x100f00f00f00f00full;
+    x = (x | (x >> 8))  & 0x001f0000ff0000ffull;
+    x = (x | (x >> 16)) & 0x001f00000000ffffull;
+    x = (x | (x >> 32)) & 0x00000000001fffffull;
+    return static_cast<uint32_t>(x);
+}
+
+uint64_t MortonKey(uint32_t x, uint32_t y, uint32_t z)
+{
+    return SpreadBits(x) | (SpreadBits(y) << 1) | (SpreadBits(z) << 2);
+}
+
+uint32_t MortonCoordinate(uint64_t key, int axis)
+{
+    return CompactBits(key >> axis);
+}
+
+//  Each pass sorts on one byte of the key. Chunks are large enough that the per chunk
+//  histograms are cheap to combine but small enough to give every core several chunks.
+
+void ParallelRadixSort(std::vector<uint64_t>& keys, std::vector<int>& values,
+    std::vector<uint64_t>& keysTemp, std::vector<int>& valuesTemp, int count)
+{
+    const int kRadixBits = 8;
+    const int kBuckets = 1 << kRadixBits;
+    const int kChunkSize = 16 * 1024;
+    const int numChunks = std::max(1, (count + kChunkSize - 1) / kChunkSize);
+
+    if (keysTemp.size() < keys.size())
+        keysTemp.resize(keys.size());
+    if (valuesTemp.size() < values.size())
+        valuesTemp.resize(values.size());
+
+    uint64_t* pKeys = keys.data();
+    int* pValues = values.data();
+    uint64_t* pKeysOut = keysTemp.data();
+    int* pValuesOut = valuesTemp.data();
+
+    // Chunk c's offsets for each bucket, stored bucket major so the prefix sum visits the
+    // chunks in order for every bucket. This keeps the sort stable.
+    std::vector<int> offsets(numChunks * kBuckets);
+
+    for (int shift = 0; shift < 64; shift += kRadixBits)
+    {
+        ParallelFor(0, numChunks, [=, &offsets](int c)
+        {
+            int* const histogram = &offsets[c * kBuckets];
+            std::fill(histogram, histogram + kBuckets, 0);
+            const int end = std::min((c + 1) * kChunkSize, count);
+            for (int i = c * kChunkSize; i < end; ++i)
+                ++histogram[(pKeys[i] >> shift) & (kBuckets - 1)];
+        });
+
+        // If every key falls into one bucket this pass would not change the order.
+        bool skipPass = false;
+        int total = 0;
+        for (int b = 0; b < kBuckets; ++b)
+        {
+            int bucketCount = 0;
+            for (int c = 0; c < numChunks; ++c)
+            {
+                const int n = offsets[c * kBuckets + b];
+                offsets[c * kBuckets + b] = total;
+                total += n;
+                bucketCount += n;
+            }
+            skipPass |= (bucketCount == count);
+        }
+        if (skipPass)
+            continue;
+
+        ParallelFor(0, numChunks, [=, &offsets](int c)
+        {
+            int* const offset = &offsets[c * kBuckets];
+            const int end = std::min((c + 1) * kChunkSize, count);
+            for (int i = c * kChunkSize; i < end; ++i)
+            {
+                const int dest = offset[(pKeys[i] >> shift) & (kBuckets - 1)]++;
+                pKeysOut[dest] = pKeys[i];
+                pValuesOut[dest] = pValues[i];
+            }
+        });
+
+        std::swap(pKeys, pKeysOut);
+        std::swap(pValues, pValuesOut);
+    }
+
+    // An odd number of passes leaves the result in the temporary arrays.
+    if (pKeys != keys.data())
+    {
+        keys.swap(keysTemp);
+        values.swap(valuesTemp);
+    }
+}
+
+//--------------------------------------------------------------------------------------
+//  Adaptive octree.
+//--------------------------------------------------------------------------------------
+
+//  Nodes with more particles than this build their children in parallel.
+
+const int kParallelBuildThreshold = 4 * 1024;
+
+//  Chunk size used when processing the particle arrays in parallel.
+
+const int kOctreeChunkSize = 4 * 1024;
+
+//  The three bit octant of a key at a given tree level.
+
+static inline int Octant(uint64_t key, int level)
+{
+    return static_cast<int>((key >> (3 * (kMortonBitsPerAxis - 1 - level))) & 7);
+}
+
+Octree::Octree(int leafSize) :
+    m_leafSize(leafSize),
+    m_numParticles(0),
+    m_boxMin(0.0f),
+    m_boxSize(1.0f),
+    m_nodeCount(0),
+    m_leafCount(0)
+{
+    assert(leafSize > 0);
+}
+
+void Octree::Build(const ParticleStoreSoA* const pParticles, int numParticles)
+{
+    m_numParticles = numParticles;
+
+    if ((m_pSorted == nullptr) || (m_pSorted->Capacity() < numParticles))
+    {
+        m_pSorted.reset(new ParticleStoreSoA(numParticles));
+        m_keys.resize(numParticles);
+        m_index.resize(numParticles);
+        m_nodes.resize(std::max(1, 2 * numParticles));
+        m_leaves.resize(std::max(1, numParticles));
+    }
+
+    ComputeBounds(pParticles);
+    ComputeKeys(pParticles);
+    ParallelRadixSort(m_keys, m_index, m_keysTemp, m_indexTemp, numParticles);
+
+    // Copy the particles into Morton order so each node's particles are contiguous.
+    ParticleStoreSoA* const pSorted = m_pSorted.get();
+    const int* const index = m_index.data();
+    ParallelFor(0, numParticles, kOctreeChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kOctreeChunkSize, numParticles);
+        for (int s = begin; s < end; ++s)
+        {
+            const int i = index[s];
+            pSorted->x[s] = pParticles->x[i];
+            pSorted->y[s] = pParticles->y[i];
+            pSorted->z[s] = pParticles->z[i];
+            pSorted->mass[s] = pParticles->mass[i];
+        }
+    });
+
+    m_nodeCount = 1;
+    m_leafCount = 0;
+    BuildNode(Root(), 0, numParticles, 0);
+}
+
+//  The bounding cube is a cube around the particles' bounding box.
+
+void Octree::ComputeBounds(const ParticleStoreSoA* const pParticles)
+{
+    float_3 lo;
+    float_3 hi;
+    ParticleBounds(pParticles, m_numParticles, lo, hi);
+
+    // Grow the cube slightly so particles on the upper faces still quantize inside it.
+    const float extent = std::max(std::max(hi.x - lo.x, hi.y - lo.y), hi.z - lo.z);
+    m_boxSize = (extent > 0.0f) ? extent * 1.0001f : 1.0f;
+    m_boxMin = lo;
+}
+
+void Octree::ComputeKeys(const ParticleStoreSoA* const pParticles)
+{
+    const int numParticles = m_numParticles;
+    const uint32_t maxCoordinate = (1u << kMortonBitsPerAxis) - 1;
+    const float scale = (1u << kMortonBitsPerAxis) / m_boxSize;
+    const float_3 boxMin = m_boxMin;
+    uint64_t* const keys = m_keys.data();
+    int* const index = m_index.data();
+
+    ParallelFor(0, numParticles, kOctreeChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kOctreeChunkSize, numParticles);
+        for (int i = begin; i < end; ++i)
+        {
+            const uint32_t x = std::min(static_cast<uint32_t>((pParticles->x[i] - boxMin.x) * scale), maxCoordinate);
+            const uint32_t y = std::min(static_cast<uint32_t>((pParticles->y[i] - boxMin.y) * scale), maxCoordinate);
+            const uint32_t z = std::min(static_cast<uint32_t>((pParticles->z[i] - boxMin.z) * scale), maxCoordinate);
+            keys[i] = MortonKey(x, y, z);
+            index[i] = i;
+        }
+    });
+}
+
+//  Recursively subdivide the sorted keys in [begin, end). All the keys share the first level
+//  octants so they lie in the same cube at that level.
+
+void Octree::BuildNode(int node, int begin, int end, int level)
+{
+    const uint64_t* const keys = m_keys.data();
+
+    // Skip levels that do not separate any of the particles.
+    while ((end - begin > 1) && (level < kMortonBitsPerAxis) && (Octant(keys[begin], level) == Octant(keys[end - 1], level)))
+        ++level;
+
+    OctreeNode& n = m_nodes[node];
+    const float cellSize = ldexp(m_boxSize, -level);
+    const int shift = kMortonBitsPerAxis - level;
+    const uint64_t key = (end > begin) ? keys[begin] : 0;
+    n.center = m_boxMin + float_3(static_cast<float>(MortonCoordinate(key, 0) >> shift) + 0.5f,
+                                  static_cast<float>(MortonCoordinate(key, 1) >> shift) + 0.5f,
+                                  static_cast<float>(MortonCoordinate(key, 2) >> shift) + 0.5f) * cellSize;
+    n.halfWidth = 0.5f * cellSize;
+    n.begin = begin;
+    n.end = end;
+    n.level = level;
+    n.firstChild = -1;
+    n.numChildren = 0;
+
+    if ((end - begin <= m_leafSize) || (level == kMortonBitsPerAxis))
+    {
+        n.numSources = PartitionLeaf(begin, end);
+        m_leaves[m_leafCount++] = node;
+        return;
+    }
+
+    // Find the range of each non empty octant. The octants of the sorted keys are increasing.
+    int childBegin[9];
+    int numChildren = 0;
+    int i = begin;
+    while (i < end)
+    {
+        const int octant = Octant(keys[i], level);
+        childBegin[numChildren++] = i;
+        i = static_cast<int>(std::lower_bound(keys + i, keys + end, octant + 1, [level](uint64_t k, int o)
+        {
+            return Octant(k, level) < o;
+        }) - keys);
+    }
+    childBegin[numChildren] = end;
+    assert(numChildren > 1);
+
+    const int firstChild = m_nodeCount.fetch_add(numChildren);
+    n.firstChild = firstChild;
+    n.numChildren = numChildren;
+
+    if (end - begin > kParallelBuildThreshold)
+    {
+        ParallelFor(0, numChildren, [=, &childBegin](int c)
+        {
+            BuildNode(firstChild + c, childBegin[c], childBegin[c + 1], level + 1);
+        });
+    }
+    else
+    {
+        for (int c = 0; c < numChildren; ++c)
+            BuildNode(firstChild + c, childBegin[c], childBegin[c + 1], level + 1);
+    }
+
+    n.numSources = 0;
+    for (int c = firstChild; c < firstChild + numChildren; ++c)
+        n.numSources += m_nodes[c].numSources;
+}
+
+//  Move a leaf's sources in front of its tracers and return the number of sources. The order
+//  of the particles within a leaf does not matter so they are swapped in place.
+
+int Octree::PartitionLeaf(int begin, int end)
+{
+    ParticleStoreSoA* const pSorted = m_pSorted.get();
+    int sourceEnd = begin;
+    for (int s = begin; s < end; ++s)
+    {
+        if (pSorted->mass[s] <= 0.0f)
+            continue;
+        if (s != sourceEnd)
+        {
+            std::swap(pSorted->x[s], pSorted->x[sourceEnd]);
+            std::swap(pSorted->y[s], pSorted->y[sourceEnd]);
+            std::swap(pSorted->z[s], pSorted->z[sourceEnd]);
+            std::swap(pSorted->mass[s], pSorted->mass[sourceEnd]);
+            std::swap(m_index[s], m_index[sourceEnd]);
+        }
+        ++sourceEnd;
+    }
+    return sourceEnd - begin;
+}
@@ -0,0 +1,151 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <amp_short_vectors.h>
+
+#include "ParticleCpu.h"
+
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  Bounding box of the particles, calculated with a parallel reduction.
+//--------------------------------------------------------------------------------------
+
+void ParticleBounds(const ParticleStoreSoA* const pParticles, int numParticles, float_3& boxMin, float_3& boxMax);
+
+//--------------------------------------------------------------------------------------
+//  Morton keys and sorting.
+//--------------------------------------------------------------------------------------
+//
+//  A Morton key interleaves the bits of a particle's quantized x, y and z coordinates so that
+//  sorting particles by key places them along a space filling curve. Particles that are close
+//  in space are then mostly close in memory, and every octree node covers a contiguous range
+//  of the sorted particles.
+//
+//  Keys use 21 bits per axis, 63 bits in total.
+
+const int kMortonBitsPerAxis = 21;
+
+//  Interleave the bits of the three 21 bit coordinates, x occupies the lowest bit of each triple.
+
+uint64_t MortonKey(uint32_t x, uint32_t y, uint32_t z);
+
+//  Extract one of the three coordinates from a key. The axis is 0, 1 or 2 for x, y and z.
+
+uint32_t MortonCoordinate(uint64_t key, int axis);
+
+//  Stable least significant digit radix sort of keys, carrying the values along with them.
+//  The histogram and scatter phases of each pass run in parallel over chunks of the arrays.
+//  Passes where every key has the same digit are skipped. The temporary arrays are resized as
+//  required and may be kept by the caller between sorts to avoid reallocating them.
+
+void ParallelRadixSort(std::vector<uint64_t>& keys, std::vector<int>& values,
+    std::vector<uint64_t>& keysTemp, std::vector<int>& valuesTemp, int count);
+
+//--------------------------------------------------------------------------------------
+//  Adaptive octree shared by the tree based engines.
+//--------------------------------------------------------------------------------------
+//
+//  Build sorts the particles by Morton key and then subdivides the key range top down. Cells
+//  are split until they contain no more than the leaf size particles. Levels where all of a
+//  cell's particles lie in the same octant are skipped, so every internal node has at least
+//  two children and the tree has fewer than twice as many nodes as particles.
+//
+//  The positions and masses of the particles are copied into a store in Morton order. Node
+//  particle ranges refer to this store and SortedIndex maps back to the caller's ordering.
+//  Engines attach their own per node data, such as multipole moments, using the node indices.
+//
+//  Every particle is a target but only the sources, the particles with mass, contribute to the
+//  field. Each leaf's sources are moved in front of its tracers, so the engines' direct sums
+//  only loop over them, and nodes without sources can be skipped by the walks.
+
+struct OctreeNode
+{
+    float_3 center;             // Center of the node's cube.
+    float halfWidth;            // Half the length of the cube's sides.
+    int begin;                  // Range of the node's particles in the sorted store.
+    int end;
+    int firstChild;             // Children are stored contiguously, firstChild is -1 for a leaf.
+    int numChildren;
+    int level;                  // Depth of the node's cube, the root cube is level 0.
+    int numSources;             // Particles with mass, the first of a leaf's particles.
+
+    inline bool IsLeaf() const { return numChildren == 0; }
+    inline int Count() const { return end - begin; }
+    inline int SourceEnd() const { return begin + numSources; }
+};
+
+class Octree
+{
+private:
+    const int m_leafSize;
+    int m_numParticles;
+    float_3 m_boxMin;
+    float m_boxSize;
+
+    std::vector<OctreeNode> m_nodes;
+    std::vector<int> m_leaves;
+    std::atomic<int> m_nodeCount;
+    std::atomic<int> m_leafCount;
+
+    std::vector<uint64_t> m_keys;
+    std::vector<int> m_index;
+    std::vector<uint64_t> m_keysTemp;
+    std::vector<int> m_indexTemp;
+    std::unique_ptr<ParticleStoreSoA> m_pSorted;
+
+public:
+    explicit Octree(int leafSize);
+
+    void Build(const ParticleStoreSoA* const pParticles, int numParticles);
+
+    inline int NumParticles() const { return m_numParticles; }
+    inline int NumNodes() const { return m_nodeCount; }
+    inline int NumLeaves() const { return m_leafCount; }
+    inline int Root() const { return 0; }
+    inline const OctreeNode& Node(int n) const { return m_nodes[n]; }
+    inline int Leaf(int l) const { return m_leaves[l]; }
+
+    //  Position and mass of the particles in Morton order. The acceleration streams are not
+    //  used by the tree and are free for the engine to accumulate results into.
+
+    inline ParticleStoreSoA* Sorted() const { return m_pSorted.get(); }
+
+    //  Index in the caller's particle store of each sorted particle.
+
+    inline int SortedIndex(int s) const { return m_index[s]; }
+
+    //  Bounding cube of all the particles.
+
+    inline float_3 BoxMin() const { return m_boxMin; }
+    inline float BoxSize() const { return m_boxSize; }
+
+private:
+    void ComputeBounds(const ParticleStoreSoA* const pParticles);
+    void ComputeKeys(const ParticleStoreSoA* const pParticles);
+    void BuildNode(int node, int begin, int end, int level);
+    int PartitionLeaf(int begin, int end);
+
+    // VC++ does not yet support deleted functions.
+    Octree(const Octree&);
+    Octree& operator=(const Octree&);
+};
@@ -0,0 +1,612 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <math.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "NBodyAdvancedCpu.h"
+#include "NBodyParticleMeshCpu.h"
+#include "ParallelCpu.h"
+
+using namespace concurrency::graphics;
+
+//  Empty cells between the particles' bounding box and the edges of the grid. The assignment
+//  schemes and the finite difference reach two cells either side of a particle.
+
+const int kMeshMargin = 3;
+
+//  Number of particles deposited or interpolated by each task.
+
+const int kMeshChunkSize = 4 * 1024;
+
+static const double kPi = 3.14159265358979323846;
+
+//  Complementary error function, W. J. Cody's rational approximation as given in Numerical
+//  Recipes, accurate to 1.2e-7 everywhere.
+
+double ErrorFunctionComplement(double x)
+{
+    const double z = fabs(x);
+    const double t = 1.0 / (1.0 + 0.5 * z);
+    const double r = t * exp(-z * z - 1.26551223 + t * (1.00002368 + t * (0.37409196 + t * (0.09678418 +
+        t * (-0.18628806 + t * (0.27886807 + t * (-1.13520398 + t * (1.48851587 +
+        t * (-0.82215223 + t * 0.17087277)))))))));
+    return (x >= 0.0) ? r : 2.0 - r;
+}
+
+static inline float Sinc(float x)
+{
+    return (x > 0.0f) ? sinf(x) / x : 1.0f;
+}
+
+//  Index of the first of the three cells a particle at grid coordinate u is assigned to, and the
+//  weight of each. CIC only uses the first two cells, the third weight is zero.
+
+static inline int AssignmentWeights(MeshAssignment assignment, float u, float* const weights)
+{
+    if (assignment == kMeshCIC)
+    {
+        const int first = static_cast<int>(floorf(u - 0.5f));
+        const float d = u - 0.5f - first;
+        weights[0] = 1.0f - d;
+        weights[1] = d;
+        weights[2] = 0.0f;
+        return first;
+    }
+
+    const int center = static_cast<int>(floorf(u));
+    const float d = u - center - 0.5f;
+    weights[0] = 0.5f * (0.5f - d) * (0.5f - d);
+    weights[1] = 0.75f - d * d;
+    weights[2] = 0.5f * (0.5f + d) * (0.5f + d);
+    return center - 1;
+}
+
+//--------------------------------------------------------------------------------------
+//  Particle-mesh solver.
+//--------------------------------------------------------------------------------------
+
+ParticleMesh::ParticleMesh(int gridSize, MeshAssignment assignment, float softeningSquared, float splitScale) :
+    m_gridSize(gridSize),
+    m_paddedSize(2 * gridSize),
+    m_assignment(assignment),
+    m_softeningSquared(softeningSquared),
+    m_splitScale(splitScale),
+    m_cellSize(1.0f),
+    m_origin(0.0f),
+    m_greenCellSize(0.0f)
+{
+    // The FFTs are radix 2 and the margins must leave room for the particles.
+    assert((gridSize & (gridSize - 1)) == 0);
+    assert(gridSize >= 16);
+
+    const size_t G = m_gridSize;
+    const size_t M = m_paddedSize;
+    const size_t H = M / 2 + 1;
+    m_grid.resize(M * M * M, 0.0f);
+    m_spectrum.resize(H * M * M);
+    m_green.resize(H * M * M);
+    m_accX.resize(G * G * G, 0.0f);
+    m_accY.resize(G * G * G, 0.0f);
+    m_accZ.resize(G * G * G, 0.0f);
+
+    m_twiddles.resize(M / 2);
+    for (size_t k = 0; k < M / 2; ++k)
+    {
+        const double angle = -2.0 * kPi * k / M;
+        m_twiddles[k] = std::complex<float>(float(cos(angle)), float(sin(angle)));
+    }
+}
+
+void ParticleMesh::AccumulateAccelerations(ParticleStoreSoA* const pParticles, int numParticles)
+{
+    if (numParticles == 0)
+        return;
+
+    FitGrid(pParticles, numParticles);
+    if (m_cellSize != m_greenCellSize)
+        UpdateGreensFunction();
+    Deposit(pParticles, pParticles->NumSources(numParticles));
+    SolvePotential();
+    Gradient();
+    Interpolate(pParticles, numParticles);
+}
+
+//  Fit the grid around the particles' bounding box, leaving the margin empty on every side.
+
+void ParticleMesh::FitGrid(const ParticleStoreSoA* const pParticles, int numParticles)
+{
+    float_3 lo;
+    float_3 hi;
+    ParticleBounds(pParticles, numParticles, lo, hi);
+
+    const float extent = std::max(std::max(hi.x - lo.x, hi.y - lo.y), hi.z - lo.z);
+    const float required = (extent > 0.0f) ? extent / (m_gridSize - 2 * kMeshMargin - 1) : 1.0f;
+    m_cellSize = powf(2.0f, ceilf(4.0f * logf(required) / logf(2.0f)) / 4.0f);
+    m_origin = lo - float_3(kMeshMargin * m_cellSize);
+}
+
+//  Transform the Green's function sampled at every separation of the padded grid. Separations of
+//  more than half the padded grid wrap around, so the circular convolution of the zero padded
+//  grid equals the linear convolution of the unpadded one.
+
+void ParticleMesh::UpdateGreensFunction()
+{
+    const int M = m_paddedSize;
+    const int H = M / 2 + 1;
+    const float h = m_cellSize;
+    const float softeningSquared = std::max(m_softeningSquared, 0.25f * h * h);
+    const float splitScale = m_splitScale * h;
+
+    ParallelFor(0, M, [=](int z)
+    {
+        const float dz = float((z < M / 2) ? z : z - M) * h;
+        for (int y = 0; y < M; ++y)
+        {
+            const float dy = float((y < M / 2) ? y : y - M) * h;
+            float* const line = &m_grid[(size_t(z) * M + y) * M];
+            for (int x = 0; x < M; ++x)
+            {
+                const float dx = float((x < M / 2) ? x : x - M) * h;
+                const float rSquared = dx * dx + dy * dy + dz * dz;
+                if (splitScale > 0.0f)
+                {
+                    const float r = sqrtf(rSquared);
+                    line[x] = (r > 0.0f) ?
+                        float((1.0 - ErrorFunctionComplement(r / (2.0 * splitScale))) / r) :
+                        float(1.0 / (sqrt(kPi) * splitScale));
+                }
+                else
+                {
+                    line[x] = 1.0f / sqrtf(rSquared + softeningSquared);
+                }
+            }
+        }
+    });
+
+    ForwardTransform(M);
+
+    // The kernel is real and even so its transform is real. The inverse transform is not
+    // normalized, so the normalization is folded in here.
+    //
+    // The long range kernel has no power at the grid scale, so the smoothing of the assignment
+    // and interpolation, both of which multiply the spectrum by the transform of the assignment
+    // window, can be divided out. The window is sinc^2 per axis for CIC and sinc^3 for TSC.
+    const float scale = 1.0f / (float(M) * M * M);
+    const int windowPower = (m_assignment == kMeshCIC) ? 4 : 6;
+    const bool deconvolve = (splitScale > 0.0f);
+    ParallelFor(0, M, [=](int z)
+    {
+        const float sincZ = Sinc(float(kPi) * std::min(z, M - z) / M);
+        for (int y = 0; y < M; ++y)
+        {
+            const float sincY = Sinc(float(kPi) * std::min(y, M - y) / M);
+            const size_t row = (size_t(z) * M + y) * H;
+            for (int x = 0; x < H; ++x)
+            {
+                float green = m_spectrum[row + x].real() * scale;
+                if (deconvolve)
+                    green /= powf(Sinc(float(kPi) * x / M) * sincY * sincZ, float(windowPower));
+                m_green[row + x] = green;
+            }
+        }
+    });
+
+    m_greenCellSize = m_cellSize;
+}
+
+//  The sources are sorted by the first plane in z they are assigned to. Each source touches that
+//  plane and the two after it, so the planes of each phase, which are three apart, are deposited
+//  by parallel tasks straight into the padded grid without two tasks writing the same cell. The
+//  work and memory do not depend on the number of threads.
+
+void ParticleMesh::Deposit(const ParticleStoreSoA* const pParticles, int numSources)
+{
+    const int G = m_gridSize;
+    const int M = m_paddedSize;
+    const MeshAssignment assignment = m_assignment;
+    const float_3 origin = m_origin;
+    const float inverseCellSize = 1.0f / m_cellSize;
+
+    m_planeKeys.resize(std::max(numSources, static_cast<int>(m_planeKeys.size())));
+    m_planeIndex.resize(std::max(numSources, static_cast<int>(m_planeIndex.size())));
+    uint64_t* const keys = m_planeKeys.data();
+    int* const index = m_planeIndex.data();
+    ParallelFor(0, numSources, kMeshChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kMeshChunkSize, numSources);
+        for (int i = begin; i < end; ++i)
+        {
+            float wz[3];
+            keys[i] = static_cast<uint64_t>(AssignmentWeights(assignment, (pParticles->z[i] - origin.z) * inverseCellSize, wz));
+            index[i] = i;
+        }
+    });
+
+    ParallelRadixSort(m_planeKeys, m_planeIndex, m_planeKeysTemp, m_planeIndexTemp, numSources);
+
+    // The first source of each plane marks the start of it and of any empty planes before it.
+    m_planeStart.resize(G + 1);
+    int* const planeStart = m_planeStart.data();
+    const uint64_t* const sortedKeys = m_planeKeys.data();
+    ParallelFor(0, numSources, kMeshChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kMeshChunkSize, numSources);
+        for (int s = begin; s < end; ++s)
+        {
+            const int plane = static_cast<int>(sortedKeys[s]);
+            const int previous = (s > 0) ? static_cast<int>(sortedKeys[s - 1]) : -1;
+            for (int z = previous + 1; z <= plane; ++z)
+                planeStart[z] = s;
+        }
+    });
+    const int lastPlane = (numSources > 0) ? static_cast<int>(sortedKeys[numSources - 1]) : -1;
+    std::fill(planeStart + lastPlane + 1, planeStart + G + 1, numSources);
+
+    // Clear the lines of the padded grid that hold the corner, the rest is never written.
+    ParallelFor(0, G, [=](int z)
+    {
+        float* const plane = &m_grid[size_t(z) * M * M];
+        for (int y = 0; y < G; ++y)
+            std::fill(plane + size_t(y) * M, plane + size_t(y + 1) * M, 0.0f);
+    });
+
+    const int* const sortedIndex = m_planeIndex.data();
+    float* const grid = m_grid.data();
+    for (int phase = 0; phase < 3; ++phase)
+    {
+        ParallelFor(0, (G - phase + 2) / 3, [=](int n)
+        {
+            const int plane = phase + 3 * n;
+            for (int s = planeStart[plane]; s < planeStart[plane + 1]; ++s)
+            {
+                const int i = sortedIndex[s];
+                const float mass = pParticles->mass[i];
+                float wx[3], wy[3], wz[3];
+                const int x0 = AssignmentWeights(assignment, (pParticles->x[i] - origin.x) * inverseCellSize, wx);
+                const int y0 = AssignmentWeights(assignment, (pParticles->y[i] - origin.y) * inverseCellSize, wy);
+                AssignmentWeights(assignment, (pParticles->z[i] - origin.z) * inverseCellSize, wz);
+                for (int k = 0; k < 3; ++k)
+                {
+                    for (int j = 0; j < 3; ++j)
+                    {
+                        float* const line = &grid[(size_t(plane + k) * M + (y0 + j)) * M + x0];
+                        const float w = mass * wz[k] * wy[j];
+                        line[0] += w * wx[0];
+                        line[1] += w * wx[1];
+                        line[2] += w * wx[2];
+                    }
+                }
+            }
+        });
+    }
+}
+
+//  Convolve the mass grid with the Green's function. Only the corner of the padded grid holding
+//  particles is non-zero before the transform, or needed after it.
+
+void ParticleMesh::SolvePotential()
+{
+    const int M = m_paddedSize;
+    const int H = M / 2 + 1;
+
+    ForwardTransform(m_gridSize);
+
+    ParallelFor(0, M, [=](int z)
+    {
+        const size_t planeBegin = size_t(z) * M * H;
+        for (size_t i = planeBegin; i < planeBegin + size_t(M) * H; ++i)
+            m_spectrum[i] *= m_green[i];
+    });
+
+    InverseTransform(m_gridSize);
+}
+
+//  The acceleration is the gradient of the potential, a = grad(phi) with phi = sum(m / r), using
+//  a fourth order central difference.
+
+void ParticleMesh::Gradient()
+{
+    const int G = m_gridSize;
+    const size_t M = m_paddedSize;
+    const float scale = 1.0f / (12.0f * m_cellSize);
+
+    ParallelFor(2, G - 2, [=](int z)
+    {
+        for (int y = 2; y < G - 2; ++y)
+        {
+            const float* const phi = &m_grid[(z * M + y) * M];
+            const size_t row = (size_t(z) * G + y) * G;
+            for (int x = 2; x < G - 2; ++x)
+            {
+                const size_t M2 = M * M;
+                m_accX[row + x] = scale * (8.0f * (phi[x + 1] - phi[x - 1]) - (phi[x + 2] - phi[x - 2]));
+                m_accY[row + x] = scale * (8.0f * (phi[x + M] - phi[x - M]) - (phi[x + 2 * M] - phi[x - 2 * M]));
+                m_accZ[row + x] = scale * (8.0f * (phi[x + M2] - phi[x - M2]) - (phi[x + 2 * M2] - phi[x - 2 * M2]));
+            }
+        }
+    });
+}
+
+//  Interpolate the grid accelerations at each particle with the weights used to deposit it.
+
+void ParticleMesh::Interpolate(ParticleStoreSoA* const pParticles, int numParticles) const
+{
+    const int G = m_gridSize;
+    const MeshAssignment assignment = m_assignment;
+    const float_3 origin = m_origin;
+    const float inverseCellSize = 1.0f / m_cellSize;
+
+    ParallelFor(0, numParticles, kMeshChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kMeshChunkSize, numParticles);
+        for (int i = begin; i < end; ++i)
+        {
+            float wx[3], wy[3], wz[3];
+            const int x0 = AssignmentWeights(assignment, (pParticles->x[i] - origin.x) * inverseCellSize, wx);
+            const int y0 = AssignmentWeights(assignment, (pParticles->y[i] - origin.y) * inverseCellSize, wy);
+            const int z0 = AssignmentWeights(assignment, (pParticles->z[i] - origin.z) * inverseCellSize, wz);
+
+            float ax = 0.0f, ay = 0.0f, az = 0.0f;
+            for (int k = 0; k < 3; ++k)
+            {
+                for (int j = 0; j < 3; ++j)
+                {
+                    const size_t offset = (size_t(z0 + k) * G + (y0 + j)) * G + x0;
+                    const float w = wz[k] * wy[j];
+                    for (int l = 0; l < 3; ++l)
+                    {
+                        ax += w * wx[l] * m_accX[offset + l];
+                        ay += w * wx[l] * m_accY[offset + l];
+                        az += w * wx[l] * m_accZ[offset + l];
+                    }
+                }
+            }
+            pParticles->ax[i] += ax;
+            pParticles->ay[i] += ay;
+            pParticles->az[i] += az;
+        }
+    });
+}
+
+//--------------------------------------------------------------------------------------
+//  Three dimensional FFTs of the padded grid.
+//--------------------------------------------------------------------------------------
+//
+//  The real grid is M^3 and its spectrum is (M/2 + 1) x M x M, x varying fastest in both. The
+//  transforms are separable passes along x, y and z, each parallel over the lines of the pass.
+//  Lines that are entirely zero on input, or not needed on output, are skipped.
+
+//  Forward transform of m_grid into m_spectrum, where only cells with y and z less than
+//  nonZeroSize may be non-zero.
+
+void ParticleMesh::ForwardTransform(const int nonZeroSize)
+{
+    const int M = m_paddedSize;
+    const int H = M / 2 + 1;
+
+    ParallelFor(0, M, [=](int z)
+    {
+        for (int y = 0; y < M; ++y)
+        {
+            std::complex<float>* const spectrum = &m_spectrum[(size_t(z) * M + y) * H];
+            if ((y < nonZeroSize) && (z < nonZeroSize))
+                RealFft(&m_grid[(size_t(z) * M + y) * M], spectrum);
+            else
+                std::fill(spectrum, spectrum + H, std::complex<float>(0.0f));
+        }
+    });
+
+    ParallelFor(0, nonZeroSize, [=](int z)
+    {
+        std::vector<std::complex<float>> line(M);
+        std::complex<float>* const plane = &m_spectrum[size_t(z) * M * H];
+        for (int x = 0; x < H; ++x)
+        {
+            for (int y = 0; y < M; ++y)
+                line[y] = plane[size_t(y) * H + x];
+            ComplexFft(line.data(), M, false);
+            for (int y = 0; y < M; ++y)
+                plane[size_t(y) * H + x] = line[y];
+        }
+    });
+
+    ParallelFor(0, M, [=](int y)
+    {
+        std::vector<std::complex<float>> line(M);
+        std::complex<float>* const row = &m_spectrum[size_t(y) * H];
+        const size_t stride = size_t(M) * H;
+        for (int x = 0; x < H; ++x)
+        {
+            for (int z = 0; z < M; ++z)
+                line[z] = row[z * stride + x];
+            ComplexFft(line.data(), M, false);
+            for (int z = 0; z < M; ++z)
+                row[z * stride + x] = line[z];
+        }
+    });
+}
+
+//  Unnormalized inverse transform of m_spectrum into m_grid, only calculating the cells with
+//  y and z less than outputSize. The spectrum is overwritten.
+
+void ParticleMesh::InverseTransform(const int outputSize)
+{
+    const int M = m_paddedSize;
+    const int H = M / 2 + 1;
+
+    ParallelFor(0, M, [=](int y)
+    {
+        std::vector<std::complex<float>> line(M);
+        std::complex<float>* const row = &m_spectrum[size_t(y) * H];
+        const size_t stride = size_t(M) * H;
+        for (int x = 0; x < H; ++x)
+        {
+            for (int z = 0; z < M; ++z)
+                line[z] = row[z * stride + x];
+            ComplexFft(line.data(), M, true);
+            for (int z = 0; z < M; ++z)
+                row[z * stride + x] = line[z];
+        }
+    });
+
+    ParallelFor(0, outputSize, [=](int z)
+    {
+        std::vector<std::complex<float>> line(M);
+        std::complex<float>* const plane = &m_spectrum[size_t(z) * M * H];
+        for (int x = 0; x < H; ++x)
+        {
+            for (int y = 0; y < M; ++y)
+                line[y] = plane[size_t(y) * H + x];
+            ComplexFft(line.data(), M, true);
+            for (int y = 0; y < M; ++y)
+                plane[size_t(y) * H + x] = line[y];
+        }
+    });
+
+    ParallelFor(0, outputSize, [=](int z)
+    {
+        for (int y = 0; y < outputSize; ++y)
+            InverseRealFft(&m_spectrum[(size_t(z) * M + y) * H], &m_grid[(size_t(z) * M + y) * M]);
+    });
+}
+
+//  In place iterative radix 2 FFT of n points, where n is M or M/2. The twiddle factors of the
+//  M point transform are shared by the smaller transforms by striding through them.
+
+void ParticleMesh::ComplexFft(std::complex<float>* const data, const int n, const bool inverse) const
+{
+    for (int i = 1, j = 0; i < n; ++i)
+    {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(data[i], data[j]);
+    }
+
+    for (int length = 2; length <= n; length <<= 1)
+    {
+        const int half = length / 2;
+        const int stride = m_paddedSize / length;
+        for (int i = 0; i < n; i += length)
+        {
+            for (int k = 0; k < half; ++k)
+            {
+                const std::complex<float> w = inverse ? std::conj(m_twiddles[k * stride]) : m_twiddles[k * stride];
+                const std::complex<float> u = data[i + k];
+                const std::complex<float> v = data[i + k + half] * w;
+                data[i + k] = u + v;
+                data[i + k + half] = u - v;
+            }
+        }
+    }
+}
+
+//  Transform a line of M real values into its M/2 + 1 non-negative frequencies. The even and odd
+//  values are packed into the real and imaginary parts of an M/2 point complex transform, whose
+//  result is then separated into the transforms of the even and odd values and combined.
+
+void ParticleMesh::RealFft(float* const real, std::complex<float>* const spectrum) const
+{
+    const int N = m_paddedSize / 2;
+    for (int k = 0; k < N; ++k)
+        spectrum[k] = std::complex<float>(real[2 * k], real[2 * k + 1]);
+
+    ComplexFft(spectrum, N, false);
+
+    const std::complex<float> z0 = spectrum[0];
+    spectrum[0] = std::complex<float>(z0.real() + z0.imag(), 0.0f);
+    spectrum[N] = std::complex<float>(z0.real() - z0.imag(), 0.0f);
+
+    for (int k = 1; k <= N / 2; ++k)
+    {
+        const std::complex<float> a = spectrum[k];
+        const std::complex<float> b = std::conj(spectrum[N - k]);
+        const std::complex<float> even = 0.5f * (a + b);
+        const std::complex<float> odd = std::complex<float>(0.0f, -0.5f) * (a - b);
+        const std::complex<float> wOdd = m_twiddles[k] * odd;
+        spectrum[k] = even + wOdd;
+        spectrum[N - k] = std::conj(even - wOdd);
+    }
+}
+
+//  Inverse of RealFft, scaled by M. The spectrum is overwritten.
+
+void ParticleMesh::InverseRealFft(std::complex<float>* const spectrum, float* const real) const
+{
+    const int N = m_paddedSize / 2;
+    const std::complex<float> i(0.0f, 1.0f);
+
+    const std::complex<float> x0 = spectrum[0];
+    const std::complex<float> xN = std::conj(spectrum[N]);
+    spectrum[0] = (x0 + xN) + i * (x0 - xN);
+
+    for (int k = 1; k <= N / 2; ++k)
+    {
+        const std::complex<float> a = spectrum[k];
+        const std::complex<float> b = std::conj(spectrum[N - k]);
+        const std::complex<float> even = a + b;
+        const std::complex<float> odd = (a - b) * std::conj(m_twiddles[k]);
+        spectrum[k] = even + i * odd;
+        spectrum[N - k] = std::conj(even) + i * std::conj(odd);
+    }
+
+    ComplexFft(spectrum, N, true);
+
+    for (int k = 0; k < N; ++k)
+    {
+        real[2 * k] = spectrum[k].real();
+        real[2 * k + 1] = spectrum[k].imag();
+    }
+}
+
+//--------------------------------------------------------------------------------------
+//  Particle-mesh engine.
+//--------------------------------------------------------------------------------------
+
+NBodyParticleMesh::NBodyParticleMesh(float softeningSquared, float dampingFactor, float deltaTime, int gridSize, MeshAssignment assignment,
+    IntegratorType integrator) :
+    INBodyCpu(),
+    m_deltaTime(deltaTime),
+    m_dampingFactor(dampingFactor),
+    m_integrator(integrator),
+    m_mesh(gridSize, assignment, softeningSquared),
+    m_primed(false)
+{
+}
+
+void NBodyParticleMesh::Integrate(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const unused, int numParticles) const
+{
+    if (!m_primed && UsesPreviousAcceleration(m_integrator))
+        ComputeAccelerations(pParticles, numParticles);
+    m_primed = true;
+
+    BeginParticleStep(pParticles, numParticles, m_deltaTime, m_integrator);
+    ComputeAccelerations(pParticles, numParticles);
+    EndParticleStep(pParticles, numParticles, m_deltaTime, m_dampingFactor, m_integrator);
+}
+
+void NBodyParticleMesh::ComputeAccelerations(ParticleStoreSoA* const pParticles, int numParticles) const
+{
+    std::fill(pParticles->ax, pParticles->ax + numParticles, 0.0f);
+    std::fill(pParticles->ay, pParticles->ay + numParticles, 0.0f);
+    std::fill(pParticles->az, pParticles->az + numParticles, 0.0f);
+
+    m_mesh.AccumulateAccelerations(pParticles, numParticles);
+}
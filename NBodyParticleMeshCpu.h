@@ -0,0 +1,154 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <vector>
+#include <complex>
+#include <amp_short_vectors.h>
+
+#include "INBodyCpu.h"
+#include "ParticleCpu.h"
+#include "NBodyOctreeCpu.h"
+#include "IntegratorCpu.h"
+
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  Particle-mesh gravity solver.
+//--------------------------------------------------------------------------------------
+//
+//  Calculates the accelerations of all the particles by solving for the potential on a
+//  regular grid:
+//
+//  1. The sources' masses are deposited onto the grid using the cloud in cell (CIC) or
+//     triangular shaped cloud (TSC) assignment scheme. The sources are sorted by the first
+//     plane of the grid they touch and each task deposits one plane's sources, in three
+//     phases so that tasks never write the same plane. Tracers have no mass and are skipped.
+//  2. The potential is the convolution of the mass grid with the Green's function of the
+//     potential. This is calculated with a real to complex FFT, a multiplication by the
+//     transformed Green's function and an inverse complex to real FFT. The FFTs are parallel
+//     over the lines of the grid.
+//  3. The acceleration on the grid is the gradient of the potential, calculated with a four
+//     point finite difference.
+//  4. The grid accelerations are interpolated back to all the particles using the same
+//     scheme used to deposit the masses.
+//
+//  The particles are not in a periodic box so the grid is zero padded to twice its size in
+//  each dimension before the convolution, Hockney and Eastwood's method for isolated systems.
+//  The grid is fitted to the particles' bounding box each step. The cell size is rounded up to
+//  a power of 2^(1/4) so the transformed Green's function only needs to be recalculated when
+//  the particles' extent changes significantly.
+//
+//  The cost of each step is O(N + G log G) for N particles and G grid cells. Separations smaller
+//  than a few cells are not resolved.
+//
+//  The Green's function is either the softened Newtonian potential, 1 / sqrt(r^2 + e^2), or the
+//  long range part of a Gaussian force split, erf(r / 2rs) / r, for the TreePM engine. The split
+//  scale rs is given in cells so the split follows the grid as it is refitted.
+
+//  VC++ 2012 does not provide the C99 erf and erfc functions.
+
+double ErrorFunctionComplement(double x);
+
+enum MeshAssignment
+{
+    kMeshCIC = 0,
+    kMeshTSC = 1
+};
+
+class ParticleMesh
+{
+private:
+    const int m_gridSize;               // Cells along each side of the grid holding particles.
+    const int m_paddedSize;             // Cells along each side of the zero padded FFT grid.
+    const MeshAssignment m_assignment;
+    const float m_softeningSquared;
+    const float m_splitScale;           // Gaussian split scale in cells, zero for the full potential.
+
+    float m_cellSize;
+    float_3 m_origin;
+    float m_greenCellSize;              // Cell size the transformed Green's function was calculated for.
+
+    std::vector<float> m_grid;          // Zero padded mass grid, replaced by the potential.
+    std::vector<uint64_t> m_planeKeys;  // First plane touched by each source, sorted.
+    std::vector<int> m_planeIndex;      // Source of each sorted key.
+    std::vector<uint64_t> m_planeKeysTemp;
+    std::vector<int> m_planeIndexTemp;
+    std::vector<int> m_planeStart;      // First sorted source of each plane.
+    std::vector<std::complex<float>> m_spectrum;
+    std::vector<float> m_green;
+    std::vector<float> m_accX;
+    std::vector<float> m_accY;
+    std::vector<float> m_accZ;
+    std::vector<std::complex<float>> m_twiddles;
+
+public:
+    ParticleMesh(int gridSize, MeshAssignment assignment, float softeningSquared, float splitScale = 0.0f);
+
+    //  Add the mesh acceleration of each particle to its acceleration streams.
+
+    void AccumulateAccelerations(ParticleStoreSoA* const pParticles, int numParticles);
+
+    inline float CellSize() const { return m_cellSize; }
+
+private:
+    void FitGrid(const ParticleStoreSoA* const pParticles, int numParticles);
+    void UpdateGreensFunction();
+    void Deposit(const ParticleStoreSoA* const pParticles, int numSources);
+    void SolvePotential();
+    void Gradient();
+    void Interpolate(ParticleStoreSoA* const pParticles, int numParticles) const;
+
+    void ForwardTransform(const int nonZeroSize);
+    void InverseTransform(const int outputSize);
+    void ComplexFft(std::complex<float>* const data, const int n, const bool inverse) const;
+    void RealFft(float* const real, std::complex<float>* const spectrum) const;
+    void InverseRealFft(std::complex<float>* const spectrum, float* const real) const;
+
+    // VC++ does not yet support deleted functions.
+    ParticleMesh(const ParticleMesh&);
+    ParticleMesh& operator=(const ParticleMesh&);
+};
+
+//--------------------------------------------------------------------------------------
+//  Particle-mesh implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  Suited to smooth, large scale distributions where forces between nearby particles are not
+//  important. Particles are updated in place, integrated and damped exactly as NBodyAdvanced
+//  does, so the particleOut parameter is unused.
+
+class NBodyParticleMesh : public INBodyCpu
+{
+private:
+    const float m_deltaTime;
+    const float m_dampingFactor;
+    const IntegratorType m_integrator;
+    mutable ParticleMesh m_mesh;
+    mutable bool m_primed;
+
+public:
+    NBodyParticleMesh(float softeningSquared, float dampingFactor, float deltaTime, int gridSize, MeshAssignment assignment,
+        IntegratorType integrator = kIntegratorEuler);
+
+    void Integrate(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const unused, int numParticles) const;
+
+    void ParticlesChanged(bool reloaded) { m_primed = m_primed && !reloaded; }
+
+private:
+    void ComputeAccelerations(ParticleStoreSoA* const pParticles, int numParticles) const;
+};
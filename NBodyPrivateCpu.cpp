@@ -0,0 +1,302 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <assert.h>
+#include <stdint.h>
+#include <algorithm>
+#include <utility>
+
+#include "Common.h"
+#include "NBodyPrivateCpu.h"
+#include "ArenaCpu.h"
+#include "ParallelCpu.h"
+
+//  Number of sources summed into the store by each task of the last reduction step.
+
+const int kPrivateChunkSize = 4 * 1024;
+
+//  Blocks start on a cache line so no two tasks of the reduction write the same line.
+
+const int kBlockAlignment = CACHE_ALIGNMENTBOUNDARY / sizeof(float);
+
+NBodyPrivateAccumulation::NBodyPrivateAccumulation(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int tileSize, int blockSize,
+    CpuSSE maxSSE, IntegratorType integrator) :
+    INBodyCpu(),
+    m_engine(new NBodyAdvancedInteractionEngine(softeningSquared, particleMass, maxSSE)),
+    m_deltaTime(deltaTime),
+    m_dampingFactor(dampingFactor),
+    m_integrator(integrator),
+    m_tileSize(tileSize),
+    m_blockSize(std::max(blockSize, tileSize)),
+    m_primed(false),
+    m_stride(0)
+{
+    assert(tileSize > 0);
+}
+
+NBodyPrivateAccumulation::~NBodyPrivateAccumulation()
+{
+    FreeAccelerations();
+}
+
+//--------------------------------------------------------------------------------------
+//  Integrate all the particles in place.
+//--------------------------------------------------------------------------------------
+//
+//  Integrators that start each step with the previous step's accelerations calculate them once
+//  more before the first step, and again after the particles have been reloaded.
+
+#pragma warning(push)
+#pragma warning(disable:4100)   // Ignore unused parameter warning.
+
+void NBodyPrivateAccumulation::Integrate(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const unused, int numParticles) const
+{
+    if (!m_primed && UsesPreviousAcceleration(m_integrator))
+    {
+        std::fill(pParticles->ax, pParticles->ax + numParticles, 0.0f);
+        std::fill(pParticles->ay, pParticles->ay + numParticles, 0.0f);
+        std::fill(pParticles->az, pParticles->az + numParticles, 0.0f);
+        AccumulateAccelerations(pParticles, numParticles);
+    }
+    m_primed = true;
+
+    BeginParticleStep(pParticles, numParticles, m_deltaTime, m_integrator);
+    AccumulateAccelerations(pParticles, numParticles);
+    EndParticleStep(pParticles, numParticles, m_deltaTime, m_dampingFactor, m_integrator);
+}
+
+#pragma warning(pop)
+
+//  Add the accelerations of every particle to those already in the store. The sources' cells
+//  are calculated by one static task per block, so each thread works in the same streams, and
+//  on a NUMA machine the same pages, every step. The tracers gather from all the sources.
+
+void NBodyPrivateAccumulation::AccumulateAccelerations(ParticleStoreSoA* const pParticles, int numParticles) const
+{
+    const int numSources = pParticles->NumSources(numParticles);
+    if (numSources > 0)
+    {
+        Partition(pParticles, numSources);
+        ParallelForStatic(0, static_cast<int>(m_blockBegin.size()) - 1, [=](int thread)
+        {
+            ThreadInteractions(pParticles, thread);
+        });
+        ReduceAccelerations(pParticles);
+    }
+
+    const int tileSize = m_tileSize;
+    const NBodyAdvancedInteractionEngine* const engine = m_engine.get();
+    ParallelForStatic(numSources, numParticles, tileSize, [=](int begin)
+    {
+        const int end = std::min(begin + tileSize, numParticles);
+        for (int j = 0; j < numSources; j += tileSize)
+            engine->InvokeBodyBodyGather(pParticles, begin, end, j, std::min(j + tileSize, numSources));
+    });
+}
+
+//  Split the sources into one block per thread, at least a tile each, and make sure every block
+//  has its streams. The streams are only reallocated when the store's stride changes or there
+//  are more blocks than before. They are sparse, as each thread only writes part of them.
+
+void NBodyPrivateAccumulation::Partition(const ParticleStoreSoA* const pParticles, int numSources) const
+{
+    const int numBlocks = std::max(1, std::min(ParallelConcurrency(), numSources / m_tileSize));
+    m_blockBegin.resize(numBlocks + 1);
+    for (int b = 0; b < numBlocks; ++b)
+    {
+        const int begin = static_cast<int>(int64_t(numSources) * b / numBlocks);
+        m_blockBegin[b] = std::min(numSources, ((begin + kBlockAlignment - 1) / kBlockAlignment) * kBlockAlignment);
+    }
+    m_blockBegin[numBlocks] = numSources;
+    m_written.assign(size_t(numBlocks) * numBlocks, 0);
+
+    if (m_stride != pParticles->Stride())
+    {
+        FreeAccelerations();
+        m_stride = pParticles->Stride();
+    }
+    while (static_cast<int>(m_accelerations.size()) < numBlocks)
+    {
+        float* const pAccelerations = static_cast<float*>(ParticleArena::Instance().Allocate(3 * m_stride * sizeof(float), ParticleArena::kAnyNode, true));
+        assert(pAccelerations != nullptr);
+        m_accelerations.push_back(pAccelerations);
+    }
+}
+
+//  All the cells owned by one thread, calculated into its own streams through a view of the
+//  store. The blocks it writes are cleared first, which on a NUMA machine also places them on
+//  the thread's node.
+
+void NBodyPrivateAccumulation::ThreadInteractions(ParticleStoreSoA* const pParticles, int thread) const
+{
+    const int numBlocks = static_cast<int>(m_blockBegin.size()) - 1;
+    const int* const blockBegin = m_blockBegin.data();
+    ParticleStoreSoA view(*pParticles, m_accelerations[thread]);
+
+    for (int k = 0; k <= numBlocks / 2; ++k)
+    {
+        const int b = (thread + k) % numBlocks;
+        std::fill(view.ax + blockBegin[b], view.ax + blockBegin[b + 1], 0.0f);
+        std::fill(view.ay + blockBegin[b], view.ay + blockBegin[b + 1], 0.0f);
+        std::fill(view.az + blockBegin[b], view.az + blockBegin[b + 1], 0.0f);
+        m_written[thread * numBlocks + b] = 1;
+    }
+
+    ListInteractions(&view, blockBegin[thread], blockBegin[thread + 1]);
+    for (int k = 1; k <= (numBlocks - 1) / 2; ++k)
+    {
+        const int b = (thread + k) % numBlocks;
+        CellInteractions(&view, blockBegin[thread], blockBegin[thread + 1], blockBegin[b], blockBegin[b + 1]);
+    }
+
+    // The cell between block a and block a + B / 2 is split by the rows of block a.
+    if (numBlocks % 2 == 0)
+    {
+        const int half = numBlocks / 2;
+        const int a = thread % half;
+        const int b = a + half;
+        const int middle = blockBegin[a] + (((blockBegin[a + 1] - blockBegin[a]) / 2) / kBlockAlignment) * kBlockAlignment;
+        if (thread < half)
+            CellInteractions(&view, blockBegin[a], middle, blockBegin[b], blockBegin[b + 1]);
+        else
+            CellInteractions(&view, middle, blockBegin[a + 1], blockBegin[b], blockBegin[b + 1]);
+    }
+}
+
+//  Interactions within a thread's block. Each L2 block, and within it each tile, interacts with
+//  itself and then with the blocks or tiles after it. Tiles are halved down to single particles.
+
+void NBodyPrivateAccumulation::ListInteractions(ParticleStoreSoA* const pView, int begin, int end) const
+{
+    const int width = end - begin;
+
+    if (width > m_blockSize)
+    {
+        for (int i = begin; i < end; i += m_blockSize)
+        {
+            const int iEnd = std::min(i + m_blockSize, end);
+            ListInteractions(pView, i, iEnd);
+            if (iEnd < end)
+                CellInteractions(pView, i, iEnd, iEnd, end);
+        }
+    }
+    else if (width > m_tileSize)
+    {
+        for (int i = begin; i < end; i += m_tileSize)
+        {
+            const int iEnd = std::min(i + m_tileSize, end);
+            ListInteractions(pView, i, iEnd);
+            if (iEnd < end)
+                CellInteractions(pView, i, iEnd, iEnd, end);
+        }
+    }
+    else if (width > 1)
+    {
+        const int middle = begin + (width / 2);
+        ListInteractions(pView, begin, middle);
+        ListInteractions(pView, middle, end);
+        m_engine->InvokeBodyBodyInteraction(pView, begin, middle, middle, end);
+    }
+}
+
+//  Interactions between two ranges. The j range is taken an L2 block at a time, which stays in
+//  the L2 cache while each i tile, in the L1 cache, interacts with each of its tiles in turn.
+
+void NBodyPrivateAccumulation::CellInteractions(ParticleStoreSoA* const pView, int iBegin, int iEnd, int jBegin, int jEnd) const
+{
+    for (int jBlock = jBegin; jBlock < jEnd; jBlock += m_blockSize)
+    {
+        const int jBlockEnd = std::min(jBlock + m_blockSize, jEnd);
+        for (int i = iBegin; i < iEnd; i += m_tileSize)
+        {
+            const int iTileEnd = std::min(i + m_tileSize, iEnd);
+            for (int j = jBlock; j < jBlockEnd; j += m_tileSize)
+                m_engine->InvokeBodyBodyInteraction(pView, i, iTileEnd, j, std::min(j + m_tileSize, jBlockEnd));
+        }
+    }
+}
+
+//  Merge the threads' streams by a tree of pairwise sums. In each step thread t's streams take
+//  the blocks of thread t + span, adding those both have written and copying the rest, with one
+//  task per block. After log2(B) steps thread 0's streams hold every block, which are then added
+//  to the store.
+
+void NBodyPrivateAccumulation::ReduceAccelerations(ParticleStoreSoA* const pParticles) const
+{
+    const int numBlocks = static_cast<int>(m_blockBegin.size()) - 1;
+    const int* const blockBegin = m_blockBegin.data();
+    float* const* const accelerations = m_accelerations.data();
+    char* const written = m_written.data();
+    const size_t stride = m_stride;
+
+    std::vector<std::pair<int, int>> sums;
+    for (int span = 1; span < numBlocks; span *= 2)
+    {
+        sums.clear();
+        for (int t = 0; t + span < numBlocks; t += 2 * span)
+        {
+            for (int b = 0; b < numBlocks; ++b)
+            {
+                if (written[(t + span) * numBlocks + b])
+                    sums.push_back(std::make_pair(t, b));
+            }
+        }
+
+        const std::pair<int, int>* const pSums = sums.data();
+        ParallelFor(0, static_cast<int>(sums.size()), [=](int n)
+        {
+            const int t = pSums[n].first;
+            const int b = pSums[n].second;
+            const int begin = blockBegin[b];
+            const int end = blockBegin[b + 1];
+            for (int s = 0; s < 3; ++s)
+            {
+                float* const pTo = accelerations[t] + s * stride;
+                const float* const pFrom = accelerations[t + span] + s * stride;
+                if (written[t * numBlocks + b])
+                {
+                    for (int i = begin; i < end; ++i)
+                        pTo[i] += pFrom[i];
+                }
+                else
+                {
+                    std::copy(pFrom + begin, pFrom + end, pTo + begin);
+                }
+            }
+            written[t * numBlocks + b] = 1;
+        });
+    }
+
+    const int numSources = blockBegin[numBlocks];
+    const float* const pSum = accelerations[0];
+    ParallelForStatic(0, numSources, kPrivateChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kPrivateChunkSize, numSources);
+        for (int i = begin; i < end; ++i)
+        {
+            pParticles->ax[i] += pSum[i];
+            pParticles->ay[i] += pSum[stride + i];
+            pParticles->az[i] += pSum[2 * stride + i];
+        }
+    });
+}
+
+void NBodyPrivateAccumulation::FreeAccelerations() const
+{
+    for (float* const pAccelerations : m_accelerations)
+        ParticleArena::Instance().Free(pAccelerations);
+    m_accelerations.clear();
+}
@@ -0,0 +1,89 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <vector>
+#include <memory>
+
+#include "INBodyCpu.h"
+#include "ParticleCpu.h"
+#include "IntegratorCpu.h"
+#include "NBodyAdvancedCpu.h"
+
+//--------------------------------------------------------------------------------------
+//  Direct n-body calculation with thread private accelerations.
+//--------------------------------------------------------------------------------------
+//
+//  An alternative to the recursion of NBodyAdvanced for comparing how the two scale on machines
+//  with many cores. The recursion keeps every update in the shared store, so its tasks only run
+//  in parallel when they write disjoint ranges, and every level waits for both of its halves.
+//  Here the sources are split into one block per thread and every thread owns a fixed set of
+//  pairs of blocks, the cells, which it calculates into its own acceleration streams with the
+//  same reciprocal kernels. No two threads ever write the same memory while the forces are
+//  calculated, and a tree of pairwise sums then merges the threads' streams in log2(T) steps.
+//
+//  With B blocks thread t owns the pairs within block t and the cells (t, t + k), modulo B, for
+//  k = 1 ... (B - 1) / 2. With an even number of blocks the cells (t, t + B / 2) are shared by
+//  two threads, each taking half of the rows of the first block. Every thread then calculates
+//  the same number of pairs and only writes its own block and the B / 2 blocks after it, so
+//  only these are cleared and summed. Each stream spans all the sources, so the streams are
+//  sparse buffers from the arena, with normal pages, and only the pages of the blocks a thread
+//  writes take physical memory. The reduction then copies blocks into the streams of the lower
+//  threads, until thread 0's hold all of them.
+//
+//  Within its cells each thread works through blocks that fit into its share of the L2 cache
+//  and tiles that fit into the L1 cache, as NBodyAdvanced does. The tracers gather from the
+//  sources straight into the store.
+
+class NBodyPrivateAccumulation : public INBodyCpu
+{
+private:
+    std::shared_ptr<NBodyAdvancedInteractionEngine> m_engine;
+    const float m_deltaTime;
+    const float m_dampingFactor;
+    const IntegratorType m_integrator;
+    const int m_tileSize;                                       // Number of particles that fit into an L1 cache.
+    const int m_blockSize;                                      // Number of particles that fit into a core's share of the L2 cache.
+    mutable bool m_primed;                                      // The store holds the previous step's accelerations.
+    mutable std::vector<float*> m_accelerations;                // Each thread's ax, ay and az streams.
+    mutable size_t m_stride;                                    // Floats in each of those streams.
+    mutable std::vector<int> m_blockBegin;                      // First source of each block, and the end of the last.
+    mutable std::vector<char> m_written;                        // Thread t's streams hold block b at [t * B + b].
+
+public:
+    NBodyPrivateAccumulation(float softeningSquared, float dampingFactor, float deltaTime, float particleMass, int tileSize, int blockSize,
+        CpuSSE maxSSE = kCpuAVX512, IntegratorType integrator = kIntegratorEuler);
+
+    ~NBodyPrivateAccumulation();
+
+    void Integrate(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const unused, int numParticles) const;
+
+    void ParticlesChanged(bool reloaded) { m_primed = m_primed && !reloaded; }
+
+private:
+    void AccumulateAccelerations(ParticleStoreSoA* const pParticles, int numParticles) const;
+    void Partition(const ParticleStoreSoA* const pParticles, int numSources) const;
+    void ThreadInteractions(ParticleStoreSoA* const pParticles, int thread) const;
+    void ListInteractions(ParticleStoreSoA* const pView, int begin, int end) const;
+    void CellInteractions(ParticleStoreSoA* const pView, int iBegin, int iEnd, int jBegin, int jEnd) const;
+    void ReduceAccelerations(ParticleStoreSoA* const pParticles) const;
+    void FreeAccelerations() const;
+
+    // VC++ does not yet support deleted functions. Copying would double free the streams.
+    NBodyPrivateAccumulation(const NBodyPrivateAccumulation&);
+    NBodyPrivateAccumulation& operator=(const NBodyPrivateAccumulation&);
+};
@@ -0,0 +1,311 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <math.h>
+#include <float.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "Common.h"
+#include "NBodyAdvancedCpu.h"
+#include "NBodyTreePmCpu.h"
+#include "ParallelCpu.h"
+
+using namespace concurrency::graphics;
+
+//  Maximum number of particles in a leaf of the tree.
+
+const int kTreePmLeafSize = 64;
+
+//  Nodes with more particles than this calculate their children's moments in parallel.
+
+const int kTreePmParallelThreshold = 4 * 1024;
+
+//  Number of leaves traversed by each task.
+
+const int kTreePmLeavesPerTask = 16;
+
+//  Short range interactions are ignored beyond this many split scales, where the short range
+//  force is less than 2% of the Newtonian force.
+
+const float kTreePmCutoff = 4.5f;
+
+//  Short range fraction of the Newtonian force at distance r, where x = r / 2rs:
+//
+//      g(x) = erfc(x) + (2x / sqrt(pi)) * exp(-x^2)
+//
+//  Inside the cutoff g is approximated by a degree 8 Chebyshev fit, accurate to 1e-4, which is
+//  several times cheaper than evaluating the exponential and erfc and still vectorizes. Beyond
+//  the cutoff it is zero, matching the nodes the walk skips.
+
+const float kTreePmCutoffX = 0.5f * kTreePmCutoff;
+
+static inline float ShortRangeFactor(float x)
+{
+    const float g = 0.99994722f + x * (0.0038657421f + x * (-0.049751044f + x * (-0.49237664f + x * (-0.70414878f +
+        x * (1.5357161f + x * (-0.95314397f + x * (0.25916046f + x * -0.026842111f)))))));
+    return (x < kTreePmCutoffX) ? g : 0.0f;
+}
+
+NBodyTreePm::NBodyTreePm(float softeningSquared, float dampingFactor, float deltaTime,
+    float openingAngle, int meshSize, float splitScale, IntegratorType integrator) :
+    INBodyCpu(),
+    m_softeningSquared(softeningSquared),
+    m_dampingFactor(dampingFactor),
+    m_deltaTime(deltaTime),
+    m_openingAngle(openingAngle),
+    m_splitScale(splitScale),
+    m_integrator(integrator),
+    m_mesh(meshSize, kMeshTSC, softeningSquared, splitScale),
+    m_tree(kTreePmLeafSize),
+    m_primed(false)
+{
+    assert((openingAngle >= 0.0f) && (openingAngle <= 1.0f));
+    assert(splitScale > 0.0f);
+}
+
+//--------------------------------------------------------------------------------------
+//  Integrate all the particles.
+//--------------------------------------------------------------------------------------
+//
+//  Integrators that start each step with the previous step's accelerations calculate them once
+//  more before the first step.
+
+void NBodyTreePm::Integrate(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const unused, int numParticles) const
+{
+    if (!m_primed && UsesPreviousAcceleration(m_integrator))
+        ComputeAccelerations(pParticles, numParticles);
+    m_primed = true;
+
+    BeginParticleStep(pParticles, numParticles, m_deltaTime, m_integrator);
+    ComputeAccelerations(pParticles, numParticles);
+    EndParticleStep(pParticles, numParticles, m_deltaTime, m_dampingFactor, m_integrator);
+}
+
+//  The mesh adds the long range accelerations to the particles. The short range accelerations
+//  are calculated in Morton order in the tree's sorted store and then added to them. The split
+//  scale follows the mesh's cell size, which is only known once the mesh has been fitted.
+
+void NBodyTreePm::ComputeAccelerations(ParticleStoreSoA* const pParticles, int numParticles) const
+{
+    std::fill(pParticles->ax, pParticles->ax + numParticles, 0.0f);
+    std::fill(pParticles->ay, pParticles->ay + numParticles, 0.0f);
+    std::fill(pParticles->az, pParticles->az + numParticles, 0.0f);
+
+    m_mesh.AccumulateAccelerations(pParticles, numParticles);
+    const float splitScale = m_splitScale * m_mesh.CellSize();
+
+    m_tree.Build(pParticles, numParticles);
+
+    if (m_moments.size() < static_cast<size_t>(m_tree.NumNodes()))
+        m_moments.resize(std::max(static_cast<size_t>(m_tree.NumNodes()), 2 * static_cast<size_t>(numParticles)));
+    ComputeMoments(m_tree.Root());
+
+    const int numLeaves = m_tree.NumLeaves();
+    ParallelFor(0, numLeaves, kTreePmLeavesPerTask, [=](int begin)
+    {
+        std::vector<int> nodeList;
+        std::vector<int> leafList;
+        std::vector<int> stack;
+        const int end = std::min(begin + kTreePmLeavesPerTask, numLeaves);
+        for (int l = begin; l < end; ++l)
+            LeafInteractions(m_tree.Leaf(l), splitScale, nodeList, leafList, stack);
+    });
+
+    const ParticleStoreSoA* const pSorted = m_tree.Sorted();
+    const int chunkSize = 1024;
+    ParallelFor(0, numParticles, chunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + chunkSize, numParticles);
+        for (int s = begin; s < end; ++s)
+        {
+            const int i = m_tree.SortedIndex(s);
+            pParticles->ax[i] += pSorted->ax[s];
+            pParticles->ay[i] += pSorted->ay[s];
+            pParticles->az[i] += pSorted->az[s];
+        }
+    });
+}
+
+//  Calculate the mass and center of mass of each node, from the leaves up. A node without
+//  sources is given its geometric center and is never used.
+
+void NBodyTreePm::ComputeMoments(int node) const
+{
+    const OctreeNode& n = m_tree.Node(node);
+    float_3 com(0.0f);
+    float mass = 0.0f;
+
+    if (n.IsLeaf())
+    {
+        const ParticleStoreSoA* const pSorted = m_tree.Sorted();
+        for (int s = n.begin; s < n.SourceEnd(); ++s)
+        {
+            com += pSorted->Position(s) * pSorted->mass[s];
+            mass += pSorted->mass[s];
+        }
+    }
+    else
+    {
+        if (n.Count() > kTreePmParallelThreshold)
+            ParallelFor(n.firstChild, n.firstChild + n.numChildren, [=](int c) { ComputeMoments(c); });
+        else
+            for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+                ComputeMoments(c);
+
+        for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+        {
+            com += m_moments[c].centerOfMass * m_moments[c].mass;
+            mass += m_moments[c].mass;
+        }
+    }
+    com = (mass > 0.0f) ? com * (1.0f / mass) : n.center;
+
+    TreePmMoments& moments = m_moments[node];
+    moments.centerOfMass = com;
+    moments.mass = mass;
+
+    const float delta = sqrt(SqrLength(com - n.center));
+    const float openRadius = (m_openingAngle > 0.0f) ? (2.0f * n.halfWidth / m_openingAngle + delta) : FLT_MAX;
+    moments.openRadiusSqr = (openRadius < sqrt(FLT_MAX)) ? openRadius * openRadius : FLT_MAX;
+}
+
+//--------------------------------------------------------------------------------------
+//  Calculate the short range accelerations of one leaf's particles.
+//--------------------------------------------------------------------------------------
+//
+//  As NBodyBarnesHut::LeafInteractions, except that nodes whose cube is further than the
+//  cutoff from the leaf's bounding box are skipped along with all their children, and each
+//  interaction is scaled by the short range factor.
+
+void NBodyTreePm::LeafInteractions(int leaf, float splitScale, std::vector<int>& nodeList, std::vector<int>& leafList, std::vector<int>& stack) const
+{
+    ParticleStoreSoA* const pSorted = m_tree.Sorted();
+    const OctreeNode& target = m_tree.Node(leaf);
+
+    float_3 boxMin(FLT_MAX);
+    float_3 boxMax(-FLT_MAX);
+    for (int s = target.begin; s < target.end; ++s)
+    {
+        boxMin.x = std::min(boxMin.x, pSorted->x[s]); boxMax.x = std::max(boxMax.x, pSorted->x[s]);
+        boxMin.y = std::min(boxMin.y, pSorted->y[s]); boxMax.y = std::max(boxMax.y, pSorted->y[s]);
+        boxMin.z = std::min(boxMin.z, pSorted->z[s]); boxMax.z = std::max(boxMax.z, pSorted->z[s]);
+    }
+
+    const float cutoff = kTreePmCutoff * splitScale;
+    const float cutoffSqr = cutoff * cutoff;
+
+    nodeList.clear();
+    leafList.clear();
+    stack.clear();
+    stack.push_back(m_tree.Root());
+
+    while (!stack.empty())
+    {
+        const int node = stack.back();
+        stack.pop_back();
+        const OctreeNode& n = m_tree.Node(node);
+        if (n.numSources == 0)
+            continue;
+
+        // Distance between the node's cube and the leaf's box.
+        const float gapX = std::max(0.0f, std::max(boxMin.x - (n.center.x + n.halfWidth), (n.center.x - n.halfWidth) - boxMax.x));
+        const float gapY = std::max(0.0f, std::max(boxMin.y - (n.center.y + n.halfWidth), (n.center.y - n.halfWidth) - boxMax.y));
+        const float gapZ = std::max(0.0f, std::max(boxMin.z - (n.center.z + n.halfWidth), (n.center.z - n.halfWidth) - boxMax.z));
+        if ((gapX * gapX + gapY * gapY + gapZ * gapZ) > cutoffSqr)
+            continue;
+
+        // Distance from the node's center of mass to the nearest point of the leaf's box.
+        const TreePmMoments& moments = m_moments[node];
+        const float_3 com = moments.centerOfMass;
+        const float dx = std::max(0.0f, std::max(boxMin.x - com.x, com.x - boxMax.x));
+        const float dy = std::max(0.0f, std::max(boxMin.y - com.y, com.y - boxMax.y));
+        const float dz = std::max(0.0f, std::max(boxMin.z - com.z, com.z - boxMax.z));
+
+        if ((dx * dx + dy * dy + dz * dz) > moments.openRadiusSqr)
+            nodeList.push_back(node);
+        else if (n.IsLeaf())
+            leafList.push_back(node);
+        else
+            for (int c = n.firstChild; c < n.firstChild + n.numChildren; ++c)
+                stack.push_back(c);
+    }
+
+    const float inverseSplit = 0.5f / splitScale;
+    for (int blockBegin = target.begin; blockBegin < target.end; blockBegin += kTreePmLeafSize)
+    {
+        const int count = std::min(target.end - blockBegin, kTreePmLeafSize);
+        float posX[kTreePmLeafSize], posY[kTreePmLeafSize], posZ[kTreePmLeafSize];
+        float accX[kTreePmLeafSize], accY[kTreePmLeafSize], accZ[kTreePmLeafSize];
+        for (int i = 0; i < count; ++i)
+        {
+            posX[i] = pSorted->x[blockBegin + i];
+            posY[i] = pSorted->y[blockBegin + i];
+            posZ[i] = pSorted->z[blockBegin + i];
+            accX[i] = accY[i] = accZ[i] = 0.0f;
+        }
+
+        // Monopole of each accepted node.
+        for (auto it = nodeList.cbegin(); it != nodeList.cend(); ++it)
+        {
+            const TreePmMoments& m = m_moments[*it];
+            for (int i = 0; i < count; ++i)
+            {
+                const float rX = m.centerOfMass.x - posX[i];
+                const float rY = m.centerOfMass.y - posY[i];
+                const float rZ = m.centerOfMass.z - posZ[i];
+                const float distSqr = rX * rX + rY * rY + rZ * rZ + m_softeningSquared;
+                const float invDist = 1.0f / sqrt(distSqr);
+                const float s = m.mass * invDist * invDist * invDist * ShortRangeFactor(distSqr * invDist * inverseSplit);
+                accX[i] += rX * s;
+                accY[i] += rY * s;
+                accZ[i] += rZ * s;
+            }
+        }
+
+        // Direct sum over the sources of each opened leaf.
+        for (auto it = leafList.cbegin(); it != leafList.cend(); ++it)
+        {
+            const OctreeNode& source = m_tree.Node(*it);
+            for (int j = source.begin; j < source.SourceEnd(); ++j)
+            {
+                const float jX = pSorted->x[j];
+                const float jY = pSorted->y[j];
+                const float jZ = pSorted->z[j];
+                const float jMass = pSorted->mass[j];
+                for (int i = 0; i < count; ++i)
+                {
+                    const float rX = jX - posX[i];
+                    const float rY = jY - posY[i];
+                    const float rZ = jZ - posZ[i];
+                    const float distSqr = rX * rX + rY * rY + rZ * rZ + m_softeningSquared;
+                    const float invDist = 1.0f / sqrt(distSqr);
+                    const float s = jMass * invDist * invDist * invDist * ShortRangeFactor(distSqr * invDist * inverseSplit);
+                    accX[i] += rX * s;
+                    accY[i] += rY * s;
+                    accZ[i] += rZ * s;
+                }
+            }
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            pSorted->ax[blockBegin + i] = accX[i];
+            pSorted->ay[blockBegin + i] = accY[i];
+            pSorted->az[blockBegin + i] = accZ[i];
+        }
+    }
+}
@@ -0,0 +1,91 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <vector>
+#include <amp_short_vectors.h>
+
+#include "INBodyCpu.h"
+#include "ParticleCpu.h"
+#include "NBodyOctreeCpu.h"
+#include "NBodyParticleMeshCpu.h"
+#include "IntegratorCpu.h"
+
+using namespace concurrency::graphics;
+
+//--------------------------------------------------------------------------------------
+//  TreePM implementation of the n-body calculation.
+//--------------------------------------------------------------------------------------
+//
+//  The potential of each particle is split into long and short range parts with a Gaussian
+//  of scale rs:
+//
+//      1 / r = erf(r / 2rs) / r + erfc(r / 2rs) / r
+//
+//  The long range part is smooth and is calculated on a ParticleMesh. The short range part
+//  falls off rapidly beyond rs and is calculated with a tree walk that ignores every node
+//  further than the cutoff radius from the particles being updated. Nodes inside the cutoff
+//  are accepted or opened with the Barnes-Hut criterion and contribute their monopole, leaves
+//  that are too close are summed directly.
+//
+//  The short range force of a mass at distance r is the Newtonian force multiplied by
+//  erfc(r / 2rs) + (r / (rs * sqrt(pi))) * exp(-r^2 / 4rs^2).
+//
+//  The split scale is given in mesh cells. Larger scales move more of the work from the mesh
+//  to the tree and are more accurate, larger meshes shrink the cells and so the cutoff radius.
+//  Only the sources are deposited onto the mesh and summed by the walk, as in NBodyBarnesHut.
+//  Particles are updated in place, so the particleOut parameter is unused.
+//
+//  See: V. Springel, "The cosmological simulation code GADGET-2", MNRAS 364, 2005.
+
+//  Mass, center of mass and opening radius of a node for the short range walk.
+
+struct TreePmMoments
+{
+    float_3 centerOfMass;
+    float mass;
+    float openRadiusSqr;        // Square of the distance beyond which the node is not opened.
+};
+
+class NBodyTreePm : public INBodyCpu
+{
+private:
+    const float m_softeningSquared;
+    const float m_dampingFactor;
+    const float m_deltaTime;
+    const float m_openingAngle;
+    const float m_splitScale;
+    const IntegratorType m_integrator;
+
+    mutable ParticleMesh m_mesh;
+    mutable Octree m_tree;
+    mutable std::vector<TreePmMoments> m_moments;
+    mutable bool m_primed;
+
+public:
+    NBodyTreePm(float softeningSquared, float dampingFactor, float deltaTime,
+        float openingAngle, int meshSize, float splitScale, IntegratorType integrator = kIntegratorEuler);
+
+    void Integrate(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const unused, int numParticles) const;
+
+    void ParticlesChanged(bool reloaded) { m_primed = m_primed && !reloaded; }
+
+private:
+    void ComputeAccelerations(ParticleStoreSoA* const pParticles, int numParticles) const;
+    void ComputeMoments(int node) const;
+    void LeafInteractions(int leaf, float splitScale, std::vector<int>& nodeList, std::vector<int>& leafList, std::vector<int>& stack) const;
+};
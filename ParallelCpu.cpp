@@ -0,0 +1,574 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <stdlib.h>
+#include <algorithm>
+
+#include "ParallelCpu.h"
+#include "TopologyCpu.h"
+
+#if defined(NBODY_PARALLEL_THREADS)
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+//  Number of tasks each deque can hold. The recursive engines push one task per level of
+//  recursion and the loops one per thread, so this is never reached in practice. If it is
+//  the forking thread executes the tasks itself.
+
+const int kDequeCapacity = 4096;
+
+//  Number of threads outside the pool, such as the application's main thread, that can fork
+//  tasks. Further threads execute their tasks themselves.
+
+const int kMaxExternalThreads = 8;
+
+//  Time an idle thread spins, looking for work, before going to sleep. Unless NBODY_SPIN_US is
+//  set this covers the gaps between the loops of a step and between the steps of a small
+//  simulation, but not a pause in the simulation.
+
+const int kDefaultSpinMicroseconds = 2000;
+
+//--------------------------------------------------------------------------------------
+//  Chase-Lev deque.
+//--------------------------------------------------------------------------------------
+//
+//  Only the owner calls Push and Pop, any thread may call Steal. The indices only ever grow,
+//  top is advanced by a successful steal, or by the owner taking the last task, and bottom is
+//  moved by the owner. They are kept on separate cache lines as they are written by different
+//  threads. This follows the C11 version of Le et al.
+
+class TaskDeque
+{
+private:
+    std::atomic<int64_t> m_top;
+    char m_padding[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> m_bottom;
+    std::atomic<ParallelTask*> m_tasks[kDequeCapacity];
+
+public:
+    TaskDeque() : m_top(0), m_bottom(0)
+    {
+        for (int i = 0; i < kDequeCapacity; ++i)
+            m_tasks[i].store(nullptr, std::memory_order_relaxed);
+    }
+
+    bool Push(ParallelTask* task)
+    {
+        const int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+        const int64_t top = m_top.load(std::memory_order_acquire);
+        if (bottom - top >= kDequeCapacity)
+            return false;
+        m_tasks[bottom % kDequeCapacity].store(task, std::memory_order_relaxed);
+        m_bottom.store(bottom + 1, std::memory_order_release);
+        return true;
+    }
+
+    ParallelTask* Pop()
+    {
+        const int64_t bottom = m_bottom.load(std::memory_order_relaxed) - 1;
+        m_bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = m_top.load(std::memory_order_relaxed);
+        if (top > bottom)
+        {
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        ParallelTask* task = m_tasks[bottom % kDequeCapacity].load(std::memory_order_relaxed);
+        if (top == bottom)
+        {
+            // The last task, race any thieves for it.
+            if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                task = nullptr;
+            m_bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    ParallelTask* Steal()
+    {
+        int64_t top = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const int64_t bottom = m_bottom.load(std::memory_order_acquire);
+        if (top >= bottom)
+            return nullptr;
+
+        ParallelTask* const task = m_tasks[top % kDequeCapacity].load(std::memory_order_relaxed);
+        if (!m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return task;
+    }
+
+    bool Empty() const
+    {
+        return m_top.load(std::memory_order_seq_cst) >= m_bottom.load(std::memory_order_seq_cst);
+    }
+};
+
+//  A thread's deque and counters. Only the owner updates the counters.
+
+struct ThreadSlot
+{
+    TaskDeque deque;
+    uint32_t random;                                            // Chooses the first victim of each pass.
+    std::atomic<uint64_t> tasks;
+    std::atomic<uint64_t> steals;
+    std::atomic<uint64_t> failedSteals;
+    std::atomic<uint64_t> sleeps;
+    unsigned teamGeneration;                                    // The last loop run on every thread that this worker ran.
+    bool teamSense;
+
+    explicit ThreadSlot(int index) :
+        random(2654435761u * uint32_t(index + 1)), tasks(0), steals(0), failedSteals(0), sleeps(0), teamGeneration(0), teamSense(false)
+    {
+    }
+
+    static inline void Count(std::atomic<uint64_t>& counter)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+};
+
+//  Index of the calling thread's slot, or -1 if it has not forked any tasks yet. VC++ 2013 does
+//  not support thread_local.
+
+#if defined(_MSC_VER) && (_MSC_VER < 1900)
+static __declspec(thread) int t_slotIndex = -1;
+#else
+static thread_local int t_slotIndex = -1;
+#endif
+
+static int EnvironmentValue(const char* name, int defaultValue)
+{
+    const char* const value = getenv(name);
+    return (value != nullptr) ? atoi(value) : defaultValue;
+}
+
+static void BindThread(const std::vector<int>& cpus)
+{
+#if defined(_WIN32)
+    // The mask only covers the first processor group.
+    DWORD_PTR mask = 0;
+    for (int cpu : cpus)
+    {
+        if (cpu < int(8 * sizeof(DWORD_PTR)))
+            mask |= DWORD_PTR(1) << cpu;
+    }
+    if (mask != 0)
+        SetThreadAffinityMask(GetCurrentThread(), mask);
+#elif defined(__linux__)
+    cpu_set_t bound;
+    CPU_ZERO(&bound);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &bound);
+    pthread_setaffinity_np(pthread_self(), sizeof(bound), &bound);
+#endif
+}
+
+//  The usable CPUs on the same node as the given one.
+
+static std::vector<int> NodeCpus(const CpuTopology& topology, int cpu)
+{
+    const int node = topology.cpuNodes[std::find(topology.cpus.begin(), topology.cpus.end(), cpu) - topology.cpus.begin()];
+    std::vector<int> cpus;
+    for (size_t n = 0; n < topology.cpus.size(); ++n)
+    {
+        if (topology.cpuNodes[n] == node)
+            cpus.push_back(topology.cpus[n]);
+    }
+    return cpus;
+}
+
+ThreadPool& ThreadPool::Instance()
+{
+    static ThreadPool pool(std::max(1, EnvironmentValue("NBODY_NUM_THREADS", GetCpuTopology().UsableThreads())));
+    return pool;
+}
+
+//  If the pool has more threads than there are CPUs nothing is pinned, and loops are not run on
+//  every thread at once as that would wait for every thread to be scheduled. Worker i is pinned
+//  to usable CPU i + 1, in the topology's order, or with NBODY_PIN_THREADS=2 bound to the CPUs
+//  of that CPU's node. The first CPU is left to the thread that starts the work, which is bound
+//  to that CPU's node when it first forks, so its share of a static loop stays on one node.
+
+ThreadPool::ThreadPool(int numThreads) :
+    m_numThreads(numThreads),
+    m_numSlots(numThreads - 1),
+    m_sleeping(0),
+    m_shutdown(false),
+    m_spinMicroseconds(std::max(0, EnvironmentValue("NBODY_SPIN_US", kDefaultSpinMicroseconds))),
+    m_teamBarrier(numThreads),
+    m_teamBusy(false),
+    m_teamGeneration(0),
+    m_teamTask(nullptr),
+    m_teamSense(false)
+{
+    const CpuTopology& topology = GetCpuTopology();
+    const std::vector<int>& cpus = topology.cpus;
+    const bool dedicated = (numThreads <= int(cpus.size()));
+    const int pinning = dedicated ? EnvironmentValue("NBODY_PIN_THREADS", 1) : 0;
+    m_teamBusy.store(!dedicated);
+    if (pinning != 0)
+        m_startCpus = NodeCpus(topology, cpus[0]);
+
+    for (int i = 0; i < numThreads - 1 + kMaxExternalThreads; ++i)
+        m_slots.push_back(std::unique_ptr<ThreadSlot>(new ThreadSlot(i)));
+    for (int i = 0; i < numThreads - 1; ++i)
+    {
+        std::vector<int> bound;
+        if (pinning == 2)
+            bound = NodeCpus(topology, cpus[i + 1]);
+        else if (pinning != 0)
+            bound.push_back(cpus[i + 1]);
+        m_workers.push_back(std::thread([this, i, bound]
+        {
+            if (!bound.empty())
+                BindThread(bound);
+            WorkerLoop(i);
+        }));
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_shutdown = true;
+    }
+    m_wake.notify_all();
+    for (auto& worker : m_workers)
+        worker.join();
+}
+
+ThreadSlot* ThreadPool::CurrentSlot()
+{
+    if (t_slotIndex < 0)
+    {
+        if (m_numSlots.load(std::memory_order_relaxed) >= int(m_slots.size()))
+            return nullptr;
+        const int index = m_numSlots.fetch_add(1);
+        if (index >= int(m_slots.size()))
+            return nullptr;
+        t_slotIndex = index;
+        if (!m_startCpus.empty())
+            BindThread(m_startCpus);
+    }
+    return m_slots[t_slotIndex].get();
+}
+
+int ThreadPool::TeamIndex() const
+{
+    return ((t_slotIndex >= 0) && (t_slotIndex < m_numThreads - 1)) ? t_slotIndex + 1 : 0;
+}
+
+int ThreadPool::Fork(ParallelTask& task, int count)
+{
+    ThreadSlot* const slot = CurrentSlot();
+    if (slot == nullptr)
+        return 0;
+
+    task.m_pending.store(count, std::memory_order_relaxed);
+    int pushed = 0;
+    while ((pushed < count) && slot->deque.Push(&task))
+        ++pushed;
+    if (pushed < count)
+        task.m_pending.fetch_sub(count - pushed, std::memory_order_relaxed);
+
+    // Pairs with the sleeping thread's check of the deques in Sleep.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if ((pushed > 0) && (m_sleeping.load(std::memory_order_seq_cst) > 0))
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (pushed > 1)
+            m_wake.notify_all();
+        else
+            m_wake.notify_one();
+    }
+    return pushed;
+}
+
+void ThreadPool::Join(ParallelTask& task)
+{
+    // Nothing was pushed if the thread has no slot.
+    if (task.m_pending.load(std::memory_order_acquire) == 0)
+        return;
+
+    ThreadSlot* const slot = m_slots[t_slotIndex].get();
+    std::chrono::steady_clock::time_point idleSince;
+    while (task.m_pending.load(std::memory_order_acquire) != 0)
+    {
+        ParallelTask* next = slot->deque.Pop();
+        if (next == nullptr)
+            next = Steal(slot);
+        if (next != nullptr)
+        {
+            Execute(slot, next);
+            idleSince = std::chrono::steady_clock::time_point();
+        }
+        else if (!Spin(idleSince))
+        {
+            Sleep(slot, &task);
+            idleSince = std::chrono::steady_clock::time_point();
+        }
+    }
+}
+
+bool ThreadPool::Broadcast(ParallelTask& task)
+{
+    if ((t_slotIndex >= 0) && (t_slotIndex < m_numThreads - 1))
+        return false;
+    bool busy = false;
+    if (!m_teamBusy.compare_exchange_strong(busy, true, std::memory_order_acquire))
+        return false;
+    ThreadSlot* const slot = CurrentSlot();
+    if (slot == nullptr)
+    {
+        m_teamBusy.store(false, std::memory_order_release);
+        return false;
+    }
+
+    m_teamTask.store(&task, std::memory_order_relaxed);
+    m_teamGeneration.fetch_add(1, std::memory_order_seq_cst);
+    if (m_sleeping.load(std::memory_order_seq_cst) > 0)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_wake.notify_all();
+    }
+    task.Execute();
+    TeamWait(slot, m_teamSense);
+    m_teamBusy.store(false, std::memory_order_release);
+    return true;
+}
+
+void ThreadPool::WorkerLoop(int index)
+{
+    t_slotIndex = index;
+    ThreadSlot* const slot = m_slots[index].get();
+    std::chrono::steady_clock::time_point idleSince;
+    for (;;)
+    {
+        const unsigned generation = m_teamGeneration.load(std::memory_order_acquire);
+        if (generation != slot->teamGeneration)
+        {
+            slot->teamGeneration = generation;
+            m_teamTask.load(std::memory_order_relaxed)->Execute();
+            TeamWait(slot, slot->teamSense);
+            idleSince = std::chrono::steady_clock::time_point();
+            continue;
+        }
+
+        ParallelTask* const next = Steal(slot);
+        if (next != nullptr)
+        {
+            Execute(slot, next);
+            idleSince = std::chrono::steady_clock::time_point();
+        }
+        else if (!Spin(idleSince))
+        {
+            if (!Sleep(slot, nullptr))
+                return;
+            idleSince = std::chrono::steady_clock::time_point();
+        }
+    }
+}
+
+//  Wait at the barrier that ends a loop run on every thread, stealing any tasks the loop forked.
+
+void ThreadPool::TeamWait(ThreadSlot* slot, bool& sense)
+{
+    if (m_teamBarrier.Arrive(sense))
+        return;
+    std::chrono::steady_clock::time_point idleSince;
+    while (!m_teamBarrier.Released(sense))
+    {
+        ParallelTask* const next = Steal(slot);
+        if (next != nullptr)
+        {
+            Execute(slot, next);
+            idleSince = std::chrono::steady_clock::time_point();
+        }
+        else if (!Spin(idleSince))
+        {
+            ThreadSlot::Count(slot->sleeps);
+            m_teamBarrier.Sleep(sense);
+        }
+    }
+}
+
+//  Called each time an idle thread finds no work. Returns false once it has been idle for the
+//  spin time, starting from the first call after idleSince was reset.
+
+bool ThreadPool::Spin(std::chrono::steady_clock::time_point& idleSince)
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (idleSince == std::chrono::steady_clock::time_point())
+        idleSince = now;
+    else if (now - idleSince >= std::chrono::microseconds(m_spinMicroseconds))
+        return false;
+    std::this_thread::yield();
+    return true;
+}
+
+//  Make one pass over the other threads' deques, starting from a random one, and return the
+//  first task stolen.
+
+ParallelTask* ThreadPool::Steal(ThreadSlot* slot)
+{
+    const int numSlots = std::min(m_numSlots.load(std::memory_order_acquire), int(m_slots.size()));
+    slot->random ^= slot->random << 13;
+    slot->random ^= slot->random >> 17;
+    slot->random ^= slot->random << 5;
+    const int first = int(slot->random % uint32_t(numSlots));
+    for (int n = 0; n < numSlots; ++n)
+    {
+        ThreadSlot* const victim = m_slots[(first + n) % numSlots].get();
+        if (victim == slot)
+            continue;
+        ParallelTask* const task = victim->deque.Steal();
+        if (task != nullptr)
+        {
+            ThreadSlot::Count(slot->steals);
+            return task;
+        }
+    }
+    ThreadSlot::Count(slot->failedSteals);
+    return nullptr;
+}
+
+bool ThreadPool::AnyQueued() const
+{
+    const int numSlots = std::min(m_numSlots.load(std::memory_order_acquire), int(m_slots.size()));
+    for (int n = 0; n < numSlots; ++n)
+    {
+        if (!m_slots[n]->deque.Empty())
+            return true;
+    }
+    return false;
+}
+
+//  Sleep until there may be a task to steal, or the given task has been completed. Without a
+//  task the thread is idle and also wakes to run a loop on every thread. Fork, Broadcast and
+//  Execute check for sleeping threads after pushing a task, starting a loop or completing a
+//  task, and the sleeping thread checks for them after counting itself, so a wake up is never
+//  missed. Returns false once the pool is shutting down.
+
+bool ThreadPool::Sleep(ThreadSlot* slot, const ParallelTask* task)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_sleeping.fetch_add(1, std::memory_order_seq_cst);
+    while (!m_shutdown && !AnyQueued() && ((task != nullptr) ? (task->m_pending.load(std::memory_order_seq_cst) != 0) :
+        (m_teamGeneration.load(std::memory_order_seq_cst) == slot->teamGeneration)))
+    {
+        ThreadSlot::Count(slot->sleeps);
+        m_wake.wait(lock);
+    }
+    m_sleeping.fetch_sub(1, std::memory_order_seq_cst);
+    return !m_shutdown;
+}
+
+//  The task belongs to the thread that forked it and may be destroyed as soon as its last copy
+//  has been executed, so it is not touched after the count is decremented.
+
+void ThreadPool::Execute(ThreadSlot* slot, ParallelTask* task)
+{
+    ThreadSlot::Count(slot->tasks);
+    task->Execute();
+    if ((task->m_pending.fetch_sub(1, std::memory_order_seq_cst) == 1) && (m_sleeping.load(std::memory_order_seq_cst) > 0))
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_wake.notify_all();
+    }
+}
+
+ParallelStatistics ThreadPool::Statistics() const
+{
+    ParallelStatistics statistics = {};
+    for (auto& slot : m_slots)
+    {
+        statistics.tasks += slot->tasks.load(std::memory_order_relaxed);
+        statistics.steals += slot->steals.load(std::memory_order_relaxed);
+        statistics.failedSteals += slot->failedSteals.load(std::memory_order_relaxed);
+        statistics.sleeps += slot->sleeps.load(std::memory_order_relaxed);
+    }
+    return statistics;
+}
+
+//--------------------------------------------------------------------------------------
+//  Sense reversing barrier.
+//--------------------------------------------------------------------------------------
+
+SpinBarrier::SpinBarrier(int count) :
+    m_count(count),
+    m_remaining(count),
+    m_sense(0),
+    m_sleeping(0)
+{
+}
+
+void SpinBarrier::Wait(bool& sense, int spinMicroseconds)
+{
+    if (Arrive(sense))
+        return;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while (!Released(sense))
+    {
+        if (std::chrono::steady_clock::now() - start >= std::chrono::microseconds(spinMicroseconds))
+        {
+            Sleep(sense);
+            return;
+        }
+        std::this_thread::yield();
+    }
+}
+
+//  The count is reset before the sense is flipped, and the released threads only see the new
+//  sense, so they find the barrier ready for its next use.
+
+bool SpinBarrier::Arrive(bool& sense)
+{
+    sense = !sense;
+    if (m_remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return false;
+
+    m_remaining.store(m_count, std::memory_order_relaxed);
+    m_sense.store(int(sense), std::memory_order_seq_cst);
+    if (m_sleeping.load(std::memory_order_seq_cst) > 0)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_wake.notify_all();
+    }
+    return true;
+}
+
+void SpinBarrier::Sleep(bool sense)
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_sleeping.fetch_add(1, std::memory_order_seq_cst);
+    while (m_sense.load(std::memory_order_seq_cst) != int(sense))
+        m_wake.wait(lock);
+    m_sleeping.fetch_sub(1, std::memory_order_seq_cst);
+}
+
+#endif
@@ -0,0 +1,640 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+//--------------------------------------------------------------------------------------
+//  Parallel backend used by the CPU engines.
+//--------------------------------------------------------------------------------------
+//
+//  The engines only need fork-join parallelism: loops over an index range, loops over
+//  chunks of a range, two way splits for the recursive engines and groups of tasks for the
+//  tree walks. These are provided on top of one of four backends, selected at compile time by
+//  defining one of
+//
+//      NBODY_PARALLEL_PPL      - the Concurrency Runtime's Parallel Patterns Library.
+//      NBODY_PARALLEL_TBB      - Threading Building Blocks.
+//      NBODY_PARALLEL_OPENMP   - OpenMP 3.0 or later, the nested calls use tasks.
+//      NBODY_PARALLEL_THREADS  - the std::thread pool in ParallelCpu.cpp.
+//
+//  If none is defined the thread pool is used, with every compiler. It is the only backend that
+//  keeps its workers pinned and spinning between steps, that maps each static share to the same
+//  thread every time and that binds the threads to NUMA nodes, so the others are for comparison.
+//
+//  ParallelFor(first, last, func) calls func(i) for every i in [first, last) and
+//  ParallelFor(first, last, step, func) calls it for first, first + step, ... up to last.
+//  Both return once all the calls have completed and may be nested.
+//
+//  ParallelForStatic makes the same calls but splits them into one contiguous share per thread.
+//  Only the thread pool gives a share to the same thread in every loop over the same range;
+//  PPL's static partitioner, TBB and OpenMP's tasks may run it on any of their threads, which
+//  are not bound to a node either. Memory pages are placed on the NUMA node of the thread that
+//  first writes to them, so with NBODY_PARALLEL_THREADS data first written by such a loop is
+//  local to the threads that use it in later ones. With the other backends NUMA placement does
+//  not work. Only worth using for loops whose iterations all cost about the same.
+//
+//  ParallelConcurrency is the number of threads the loops run on, so a static loop over that
+//  many iterations gives each thread one of them.
+
+#if !defined(NBODY_PARALLEL_PPL) && !defined(NBODY_PARALLEL_TBB) && !defined(NBODY_PARALLEL_OPENMP) && !defined(NBODY_PARALLEL_THREADS)
+#define NBODY_PARALLEL_THREADS
+#endif
+
+#if defined(NBODY_PARALLEL_PPL)
+
+#include <ppl.h>
+
+template <typename Func>
+inline void ParallelFor(int first, int last, const Func& func)
+{
+    concurrency::parallel_for(first, last, func);
+}
+
+template <typename Func>
+inline void ParallelFor(int first, int last, int step, const Func& func)
+{
+    concurrency::parallel_for(first, last, step, func);
+}
+
+template <typename Func>
+inline void ParallelForStatic(int first, int last, int step, const Func& func)
+{
+    concurrency::parallel_for(first, last, step, func, concurrency::static_partitioner());
+}
+
+template <typename Func>
+inline void ParallelForStatic(int first, int last, const Func& func)
+{
+    concurrency::parallel_for(first, last, func, concurrency::static_partitioner());
+}
+
+inline int ParallelConcurrency()
+{
+    return static_cast<int>(concurrency::GetProcessorCount());
+}
+
+template <typename Func1, typename Func2>
+inline void ParallelInvoke(const Func1& func1, const Func2& func2)
+{
+    concurrency::parallel_invoke(func1, func2);
+}
+
+class TaskGroup
+{
+private:
+    concurrency::task_group m_tasks;
+
+public:
+    template <typename Func>
+    inline void Run(const Func& func) { m_tasks.run(func); }
+
+    inline void Wait() { m_tasks.wait(); }
+};
+
+#elif defined(NBODY_PARALLEL_TBB)
+
+#include <tbb/parallel_for.h>
+#include <tbb/parallel_invoke.h>
+#include <tbb/task_group.h>
+#include <tbb/task_arena.h>
+
+template <typename Func>
+inline void ParallelFor(int first, int last, const Func& func)
+{
+    tbb::parallel_for(first, last, func);
+}
+
+template <typename Func>
+inline void ParallelFor(int first, int last, int step, const Func& func)
+{
+    tbb::parallel_for(first, last, step, func);
+}
+
+template <typename Func>
+inline void ParallelForStatic(int first, int last, int step, const Func& func)
+{
+    tbb::parallel_for(first, last, step, func, tbb::static_partitioner());
+}
+
+template <typename Func>
+inline void ParallelForStatic(int first, int last, const Func& func)
+{
+    tbb::parallel_for(first, last, func, tbb::static_partitioner());
+}
+
+inline int ParallelConcurrency()
+{
+    return tbb::this_task_arena::max_concurrency();
+}
+
+template <typename Func1, typename Func2>
+inline void ParallelInvoke(const Func1& func1, const Func2& func2)
+{
+    tbb::parallel_invoke(func1, func2);
+}
+
+class TaskGroup
+{
+private:
+    tbb::task_group m_tasks;
+
+public:
+    template <typename Func>
+    inline void Run(const Func& func) { m_tasks.run(func); }
+
+    inline void Wait() { m_tasks.wait(); }
+};
+
+#else
+
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#if defined(NBODY_PARALLEL_OPENMP)
+
+#include <omp.h>
+
+#if !defined(_OPENMP) || (_OPENMP < 200805)
+#error The OpenMP parallel backend needs OpenMP 3.0 tasks, use NBODY_PARALLEL_PPL with Visual C++.
+#endif
+
+//  Outside a parallel region each call starts one, with a dynamic schedule as the iterations
+//  of the engines' loops vary a lot in cost. Calls made from inside a region, by the
+//  recursive engines and the tree walks, add tasks to the enclosing team instead.
+
+template <typename Func>
+inline void ParallelFor(int first, int last, int step, const Func& func)
+{
+    if (omp_in_parallel())
+    {
+#if _OPENMP >= 201511
+#pragma omp taskloop default(shared)
+        for (int i = first; i < last; i += step)
+            func(i);
+#else
+        for (int i = first; i < last; i += step)
+        {
+#pragma omp task default(shared) firstprivate(i)
+            func(i);
+        }
+#pragma omp taskwait
+#endif
+        return;
+    }
+
+#pragma omp parallel for schedule(dynamic)
+    for (int i = first; i < last; i += step)
+        func(i);
+}
+
+template <typename Func>
+inline void ParallelFor(int first, int last, const Func& func)
+{
+    if (omp_in_parallel())
+    {
+        ParallelFor(first, last, 1, func);
+        return;
+    }
+
+#pragma omp parallel for schedule(guided)
+    for (int i = first; i < last; ++i)
+        func(i);
+}
+
+//  With OMP_PROC_BIND set the threads of each team are bound in the same order every time.
+
+template <typename Func>
+inline void ParallelForStatic(int first, int last, int step, const Func& func)
+{
+    if (omp_in_parallel())
+    {
+        ParallelFor(first, last, step, func);
+        return;
+    }
+
+#pragma omp parallel for schedule(static)
+    for (int i = first; i < last; i += step)
+        func(i);
+}
+
+template <typename Func>
+inline void ParallelForStatic(int first, int last, const Func& func)
+{
+    ParallelForStatic(first, last, 1, func);
+}
+
+inline int ParallelConcurrency()
+{
+    return omp_get_max_threads();
+}
+
+template <typename Func1, typename Func2>
+inline void ParallelInvoke(const Func1& func1, const Func2& func2)
+{
+    if (omp_in_parallel())
+    {
+#pragma omp task default(shared)
+        func2();
+        func1();
+#pragma omp taskwait
+        return;
+    }
+
+#pragma omp parallel
+#pragma omp single
+    {
+#pragma omp task default(shared)
+        func2();
+        func1();
+#pragma omp taskwait
+    }
+}
+
+#else
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+
+//--------------------------------------------------------------------------------------
+//  A work stealing pool of worker threads for the std::thread backend.
+//--------------------------------------------------------------------------------------
+//
+//  The pool has one thread less than the concurrency, as the thread forking the work always
+//  takes part in it. The concurrency is the number of hardware threads unless the
+//  NBODY_NUM_THREADS environment variable is set. This is the default backend, so unless
+//  NBODY_PARALLEL_PPL, NBODY_PARALLEL_TBB or NBODY_PARALLEL_OPENMP is defined every ParallelInvoke
+//  of the recursive engines goes through the deques below.
+//
+//  Every thread that forks tasks has its own Chase-Lev deque. The owner pushes and pops tasks
+//  at the bottom without taking a lock, so a fork that nobody steals costs a few atomic
+//  operations. Idle threads steal the oldest task from the top of another thread's deque,
+//  which in the recursive engines is the largest one left. A thread joining its tasks first
+//  pops its own deque, and then steals, so waiting threads never block while there is work.
+//
+//  C++ cannot steal a continuation without switching stacks, so the forking thread runs the
+//  first half of the work itself and leaves the second half to be stolen, which is the same
+//  split continuation stealing makes for a two way fork. A task may be pushed several times and
+//  is then executed once by each thread that takes it, for example by each thread sharing the
+//  chunks of a loop.
+//
+//  Loops started by a thread outside the pool, such as the application's main thread, are not
+//  pushed at all. Every worker runs them and then waits at a sense reversing barrier, which the
+//  starting thread passes once the loop is complete. The workers are pinned to their own CPUs
+//  and spin for a while after running out of work, checking for the next loop, so closely
+//  spaced loops or steps find them running. Only then do they sleep. The spin time is
+//  NBODY_SPIN_US microseconds, NBODY_PIN_THREADS=0 leaves the workers unpinned and
+//  NBODY_PIN_THREADS=2 binds each to a NUMA node rather than a CPU. Neither pinning nor these
+//  loops are used if there are more threads than CPUs.
+//
+//  The pool counts the steals, the failed attempts and the sleeps so the causes of poor scaling
+//  can be seen.
+//
+//  See: D. Chase and Y. Lev, "Dynamic circular work-stealing deque", SPAA 2005, N. M. Le,
+//  A. Pop, A. Cohen and F. Zappa Nardelli, "Correct and efficient work-stealing for weak
+//  memory models", PPoPP 2013, and J. Mellor-Crummey and M. Scott, "Algorithms for scalable
+//  synchronization on shared-memory multiprocessors", ACM TOCS 9, 1991.
+
+class ParallelTask
+{
+    friend class ThreadPool;
+
+private:
+    std::atomic<int> m_pending;
+
+public:
+    ParallelTask() : m_pending(0) {}
+    virtual ~ParallelTask() {}
+
+    virtual void Execute() = 0;
+};
+
+//  Counters summed over all the pool's threads since the pool started.
+
+struct ParallelStatistics
+{
+    uint64_t tasks;                                             // Forked tasks executed.
+    uint64_t steals;                                            // Tasks taken from another thread's deque.
+    uint64_t failedSteals;                                      // Passes over every deque that found no task.
+    uint64_t sleeps;                                            // Times a thread stopped spinning and slept.
+};
+
+//  Sense reversing barrier for a fixed number of threads. Each thread keeps its own sense, which
+//  starts false, and passes it to every call. The last thread to arrive flips the barrier's
+//  sense, which releases the others, so the barrier can be reused without being reset.
+
+class SpinBarrier
+{
+private:
+    const int m_count;
+    std::atomic<int> m_remaining;
+    std::atomic<int> m_sense;
+    std::atomic<int> m_sleeping;
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+
+public:
+    explicit SpinBarrier(int count);
+
+    //  Wait for all the threads to arrive, spinning for up to spinMicroseconds before sleeping.
+
+    void Wait(bool& sense, int spinMicroseconds);
+
+    //  Flip the thread's sense and count it in. Returns true if it was the last to arrive, in
+    //  which case the other threads have been released.
+
+    bool Arrive(bool& sense);
+
+    inline bool Released(bool sense) const { return m_sense.load(std::memory_order_acquire) == int(sense); }
+
+    //  Sleep until the threads that arrived with this sense are released.
+
+    void Sleep(bool sense);
+
+private:
+    // VC++ does not yet support deleted functions.
+    SpinBarrier(const SpinBarrier&);
+    SpinBarrier& operator=(const SpinBarrier&);
+};
+
+struct ThreadSlot;
+
+class ThreadPool
+{
+private:
+    const int m_numThreads;
+    std::vector<std::thread> m_workers;
+    std::vector<std::unique_ptr<ThreadSlot>> m_slots;           // The workers' slots followed by the external threads'.
+    std::atomic<int> m_numSlots;                                // Slots claimed so far.
+    std::atomic<int> m_sleeping;
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+    bool m_shutdown;
+    const int m_spinMicroseconds;                               // How long idle threads spin before sleeping.
+    SpinBarrier m_teamBarrier;                                  // Ends each loop run by every thread.
+    std::atomic<bool> m_teamBusy;                               // A thread is running a loop on every thread, or they are disabled.
+    std::atomic<unsigned> m_teamGeneration;                     // Counts the loops run on every thread.
+    std::atomic<ParallelTask*> m_teamTask;
+    bool m_teamSense;                                           // Barrier sense of the thread starting the loops.
+    std::vector<int> m_startCpus;                               // CPUs the threads outside the pool are bound to, if any.
+
+public:
+    static ThreadPool& Instance();
+
+    inline int Concurrency() const { return m_numThreads; }
+
+    //  Push the task count times onto the calling thread's deque and return the number of
+    //  times it was pushed, which is less than count if the deque is full. The caller must
+    //  call Join before the task is destroyed.
+
+    int Fork(ParallelTask& task, int count);
+
+    //  Execute tasks until every pushed copy of the task has been executed.
+
+    void Join(ParallelTask& task);
+
+    //  Execute the task on every thread of the pool and return once they have all finished it.
+    //  Returns false, without executing the task, if the calling thread is one of the workers,
+    //  another thread is already doing this or the pool has more threads than CPUs.
+
+    bool Broadcast(ParallelTask& task);
+
+    //  The calling thread's place in a Broadcast, one more than its index for the workers and
+    //  zero for the thread that started it.
+
+    int TeamIndex() const;
+
+    ParallelStatistics Statistics() const;
+
+private:
+    explicit ThreadPool(int numThreads);
+    ~ThreadPool();
+
+    ThreadSlot* CurrentSlot();
+    void WorkerLoop(int index);
+    ParallelTask* Steal(ThreadSlot* slot);
+    bool AnyQueued() const;
+    bool Sleep(ThreadSlot* slot, const ParallelTask* task);
+    void Execute(ThreadSlot* slot, ParallelTask* task);
+    void TeamWait(ThreadSlot* slot, bool& sense);
+    bool Spin(std::chrono::steady_clock::time_point& idleSince);
+
+    // VC++ does not yet support deleted functions.
+    ThreadPool(const ThreadPool&);
+    ThreadPool& operator=(const ThreadPool&);
+};
+
+inline ParallelStatistics GetParallelStatistics()
+{
+    return ThreadPool::Instance().Statistics();
+}
+
+//  The iterations are handed out in chunks from a shared counter, so the threads that joined
+//  the loop early, or were given cheap iterations, take more of them.
+
+template <typename Func>
+class ParallelForTask : public ParallelTask
+{
+private:
+    const Func& m_func;
+    const int m_first;
+    const int m_step;
+    const int m_count;
+    const int m_grain;
+    std::atomic<int> m_next;
+
+public:
+    ParallelForTask(int first, int step, int count, int grain, const Func& func) :
+        m_func(func), m_first(first), m_step(step), m_count(count), m_grain(grain), m_next(0)
+    {
+    }
+
+    inline int NumChunks() const { return (m_count + m_grain - 1) / m_grain; }
+
+    virtual void Execute()
+    {
+        for (;;)
+        {
+            const int begin = m_next.fetch_add(m_grain, std::memory_order_relaxed);
+            if (begin >= m_count)
+                return;
+            const int end = std::min(begin + m_grain, m_count);
+            for (int n = begin; n < end; ++n)
+                m_func(m_first + n * m_step);
+        }
+    }
+};
+
+template <typename Func>
+class InvokeTask : public ParallelTask
+{
+private:
+    const Func& m_func;
+
+public:
+    explicit InvokeTask(const Func& func) : m_func(func) {}
+
+    virtual void Execute() { m_func(); }
+};
+
+template <typename Func>
+inline void ParallelForChunked(int first, int step, int count, int grain, const Func& func)
+{
+    ThreadPool& pool = ThreadPool::Instance();
+    ParallelForTask<Func> task(first, step, count, grain, func);
+    const int helpers = std::min(pool.Concurrency(), task.NumChunks()) - 1;
+    if (helpers <= 0)
+    {
+        task.Execute();
+        return;
+    }
+    if ((helpers == pool.Concurrency() - 1) && pool.Broadcast(task))
+        return;
+    pool.Fork(task, helpers);
+    task.Execute();
+    pool.Join(task);
+}
+
+//  Loops over chunks already do enough work per call to be handed out one at a time. Loops
+//  over single indices are split into about eight chunks per thread.
+
+template <typename Func>
+inline void ParallelFor(int first, int last, int step, const Func& func)
+{
+    if (first < last)
+        ParallelForChunked(first, step, (last - first + step - 1) / step, 1, func);
+}
+
+template <typename Func>
+inline void ParallelFor(int first, int last, const Func& func)
+{
+    if (first < last)
+    {
+        const int count = last - first;
+        ParallelForChunked(first, 1, count, std::max(1, count / (8 * ThreadPool::Instance().Concurrency())), func);
+    }
+}
+
+//  Each thread takes the share of the iterations given by its place in the broadcast. If the
+//  loop cannot be broadcast, because it is nested in another or the pool has more threads than
+//  CPUs, the shares go to whichever threads are free.
+
+template <typename Func>
+class ParallelStaticTask : public ParallelTask
+{
+private:
+    const Func& m_func;
+    const int m_first;
+    const int m_step;
+    const int m_count;
+    const int m_shares;
+
+public:
+    ParallelStaticTask(int first, int step, int count, int shares, const Func& func) :
+        m_func(func), m_first(first), m_step(step), m_count(count), m_shares(shares)
+    {
+    }
+
+    inline void ExecuteShare(int share) const
+    {
+        const int begin = int(int64_t(m_count) * share / m_shares);
+        const int end = int(int64_t(m_count) * (share + 1) / m_shares);
+        for (int n = begin; n < end; ++n)
+            m_func(m_first + n * m_step);
+    }
+
+    virtual void Execute() { ExecuteShare(ThreadPool::Instance().TeamIndex()); }
+};
+
+template <typename Func>
+inline void ParallelForStatic(int first, int last, int step, const Func& func)
+{
+    if (first >= last)
+        return;
+    ThreadPool& pool = ThreadPool::Instance();
+    const int count = (last - first + step - 1) / step;
+    const int shares = std::min(pool.Concurrency(), count);
+    ParallelStaticTask<Func> task(first, step, count, shares, func);
+    if (shares == 1)
+    {
+        task.ExecuteShare(0);
+        return;
+    }
+    if ((shares == pool.Concurrency()) && pool.Broadcast(task))
+        return;
+    ParallelFor(0, shares, 1, [&task](int share) { task.ExecuteShare(share); });
+}
+
+template <typename Func>
+inline void ParallelForStatic(int first, int last, const Func& func)
+{
+    ParallelForStatic(first, last, 1, func);
+}
+
+inline int ParallelConcurrency()
+{
+    return ThreadPool::Instance().Concurrency();
+}
+
+template <typename Func1, typename Func2>
+inline void ParallelInvoke(const Func1& func1, const Func2& func2)
+{
+    ThreadPool& pool = ThreadPool::Instance();
+    if (pool.Concurrency() == 1)
+    {
+        func1();
+        func2();
+        return;
+    }
+    InvokeTask<Func2> task(func2);
+    if (pool.Fork(task, 1) == 0)
+    {
+        func1();
+        func2();
+        return;
+    }
+    func1();
+    pool.Join(task);
+}
+
+#endif
+
+//  The tasks of a group are collected and run as a parallel loop by Wait.
+
+class TaskGroup
+{
+private:
+    std::vector<std::function<void()>> m_tasks;
+
+public:
+    template <typename Func>
+    inline void Run(const Func& func) { m_tasks.push_back(func); }
+
+    inline void Wait()
+    {
+        const std::vector<std::function<void()>>& tasks = m_tasks;
+        ParallelFor(0, int(tasks.size()), 1, [&tasks](int t) { tasks[t](); });
+        m_tasks.clear();
+    }
+};
+
+#endif
@@ -5,7 +5,7 @@
 //
 //===============================================================================
 // Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
-// This code released under the terms of the 
+// This code released under the terms of the
 // Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
 //
 // THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
@@ -16,58 +16,287 @@
 
 #pragma once
 
+#include <malloc.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
 #include <amp_short_vectors.h>
 
+#include "ArenaCpu.h"
+#include "ParallelCpu.h"
+#include "TopologyCpu.h"
+
+using namespace concurrency::graphics;
+
 //--------------------------------------------------------------------------------------
 // Data structures for storing particles.
 //--------------------------------------------------------------------------------------
 
-// Data structure for storing the position, velocity for each particle.
+#define SSE_ALIGNMENTBOUNDARY 16
+#define AVX_ALIGNMENTBOUNDARY 32
+#define CACHE_ALIGNMENTBOUNDARY 64
+
+// Structure of arrays storing the position, velocity, acceleration and mass of each particle.
 // The advanced integrator also requires the acceleration during each integration step.
 //
-// Note: Changes to the layout or size of this structure require that the HLSL renderer 
-// also be changed to match. The particleSize value should equal the number of floats 
-// stored in ParticleCpu.
+// Each component is stored in its own stream. The interaction kernels' inner loops only read
+// the x, y and z streams of the j particles, and the mass stream when the masses differ, so no
+// memory bandwidth is wasted loading velocities or padding, and each SIMD load fills a whole
+// register with the same component of consecutive particles.
 //
-// To improve memory access performance and limit false sharing of cache lines this 
-// struct is padded to be the size if a single cache line.
+// Every stream starts on a cache line boundary and is padded to a whole number of cache lines.
+// This means that kernels may load a full vector past the last particle, as long as the padding
+// lanes are masked out of the result, and that threads working on different streams never share
+// a cache line.
 //
-// You can use the COREINFO tool to display information about your processor's cache size 
-// and modify this code accordingly. COREINFO can be downloaded from TechNet
+// Particles with zero mass are tracers. They are accelerated by the other particles but exert
+// no force themselves, so the engines only use the particles with mass, the sources, as the j
+// particles of their interactions. Tracers are kept behind all the sources in the store, see
+// MortonReorder, so the sources are the first NumSources particles.
 //
-// http://technet.microsoft.com/en-us/sysinternals/cc835722
+// The renderer does not read this structure directly, it gathers the values it needs into a
+// vertex buffer, see RenderParticles.
 //
-// In addition to padding for cache line size each float_3 element is also padded with an 
-// additional float so that it is the same size as the __m128 SSE type used by the SSE based
-// calculation engines.
+// The buffer comes from the ParticleArena, so it is backed by huge pages where possible and is
+// reused by the next store of about the same size once the store is destroyed. The streams are
+// zeroed by a static parallel loop over the whole capacity, but the engines' static loops only
+// split the particles in use, which are usually far fewer. Place copies the store into a new
+// buffer by a static loop over those particles, so on a NUMA machine each share of every stream
+// is then on the node of the thread whose share of the engines' loops it is, as the arena
+// discards the pages of a buffer it reuses. It is called whenever the number of particles
+// changes. This only holds with NBODY_PARALLEL_THREADS, see
+// ParallelForStatic. A store can also be placed on one node, for the copies of the sources that
+// each node reads from, see SourceReplicas, or be a view that shares another store's particles
+// but has its own accelerations.
 
-#define SSE_ALIGNMENTBOUNDARY 16
-
-__declspec(align(SSE_ALIGNMENTBOUNDARY))
-struct ParticleCpu
+class ParticleStoreSoA
 {
-    float_3 pos;
-    float ssePpadding1;
-    float_3 vel;
-    float ssePpadding2;
-    float_3 acc;
-    float ssePpadding3;
-    float_4 cacheLinePadding;
+public:
+    float* x;
+    float* y;
+    float* z;
+    float* vx;
+    float* vy;
+    float* vz;
+    float* ax;
+    float* ay;
+    float* az;
+    float* mass;
+
+    // Number of bytes of each particle that are touched by the interaction kernels, the position
+    // and acceleration. Used when sizing tiles to fit into a cache.
+    static const int kInteractionBytes = 6 * sizeof(float);
+
+private:
+    static const int kNumStreams = 10;
+    static const int kFirstTouchChunk = 1024;                   // Floats of each stream zeroed per call, one page.
+    float* m_pBuffer;
+    int m_capacity;
+    size_t m_stride;
+
+public:
+    explicit ParticleStoreSoA(int capacity) :
+        m_pBuffer(nullptr),
+        m_capacity(capacity),
+        m_stride(PaddedSize(capacity))
+    {
+        m_pBuffer = static_cast<float*>(ParticleArena::Instance().Allocate(m_stride * kNumStreams * sizeof(float)));
+        assert(m_pBuffer != nullptr);
+        assert(((uintptr_t)m_pBuffer % CACHE_ALIGNMENTBOUNDARY) == 0);
+        SetStreams();
+
+        float* const pBuffer = m_pBuffer;
+        const int stride = static_cast<int>(m_stride);
+        ParallelForStatic(0, stride, kFirstTouchChunk, [=](int begin)
+        {
+            const int count = std::min(static_cast<int>(kFirstTouchChunk), stride - begin);
+            for (int s = 0; s < static_cast<int>(kNumStreams); ++s)
+                memset(pBuffer + s * stride + begin, 0, count * sizeof(float));
+        });
+    }
+
+    ParticleStoreSoA(int capacity, int node) :
+        m_pBuffer(nullptr),
+        m_capacity(capacity),
+        m_stride(PaddedSize(capacity))
+    {
+        m_pBuffer = static_cast<float*>(ParticleArena::Instance().Allocate(m_stride * kNumStreams * sizeof(float), node));
+        assert(m_pBuffer != nullptr);
+        memset(m_pBuffer, 0, m_stride * kNumStreams * sizeof(float));
+        SetStreams();
+    }
+
+    // A view of another store's particles with its own acceleration streams, three consecutive
+    // streams of Stride floats each. The view owns no memory and must not outlive either. Used
+    // by the engines that accumulate each thread's accelerations separately.
+    ParticleStoreSoA(const ParticleStoreSoA& particles, float* const pAccelerations) :
+        m_pBuffer(nullptr),
+        m_capacity(particles.m_capacity),
+        m_stride(particles.m_stride)
+    {
+        assert(((uintptr_t)pAccelerations % CACHE_ALIGNMENTBOUNDARY) == 0);
+        x = particles.x;
+        y = particles.y;
+        z = particles.z;
+        vx = particles.vx;
+        vy = particles.vy;
+        vz = particles.vz;
+        ax = pAccelerations;
+        ay = pAccelerations + m_stride;
+        az = pAccelerations + 2 * m_stride;
+        mass = particles.mass;
+    }
+
+    ~ParticleStoreSoA()
+    {
+        ParticleArena::Instance().Free(m_pBuffer);
+    }
+
+    // Exchange the particles of two stores of the same size by swapping their buffers.
+    void Swap(ParticleStoreSoA& other)
+    {
+        assert((m_pBuffer != nullptr) && (other.m_pBuffer != nullptr) && (m_stride == other.m_stride));
+        std::swap(m_pBuffer, other.m_pBuffer);
+        SetStreams();
+        other.SetStreams();
+    }
+
+    // Move the first numParticles particles to the nodes of the threads that use them, by copying
+    // them into a new buffer with a static loop. The rest are copied by the calling thread. On a
+    // single node the pages are left where they are.
+    void Place(int numParticles)
+    {
+        assert(m_pBuffer != nullptr);
+        if (GetCpuTopology().numNodes == 1)
+            return;
+
+        float* const pBuffer = static_cast<float*>(ParticleArena::Instance().Allocate(m_stride * kNumStreams * sizeof(float)));
+        assert(pBuffer != nullptr);
+        const float* const pOld = m_pBuffer;
+        const int stride = static_cast<int>(m_stride);
+        const int count = std::min(numParticles, stride);
+        ParallelForStatic(0, count, kFirstTouchChunk, [=](int begin)
+        {
+            const int end = std::min(begin + static_cast<int>(kFirstTouchChunk), count);
+            for (int s = 0; s < static_cast<int>(kNumStreams); ++s)
+                memcpy(pBuffer + s * stride + begin, pOld + s * stride + begin, (end - begin) * sizeof(float));
+        });
+        for (int s = 0; s < static_cast<int>(kNumStreams); ++s)
+            memcpy(pBuffer + s * stride + count, pOld + s * stride + count, (stride - count) * sizeof(float));
+
+        ParticleArena::Instance().Free(m_pBuffer);
+        m_pBuffer = pBuffer;
+        SetStreams();
+    }
+
+    inline int Capacity() const { return m_capacity; }
+
+    // Number of floats in each stream, including the padding.
+    inline size_t Stride() const { return m_stride; }
+
+    // Number of sources among the first numParticles particles, found by a binary search for the
+    // first tracer.
+    inline int NumSources(int numParticles) const
+    {
+        return static_cast<int>(std::partition_point(mass, mass + numParticles, [](float m) { return m > 0.0f; }) - mass);
+    }
+
+    inline float_3 Position(size_t i) const { return float_3(x[i], y[i], z[i]); }
+    inline float_3 Velocity(size_t i) const { return float_3(vx[i], vy[i], vz[i]); }
+    inline float_3 Acceleration(size_t i) const { return float_3(ax[i], ay[i], az[i]); }
+
+    inline void SetPosition(size_t i, const float_3& v) { x[i] = v.x; y[i] = v.y; z[i] = v.z; }
+    inline void SetVelocity(size_t i, const float_3& v) { vx[i] = v.x; vy[i] = v.y; vz[i] = v.z; }
+    inline void SetAcceleration(size_t i, const float_3& v) { ax[i] = v.x; ay[i] = v.y; az[i] = v.z; }
+
+private:
+    void SetStreams()
+    {
+        float** const streams[kNumStreams] = { &x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az, &mass };
+        for (int s = 0; s < kNumStreams; ++s)
+            *streams[s] = m_pBuffer + s * m_stride;
+    }
+
+    // Round the number of floats in each stream up to a whole number of cache lines.
+    static size_t PaddedSize(int capacity)
+    {
+        const size_t floatsPerLine = CACHE_ALIGNMENTBOUNDARY / sizeof(float);
+        return ((capacity + floatsPerLine - 1) / floatsPerLine) * floatsPerLine;
+    }
+
+    // VC++ does not yet support deleted functions. Copying would double free the buffer.
+    ParticleStoreSoA(const ParticleStoreSoA&);
+    ParticleStoreSoA& operator=(const ParticleStoreSoA&);
 };
 
-// The advanced integrator makes use of __m128 values directly. By ensuring alignement the 
-// SSE code in NBodyAdvancedInteractionEngine can load values directly into SSE registers
-// saving calls to explicitly load unaligned data (_mm_loadu_ps). This structure is also 
-// padded to be the same size as ParticleCpu and fill a whole cache line.
+//--------------------------------------------------------------------------------------
+//  Copies of the sources on each NUMA node.
+//--------------------------------------------------------------------------------------
 //
-// These two types could have been combined using a union but are kept separate here for 
-// clarity and a cast is used when access to the __m128 values is needed.
+//  The simple engines read the position and mass of every source for each particle they update.
+//  On a machine with more than one node, each node is given its own copy of these streams,
+//  placed on that node, and each thread reads the copy on its own node. Update copies the sources
+//  once per step, which costs O(N) against the O(N^2) of the interactions. Only the thread pool
+//  binds its threads to nodes, so with the other backends, as on a single node, nothing is
+//  copied and Local returns the particles themselves.
 
-__declspec(align(SSE_ALIGNMENTBOUNDARY))
-struct ParticleSSE
+class SourceReplicas
 {
-    __m128 pos;
-    __m128 vel;
-    __m128 acc;
-    __m128 cacheLinePadding;
+private:
+    std::vector<std::unique_ptr<ParticleStoreSoA>> m_replicas;  // Indexed by node, empty on a single node.
+    const ParticleStoreSoA* m_pParticles;
+
+public:
+    SourceReplicas() : m_pParticles(nullptr) {}
+
+    void Update(const ParticleStoreSoA* const pParticles, int numSources)
+    {
+        m_pParticles = pParticles;
+#if defined(NBODY_PARALLEL_THREADS)
+        const CpuTopology& topology = GetCpuTopology();
+        if (topology.numNodes == 1)
+            return;
+
+        //  Build CurrentNode's table here rather than in the first worker to call Local, VC++
+        //  does not yet initialize function local statics safely.
+        CurrentNode();
+
+        if (m_replicas.empty() || (m_replicas[topology.nodes[0]]->Capacity() < numSources))
+        {
+            m_replicas.clear();
+            m_replicas.resize(topology.nodes.back() + 1);
+            for (int node : topology.nodes)
+                m_replicas[node].reset(new ParticleStoreSoA(pParticles->Capacity(), node));
+        }
+
+        const int chunkSize = 16 * 1024;
+        const int numChunks = (numSources + chunkSize - 1) / chunkSize;
+        const std::vector<int>& nodes = topology.nodes;
+        ParallelFor(0, topology.numNodes * numChunks, [=, &nodes](int task)
+        {
+            ParticleStoreSoA* const pReplica = m_replicas[nodes[task % nodes.size()]].get();
+            const int begin = (task / int(nodes.size())) * chunkSize;
+            const int end = std::min(begin + chunkSize, numSources);
+            std::copy(pParticles->x + begin, pParticles->x + end, pReplica->x + begin);
+            std::copy(pParticles->y + begin, pParticles->y + end, pReplica->y + begin);
+            std::copy(pParticles->z + begin, pParticles->z + end, pReplica->z + begin);
+            std::copy(pParticles->mass + begin, pParticles->mass + end, pReplica->mass + begin);
+        });
+#endif
+    }
+
+    //  The sources to read on the calling thread's node.
+
+    inline const ParticleStoreSoA* Local() const
+    {
+        return m_replicas.empty() ? m_pParticles : m_replicas[CurrentNode()].get();
+    }
+
+private:
+    // VC++ does not yet support deleted functions.
+    SourceReplicas(const SourceReplicas&);
+    SourceReplicas& operator=(const SourceReplicas&);
 };
@@ -78,14 +78,14 @@ ByteAddressBuffer g_bufPosVelo;
 //
 VSParticleDrawOut VSParticleDraw(VSParticleIn input)
 {
-	const int particleSize = 16 * 4; // Size of float_3 object as number of bytes.
+	const int particleSize = 4 * 4; // Size of the gathered float_4 (x, y, z, vz) as number of bytes.
     VSParticleDrawOut output; 
 
 	output.pos.x = asfloat(g_bufPosVelo.Load(input.id*particleSize + 0));
 	output.pos.y = asfloat(g_bufPosVelo.Load(input.id*particleSize + 4));
 	output.pos.z = asfloat(g_bufPosVelo.Load(input.id*particleSize + 8));
 
-	float vz = asfloat(g_bufPosVelo.Load(input.id*particleSize + 24)) / 9;
+	float vz = asfloat(g_bufPosVelo.Load(input.id*particleSize + 12)) / 9;
     output.color = lerp(float4(1,0.1,0.1,1), input.color, vz);
     
     return output;
@@ -0,0 +1,163 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+
+#include "NBodyOctreeCpu.h"
+#include "ParticleReorderCpu.h"
+#include "ParallelCpu.h"
+
+using namespace concurrency::graphics;
+
+//  Number of particles keyed or copied by each task.
+
+const int kReorderChunkSize = 4 * 1024;
+
+//  Move every stream of particle index[s] in pIn to slot s of pOut, or if scatter is true
+//  move slot s of pIn to particle index[s] of pOut.
+
+static void PermuteStreams(const ParticleStoreSoA* const pIn, ParticleStoreSoA* const pOut, const int* const index, int numParticles, bool scatter)
+{
+    const float* const in[] = { pIn->x, pIn->y, pIn->z, pIn->vx, pIn->vy, pIn->vz, pIn->ax, pIn->ay, pIn->az, pIn->mass };
+    float* const out[] = { pOut->x, pOut->y, pOut->z, pOut->vx, pOut->vy, pOut->vz, pOut->ax, pOut->ay, pOut->az, pOut->mass };
+    const int numStreams = sizeof(in) / sizeof(in[0]);
+
+    // Each task moves one stream of a chunk at a time, so only two streams are being accessed.
+    ParallelFor(0, numParticles, kReorderChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kReorderChunkSize, numParticles);
+        for (int stream = 0; stream < numStreams; ++stream)
+        {
+            const float* const pFrom = in[stream];
+            float* const pTo = out[stream];
+            if (scatter)
+            {
+                for (int s = begin; s < end; ++s)
+                    pTo[index[s]] = pFrom[s];
+            }
+            else
+            {
+                for (int s = begin; s < end; ++s)
+                    pTo[s] = pFrom[index[s]];
+            }
+        }
+    });
+}
+
+//  Copy the first numParticles particles of every stream.
+
+static void CopyStreams(const ParticleStoreSoA* const pIn, ParticleStoreSoA* const pOut, int numParticles)
+{
+    const float* const in[] = { pIn->x, pIn->y, pIn->z, pIn->vx, pIn->vy, pIn->vz, pIn->ax, pIn->ay, pIn->az, pIn->mass };
+    float* const out[] = { pOut->x, pOut->y, pOut->z, pOut->vx, pOut->vy, pOut->vz, pOut->ax, pOut->ay, pOut->az, pOut->mass };
+    const int numStreams = sizeof(in) / sizeof(in[0]);
+
+    ParallelFor(0, numStreams, [=](int stream)
+    {
+        memcpy(out[stream], in[stream], numParticles * sizeof(float));
+    });
+}
+
+MortonReorder::MortonReorder(int capacity, int interval) :
+    m_interval(interval),
+    m_step(0),
+    m_ids(capacity),
+    m_idsTemp(capacity)
+{
+    assert(interval > 0);
+    Reset();
+}
+
+bool MortonReorder::Update(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const pOther, int numParticles)
+{
+    if (++m_step < m_interval)
+        return false;
+
+    Reorder(pParticles, pOther, numParticles);
+    return true;
+}
+
+void MortonReorder::Reorder(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const pOther, int numParticles)
+{
+    assert(numParticles <= static_cast<int>(m_ids.size()));
+    m_step = 0;
+    m_keys.resize(std::max(numParticles, static_cast<int>(m_keys.size())));
+    m_index.resize(std::max(numParticles, static_cast<int>(m_index.size())));
+
+    // Quantize the positions in a cube around the particles' bounding box, as the octree does.
+    float_3 lo;
+    float_3 hi;
+    ParticleBounds(pParticles, numParticles, lo, hi);
+    const float extent = std::max(std::max(hi.x - lo.x, hi.y - lo.y), hi.z - lo.z);
+    const float scale = (1u << kMortonBitsPerAxis) / ((extent > 0.0f) ? extent * 1.0001f : 1.0f);
+    const uint32_t maxCoordinate = (1u << kMortonBitsPerAxis) - 1;
+    const uint64_t tracerBit = uint64_t(1) << (3 * kMortonBitsPerAxis);
+
+    uint64_t* const keys = m_keys.data();
+    int* const index = m_index.data();
+    ParallelFor(0, numParticles, kReorderChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kReorderChunkSize, numParticles);
+        for (int i = begin; i < end; ++i)
+        {
+            const uint32_t x = std::min(static_cast<uint32_t>((pParticles->x[i] - lo.x) * scale), maxCoordinate);
+            const uint32_t y = std::min(static_cast<uint32_t>((pParticles->y[i] - lo.y) * scale), maxCoordinate);
+            const uint32_t z = std::min(static_cast<uint32_t>((pParticles->z[i] - lo.z) * scale), maxCoordinate);
+            keys[i] = MortonKey(x, y, z) | ((pParticles->mass[i] > 0.0f) ? 0 : tracerBit);
+            index[i] = i;
+        }
+    });
+
+    ParallelRadixSort(m_keys, m_index, m_keysTemp, m_indexTemp, numParticles);
+
+    const int* const sorted = m_index.data();
+    const int* const ids = m_ids.data();
+    int* const idsTemp = m_idsTemp.data();
+    ParallelFor(0, numParticles, kReorderChunkSize, [=](int begin)
+    {
+        const int end = std::min(begin + kReorderChunkSize, numParticles);
+        for (int s = begin; s < end; ++s)
+            idsTemp[s] = ids[sorted[s]];
+    });
+    std::copy(m_idsTemp.begin(), m_idsTemp.begin() + numParticles, m_ids.begin());
+
+    // The permuted particles become the particles by swapping the stores' buffers. pOther then
+    // only needs the masses in the new order, the engines that write into it write the rest.
+    PermuteStreams(pParticles, pOther, sorted, numParticles, false);
+    pParticles->Swap(*pOther);
+    memcpy(pOther->mass, pParticles->mass, numParticles * sizeof(float));
+}
+
+//  Both stores are left holding the same particles, which keeps the slots beyond numParticles
+//  the same in both as the reorders swap the stores' buffers.
+
+void MortonReorder::Restore(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const pOther, int numParticles)
+{
+    PermuteStreams(pParticles, pOther, m_ids.data(), numParticles, true);
+    CopyStreams(pOther, pParticles, numParticles);
+    for (int i = 0; i < numParticles; ++i)
+        m_ids[i] = i;
+    m_step = 0;
+}
+
+void MortonReorder::Reset()
+{
+    for (int i = 0; i < static_cast<int>(m_ids.size()); ++i)
+        m_ids[i] = i;
+    m_step = 0;
+}
@@ -0,0 +1,90 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include "ParticleCpu.h"
+
+//--------------------------------------------------------------------------------------
+//  Periodic Morton order reordering of the particle streams.
+//--------------------------------------------------------------------------------------
+//
+//  Particles are loaded cluster by cluster, so particles that are close in space end up
+//  scattered through the streams and the tiles of the advanced engine mix particles from all
+//  over the simulation. Every interval steps the particles are sorted by their 63 bit Morton
+//  keys, with the radix sort shared with the octree, and all the streams are permuted into
+//  that order. The particles drift slowly so the order stays coherent between sorts.
+//
+//  Tracers, the particles without mass, have the unused top bit of their keys set, so they
+//  are sorted behind all the sources and the engines find the sources at the start of the
+//  store. Reorder must be called whenever the particles or their number change, even if
+//  periodic reordering is off, so that the tracers are partitioned before the next step.
+//
+//  The id of each slot is the index the particle had when it was loaded. It is permuted along
+//  with the streams so results can be written out, or rendered, in a stable order. The first
+//  numParticles slots always hold the particles with ids [0, numParticles), so the particle
+//  count can only be changed after calling Restore.
+
+class MortonReorder
+{
+private:
+    const int m_interval;
+    int m_step;
+    std::vector<int> m_ids;
+    std::vector<int> m_idsTemp;
+    std::vector<uint64_t> m_keys;
+    std::vector<uint64_t> m_keysTemp;
+    std::vector<int> m_index;
+    std::vector<int> m_indexTemp;
+
+public:
+    MortonReorder(int capacity, int interval);
+
+    //  Count one step and reorder the particles if the interval has elapsed. Returns true if
+    //  the particles were reordered.
+
+    bool Update(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const pOther, int numParticles);
+
+    //  Sort the particles into Morton order. The particles are permuted into pOther and the
+    //  stores' buffers are swapped, so afterwards pOther holds the masses in the new order but
+    //  the positions, velocities and accelerations of the old order. Only the first
+    //  numParticles slots are changed.
+
+    void Reorder(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const pOther, int numParticles);
+
+    //  Return the particles to the slots they were loaded into, in both stores.
+
+    void Restore(ParticleStoreSoA* const pParticles, ParticleStoreSoA* const pOther, int numParticles);
+
+    //  Forget the current order after the particles have been reloaded.
+
+    void Reset();
+
+    inline int Interval() const { return m_interval; }
+    inline const int* Ids() const { return m_ids.data(); }
+
+    //  Slot s holds the particle that was in slot Order()[s] before the last reorder.
+
+    inline const int* Order() const { return m_index.data(); }
+
+private:
+    // VC++ does not yet support deleted functions.
+    MortonReorder(const MortonReorder&);
+    MortonReorder& operator=(const MortonReorder&);
+};
@@ -0,0 +1,109 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <immintrin.h>
+
+//  AVX-512 intrinsics are only available from Visual C++ 2017 onwards. Older compilers build
+//  without the AVX-512 kernels and the runtime selection falls back to AVX2.
+
+#if defined(__AVX512F__) || (defined(_MSC_VER) && (_MSC_VER >= 1910))
+#define NBODY_AVX512_SUPPORTED
+#endif
+
+//--------------------------------------------------------------------------------------
+//  Helper functions shared by the wide SIMD interaction engines.
+//--------------------------------------------------------------------------------------
+//
+//  These are only ever called from kernels that have been selected at runtime after
+//  checking the CPU supports the instruction set used, see GetSSEType.
+
+//  Sum all eight lanes of an AVX register.
+
+inline float HorizontalSum(__m256 v)
+{
+    __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1,1,1,1)));
+    return _mm_cvtss_f32(sum);
+}
+
+//  Sum all four lanes of an SSE register.
+
+inline float HorizontalSum(__m128 v)
+{
+    __m128 sum = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1,1,1,1)));
+    return _mm_cvtss_f32(sum);
+}
+
+//  Masks with the first count lanes set. These are used to exclude lanes past the end of the
+//  particle range from a calculation.
+
+inline __m128 TailMask4(const int count)
+{
+    return _mm_cmplt_ps(_mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f), _mm_set1_ps(static_cast<float>(count)));
+}
+
+inline __m256i TailMask8i(const int count)
+{
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32(count), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+inline __m256 TailMask8(const int count)
+{
+    return _mm256_castsi256_ps(TailMask8i(count));
+}
+
+//  Reciprocal square root using the 12 bit approximation followed by one Newton-Raphson step.
+//  The plain approximation is accurate enough for the second order integrators but not for
+//  the Hermite kernels: y = y * (3 - x * y * y) / 2
+
+inline __m128 ReciprocalSqrtNewton(__m128 x)
+{
+    const __m128 y = _mm_rsqrt_ps(x);
+    const __m128 t = _mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(_mm_mul_ps(x, y), y));
+    return _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), y), t);
+}
+
+inline __m256 ReciprocalSqrtNewton(__m256 x)
+{
+    const __m256 y = _mm256_rsqrt_ps(x);
+    const __m256 t = _mm256_fnmadd_ps(_mm256_mul_ps(x, y), y, _mm256_set1_ps(3.0f));
+    return _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(0.5f), y), t);
+}
+
+#ifdef NBODY_AVX512_SUPPORTED
+
+//  Reciprocal square root using the 14 bit approximation followed by one Newton-Raphson step,
+//  giving close to full single precision accuracy: y = y * (3 - x * y * y) / 2
+
+inline __m512 ReciprocalSqrtNewton(__m512 x)
+{
+    const __m512 y = _mm512_rsqrt14_ps(x);
+    const __m512 t = _mm512_fnmadd_ps(_mm512_mul_ps(x, y), y, _mm512_set1_ps(3.0f));
+    return _mm512_mul_ps(_mm512_mul_ps(_mm512_set1_ps(0.5f), y), t);
+}
+
+//  Mask with the first count lanes set, count must be in the range [0, 16].
+
+inline __mmask16 TailMask16(const size_t count)
+{
+    return static_cast<__mmask16>((count >= 16) ? 0xFFFF : ((1u << count) - 1));
+}
+
+#endif
@@ -0,0 +1,437 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <memory>
+#include "Common.h"
+#elif defined(__linux__)
+#include <sched.h>
+#endif
+
+#include "TopologyCpu.h"
+
+//  Defaults for anything that cannot be discovered.
+
+const int kDefaultCacheLineSize = 64;
+const int kDefaultLevelOneCacheSize = 16 * 1024;
+const int kDefaultLevelTwoCacheSize = 256 * 1024;
+
+//  A usable processor and where it sits in the machine, used to order them.
+
+struct CpuPlacement
+{
+    int cpu;
+    int node;
+    int core;                                                   // Unique over the machine.
+    int thread;                                                 // Rank within the core's usable processors.
+};
+
+static void InitializeTopology(CpuTopology& topology)
+{
+    topology.cacheLineSize = kDefaultCacheLineSize;
+    topology.levelOneCacheSize = kDefaultLevelOneCacheSize;
+    topology.levelTwoCacheSize = kDefaultLevelTwoCacheSize;
+    topology.levelThreeCacheSize = 0;
+    topology.levelTwoSharedBy = 1;
+    topology.levelThreeSharedBy = 1;
+    topology.threadsPerCore = 1;
+    topology.numCores = 0;
+    topology.numNodes = 1;
+    topology.cpuLimit = 0;
+}
+
+//  Rank the processors of each core, order them and count the cores and nodes.
+
+static void PlaceCpus(CpuTopology& topology, std::vector<CpuPlacement>& placements)
+{
+    std::sort(placements.begin(), placements.end(), [](const CpuPlacement& a, const CpuPlacement& b)
+    {
+        return (a.core != b.core) ? (a.core < b.core) : (a.cpu < b.cpu);
+    });
+    std::vector<int> nodes;
+    int cores = 0;
+    for (size_t n = 0; n < placements.size(); ++n)
+    {
+        const bool first = (n == 0) || (placements[n].core != placements[n - 1].core);
+        placements[n].thread = first ? 0 : placements[n - 1].thread + 1;
+        topology.threadsPerCore = std::max(topology.threadsPerCore, placements[n].thread + 1);
+        cores += first ? 1 : 0;
+        if (std::find(nodes.begin(), nodes.end(), placements[n].node) == nodes.end())
+            nodes.push_back(placements[n].node);
+    }
+
+    std::stable_sort(placements.begin(), placements.end(), [](const CpuPlacement& a, const CpuPlacement& b)
+    {
+        return (a.thread != b.thread) ? (a.thread < b.thread) : (a.node < b.node);
+    });
+    topology.cpus.clear();
+    topology.cpuNodes.clear();
+    for (const CpuPlacement& placement : placements)
+    {
+        topology.cpus.push_back(placement.cpu);
+        topology.cpuNodes.push_back(placement.node);
+    }
+    if (nodes.empty())
+        nodes.push_back(0);
+    std::sort(nodes.begin(), nodes.end());
+    topology.nodes = nodes;
+    topology.numCores = std::max(cores, 1);
+    topology.numNodes = int(nodes.size());
+}
+
+#if defined(_WIN32)
+
+//--------------------------------------------------------------------------------------
+//  Windows, from GetLogicalProcessorInformation.
+//--------------------------------------------------------------------------------------
+//
+//  Only the first processor group, of up to 64 processors, is described. There are no
+//  cgroups, so cpuLimit is always zero.
+
+typedef BOOL (WINAPI* GetProcInfoFunc)(PSYSTEM_LOGICAL_PROCESSOR_INFORMATION, DWORD*);
+
+static int CountBits(ULONG_PTR mask)
+{
+    int count = 0;
+    for (; mask != 0; mask &= mask - 1)
+        ++count;
+    return count;
+}
+
+static void DiscoverTopology(CpuTopology& topology)
+{
+    DWORD_PTR processMask = 0;
+    DWORD_PTR systemMask = 0;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask))
+        processMask = 0;
+
+    GetProcInfoFunc funcptr = (GetProcInfoFunc)::GetProcAddress(GetModuleHandle(TEXT("kernel32")), "GetLogicalProcessorInformation");
+    typedef std::unique_ptr<SYSTEM_LOGICAL_PROCESSOR_INFORMATION, FreeDeleter<SYSTEM_LOGICAL_PROCESSOR_INFORMATION>> BufferType;
+    BufferType buffer(nullptr);
+    DWORD bufferSize = 0;
+
+    // Loop through twice. First pass gets buffer size, second pass fills buffer.
+
+    while (funcptr != nullptr)
+    {
+        if (funcptr(buffer.get(), &bufferSize) != 0)
+            break;
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+            buffer.reset();
+        else
+            buffer = BufferType((SYSTEM_LOGICAL_PROCESSOR_INFORMATION*)std::malloc(bufferSize));
+        if (buffer.get() == nullptr)
+            break;
+    }
+
+    const int bufferLen = (buffer.get() != nullptr) ? bufferSize / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION) : 0;
+    std::vector<int> cpuNode(sizeof(DWORD_PTR) * 8, 0);
+    std::vector<int> cpuCore(sizeof(DWORD_PTR) * 8, -1);
+    int numCores = 0;
+    for (int n = 0; n < bufferLen; ++n)
+    {
+        const SYSTEM_LOGICAL_PROCESSOR_INFORMATION& r = buffer.get()[n];
+        if ((r.Relationship == RelationCache) && (r.Cache.Type != CacheInstruction))
+        {
+            if ((r.ProcessorMask & processMask) == 0)
+                continue;
+            topology.cacheLineSize = r.Cache.LineSize;
+            if (r.Cache.Level == 1)
+                topology.levelOneCacheSize = r.Cache.Size;
+            else if (r.Cache.Level == 2)
+            {
+                topology.levelTwoCacheSize = r.Cache.Size;
+                topology.levelTwoSharedBy = CountBits(r.ProcessorMask);
+            }
+            else if (r.Cache.Level == 3)
+            {
+                topology.levelThreeCacheSize = r.Cache.Size;
+                topology.levelThreeSharedBy = CountBits(r.ProcessorMask);
+            }
+        }
+        for (int cpu = 0; cpu < int(cpuNode.size()); ++cpu)
+        {
+            if ((r.ProcessorMask & (ULONG_PTR(1) << cpu)) == 0)
+                continue;
+            if (r.Relationship == RelationNumaNode)
+                cpuNode[cpu] = r.NumaNode.NodeNumber;
+            else if (r.Relationship == RelationProcessorCore)
+                cpuCore[cpu] = numCores;
+        }
+        if (r.Relationship == RelationProcessorCore)
+            ++numCores;
+    }
+
+    std::vector<CpuPlacement> placements;
+    for (int cpu = 0; cpu < int(cpuNode.size()); ++cpu)
+    {
+        if ((processMask & (DWORD_PTR(1) << cpu)) == 0)
+            continue;
+        const CpuPlacement placement = { cpu, cpuNode[cpu], (cpuCore[cpu] >= 0) ? cpuCore[cpu] : numCores + cpu, 0 };
+        placements.push_back(placement);
+    }
+    PlaceCpus(topology, placements);
+}
+
+#else
+
+//--------------------------------------------------------------------------------------
+//  Linux, from sysfs and the cgroup file system.
+//--------------------------------------------------------------------------------------
+//
+//  Other systems find none of these files and get one processor per hardware thread, with
+//  the default cache sizes.
+
+//  Read the first line of a file, without its newline. Returns false if it cannot be read.
+
+static bool ReadLine(const std::string& path, std::string& line)
+{
+    FILE* const file = fopen(path.c_str(), "r");
+    if (file == nullptr)
+        return false;
+    char buffer[4096];
+    const bool read = (fgets(buffer, sizeof(buffer), file) != nullptr);
+    fclose(file);
+    if (!read)
+        return false;
+    line = buffer;
+    line.erase(line.find_last_not_of(" \n") + 1);
+    return true;
+}
+
+static int ReadInt(const std::string& path, int defaultValue)
+{
+    std::string line;
+    return ReadLine(path, line) ? atoi(line.c_str()) : defaultValue;
+}
+
+//  Parse a list of processors or nodes such as "0-3,8,10-11".
+
+static std::vector<int> ParseList(const std::string& list)
+{
+    std::vector<int> values;
+    const char* p = list.c_str();
+    while (*p != '\0')
+    {
+        char* end;
+        const long first = strtol(p, &end, 10);
+        if (end == p)
+            break;
+        long last = first;
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long v = first; v <= last; ++v)
+            values.push_back(int(v));
+        if (*p == ',')
+            ++p;
+    }
+    return values;
+}
+
+//  Parse a cache size such as "48K".
+
+static int ParseSize(const std::string& size)
+{
+    char* end;
+    const long value = strtol(size.c_str(), &end, 10);
+    if (*end == 'K')
+        return int(value * 1024);
+    if (*end == 'M')
+        return int(value * 1024 * 1024);
+    return int(value);
+}
+
+//  The CFS quota of the process's cgroup, in processors rounded up, or zero if there is none.
+//  cgroup v2 keeps it in cpu.max, v1 in cpu.cfs_quota_us and cpu.cfs_period_us.
+
+static int CgroupCpuLimit()
+{
+    std::string group;
+    FILE* const file = fopen("/proc/self/cgroup", "r");
+    if (file != nullptr)
+    {
+        char buffer[4096];
+        while (fgets(buffer, sizeof(buffer), file) != nullptr)
+        {
+            if (strncmp(buffer, "0::", 3) == 0)
+            {
+                group = buffer + 3;
+                group.erase(group.find_last_not_of(" \n") + 1);
+            }
+        }
+        fclose(file);
+    }
+
+    std::string line;
+    if (ReadLine("/sys/fs/cgroup" + group + "/cpu.max", line) || ReadLine("/sys/fs/cgroup/cpu.max", line))
+    {
+        double quota;
+        double period;
+        if (sscanf(line.c_str(), "%lf %lf", &quota, &period) == 2 && (quota > 0.0) && (period > 0.0))
+            return int(ceil(quota / period));
+        return 0;
+    }
+
+    const char* const v1Groups[] = { "/sys/fs/cgroup/cpu/", "/sys/fs/cgroup/cpu,cpuacct/" };
+    for (const char* v1Group : v1Groups)
+    {
+        const int quota = ReadInt(std::string(v1Group) + "cpu.cfs_quota_us", -1);
+        const int period = ReadInt(std::string(v1Group) + "cpu.cfs_period_us", -1);
+        if ((quota > 0) && (period > 0))
+            return (quota + period - 1) / period;
+    }
+    return 0;
+}
+
+static void DiscoverTopology(CpuTopology& topology)
+{
+    std::vector<int> usable;
+#if defined(__linux__)
+    cpu_set_t available;
+    if (sched_getaffinity(0, sizeof(available), &available) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &available))
+                usable.push_back(cpu);
+        }
+    }
+#endif
+    if (usable.empty())
+    {
+        for (int cpu = 0; cpu < std::max(1, int(std::thread::hardware_concurrency())); ++cpu)
+            usable.push_back(cpu);
+    }
+
+    const std::string cpuPath = "/sys/devices/system/cpu/cpu";
+    const std::string cachePath = cpuPath + std::to_string(usable[0]) + "/cache/index";
+    for (int index = 0; ; ++index)
+    {
+        const std::string path = cachePath + std::to_string(index);
+        std::string type;
+        std::string size;
+        std::string shared;
+        if (!ReadLine(path + "/type", type) || !ReadLine(path + "/size", size))
+            break;
+        if (type == "Instruction")
+            continue;
+        const int level = ReadInt(path + "/level", 0);
+        const int sharedBy = ReadLine(path + "/shared_cpu_list", shared) ? std::max(int(ParseList(shared).size()), 1) : 1;
+        topology.cacheLineSize = ReadInt(path + "/coherency_line_size", topology.cacheLineSize);
+        if (level == 1)
+            topology.levelOneCacheSize = ParseSize(size);
+        else if (level == 2)
+        {
+            topology.levelTwoCacheSize = ParseSize(size);
+            topology.levelTwoSharedBy = sharedBy;
+        }
+        else if (level == 3)
+        {
+            topology.levelThreeCacheSize = ParseSize(size);
+            topology.levelThreeSharedBy = sharedBy;
+        }
+    }
+
+    std::vector<int> cpuNode(usable.back() + 1, 0);
+    std::string possibleNodes;
+    if (ReadLine("/sys/devices/system/node/possible", possibleNodes))
+    {
+        for (int node : ParseList(possibleNodes))
+        {
+            std::string cpus;
+            if (!ReadLine("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist", cpus))
+                continue;
+            for (int cpu : ParseList(cpus))
+            {
+                if (cpu < int(cpuNode.size()))
+                    cpuNode[cpu] = node;
+            }
+        }
+    }
+
+    // Cores are identified by their package and their core id within it.
+    std::vector<CpuPlacement> placements;
+    for (int cpu : usable)
+    {
+        const std::string topologyPath = cpuPath + std::to_string(cpu) + "/topology/";
+        const int package = ReadInt(topologyPath + "physical_package_id", 0);
+        const int core = ReadInt(topologyPath + "core_id", cpu);
+        const CpuPlacement placement = { cpu, cpuNode[cpu], (std::max(package, 0) << 16) + core, 0 };
+        placements.push_back(placement);
+    }
+    PlaceCpus(topology, placements);
+    topology.cpuLimit = CgroupCpuLimit();
+}
+
+#endif
+
+int CpuTopology::UsableThreads() const
+{
+    const int usable = std::max(int(cpus.size()), 1);
+    return (cpuLimit > 0) ? std::min(cpuLimit, usable) : usable;
+}
+
+const CpuTopology& GetCpuTopology()
+{
+    static const CpuTopology topology = []()
+    {
+        CpuTopology discovered;
+        InitializeTopology(discovered);
+        DiscoverTopology(discovered);
+        return discovered;
+    }();
+    return topology;
+}
+
+//--------------------------------------------------------------------------------------
+//  NUMA placement.
+//--------------------------------------------------------------------------------------
+
+int CurrentNode()
+{
+#if defined(_WIN32)
+    const int cpu = int(GetCurrentProcessorNumber());
+#elif defined(__linux__)
+    const int cpu = sched_getcpu();
+#else
+    const int cpu = -1;
+#endif
+    const CpuTopology& topology = GetCpuTopology();
+    static const std::vector<int> cpuNode = [&topology]()
+    {
+        std::vector<int> nodes(topology.cpus.empty() ? 0 : *std::max_element(topology.cpus.begin(), topology.cpus.end()) + 1, topology.nodes[0]);
+        for (size_t n = 0; n < topology.cpus.size(); ++n)
+            nodes[topology.cpus[n]] = topology.cpuNodes[n];
+        return nodes;
+    }();
+    return ((cpu >= 0) && (cpu < int(cpuNode.size()))) ? cpuNode[cpu] : topology.nodes[0];
+}
@@ -0,0 +1,66 @@
+//===============================================================================
+//
+// Microsoft Press
+// C++ AMP: Accelerated Massive Parallelism with Microsoft Visual C++
+//
+//===============================================================================
+// Copyright (c) 2012-2013 Ade Miller & Kate Gregory.  All rights reserved.
+// This code released under the terms of the
+// Microsoft Public License (Ms-PL), http://ampbook.codeplex.com/license.
+//
+// THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF
+// ANY KIND, EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A
+// PARTICULAR PURPOSE.
+//===============================================================================
+
+#pragma once
+
+#include <vector>
+
+//--------------------------------------------------------------------------------------
+//  Cache and processor topology of the machine.
+//--------------------------------------------------------------------------------------
+//
+//  Discovered once, on first use, from GetLogicalProcessorInformation on Windows and from
+//  sysfs on Linux. Only the processors the process may run on are described: those in its
+//  affinity mask, which inside a container is the container's cpuset. A container may also
+//  be limited to a share of those processors by a CFS quota, which is read from the cgroup
+//  and reported as cpuLimit.
+//
+//  The cache sizes are those seen by the first usable processor, all the cores are assumed
+//  to be the same. Anything that cannot be discovered is given a conservative default, 16 KB
+//  of L1 and 256 KB of L2, so the engines can always be sized from it.
+
+struct CpuTopology
+{
+    int cacheLineSize;                                          // In bytes.
+    int levelOneCacheSize;                                      // Data cache of one core, in bytes.
+    int levelTwoCacheSize;
+    int levelThreeCacheSize;                                    // Zero if there is no L3 cache.
+    int levelTwoSharedBy;                                       // Logical processors sharing each L2 cache.
+    int levelThreeSharedBy;
+    int threadsPerCore;                                         // SMT siblings, including the processor itself.
+    int numCores;                                               // Physical cores with a usable processor.
+    int numNodes;                                               // NUMA nodes with a usable processor.
+    int cpuLimit;                                               // Processors' worth of CPU time allowed, zero if unlimited.
+    std::vector<int> cpus;                                      // Usable logical processors, see below.
+    std::vector<int> cpuNodes;                                  // NUMA node of each of cpus.
+    std::vector<int> nodes;                                     // NUMA nodes with a usable processor, ascending.
+
+    //  Number of threads worth running, the usable processors or the CPU limit if that is less.
+
+    int UsableThreads() const;
+};
+
+//  The usable processors are ordered so that the first processor of every core comes before
+//  any core's second processor, and within that by node. Pinning threads to them in order
+//  spreads the threads over the cores before sharing any, and keeps consecutive threads on
+//  the same node.
+
+const CpuTopology& GetCpuTopology();
+
+//  The NUMA node of the processor the calling thread is running on, or the first usable node
+//  if this cannot be found. This only stays the same for threads bound to a node.
+
+int CurrentNode();